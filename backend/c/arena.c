@@ -0,0 +1,106 @@
+#include <stdalign.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+struct arena_block {
+    arena_block *next;
+    size_t size;
+    alignas(max_align_t) unsigned char data[];
+};
+
+static size_t align_up(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static arena_block* new_block(size_t size) {
+    arena_block *block = malloc(offsetof(arena_block, data) + size);
+    if (block != NULL) {
+        block->next = NULL;
+        block->size = size;
+    }
+    return block;
+}
+
+static void free_blocks(arena_block *block) {
+    while (block != NULL) {
+        arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void arena_init(arena *a) {
+    a->blocks = NULL;
+    a->used = 0;
+    a->total = 0;
+    a->last = NULL;
+}
+
+void arena_free(arena *a) {
+    free_blocks(a->blocks);
+    arena_init(a);
+}
+
+void arena_reset(arena *a) {
+    size_t total = a->total;
+    if (a->blocks != NULL && (a->blocks->next != NULL || a->blocks->size > ARENA_KEEP_MAX)) {
+        // Replace the chain with one block that fits the whole request, so
+        // the next one like it needs no more; a big one is not kept at all
+        free_blocks(a->blocks);
+        a->blocks = NULL;
+        if (total <= ARENA_KEEP_MAX) {
+            size_t size = ARENA_BLOCK_SIZE;
+            while (size < total) {
+                size *= 2;
+            }
+            a->blocks = new_block(size);
+        }
+    }
+    a->used = 0;
+    a->total = 0;
+    a->last = NULL;
+}
+
+void* arena_alloc(arena *a, size_t size) {
+    size = align_up(size > 0 ? size : 1);
+    if (a->blocks == NULL || a->blocks->size - a->used < size) {
+        size_t block_size = ARENA_BLOCK_SIZE;
+        while (block_size < size) {
+            block_size *= 2;
+        }
+        arena_block *block = new_block(block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = a->blocks;
+        a->blocks = block;
+        a->used = 0;
+    }
+    void *p = a->blocks->data + a->used;
+    a->used += size;
+    a->total += size;
+    a->last = p;
+    return p;
+}
+
+void* arena_grow(arena *a, void *ptr, size_t old_size, size_t new_size) {
+    if (ptr != NULL && ptr == a->last) {
+        size_t start = (size_t)((unsigned char *)ptr - a->blocks->data);
+        size_t old_aligned = a->used - start;
+        size_t new_aligned = align_up(new_size > 0 ? new_size : 1);
+        if (new_aligned <= a->blocks->size - start) {
+            a->used = start + new_aligned;
+            a->total = a->total - old_aligned + new_aligned;
+            return ptr;
+        }
+    }
+    void *grown = arena_alloc(a, new_size);
+    if (grown != NULL && ptr != NULL) {
+        memcpy(grown, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return grown;
+}
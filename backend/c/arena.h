@@ -0,0 +1,41 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Bump allocator for memory that lives as long as one request.
+//
+// Allocations are carved out of a block in order and never freed one by
+// one; arena_reset hands everything back at once. A request that outgrows
+// the block gets more blocks chained on, and the next reset swaps them for
+// one block big enough for all of it, so a connection stops calling malloc
+// once it has served its largest request. Blocks over ARENA_KEEP_MAX are
+// freed on reset rather than kept for the life of the connection.
+
+#define ARENA_BLOCK_SIZE (16 * 1024)
+#define ARENA_KEEP_MAX (1024 * 1024)
+
+typedef struct arena_block arena_block;
+
+typedef struct {
+    arena_block *blocks; // Newest first
+    size_t used;         // Bytes used in the newest block
+    size_t total;        // Bytes allocated since the last reset
+    void *last;          // Most recent allocation, which can grow in place
+} arena;
+
+void arena_init(arena *a);
+void arena_free(arena *a);
+
+// Forgets every allocation, keeping (or merging) the blocks for reuse
+void arena_reset(arena *a);
+
+// Returns size bytes aligned for any type, or NULL if memory runs out
+void* arena_alloc(arena *a, size_t size);
+
+// Resizes an allocation of old_size bytes (ptr may be NULL). The most recent
+// allocation grows in place when its block has room; others are copied.
+// Returns NULL if memory runs out, leaving ptr as it was.
+void* arena_grow(arena *a, void *ptr, size_t old_size, size_t new_size);
+
+#endif
@@ -0,0 +1,149 @@
+// Allocation count for the request path.
+//
+// Fills the store, then builds GET /book/:id, GET /books?limit= and
+// GET /book/search responses the way the server does, plain and compressed
+// (streamed with zstd, and whole with gzip), from one arena that is reset
+// after every request. malloc, calloc and realloc are wrapped at
+// link time and counted once the arena has warmed up; the steady state
+// should make none. libmicrohttpd's own response objects are not part of
+// this check.
+//
+// Build from backend/c (GNU ld):
+//   cc -O2 -I. bench/alloc_bench.c book.c book_id.c book_file.c book_log.c book_search.c json.c json_writer.c book_parser.c arena.c
+//      cover_store.c compress.c -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc -luuid -lcurl -lz -lzstd -lpthread -lm
+//      -o alloc_bench
+// Usage: alloc_bench [books=10000] [requests=100000]
+// Exits with status 1 if any steady-state request allocated.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "book.h"
+#include "compress.h"
+#include "json.h"
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+
+static unsigned long long allocations;
+
+void* __wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+static char (*ids)[37];
+
+static size_t read_list_source(void *cls, char *buf, size_t max) {
+    size_t written = book_list_stream_read(cls, buf, max);
+    return written == BOOK_LIST_FAILED ? COMPRESS_FAILED : written;
+}
+
+// Builds one response into the arena; returns 0 if it failed
+static int serve(arena *a, int i, int book_count) {
+    char buf[4096];
+    switch (i % 6) {
+        case 0:
+        case 1:
+            return get_book_by_id_json(a, ids[(size_t)i * 7919 % (size_t)book_count]) != NULL;
+        case 2: {
+            unsigned long long next;
+            book_list_stream *stream = book_list_stream_new(a, 0, 20, &next);
+            if (stream == NULL) {
+                return 0;
+            }
+            size_t n;
+            while ((n = book_list_stream_read(stream, buf, sizeof(buf))) > 0 && n != BOOK_LIST_FAILED) {
+            }
+            return n == 0;
+        }
+        case 3:
+            return search_books_json(a, "typical", 20) != NULL;
+        case 4: {
+            unsigned long long next;
+            book_list_stream *stream = book_list_stream_new(a, 0, 20, &next);
+            compress_stream *compressed = stream != NULL ? compress_stream_new(a, ENCODING_ZSTD, COMPRESS_FAST,
+                                                                               read_list_source, stream)
+                                                         : NULL;
+            if (compressed == NULL) {
+                return 0;
+            }
+            size_t n;
+            while ((n = compress_stream_read(compressed, buf, sizeof(buf))) > 0 && n != COMPRESS_FAILED) {
+            }
+            compress_stream_free(compressed);
+            return n == 0;
+        }
+        default: {
+            char *body = search_books_json(a, "typical", 20);
+            size_t size;
+            return body != NULL && compress_buffer(a, ENCODING_GZIP, COMPRESS_FAST, body, strlen(body), &size) != NULL;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int book_count = argc > 1 ? atoi(argv[1]) : 10000;
+    int requests = argc > 2 ? atoi(argv[2]) : 100000;
+    if (book_count <= 0 || requests <= 0) {
+        fprintf(stderr, "books and requests must be positive\n");
+        return 1;
+    }
+
+    init_book_storage();
+    ids = malloc((size_t)book_count * sizeof(*ids));
+    if (ids == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < book_count; i++) {
+        char title[64];
+        char cover[96];
+        snprintf(title, sizeof(title), "A typical book %d", i);
+        snprintf(cover, sizeof(cover), "https://covers.openlibrary.org/b/id/%d-L.jpg", i);
+        Book book;
+        if (!create_book(title, "Some Author", "A description of a typical book", cover, &book)) {
+            fprintf(stderr, "Could not create book %d\n", i);
+            return 1;
+        }
+        book_id_format(book.id, ids[i]);
+    }
+
+    arena a;
+    arena_init(&a);
+
+    // The first requests size the arena block; after that it is reused
+    int warmup = requests < 1000 ? requests : 1000;
+    for (int i = 0; i < warmup; i++) {
+        serve(&a, i, book_count);
+        arena_reset(&a);
+    }
+
+    unsigned long long before = allocations;
+    int failed = 0;
+    for (int i = 0; i < requests; i++) {
+        failed += !serve(&a, i, book_count);
+        arena_reset(&a);
+    }
+    unsigned long long counted = allocations - before;
+
+    printf("%d books, %d requests (%d failed)\n", book_count, requests, failed);
+    printf("allocations: %llu (%.3f per request)\n", counted, (double)counted / requests);
+
+    arena_free(&a);
+    free(ids);
+    compress_cleanup();
+    cleanup_book_storage();
+    return counted != 0 || failed != 0;
+}
@@ -0,0 +1,414 @@
+// Many-connection HTTP benchmark for a running server.
+//
+// Creates a set of books through the API, opens a large number of keep-alive
+// connections (10000 by default) and drives all of them from a few client
+// threads with epoll, each connection keeping `pipeline` requests in flight:
+// a fixed-duration mix of GET /book/:id and PUT /book/:id. Prints requests
+// per second and latency percentiles, from queueing a request to reading its
+// response, so the libmicrohttpd and io_uring front ends (BOOK_HTTP_MODE)
+// can be compared under the same load. The server and the client both need
+// a descriptor limit above the connection count (ulimit -n).
+//
+// Build from backend/c:
+//   cc -O2 bench/conn_bench.c -lpthread -o conn_bench
+// Usage: conn_bench [host=127.0.0.1] [port=3000] [seconds=5] [connections=10000] [threads=4]
+//                   [pipeline=1] [write_percent=10] [books=1000]
+
+#define _GNU_SOURCE // memmem, strcasestr
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_THREADS 256
+#define MAX_PIPELINE 16
+#define IN_BUFFER_SIZE (8 * 1024)
+#define OUT_BUFFER_SIZE (MAX_PIPELINE * 256)
+#define EVENTS_PER_WAIT 256
+
+// Latencies in nanoseconds, in buckets SUB_BUCKETS to a power of two, so
+// every percentile is within about 3%
+#define SUB_BUCKET_BITS 5
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define HISTOGRAM_SIZE (64 * SUB_BUCKETS)
+
+static struct sockaddr_in server;
+static double seconds;
+static int pipeline;
+static int write_percent;
+static int book_count;
+static char (*ids)[37];
+static atomic_int stop;
+
+typedef struct {
+    int fd;
+    int open;
+    char in[IN_BUFFER_SIZE];
+    size_t in_len;
+    char out[OUT_BUFFER_SIZE];
+    size_t out_sent, out_len;
+    int waiting_to_send; // Registered for EPOLLOUT
+    uint64_t queued_at[MAX_PIPELINE]; // When each request in flight was queued, oldest first
+    int in_flight;
+} connection;
+
+typedef struct {
+    pthread_t thread;
+    int epoll_fd;
+    connection *connections;
+    int count;
+    unsigned seed;
+    unsigned long long requests;
+    unsigned long long errors;
+    unsigned long long histogram[HISTOGRAM_SIZE];
+} worker;
+
+static uint64_t now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t nanos) {
+    if (nanos < SUB_BUCKETS) {
+        return (int)nanos;
+    }
+    int shift = 63 - __builtin_clzll(nanos) - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int)((nanos >> shift) - SUB_BUCKETS);
+}
+
+static uint64_t bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    return (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+static double percentile_micros(const unsigned long long *histogram, unsigned long long total, double p) {
+    unsigned long long target = (unsigned long long)(p * (double)total);
+    unsigned long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += histogram[i];
+        if (seen > target) {
+            return (double)bucket_value(i) / 1e3;
+        }
+    }
+    return 0;
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(fd, (const struct sockaddr *)&server, sizeof(server)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Creates the books the connections read and update, over one blocking
+// connection
+static int create_books(void) {
+    int fd = connect_server();
+    if (fd < 0) {
+        return 0;
+    }
+    char buf[8192];
+    int ok = 1;
+    for (int i = 0; ok && i < book_count; i++) {
+        char json[256];
+        char head[256];
+        int json_len = snprintf(json, sizeof(json),
+                                "{\"title\":\"Connection test book %d\",\"author\":\"Author %d\","
+                                "\"coverImageUrl\":\"https://covers.openlibrary.org/b/id/%d-L.jpg\"}", i, i % 100, i);
+        int head_len = snprintf(head, sizeof(head), "POST /book HTTP/1.1\r\nHost: localhost\r\n"
+                                "Content-Type: application/json\r\nContent-Length: %d\r\n\r\n", json_len);
+        ok = send(fd, head, (size_t)head_len, 0) == head_len && send(fd, json, (size_t)json_len, 0) == json_len;
+
+        // Responses are small; read until the whole body is in
+        size_t len = 0;
+        char *end = NULL;
+        size_t length = 0;
+        while (ok) {
+            ssize_t got = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+            if (got <= 0) {
+                ok = 0;
+                break;
+            }
+            len += (size_t)got;
+            buf[len] = '\0';
+            if (end == NULL && (end = strstr(buf, "\r\n\r\n")) != NULL) {
+                const char *field = strcasestr(buf, "Content-Length:");
+                length = field != NULL && field < end ? strtoull(field + 15, NULL, 10) : 0;
+            }
+            if (end != NULL && len >= (size_t)(end - buf) + 4 + length) {
+                break;
+            }
+        }
+        const char *id;
+        ok = ok && strncmp(buf, "HTTP/1.1 201", 12) == 0 && (id = strstr(end, "\"id\":\"")) != NULL &&
+             sscanf(id + 6, "%36[^\"]", ids[i]) == 1;
+    }
+    close(fd);
+    return ok;
+}
+
+static void queue_request(worker *w, connection *c) {
+    const char *id = ids[rand_r(&w->seed) % (unsigned)book_count];
+    if (c->out_sent > 0) {
+        c->out_len -= c->out_sent;
+        memmove(c->out, c->out + c->out_sent, c->out_len);
+        c->out_sent = 0;
+    }
+    char *out = c->out + c->out_len;
+    size_t room = sizeof(c->out) - c->out_len;
+    int len;
+    if ((int)(rand_r(&w->seed) % 100) < write_percent) {
+        char json[64];
+        int json_len = snprintf(json, sizeof(json), "{\"title\":\"Updated %u\"}", rand_r(&w->seed));
+        len = snprintf(out, room, "PUT /book/%s HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\n"
+                       "Content-Length: %d\r\n\r\n%s", id, json_len, json);
+    } else {
+        len = snprintf(out, room, "GET /book/%s HTTP/1.1\r\nHost: localhost\r\n\r\n", id);
+    }
+    c->out_len += (size_t)len;
+    c->queued_at[c->in_flight++] = now_nanos();
+}
+
+static void drop(worker *w, connection *c) {
+    w->errors++;
+    close(c->fd);
+    c->open = 0;
+}
+
+static void wait_to_send(worker *w, connection *c, int waiting) {
+    if (c->waiting_to_send != waiting) {
+        struct epoll_event event = {.events = waiting ? EPOLLIN | EPOLLOUT : EPOLLIN, .data.ptr = c};
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &event);
+        c->waiting_to_send = waiting;
+    }
+}
+
+static void flush(worker *w, connection *c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t sent = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EAGAIN) {
+            wait_to_send(w, c, 1);
+            return;
+        }
+        if (sent <= 0) {
+            drop(w, c);
+            return;
+        }
+        c->out_sent += (size_t)sent;
+    }
+    c->out_sent = c->out_len = 0;
+    wait_to_send(w, c, 0);
+}
+
+// Consumes the complete responses in c->in, recording their latencies and
+// queueing a request in place of each
+static int read_responses(worker *w, connection *c) {
+    size_t used = 0;
+    for (;;) {
+        char *start = c->in + used;
+        char *end = memmem(start, c->in_len - used, "\r\n\r\n", 4);
+        if (end == NULL) {
+            break;
+        }
+        int status = 0;
+        if (sscanf(start, "HTTP/1.%*d %d", &status) != 1 || c->in_flight == 0) {
+            return 0;
+        }
+        size_t length = 0;
+        for (char *line = memmem(start, (size_t)(end - start), "\r\n", 2); line != NULL && line < end;
+             line = memmem(line + 2, (size_t)(end - line), "\r\n", 2)) {
+            if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+                length = strtoull(line + 17, NULL, 10);
+            }
+        }
+        size_t size = (size_t)(end + 4 - start) + length;
+        if (size > sizeof(c->in)) {
+            return 0;
+        }
+        if (used + size > c->in_len) {
+            break;
+        }
+        used += size;
+
+        // Responses that arrive after the deadline are not counted
+        uint64_t queued_at = c->queued_at[0];
+        memmove(c->queued_at, c->queued_at + 1, (size_t)(--c->in_flight) * sizeof(c->queued_at[0]));
+        if (!stop) {
+            w->histogram[bucket_of(now_nanos() - queued_at)]++;
+            w->requests++;
+            w->errors += status != 200;
+            queue_request(w, c);
+        }
+    }
+    c->in_len -= used;
+    memmove(c->in, c->in + used, c->in_len);
+    return 1;
+}
+
+static void* run_worker(void *arg) {
+    worker *w = arg;
+    for (int i = 0; i < w->count; i++) {
+        connection *c = &w->connections[i];
+        for (int r = 0; r < pipeline; r++) {
+            queue_request(w, c);
+        }
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &event);
+        flush(w, c);
+    }
+
+    struct epoll_event events[EVENTS_PER_WAIT];
+    while (!stop) {
+        int ready = epoll_wait(w->epoll_fd, events, EVENTS_PER_WAIT, 100);
+        for (int i = 0; i < ready; i++) {
+            connection *c = events[i].data.ptr;
+            if (!c->open) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                ssize_t got = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+                if (got <= 0 && !(got < 0 && errno == EAGAIN)) {
+                    drop(w, c);
+                    continue;
+                }
+                if (got > 0) {
+                    c->in_len += (size_t)got;
+                    if (!read_responses(w, c)) {
+                        drop(w, c);
+                        continue;
+                    }
+                }
+            }
+            flush(w, c);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 3000;
+    seconds = argc > 3 ? atof(argv[3]) : 5.0;
+    int connections = argc > 4 ? atoi(argv[4]) : 10000;
+    int threads = argc > 5 ? atoi(argv[5]) : 4;
+    pipeline = argc > 6 ? atoi(argv[6]) : 1;
+    write_percent = argc > 7 ? atoi(argv[7]) : 10;
+    book_count = argc > 8 ? atoi(argv[8]) : 1000;
+    if (seconds <= 0 || connections <= 0 || book_count <= 0 || threads <= 0 || threads > MAX_THREADS ||
+        pipeline <= 0 || pipeline > MAX_PIPELINE) {
+        fprintf(stderr, "seconds, connections and books must be positive, threads between 1 and %d and "
+                "pipeline between 1 and %d\n", MAX_THREADS, MAX_PIPELINE);
+        return 1;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family = AF_INET;
+    server.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "host must be an IPv4 address\n");
+        return 1;
+    }
+
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    ids = malloc((size_t)book_count * sizeof(*ids));
+    if (ids == NULL || !create_books()) {
+        fprintf(stderr, "Could not create books on %s:%d\n", host, port);
+        return 1;
+    }
+
+    // Connections are opened one at a time up front, so the accept backlog
+    // never overflows and only steady-state traffic is measured
+    connection *all = calloc((size_t)connections, sizeof(connection));
+    worker *workers = calloc((size_t)threads, sizeof(worker));
+    if (all == NULL || workers == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    uint64_t connect_start = now_nanos();
+    for (int i = 0; i < connections; i++) {
+        all[i].fd = connect_server();
+        if (all[i].fd < 0) {
+            fprintf(stderr, "Connection %d failed: %s (raise ulimit -n on both sides)\n", i + 1, strerror(errno));
+            return 1;
+        }
+        fcntl(all[i].fd, F_SETFL, fcntl(all[i].fd, F_GETFL) | O_NONBLOCK);
+        all[i].open = 1;
+    }
+    double connect_seconds = (double)(now_nanos() - connect_start) / 1e9;
+
+    printf("%s:%d, %d connections opened in %.2f s, %d client threads, pipeline %d, %d books, %d%% writes\n",
+           host, port, connections, connect_seconds, threads, pipeline, book_count, write_percent);
+    for (int t = 0; t < threads; t++) {
+        worker *w = &workers[t];
+        w->seed = (unsigned)t + 1;
+        w->epoll_fd = epoll_create1(0);
+        w->connections = all + (size_t)connections * (size_t)t / (size_t)threads;
+        w->count = (int)((size_t)connections * (size_t)(t + 1) / (size_t)threads -
+                         (size_t)connections * (size_t)t / (size_t)threads);
+        pthread_create(&w->thread, NULL, run_worker, w);
+    }
+
+    uint64_t start = now_nanos();
+    struct timespec pause = {(time_t)seconds, (long)((seconds - (double)(time_t)seconds) * 1e9)};
+    nanosleep(&pause, NULL);
+    stop = 1;
+    double elapsed = (double)(now_nanos() - start) / 1e9;
+
+    unsigned long long requests = 0;
+    unsigned long long errors = 0;
+    static unsigned long long histogram[HISTOGRAM_SIZE];
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        requests += workers[t].requests;
+        errors += workers[t].errors;
+        for (int i = 0; i < HISTOGRAM_SIZE; i++) {
+            histogram[i] += workers[t].histogram[i];
+        }
+        close(workers[t].epoll_fd);
+    }
+    int open = 0;
+    for (int i = 0; i < connections; i++) {
+        if (all[i].open) {
+            open++;
+            close(all[i].fd);
+        }
+    }
+
+    printf("%14s %10s %10s %10s %10s %10s\n", "requests/sec", "p50", "p99", "p99.9", "errors", "open");
+    printf("%14.0f %8.0fus %8.0fus %8.0fus %10llu %10d\n", (double)requests / elapsed,
+           percentile_micros(histogram, requests, 0.5), percentile_micros(histogram, requests, 0.99),
+           percentile_micros(histogram, requests, 0.999), errors, open);
+    free(all);
+    free(workers);
+    free(ids);
+    return 0;
+}
@@ -0,0 +1,125 @@
+// Serialization microbenchmark: the json-c object tree the server used to
+// build for every book versus json_buf_append_book into a reused buffer.
+//
+// Build from backend/c:
+//   cc -O2 -I. bench/json_bench.c book.c book_id.c book_file.c book_log.c book_search.c json_writer.c arena.c -ljson-c -luuid -lpthread -lm -o json_bench
+// Usage: json_bench [books=1000] [rounds=200]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+#include "book.h"
+#include "json_writer.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// The pre-json_buf serializer, kept here as the baseline
+static char* json_c_book(const BookView *book) {
+    char cover[sizeof(((Book *)0)->coverImageUrl)];
+    snprintf(cover, sizeof(cover), "%s%s", book->cover_base, book->cover_name);
+    char id[BOOK_ID_TEXT_SIZE];
+    book_id_format(book->id, id);
+    struct json_object *jobj = json_object_new_object();
+    json_object_object_add(jobj, "id", json_object_new_string(id));
+    json_object_object_add(jobj, "title", json_object_new_string(book->title));
+    json_object_object_add(jobj, "author", json_object_new_string(book->author));
+    json_object_object_add(jobj, "description", json_object_new_string(book->description));
+    json_object_object_add(jobj, "coverImageUrl", json_object_new_string(cover));
+    char *result = strdup(json_object_to_json_string(jobj));
+    json_object_put(jobj);
+    return result;
+}
+
+// Checks that json_buf output parses back to the same fields
+static int round_trips(const BookView *book) {
+    char cover[sizeof(((Book *)0)->coverImageUrl)];
+    snprintf(cover, sizeof(cover), "%s%s", book->cover_base, book->cover_name);
+    char id[BOOK_ID_TEXT_SIZE];
+    book_id_format(book->id, id);
+    json_buf buf;
+    json_buf_init(&buf);
+    json_buf_append_book(&buf, book);
+    struct json_object *jobj = json_tokener_parse(buf.data);
+    int ok = jobj != NULL;
+
+    const char *keys[] = {"id", "title", "author", "description", "coverImageUrl"};
+    const char *values[] = {id, book->title, book->author, book->description, cover};
+    for (int i = 0; ok && i < 5; i++) {
+        struct json_object *field;
+        ok = json_object_object_get_ex(jobj, keys[i], &field) &&
+             strcmp(json_object_get_string(field), values[i]) == 0;
+    }
+    json_object_put(jobj);
+    json_buf_free(&buf);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 200;
+
+    init_book_storage();
+    for (int i = 0; i < count; i++) {
+        char title[64];
+        char description[256];
+        snprintf(title, sizeof(title), "Book number %d", i);
+        // Every tenth description needs escaping, the rest take the fast path
+        snprintf(description, sizeof(description), i % 10 == 0
+                     ? "A \"quoted\" blurb\\nwith escapes for book %d"
+                     : "A plain description of book %d that needs no escaping at all", i);
+        if (!create_book(title, "Brian Kernighan and Dennis Ritchie", description,
+                        "https://covers.openlibrary.org/b/id/6660100-L.jpg", NULL)) {
+            count = i;
+            break;
+        }
+    }
+
+    int listed;
+    BookView *list = get_all_books(&listed);
+    for (int i = 0; i < listed; i++) {
+        if (!round_trips(&list[i])) {
+            fprintf(stderr, "json_buf output for book %d does not round-trip\n", i);
+            return 1;
+        }
+    }
+
+    size_t bytes = 0;
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < listed; i++) {
+            char *json = json_c_book(&list[i]);
+            bytes += strlen(json);
+            free(json);
+        }
+    }
+    double json_c_time = now_seconds() - start;
+
+    json_buf buf;
+    json_buf_init(&buf);
+    size_t buf_bytes = 0;
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < listed; i++) {
+            json_buf_reset(&buf);
+            json_buf_append_book(&buf, &list[i]);
+            buf_bytes += buf.len;
+        }
+    }
+    double buf_time = now_seconds() - start;
+    json_buf_free(&buf);
+    free(list);
+
+    double ops = (double)listed * rounds;
+    printf("books=%d rounds=%d\n", listed, rounds);
+    printf("%-10s %12s %12s\n", "serializer", "ns/book", "MB/s");
+    printf("%-10s %12.1f %12.1f\n", "json-c", json_c_time / ops * 1e9, bytes / json_c_time / 1e6);
+    printf("%-10s %12.1f %12.1f\n", "json_buf", buf_time / ops * 1e9, buf_bytes / buf_time / 1e6);
+    printf("speedup %.1fx\n", json_c_time / buf_time);
+    return 0;
+}
@@ -0,0 +1,125 @@
+// Memory benchmark: resident bytes per book for the slot store (strings in
+// an arena, authors and cover URL prefixes interned) versus the fixed Book
+// records it replaced, filled with the same catalog. The store always keeps
+// the search index too, so the index is also built on its own and reported
+// apart from the books.
+//
+// Build from backend/c:
+//   cc -O2 -I. bench/memory_bench.c book.c book_id.c book_file.c book_log.c book_search.c -luuid -lpthread -lm -o memory_bench
+// Usage: memory_bench [books=1000000] [authors=20000]
+// Linux only: resident memory is read from /proc/self/statm.
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "book.h"
+#include "book_search.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned long long resident_bytes(void) {
+    unsigned long long pages = 0;
+    unsigned long long resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%llu %llu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * (unsigned long long)sysconf(_SC_PAGESIZE);
+}
+
+// A plausible catalog entry: ~30 byte title, a shared author, a short
+// blurb and an Open Library cover URL
+static void make_book(Book *book, int i, int authors) {
+    snprintf(book->title, sizeof(book->title), "The Collected Stories, Vol. %d", i);
+    snprintf(book->author, sizeof(book->author), "Author Number %d", i % authors);
+    snprintf(book->description, sizeof(book->description),
+             "A reissue of volume %d with a new introduction and notes.", i);
+    snprintf(book->coverImageUrl, sizeof(book->coverImageUrl),
+             "https://covers.openlibrary.org/b/id/%d-L.jpg", 6000000 + i);
+}
+
+int main(int argc, char **argv) {
+    int books = argc > 1 ? atoi(argv[1]) : 1000000;
+    int authors = argc > 2 ? atoi(argv[2]) : 20000;
+    if (books <= 0 || authors <= 0) {
+        fprintf(stderr, "books and authors must be positive\n");
+        return 1;
+    }
+
+    Book book;
+    memset(&book, 0, sizeof(book));
+
+    init_book_storage();
+    unsigned long long before = resident_bytes();
+    double start = now_seconds();
+    for (int i = 0; i < books; i++) {
+        make_book(&book, i, authors);
+        if (!create_book(book.title, book.author, book.description, book.coverImageUrl, NULL)) {
+            fprintf(stderr, "Store refused book %d\n", i);
+            return 1;
+        }
+    }
+    double store_seconds = now_seconds() - start;
+    unsigned long long store_bytes = resident_bytes() - before;
+    cleanup_book_storage();
+    malloc_trim(0);
+
+    // The search index alone, over the same text
+    before = resident_bytes();
+    start = now_seconds();
+    for (int i = 0; i < books; i++) {
+        make_book(&book, i, authors);
+        if (!book_search_add((unsigned long long)i, book.title, book.author, book.description)) {
+            fprintf(stderr, "Index refused book %d\n", i);
+            return 1;
+        }
+    }
+    double index_seconds = now_seconds() - start;
+    unsigned long long index_bytes = resident_bytes() - before;
+    book_search_clear();
+    malloc_trim(0);
+    unsigned long long books_bytes = store_bytes > index_bytes ? store_bytes - index_bytes : 0;
+
+    // The old layout: one fixed Book per record plus its creation cursor
+    before = resident_bytes();
+    Book *records = malloc((size_t)books * sizeof(Book));
+    unsigned long long *seqs = malloc((size_t)books * sizeof(unsigned long long));
+    if (records == NULL || seqs == NULL) {
+        fprintf(stderr, "Not enough memory for the fixed records\n");
+        return 1;
+    }
+    start = now_seconds();
+    for (int i = 0; i < books; i++) {
+        memset(&records[i], 0, sizeof(Book));
+        make_book(&records[i], i, authors);
+        seqs[i] = (unsigned long long)i + 1;
+    }
+    double fixed_seconds = now_seconds() - start;
+    unsigned long long fixed_bytes = resident_bytes() - before;
+    free(records);
+    free(seqs);
+
+    printf("books=%d authors=%d\n", books, authors);
+    printf("%-14s %14s %12s %10s\n", "layout", "resident MiB", "bytes/book", "fill s");
+    printf("%-14s %14.1f %12.1f %10.2f\n", "fixed records",
+           (double)fixed_bytes / (1024 * 1024), (double)fixed_bytes / books, fixed_seconds);
+    printf("%-14s %14.1f %12.1f %10s\n", "slots + arena",
+           (double)books_bytes / (1024 * 1024), (double)books_bytes / books, "");
+    printf("%-14s %14.1f %12.1f %10.2f\n", "search index",
+           (double)index_bytes / (1024 * 1024), (double)index_bytes / books, index_seconds);
+    printf("%-14s %14.1f %12.1f %10.2f\n", "whole store",
+           (double)store_bytes / (1024 * 1024), (double)store_bytes / books, store_seconds);
+    printf("reduction %.1fx for the books, %.1fx with the search index\n",
+           (double)fixed_bytes / (double)books_bytes, (double)fixed_bytes / (double)store_bytes);
+    return 0;
+}
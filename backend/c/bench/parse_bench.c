@@ -0,0 +1,231 @@
+// Request body parsing: parse_book_json against the json-c path the server
+// used before (json_tokener_parse plus a strdup per field).
+//
+// Before timing, every generated body and a few hundred thousand mutated
+// ones (truncated, byte-flipped, spliced) are fed to both parsers. Any body
+// parse_book_json accepts must be accepted by json-c with the same fields,
+// and every well-formed body must be accepted. json-c is more lenient than
+// RFC 8259, so bodies only json-c accepts are counted but not an error.
+// json-c also decodes some valid surrogate pairs to U+FFFD; fields where it
+// did are skipped.
+//
+// Build from backend/c:
+//   cc -O2 -I. bench/parse_bench.c book_parser.c -ljson-c -o parse_bench
+// Usage: parse_bench [bodies=2000] [mutations=200000] [rounds=200]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+#include "book.h"
+#include "book_parser.h"
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static unsigned long long rng_state = 0x9e3779b97f4a7c15ull;
+
+static unsigned rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned)(rng_state >> 11);
+}
+
+static const char *string_pieces[] = {
+    "The C Programming Language", "Kernighan", " and ", "Ritchie", "\\\"quoted\\\"",
+    "line\\nbreak", "tab\\there", "back\\\\slash", "caf\\u00e9", "\\u20ac", "\\ud83d\\ude00",
+    "slash\\/ed", "caf\xc3\xa9 raw", "https://covers.openlibrary.org/b/id/6660100-L.jpg",
+    "a long run of plain text that crosses several simd blocks without any escapes at all",
+};
+
+static const char *extra_members[] = {
+    "\"year\":1978", "\"rating\":-4.5e+1", "\"tags\":[\"c\",\"classic\",[],{}]",
+    "\"meta\":{\"pages\":272,\"ok\":true,\"x\":null,\"y\":false}", "\"published_date\":\"1978-02-22\"",
+};
+
+static const char *known_keys[] = {"title", "author", "description", "coverImageUrl"};
+
+static void append_string(char *body, size_t *len, size_t cap) {
+    int pieces = (int)(rng() % 4);
+    *len += (size_t)snprintf(body + *len, cap - *len, "\"");
+    for (int i = 0; i < pieces; i++) {
+        const char *piece = string_pieces[rng() % (sizeof(string_pieces) / sizeof(string_pieces[0]))];
+        *len += (size_t)snprintf(body + *len, cap - *len, "%s", piece);
+    }
+    *len += (size_t)snprintf(body + *len, cap - *len, "\"");
+}
+
+// Writes a random well-formed create/update body
+static size_t generate_body(char *body, size_t cap) {
+    const char *ws[] = {"", " ", "\n  ", "\t"};
+    size_t len = 0;
+    len += (size_t)snprintf(body, cap, "%s{", ws[rng() % 4]);
+    int members = (int)(rng() % 7);
+    for (int i = 0; i < members; i++) {
+        len += (size_t)snprintf(body + len, cap - len, "%s%s", i > 0 ? "," : "", ws[rng() % 4]);
+        if (rng() % 3 == 0) {
+            len += (size_t)snprintf(body + len, cap - len, "%s",
+                                    extra_members[rng() % (sizeof(extra_members) / sizeof(extra_members[0]))]);
+            continue;
+        }
+        len += (size_t)snprintf(body + len, cap - len, "\"%s\"%s:%s", known_keys[rng() % 4], ws[rng() % 4], ws[rng() % 4]);
+        if (rng() % 8 == 0) {
+            len += (size_t)snprintf(body + len, cap - len, "null");
+        } else {
+            append_string(body, &len, cap);
+        }
+    }
+    len += (size_t)snprintf(body + len, cap - len, "%s}%s", ws[rng() % 4], ws[rng() % 4]);
+    return len;
+}
+
+// Corrupts a copy of a body without introducing NUL bytes
+static size_t mutate_body(const char *src, size_t len, char *dst) {
+    static const char structural[] = "{}[]\",:\\ u0e-.";
+    memcpy(dst, src, len);
+    switch (rng() % 4) {
+    case 0:
+        return len > 0 ? rng() % len : 0;
+    case 1:
+        if (len > 0) {
+            dst[rng() % len] = (char)(1 + rng() % 255);
+        }
+        return len;
+    case 2:
+        if (len > 0) {
+            dst[rng() % len] = structural[rng() % (sizeof(structural) - 1)];
+        }
+        return len;
+    default: {
+        if (len == 0) {
+            return 0;
+        }
+        size_t at = rng() % len;
+        memmove(dst + at + 1, dst + at, len - at);
+        dst[at] = structural[rng() % (sizeof(structural) - 1)];
+        return len + 1;
+    }
+    }
+}
+
+// Returns 0 if parse_book_json and json-c disagree on a body
+static int compare(const char *body, size_t len, int must_accept, int *lenient) {
+    char text[8192];
+    memcpy(text, body, len);
+    text[len] = '\0';
+
+    Book book;
+    int present = parse_book_json(text, len, &book);
+    struct json_object *jobj = json_tokener_parse(text);
+    int json_c_ok = jobj != NULL && json_object_get_type(jobj) == json_type_object;
+
+    int ok = 1;
+    if (present < 0) {
+        ok = !must_accept;
+        *lenient += json_c_ok;
+    } else if (!json_c_ok) {
+        ok = 0;
+    } else {
+        const char *values[] = {book.title, book.author, book.description, book.coverImageUrl};
+        const size_t caps[] = {sizeof(book.title), sizeof(book.author), sizeof(book.description),
+                               sizeof(book.coverImageUrl)};
+        for (int i = 0; ok && i < 4; i++) {
+            struct json_object *field;
+            int has = json_object_object_get_ex(jobj, known_keys[i], &field) &&
+                      json_object_get_type(field) == json_type_string;
+            if (has != ((present >> i) & 1)) {
+                ok = 0;
+            } else if (has && !strstr(json_object_get_string(field), "\xef\xbf\xbd")) {
+                ok = strncmp(json_object_get_string(field), values[i], caps[i] - 1) == 0;
+            }
+        }
+    }
+
+    if (jobj != NULL) {
+        json_object_put(jobj);
+    }
+    if (!ok) {
+        fprintf(stderr, "parsers disagree on: %s\n", text);
+    }
+    return ok;
+}
+
+static char* json_c_field(struct json_object *jobj, const char *key) {
+    struct json_object *field;
+    if (json_object_object_get_ex(jobj, key, &field)) {
+        const char *value = json_object_get_string(field);
+        return (value != NULL && strlen(value) > 0) ? strdup(value) : NULL;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 2000;
+    int mutations = argc > 2 ? atoi(argv[2]) : 200000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 200;
+
+    char (*bodies)[4096] = malloc((size_t)count * sizeof(*bodies));
+    size_t *lengths = malloc((size_t)count * sizeof(size_t));
+    int lenient = 0;
+    int failures = 0;
+
+    for (int i = 0; i < count; i++) {
+        lengths[i] = generate_body(bodies[i], sizeof(bodies[i]));
+        failures += !compare(bodies[i], lengths[i], 1, &lenient);
+    }
+    for (int i = 0; i < mutations; i++) {
+        char mutated[4097];
+        int source = (int)(rng() % (unsigned)count);
+        size_t len = mutate_body(bodies[source], lengths[source], mutated);
+        failures += !compare(mutated, len, 0, &lenient);
+    }
+    printf("conformance: %d bodies, %d mutations, %d disagreements, %d accepted only by json-c\n",
+           count, mutations, failures, lenient);
+    if (failures > 0) {
+        free(bodies);
+        free(lengths);
+        return 1;
+    }
+
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        bytes += lengths[i];
+    }
+
+    double start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            struct json_object *jobj = json_tokener_parse(bodies[i]);
+            for (int k = 0; k < 4; k++) {
+                free(json_c_field(jobj, known_keys[k]));
+            }
+            json_object_put(jobj);
+        }
+    }
+    double json_c_time = now_seconds() - start;
+
+    int sink = 0;
+    start = now_seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < count; i++) {
+            Book book;
+            sink += parse_book_json(bodies[i], lengths[i], &book);
+        }
+    }
+    double parser_time = now_seconds() - start;
+
+    double total = (double)bytes * rounds;
+    printf("%-16s %12s %12s\n", "parser", "ns/body", "MB/s");
+    printf("%-16s %12.1f %12.1f\n", "json-c", json_c_time / count / rounds * 1e9, total / json_c_time / 1e6);
+    printf("%-16s %12.1f %12.1f\n", "parse_book_json", parser_time / count / rounds * 1e9, total / parser_time / 1e6);
+    printf("speedup %.1fx (checksum %d)\n", json_c_time / parser_time, sink);
+
+    free(bodies);
+    free(lengths);
+    return 0;
+}
@@ -0,0 +1,273 @@
+// Search benchmark for the full-text index.
+//
+// Fills the store with generated books whose title and description words
+// follow a Zipf-like distribution, then times queries of several shapes
+// (whole words, typeahead prefixes, author names, very common words) and
+// prints latency percentiles for each. Finally measures how fast updates
+// run now that each one reindexes its book.
+//
+// Build from backend/c:
+//   cc -O2 -I. bench/search_bench.c book.c book_id.c book_file.c book_log.c book_search.c -luuid -lpthread -lm -o search_bench
+// Usage: search_bench [books=1000000] [queries=20000] [limit=20]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "book.h"
+
+#define VOCABULARY_SIZE 50000
+#define FIRST_NAMES 300
+#define LAST_NAMES 20000
+#define BATCH_SIZE 1024
+#define WORD_SIZE 32
+
+static const char *const syllables[] = {
+    "ka", "lo", "mi", "ren", "sa", "tor", "vel", "an", "bri", "dor", "el", "fa", "gun", "hal", "is",
+    "jor", "kin", "lu", "mar", "nov", "or", "pel", "qua", "ros", "sil", "tam", "ur", "vin", "wen", "yl",
+};
+#define SYLLABLE_COUNT (sizeof(syllables) / sizeof(syllables[0]))
+
+static const char *const common_words[] = {"the", "of", "and", "a", "in", "to", "for", "with", "on", "at"};
+#define COMMON_WORD_COUNT (sizeof(common_words) / sizeof(common_words[0]))
+
+static char vocabulary[VOCABULARY_SIZE][WORD_SIZE];
+static char first_names[FIRST_NAMES][WORD_SIZE];
+static char last_names[LAST_NAMES][WORD_SIZE];
+
+static unsigned long long rng_state = 42;
+
+static unsigned long long next_random(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double unit_random(void) {
+    return (double)(next_random() >> 11) / 9007199254740992.0;
+}
+
+// Rank in [0, n) with low ranks much more likely, like word frequencies
+static size_t zipf(size_t n) {
+    size_t rank = (size_t)pow((double)n, unit_random()) - 1;
+    return rank < n ? rank : n - 1;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Deterministic made-up word number i
+static void make_word(size_t i, char *word, int capitalize) {
+    word[0] = '\0';
+    do {
+        strcat(word, syllables[i % SYLLABLE_COUNT]);
+        i /= SYLLABLE_COUNT;
+    } while (i > 0);
+    if (capitalize) {
+        word[0] = (char)(word[0] - 'a' + 'A');
+    }
+}
+
+// Appends count words to text, a quarter of them very common
+static void append_words(char *text, size_t cap, int count) {
+    for (int w = 0; w < count; w++) {
+        const char *word = next_random() % 4 == 0 ? common_words[zipf(COMMON_WORD_COUNT)]
+                                                  : vocabulary[zipf(VOCABULARY_SIZE)];
+        size_t len = strlen(text);
+        snprintf(text + len, cap - len, "%s%s", len > 0 ? " " : "", word);
+    }
+}
+
+static void make_book(Book *book, int i) {
+    memset(book, 0, sizeof(Book));
+    append_words(book->title, sizeof(book->title), 2 + (int)(next_random() % 5));
+    book->title[0] = (char)(book->title[0] - 'a' + 'A');
+    snprintf(book->author, sizeof(book->author), "%s %s", first_names[next_random() % FIRST_NAMES],
+             last_names[zipf(LAST_NAMES)]);
+    append_words(book->description, sizeof(book->description), 8 + (int)(next_random() % 17));
+    snprintf(book->coverImageUrl, sizeof(book->coverImageUrl),
+             "https://covers.openlibrary.org/b/id/%d-L.jpg", i);
+}
+
+// Copies a random word of text into word
+static void random_word(const char *text, char *word) {
+    int words = 1;
+    for (const char *p = text; *p != '\0'; p++) {
+        words += *p == ' ';
+    }
+    int pick = (int)(next_random() % (unsigned long long)words);
+    const char *start = text;
+    while (pick-- > 0) {
+        start = strchr(start, ' ') + 1;
+    }
+    size_t len = strcspn(start, " ");
+    memcpy(word, start, len);
+    word[len] = '\0';
+}
+
+typedef void (*make_query)(const BookView *book, char *query, size_t cap);
+
+static void word_query(const BookView *book, char *query, size_t cap) {
+    char word[256];
+    random_word(book->title, word);
+    snprintf(query, cap, "%s ", word);
+}
+
+static void two_words_query(const BookView *book, char *query, size_t cap) {
+    char first[256];
+    char second[256];
+    random_word(book->title, first);
+    random_word(book->title, second);
+    snprintf(query, cap, "%s %s ", first, second);
+}
+
+// Every title word but the last, then a prefix of the last
+static void typeahead_query(const BookView *book, char *query, size_t cap) {
+    size_t len = strlen(book->title);
+    size_t cut = 1 + next_random() % len;
+    while (cut < len && book->title[cut - 1] == ' ') {
+        cut++;
+    }
+    snprintf(query, cap, "%.*s", (int)cut, book->title);
+}
+
+static void author_query(const BookView *book, char *query, size_t cap) {
+    const char *last = strrchr(book->author, ' ') + 1;
+    size_t len = strlen(last);
+    snprintf(query, cap, "%.*s", (int)(2 + next_random() % (len - 1)), last);
+}
+
+static void common_word_query(const BookView *book, char *query, size_t cap) {
+    (void)book;
+    snprintf(query, cap, "%s ", common_words[next_random() % COMMON_WORD_COUNT]);
+}
+
+static void short_prefix_query(const BookView *book, char *query, size_t cap) {
+    (void)book;
+    snprintf(query, cap, "%c", vocabulary[next_random() % 1000][0]);
+}
+
+static const struct {
+    const char *name;
+    make_query make;
+} shapes[] = {
+    {"word", word_query},
+    {"two words", two_words_query},
+    {"typeahead", typeahead_query},
+    {"author", author_query},
+    {"common word", common_word_query},
+    {"short prefix", short_prefix_query},
+};
+#define SHAPE_COUNT (sizeof(shapes) / sizeof(shapes[0]))
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t count, double p) {
+    size_t i = (size_t)(p * (double)count);
+    return sorted[i < count ? i : count - 1];
+}
+
+int main(int argc, char **argv) {
+    int books = argc > 1 ? atoi(argv[1]) : 1000000;
+    int queries = argc > 2 ? atoi(argv[2]) : 20000;
+    int limit = argc > 3 ? atoi(argv[3]) : 20;
+    if (books <= 0 || queries <= 0 || limit <= 0) {
+        fprintf(stderr, "books, queries and limit must be positive\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < VOCABULARY_SIZE; i++) {
+        make_word(i + SYLLABLE_COUNT, vocabulary[i], 0);
+    }
+    for (size_t i = 0; i < FIRST_NAMES; i++) {
+        make_word(i * 7 + 31, first_names[i], 1);
+    }
+    for (size_t i = 0; i < LAST_NAMES; i++) {
+        make_word(i * 13 + 1000, last_names[i], 1);
+    }
+
+    init_book_storage();
+    Book *batch = malloc(BATCH_SIZE * sizeof(Book));
+    int created[BATCH_SIZE];
+    if (batch == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    double start = now_seconds();
+    for (int i = 0; i < books; i += BATCH_SIZE) {
+        int count = books - i < BATCH_SIZE ? books - i : BATCH_SIZE;
+        for (int k = 0; k < count; k++) {
+            make_book(&batch[k], i + k);
+        }
+        create_books(batch, count, created);
+    }
+    printf("books=%d queries=%d limit=%d\n", books, queries, limit);
+    printf("stored and indexed in %.2f s\n\n", now_seconds() - start);
+
+    int stored_count;
+    BookView *stored = get_all_books(&stored_count);
+    Book *results = malloc((size_t)limit * sizeof(Book));
+    int per_shape = queries / (int)SHAPE_COUNT;
+    double *latencies = malloc((size_t)per_shape * sizeof(double));
+    double *all = malloc((size_t)per_shape * SHAPE_COUNT * sizeof(double));
+    if (stored == NULL || stored_count == 0 || results == NULL || latencies == NULL || all == NULL || per_shape == 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("%-14s %10s %10s %10s %10s %10s\n", "query", "p50 us", "p99 us", "max us", "avg hits", "queries");
+    size_t all_count = 0;
+    for (size_t s = 0; s < SHAPE_COUNT; s++) {
+        long long hits = 0;
+        for (int q = 0; q < per_shape; q++) {
+            char query[512];
+            shapes[s].make(&stored[next_random() % (unsigned long long)stored_count], query, sizeof(query));
+            double query_start = now_seconds();
+            hits += search_books(query, limit, results);
+            latencies[q] = (now_seconds() - query_start) * 1e6;
+            all[all_count++] = latencies[q];
+        }
+        qsort(latencies, (size_t)per_shape, sizeof(double), compare_doubles);
+        printf("%-14s %10.1f %10.1f %10.1f %10.1f %10d\n", shapes[s].name, percentile(latencies, per_shape, 0.5),
+               percentile(latencies, per_shape, 0.99), latencies[per_shape - 1], (double)hits / per_shape, per_shape);
+    }
+    qsort(all, all_count, sizeof(double), compare_doubles);
+    printf("%-14s %10.1f %10.1f %10.1f\n\n", "all", percentile(all, all_count, 0.5), percentile(all, all_count, 0.99),
+           all[all_count - 1]);
+
+    // Give random books new text; each update reindexes its book
+    int updates = books < 100000 ? books : 100000;
+    book_id *ids = malloc((size_t)updates * sizeof(*ids));
+    if (ids == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i < updates; i++) {
+        ids[i] = stored[next_random() % (unsigned long long)stored_count].id;
+    }
+    free(stored);
+    start = now_seconds();
+    for (int i = 0; i < updates; i++) {
+        make_book(&batch[0], i);
+        update_book(ids[i], batch[0].title, batch[0].author, batch[0].description, NULL, NULL);
+    }
+    printf("%.0f updates/sec with reindexing\n", updates / (now_seconds() - start));
+
+    free(ids);
+    free(all);
+    free(latencies);
+    free(results);
+    free(batch);
+    cleanup_book_storage();
+    return 0;
+}
@@ -0,0 +1,129 @@
+// Memory-mapped store benchmark.
+//
+// Fills a BOOK_STORE_FILE-style store, then compares restart time for the
+// mapped file (indexes rebuilt from slot metadata, records left on disk)
+// against loading the same books from a write-ahead log snapshot. Finishes
+// with random lookups on the reopened file, which fault records in on
+// demand.
+//
+// Build from backend/c:
+//   cc -O2 -I. bench/store_bench.c book.c book_id.c book_file.c book_log.c book_search.c -luuid -lpthread -lm -o store_bench
+// Usage: store_bench [dir=store_bench_data] [books=200000] [lookups=1000000]
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "book.h"
+#include "book_log.h"
+
+static const char *dir;
+static char store_path[4096];
+static char log_dir[4096];
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void remove_tree(const char *path) {
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        unlink(path);
+        return;
+    }
+    struct dirent *entry;
+    char child[4096];
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            remove_tree(child);
+        }
+    }
+    closedir(d);
+    rmdir(path);
+}
+
+static void fill(int books) {
+    for (int i = 0; i < books; i++) {
+        char title[32];
+        snprintf(title, sizeof(title), "Title %d", i);
+        create_book(title, "Author", "A benchmark book", "https://covers.openlibrary.org/b/id/1-L.jpg", NULL);
+    }
+}
+
+static double file_startup(int *count) {
+    double start = now_seconds();
+    init_book_storage_file(store_path);
+    double elapsed = now_seconds() - start;
+    free(get_all_books(count));
+    return elapsed;
+}
+
+static double snapshot_startup(int *count) {
+    double start = now_seconds();
+    init_book_storage();
+    enable_book_persistence(log_dir, 0, 0);
+    double elapsed = now_seconds() - start;
+    free(get_all_books(count));
+    cleanup_book_storage();
+    return elapsed;
+}
+
+int main(int argc, char **argv) {
+    dir = argc > 1 ? argv[1] : "store_bench_data";
+    int books = argc > 2 ? atoi(argv[2]) : 200000;
+    long lookups = argc > 3 ? atol(argv[3]) : 1000000;
+    if (books <= 0 || lookups <= 0) {
+        fprintf(stderr, "books and lookups must be positive\n");
+        return 1;
+    }
+
+    remove_tree(dir);
+    mkdir(dir, 0755);
+    snprintf(store_path, sizeof(store_path), "%s/books.bin", dir);
+    snprintf(log_dir, sizeof(log_dir), "%s/log", dir);
+
+    // The same books in both stores
+    init_book_storage_file(store_path);
+    fill(books);
+    int count;
+    BookView *all = get_all_books(&count);
+    book_id *ids = malloc((size_t)count * sizeof(*ids));
+    for (int i = 0; i < count; i++) {
+        ids[i] = all[i].id;
+    }
+    book_log_open(log_dir, 0, 0, NULL);
+    book_log_snapshot(all, count);
+    book_log_close();
+    free(all);
+    cleanup_book_storage();
+
+    struct stat st;
+    stat(store_path, &st);
+    printf("startup with %d books (%.1f MiB file)\n", books, (double)st.st_size / (1024 * 1024));
+    double snapshot_seconds = snapshot_startup(&count);
+    printf("%-18s %8d books  %8.2f ms\n", "log snapshot", count, snapshot_seconds * 1000);
+    double file_seconds = file_startup(&count);
+    printf("%-18s %8d books  %8.2f ms\n", "mapped file", count, file_seconds * 1000);
+
+    srand(42);
+    unsigned long long checksum = 0;
+    double start = now_seconds();
+    for (long i = 0; i < lookups; i++) {
+        Book book;
+        get_book_by_id(ids[rand() % count], &book);
+        checksum += (unsigned char)book.title[6];
+    }
+    double elapsed = now_seconds() - start;
+    printf("\n%ld random lookups: %.0f/sec (checksum %llu)\n", lookups, (double)lookups / elapsed, checksum);
+
+    cleanup_book_storage();
+    free(ids);
+    remove_tree(dir);
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Write-ahead log benchmark.
+//
+// First measures durable appends per second as writer threads are added,
+// which shows how well group commit shares each fdatasync. Then measures
+// startup time for a full store recovered from the log alone and from a
+// snapshot plus a short log tail.
+//
+// Build from backend/c:
+//   cc -O2 -I. bench/wal_bench.c book.c book_id.c book_file.c book_log.c book_search.c -luuid -lpthread -lm -o wal_bench
+// Usage: wal_bench [dir=wal_bench_data] [writes=20000] [max_threads=16] [sync=1]
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "book.h"
+#include "book_log.h"
+
+#define STORE_BOOKS 1000
+
+static const char *dir;
+static unsigned long long writes;
+static unsigned long long next_write;
+static pthread_mutex_t order_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void remove_dir(void) {
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    char path[4096];
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+static void make_book(Book *book, BookView *view, unsigned long long i) {
+    memset(book, 0, sizeof(*book));
+    book->id = book_id_generate();
+    snprintf(book->title, sizeof(book->title), "Title %llu", i);
+    snprintf(book->author, sizeof(book->author), "Author %llu", i % 100);
+    snprintf(book->description, sizeof(book->description), "A benchmark book");
+    snprintf(book->coverImageUrl, sizeof(book->coverImageUrl),
+             "https://covers.openlibrary.org/b/id/%llu-L.jpg", i);
+    BookView fields = {book->id, book->title, book->author, book->description, "", book->coverImageUrl};
+    *view = fields;
+}
+
+static void ignore_replay(book_log_op op, const Book *book) {
+    (void)op;
+    (void)book;
+}
+
+// Appends in order under a lock, then waits outside it like a server thread
+static void* writer(void *arg) {
+    (void)arg;
+    Book book;
+    BookView view;
+    for (;;) {
+        pthread_mutex_lock(&order_mutex);
+        unsigned long long i = next_write++;
+        unsigned long long lsn = 0;
+        if (i < writes) {
+            make_book(&book, &view, i);
+            lsn = book_log_append(BOOK_LOG_PUT, &view);
+        }
+        pthread_mutex_unlock(&order_mutex);
+        if (i >= writes) {
+            return NULL;
+        }
+        book_log_wait(lsn);
+    }
+}
+
+static double append_rate(int threads, int sync) {
+    remove_dir();
+    book_log_open(dir, sync, 0, ignore_replay);
+    next_write = 0;
+
+    pthread_t workers[256];
+    double start = now_seconds();
+    for (int t = 0; t < threads; t++) {
+        pthread_create(&workers[t], NULL, writer, NULL);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    book_log_close();
+    return (double)writes / elapsed;
+}
+
+// Fills the store, then updates every book `rounds` times
+static void prepare(unsigned long long snapshot_every, int rounds) {
+    remove_dir();
+    init_book_storage();
+    enable_book_persistence(dir, 0, snapshot_every);
+    for (int i = 0; i < STORE_BOOKS; i++) {
+        create_book("Title", "Author", "A benchmark book", "https://covers.openlibrary.org/b/id/1-L.jpg", NULL);
+    }
+    for (int r = 0; r < rounds; r++) {
+        unsigned long long cursor = 0;
+        Book book;
+        while (get_next_book(&cursor, &book)) {
+            update_book(book.id, "Updated title", NULL, NULL, NULL, NULL);
+        }
+    }
+    cleanup_book_storage();
+}
+
+static void report_startup(const char *label) {
+    double start = now_seconds();
+    init_book_storage();
+    enable_book_persistence(dir, 0, 0);
+    double elapsed = now_seconds() - start;
+
+    int snapshot_books;
+    unsigned long long replayed;
+    book_log_recovery_stats(&snapshot_books, &replayed);
+    printf("%-22s %6d books  %8llu replayed  %8.2f ms\n", label, snapshot_books, replayed, elapsed * 1000);
+    cleanup_book_storage();
+}
+
+int main(int argc, char **argv) {
+    dir = argc > 1 ? argv[1] : "wal_bench_data";
+    writes = argc > 2 ? strtoull(argv[2], NULL, 10) : 20000;
+    int max_threads = argc > 3 ? atoi(argv[3]) : 16;
+    int sync = argc > 4 ? atoi(argv[4]) : 1;
+    if (writes == 0 || max_threads <= 0 || max_threads > 256) {
+        fprintf(stderr, "writes must be positive and max_threads between 1 and 256\n");
+        return 1;
+    }
+
+    printf("durable appends/sec, %llu writes, fdatasync %s\n", writes, sync ? "on" : "off");
+    printf("%8s %14s\n", "threads", "writes/sec");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        printf("%8d %14.0f\n", threads, append_rate(threads, sync));
+    }
+
+    int rounds = 50;
+    printf("\nstartup with %d books and %d updates of each\n", STORE_BOOKS, rounds);
+    prepare(0, rounds);
+    report_startup("log only");
+    prepare((unsigned long long)STORE_BOOKS * rounds, rounds);
+    report_startup("snapshot + log tail");
+
+    remove_dir();
+    return 0;
+}
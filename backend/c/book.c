@@ -1,136 +1,698 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#ifdef _WIN32
-#include <rpc.h>
-#else
-#include <uuid/uuid.h>
-#endif
 #include "book.h"
+#include "book_file.h"
+#include "book_log.h"
+#include "book_search.h"
 
-#define MAX_BOOKS 1000
+// Books live in book_file slots; the indexes below and the search index
+// are rebuilt from the slots whenever the store is opened.
 
-static Book books[MAX_BOOKS];
+// Guards the slots, their strings, the search index and everything below.
+// Readers copy what they return before letting go of it.
+static pthread_rwlock_t store_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// id -> slot, open addressing with linear probing. An entry is 8 bytes: the
+// slot and the top half of the id's hash, so a probe only reads the slot
+// to confirm a match. Slots fit in 32 bits (see SLOTS_RESERVE).
+typedef struct {
+    unsigned slot; // Slot + 1; 0 marks an empty entry
+    unsigned tag;  // Top 32 bits of book_id_hash
+} id_entry;
+
+static id_entry *id_index = NULL;
+static unsigned long long id_index_mask = 0; // Capacity - 1, a power of two
+
+// One entry per book in creation order; slot is BOOK_FILE_NO_SLOT once the
+// book is deleted, until the tombstones are compacted away
+typedef struct {
+    unsigned long long seq;
+    unsigned long long slot;
+} order_entry;
+
+static order_entry *order = NULL;
+static size_t order_len = 0;
+static size_t order_cap = 0;
+static size_t tombstones = 0;
 static int book_count = 0;
 
-void init_book_storage(void) {
+// Bumped under the write lock after every change, read without it
+static unsigned long long store_version = 0;
+
+static void store_changed(void) {
+    __atomic_store_n(&store_version, store_version + 1, __ATOMIC_RELEASE);
+}
+
+// Returns the index entry holding id, or the empty entry where it would go
+static id_entry* index_entry(book_id id) {
+    unsigned long long hash = book_id_hash(id);
+    unsigned tag = (unsigned)(hash >> 32);
+    unsigned long long i = hash & id_index_mask;
+    while (id_index[i].slot != 0) {
+        if (id_index[i].tag == tag && BOOK_ID_EQUAL(book_file_slot(id_index[i].slot - 1)->id, id)) {
+            break;
+        }
+        i = (i + 1) & id_index_mask;
+    }
+    return &id_index[i];
+}
+
+static void index_put(book_id id, unsigned long long slot) {
+    id_entry *entry = index_entry(id);
+    entry->slot = (unsigned)(slot + 1);
+    entry->tag = (unsigned)(book_id_hash(id) >> 32);
+}
+
+// Returns the slot holding id, or BOOK_FILE_NO_SLOT
+static unsigned long long find_book(book_id id) {
+    if (id_index == NULL) {
+        return BOOK_FILE_NO_SLOT;
+    }
+    unsigned slot = index_entry(id)->slot;
+    return slot != 0 ? slot - 1 : BOOK_FILE_NO_SLOT;
+}
+
+// Where an entry's probe run starts
+static unsigned long long index_home(const id_entry *entry) {
+    return book_id_hash(book_file_slot(entry->slot - 1)->id) & id_index_mask;
+}
+
+static int index_grow(void) {
+    unsigned long long capacity = id_index_mask ? (id_index_mask + 1) * 2 : 1024;
+    id_entry *old = id_index;
+    unsigned long long old_capacity = id_index_mask ? id_index_mask + 1 : 0;
+    id_index = calloc(capacity, sizeof(id_entry));
+    if (id_index == NULL) {
+        id_index = old;
+        return 0;
+    }
+    id_index_mask = capacity - 1;
+    for (unsigned long long i = 0; i < old_capacity; i++) {
+        if (old[i].slot != 0) {
+            unsigned long long j = index_home(&old[i]);
+            while (id_index[j].slot != 0) {
+                j = (j + 1) & id_index_mask;
+            }
+            id_index[j] = old[i];
+        }
+    }
+    free(old);
+    return 1;
+}
+
+// Removes an id, shifting later entries of its probe run back into the hole
+static void index_remove(id_entry *entry) {
+    unsigned long long hole = (unsigned long long)(entry - id_index);
+    unsigned long long i = hole;
+    for (;;) {
+        i = (i + 1) & id_index_mask;
+        if (id_index[i].slot == 0) {
+            break;
+        }
+        unsigned long long home = index_home(&id_index[i]);
+        // Move it if its home is not between the hole and i (cyclically)
+        if (((i - home) & id_index_mask) >= ((i - hole) & id_index_mask)) {
+            id_index[hole] = id_index[i];
+            hole = i;
+        }
+    }
+    id_index[hole].slot = 0;
+}
+
+// Makes room for one more order entry
+static int order_reserve(void) {
+    if (order_len < order_cap) {
+        return 1;
+    }
+    size_t cap = order_cap ? order_cap * 2 : 1024;
+    order_entry *grown = realloc(order, cap * sizeof(order_entry));
+    if (grown == NULL) {
+        return 0;
+    }
+    order = grown;
+    order_cap = cap;
+    return 1;
+}
+
+static void order_append(unsigned long long seq, unsigned long long slot) {
+    order[order_len].seq = seq;
+    order[order_len].slot = slot;
+    order_len++;
+}
+
+// First order entry with a sequence above seq
+static size_t order_after(unsigned long long seq) {
+    size_t lo = 0;
+    size_t hi = order_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (order[mid].seq <= seq) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void order_compact(void) {
+    size_t kept = 0;
+    for (size_t i = 0; i < order_len; i++) {
+        if (order[i].slot != BOOK_FILE_NO_SLOT) {
+            order[kept++] = order[i];
+        }
+    }
+    order_len = kept;
+    tombstones = 0;
+}
+
+static int compare_order(const void *a, const void *b) {
+    unsigned long long sa = ((const order_entry *)a)->seq;
+    unsigned long long sb = ((const order_entry *)b)->seq;
+    return sa < sb ? -1 : sa > sb;
+}
+
+static void free_indexes(void) {
+    free(id_index);
+    free(order);
+    id_index = NULL;
+    id_index_mask = 0;
+    order = NULL;
+    order_len = 0;
+    order_cap = 0;
+    tombstones = 0;
     book_count = 0;
-    memset(books, 0, sizeof(books));
+    book_search_clear();
+}
+
+// Adds a stored book to the search index
+static int index_words(unsigned long long slot) {
+    book_slot *meta = book_file_slot(slot);
+    return book_search_add(slot, book_file_string(meta->title), book_file_string(meta->author),
+                           book_file_string(meta->description));
+}
+
+// Drops a stored book from the search index; call before its strings change
+static void unindex_words(unsigned long long slot) {
+    book_slot *meta = book_file_slot(slot);
+    book_search_remove(slot, book_file_string(meta->title), book_file_string(meta->author),
+                       book_file_string(meta->description));
+}
+
+// Maps the store and rebuilds the indexes from its slot metadata
+static int open_store(const char *path) {
+    book_log_close();
+    free_indexes();
+    if (!book_file_open(path) || !index_grow()) {
+        return 0;
+    }
+
+    unsigned long long slots = book_file_slot_count();
+    for (unsigned long long slot = 0; slot < slots; slot++) {
+        book_slot *meta = book_file_slot(slot);
+        if (meta->seq == 0) {
+            continue;
+        }
+        if ((unsigned long long)(book_count + 1) * 2 > id_index_mask + 1 && !index_grow()) {
+            return 0;
+        }
+        if (!order_reserve()) {
+            return 0;
+        }
+        order_append(meta->seq, slot);
+        index_put(meta->id, slot);
+        book_count++;
+    }
+    // Reused slots are out of sequence order
+    if (order_len > 1) {
+        qsort(order, order_len, sizeof(order_entry), compare_order);
+    }
+    for (size_t i = 0; i < order_len; i++) {
+        if (!index_words(order[i].slot)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void init_book_storage(void) {
+    pthread_rwlock_wrlock(&store_lock);
+    if (!open_store(NULL)) {
+        fprintf(stderr, "Failed to allocate book storage\n");
+    }
+    pthread_rwlock_unlock(&store_lock);
+}
+
+int init_book_storage_file(const char *path) {
+    pthread_rwlock_wrlock(&store_lock);
+    int ok = open_store(path);
+    pthread_rwlock_unlock(&store_lock);
+    return ok;
 }
 
 void cleanup_book_storage(void) {
-    // Nothing to cleanup for in-memory storage
-}
-
-static void generate_uuid(char *uuid_str) {
-#ifdef _WIN32
-    UUID uuid;
-    UuidCreate(&uuid);
-    unsigned char *str;
-    UuidToStringA(&uuid, &str);
-    strncpy(uuid_str, (char*)str, 36);
-    uuid_str[36] = '\0';
-    RpcStringFreeA(&str);
-#else
-    uuid_t uuid;
-    uuid_generate(uuid);
-    uuid_unparse(uuid, uuid_str);
-#endif
-}
-
-Book* create_book(const char *title, const char *author, const char *description, const char *coverImageUrl) {
-    if (book_count >= MAX_BOOKS) {
-        return NULL;
+    pthread_rwlock_wrlock(&store_lock);
+    book_log_close();
+    free_indexes();
+    book_file_close();
+    pthread_rwlock_unlock(&store_lock);
+}
+
+static void view_of(unsigned long long slot, BookView *book) {
+    book_slot *meta = book_file_slot(slot);
+    book->id = meta->id;
+    book->title = book_file_string(meta->title);
+    book->author = book_file_string(meta->author);
+    book->description = book_file_string(meta->description);
+    book->cover_base = book_file_string(meta->cover_base);
+    book->cover_name = book_file_string(meta->cover_name);
+}
+
+static int snapshot_store(void) {
+    int count;
+    BookView *all = get_all_books(&count);
+    int ok = all != NULL && book_log_snapshot(all, count);
+    free(all);
+    return ok;
+}
+
+// Releases the write lock once the changes logged under it up to lsn (0 if
+// logging failed) are durable. The wait happens after unlocking, so writers
+// that get here together share one sync. A snapshot that is due is started
+// before, since nothing may be logged while it takes the books; the file is
+// written in the background, and a failed one only delays the next.
+static int unlock_when_durable(unsigned long long lsn) {
+    if (lsn != 0 && book_log_snapshot_due() && !snapshot_store()) {
+        fprintf(stderr, "Failed to start a book snapshot\n");
+    }
+    pthread_rwlock_unlock(&store_lock);
+    int ok = lsn != 0 && book_log_wait(lsn);
+    if (!ok) {
+        fprintf(stderr, "Failed to write the book log\n");
+    }
+    return ok;
+}
+
+// Logs a change made under the write lock and releases the lock once it is
+// durable. Only releases the lock unless persistence is enabled. Returns 1,
+// or BOOK_NOT_PERSISTED if the change could not be logged.
+static int persist_and_unlock(book_log_op op, const BookView *book) {
+    if (!book_log_is_open()) {
+        pthread_rwlock_unlock(&store_lock);
+        return 1;
+    }
+    return unlock_when_durable(book_log_append(op, book)) ? 1 : BOOK_NOT_PERSISTED;
+}
+
+// Length of value once cut to fit a Book field of size cap
+static size_t clipped_length(const char *value, size_t cap) {
+    size_t len = strlen(value);
+    return len < cap - 1 ? len : cap - 1;
+}
+
+static void copy_field(char *field, size_t cap, const char *value) {
+    size_t len = clipped_length(value, cap);
+    memcpy(field, value, len);
+    field[len] = '\0';
+}
+
+// Copies a stored book out; every field fits, as the store clips them to
+// the Book sizes
+static void copy_book(unsigned long long slot, Book *book) {
+    book_slot *meta = book_file_slot(slot);
+    book->id = meta->id;
+    copy_field(book->title, sizeof(book->title), book_file_string(meta->title));
+    copy_field(book->author, sizeof(book->author), book_file_string(meta->author));
+    copy_field(book->description, sizeof(book->description), book_file_string(meta->description));
+    const char *base = book_file_string(meta->cover_base);
+    size_t base_len = clipped_length(base, sizeof(book->coverImageUrl));
+    memcpy(book->coverImageUrl, base, base_len);
+    copy_field(book->coverImageUrl + base_len, sizeof(book->coverImageUrl) - base_len,
+               book_file_string(meta->cover_name));
+}
+
+void book_view_of(const Book *book, BookView *view) {
+    view->id = book->id;
+    view->title = book->title;
+    view->author = book->author;
+    view->description = book->description;
+    view->cover_base = book->coverImageUrl;
+    view->cover_name = "";
+}
+
+// Stores value cut to cap - 1 bytes in *str
+static int put_string(book_str *str, const char *value, size_t cap, int intern) {
+    *str = book_file_put_string(value, clipped_length(value, cap), intern);
+    return *str != BOOK_FILE_NO_STR;
+}
+
+// Replaces a string with value cut to cap - 1 bytes; the old one is only
+// dropped once the new one is stored
+static int set_string(book_str *field, const char *value, size_t cap, int intern) {
+    book_str str;
+    if (!put_string(&str, value, cap, intern)) {
+        return 0;
     }
+    book_file_drop_string(*field);
+    *field = str;
+    return 1;
+}
 
+// Splits a cover URL after its last '/' so books can share the prefix, and
+// stores both parts. Returns 0 with neither stored on failure.
+static int put_cover(const char *url, book_str *base, book_str *name) {
+    size_t len = clipped_length(url, sizeof(((Book *)0)->coverImageUrl));
+    size_t base_len = len;
+    while (base_len > 0 && url[base_len - 1] != '/') {
+        base_len--;
+    }
+    *base = book_file_put_string(url, base_len, 1);
+    if (*base == BOOK_FILE_NO_STR) {
+        return 0;
+    }
+    *name = book_file_put_string(url + base_len, len - base_len, 0);
+    if (*name == BOOK_FILE_NO_STR) {
+        book_file_drop_string(*base);
+        *base = BOOK_FILE_NO_STR;
+        return 0;
+    }
+    return 1;
+}
+
+static int set_cover(book_slot *meta, const char *url) {
+    book_str base;
+    book_str name;
+    if (!put_cover(url, &base, &name)) {
+        return 0;
+    }
+    book_file_drop_string(meta->cover_base);
+    book_file_drop_string(meta->cover_name);
+    meta->cover_base = base;
+    meta->cover_name = name;
+    return 1;
+}
+
+#define FIELD_SIZE(field) sizeof(((Book *)0)->field)
+
+// Stores a book in a free slot and returns the slot; a nil id gets a fresh
+// one. Returns BOOK_FILE_NO_SLOT on failure.
+static unsigned long long add_book(book_id id, const char *title, const char *author, const char *description, const char *coverImageUrl) {
     if (title == NULL || author == NULL || strlen(title) == 0 || strlen(author) == 0) {
-        return NULL;
+        return BOOK_FILE_NO_SLOT;
     }
 
-    Book *book = &books[book_count];
-    generate_uuid(book->id);
-    
-    strncpy(book->title, title, sizeof(book->title) - 1);
-    book->title[sizeof(book->title) - 1] = '\0';
-    
-    strncpy(book->author, author, sizeof(book->author) - 1);
-    book->author[sizeof(book->author) - 1] = '\0';
-    
-    if (description != NULL) {
-        strncpy(book->description, description, sizeof(book->description) - 1);
-        book->description[sizeof(book->description) - 1] = '\0';
-    } else {
-        book->description[0] = '\0';
+    if ((unsigned long long)(book_count + 1) * 2 > id_index_mask + 1 && !index_grow()) {
+        return BOOK_FILE_NO_SLOT;
     }
-    
-    if (coverImageUrl != NULL) {
-        strncpy(book->coverImageUrl, coverImageUrl, sizeof(book->coverImageUrl) - 1);
-        book->coverImageUrl[sizeof(book->coverImageUrl) - 1] = '\0';
-    } else {
-        book->coverImageUrl[0] = '\0';
+    if (!order_reserve()) {
+        return BOOK_FILE_NO_SLOT;
+    }
+    unsigned long long slot = book_file_alloc();
+    if (slot == BOOK_FILE_NO_SLOT) {
+        return BOOK_FILE_NO_SLOT;
+    }
+
+    book_slot *meta = book_file_slot(slot);
+    int ok = set_string(&meta->title, title, FIELD_SIZE(title), 0) &&
+             set_string(&meta->author, author, FIELD_SIZE(author), 1) &&
+             (description == NULL || set_string(&meta->description, description, FIELD_SIZE(description), 0)) &&
+             (coverImageUrl == NULL || set_cover(meta, coverImageUrl)) &&
+             index_words(slot);
+    if (!ok) {
+        book_file_release(slot);
+        return BOOK_FILE_NO_SLOT;
     }
 
+    // The id goes in last, so a crash before this point leaves a slot that
+    // book_file_open frees
+    if (BOOK_ID_IS_NIL(id)) {
+        id = book_id_generate();
+    }
+    meta->id = id;
+
+    order_append(meta->seq, slot);
+    index_put(id, slot);
     book_count++;
-    return book;
+    store_changed();
+    return slot;
+}
+
+int create_book(const char *title, const char *author, const char *description, const char *coverImageUrl, Book *book) {
+    pthread_rwlock_wrlock(&store_lock);
+    book_id fresh = {0, 0};
+    unsigned long long slot = add_book(fresh, title, author, description, coverImageUrl);
+    if (slot == BOOK_FILE_NO_SLOT) {
+        pthread_rwlock_unlock(&store_lock);
+        return 0;
+    }
+    if (book != NULL) {
+        copy_book(slot, book);
+    }
+    BookView created;
+    view_of(slot, &created);
+    return persist_and_unlock(BOOK_LOG_PUT, &created);
 }
 
-Book** get_all_books(int *count) {
+int create_books(const Book *inputs, int count, int *created) {
+    unsigned long long *slots = malloc((size_t)count * sizeof(unsigned long long));
+    if (slots == NULL) {
+        memset(created, 0, (size_t)count * sizeof(int));
+        return 0;
+    }
+    int stored = 0;
+    pthread_rwlock_wrlock(&store_lock);
+    for (int i = 0; i < count; i++) {
+        const Book *input = &inputs[i];
+        slots[i] = BOOK_FILE_NO_SLOT;
+        if (BOOK_ID_IS_NIL(input->id) || find_book(input->id) == BOOK_FILE_NO_SLOT) {
+            slots[i] = add_book(input->id, input->title, input->author, input->description, input->coverImageUrl);
+        }
+        created[i] = slots[i] != BOOK_FILE_NO_SLOT;
+        stored += created[i];
+    }
+
+    // One durable wait for the whole batch
+    if (stored > 0 && book_log_is_open()) {
+        unsigned long long lsn = 0;
+        for (int i = 0; i < count; i++) {
+            if (created[i]) {
+                BookView book;
+                view_of(slots[i], &book);
+                if ((lsn = book_log_append(BOOK_LOG_PUT, &book)) == 0) {
+                    break;
+                }
+            }
+        }
+        if (!unlock_when_durable(lsn)) {
+            for (int i = 0; i < count; i++) {
+                if (created[i]) {
+                    created[i] = BOOK_NOT_PERSISTED;
+                }
+            }
+        }
+    } else {
+        pthread_rwlock_unlock(&store_lock);
+    }
+    free(slots);
+    return stored;
+}
+
+BookView* get_all_books(int *count) {
     *count = book_count;
-    Book **result = malloc(book_count * sizeof(Book*));
-    for (int i = 0; i < book_count; i++) {
-        result[i] = &books[i];
+    BookView *result = malloc((book_count > 0 ? book_count : 1) * sizeof(BookView));
+    if (result == NULL) {
+        return NULL;
+    }
+    int n = 0;
+    for (size_t i = 0; i < order_len; i++) {
+        if (order[i].slot != BOOK_FILE_NO_SLOT) {
+            view_of(order[i].slot, &result[n++]);
+        }
     }
     return result;
 }
 
-Book* get_book_by_id(const char *id) {
-    for (int i = 0; i < book_count; i++) {
-        if (strcmp(books[i].id, id) == 0) {
-            return &books[i];
+int get_book_by_id(book_id id, Book *book) {
+    pthread_rwlock_rdlock(&store_lock);
+    unsigned long long slot = find_book(id);
+    if (slot != BOOK_FILE_NO_SLOT && book != NULL) {
+        copy_book(slot, book);
+    }
+    pthread_rwlock_unlock(&store_lock);
+    return slot != BOOK_FILE_NO_SLOT;
+}
+
+unsigned long long get_book_store_version(void) {
+    return __atomic_load_n(&store_version, __ATOMIC_ACQUIRE);
+}
+
+int get_book_count(void) {
+    pthread_rwlock_rdlock(&store_lock);
+    int count = book_count;
+    pthread_rwlock_unlock(&store_lock);
+    return count;
+}
+
+#define BOOK_STRINGS 5
+
+// Exchanges the strings of a stored book with those set in strings
+static void swap_strings(book_slot *meta, book_str *strings) {
+    book_str *fields[BOOK_STRINGS] = {&meta->title, &meta->author, &meta->description,
+                                      &meta->cover_base, &meta->cover_name};
+    for (int i = 0; i < BOOK_STRINGS; i++) {
+        if (strings[i] != BOOK_FILE_NO_STR) {
+            book_str old = *fields[i];
+            *fields[i] = strings[i];
+            strings[i] = old;
         }
     }
-    return NULL;
 }
 
-Book* update_book(const char *id, const char *title, const char *author, const char *description, const char *coverImageUrl) {
-    Book *book = get_book_by_id(id);
-    if (book == NULL) {
-        return NULL;
+// Changes the given fields of a stored book without logging it. Every new
+// string is stored before the book changes, so it changes completely or, if
+// memory runs out, not at all.
+static int change_book(unsigned long long slot, const char *title, const char *author, const char *description, const char *coverImageUrl) {
+    book_str strings[BOOK_STRINGS] = {BOOK_FILE_NO_STR, BOOK_FILE_NO_STR, BOOK_FILE_NO_STR,
+                                      BOOK_FILE_NO_STR, BOOK_FILE_NO_STR};
+    int ok = (title == NULL || strlen(title) == 0 || put_string(&strings[0], title, FIELD_SIZE(title), 0)) &&
+             (author == NULL || strlen(author) == 0 || put_string(&strings[1], author, FIELD_SIZE(author), 1)) &&
+             (description == NULL || put_string(&strings[2], description, FIELD_SIZE(description), 0)) &&
+             (coverImageUrl == NULL || put_cover(coverImageUrl, &strings[3], &strings[4]));
+    if (ok) {
+        // Back to the old strings if the search index cannot take the new
+        book_slot *meta = book_file_slot(slot);
+        unindex_words(slot);
+        swap_strings(meta, strings);
+        ok = index_words(slot);
+        if (!ok) {
+            swap_strings(meta, strings);
+            index_words(slot);
+        }
+    }
+    // The strings given up: the old ones, or the new ones on failure
+    for (int i = 0; i < BOOK_STRINGS; i++) {
+        book_file_drop_string(strings[i]);
+    }
+    if (ok) {
+        store_changed();
+    }
+    return ok;
+}
+
+int update_book(book_id id, const char *title, const char *author, const char *description, const char *coverImageUrl, Book *book) {
+    pthread_rwlock_wrlock(&store_lock);
+    unsigned long long slot = find_book(id);
+    if (slot == BOOK_FILE_NO_SLOT || !change_book(slot, title, author, description, coverImageUrl)) {
+        pthread_rwlock_unlock(&store_lock);
+        return 0;
+    }
+    if (book != NULL) {
+        copy_book(slot, book);
+    }
+    BookView updated;
+    view_of(slot, &updated);
+    return persist_and_unlock(BOOK_LOG_PUT, &updated);
+}
+
+static int remove_book(book_id id) {
+    if (id_index == NULL) {
+        return 0;
     }
+    id_entry *entry = index_entry(id);
+    if (entry->slot == 0) {
+        return 0;
+    }
+    unsigned long long slot = entry->slot - 1;
+    index_remove(entry);
+
+    size_t position = order_after(book_file_slot(slot)->seq - 1);
+    order[position].slot = BOOK_FILE_NO_SLOT;
+    tombstones++;
+    if (tombstones > 64 && tombstones * 2 > order_len) {
+        order_compact();
+    }
+
+    unindex_words(slot);
+    book_file_release(slot);
+    book_count--;
+    store_changed();
+    return 1;
+}
 
-    if (title != NULL && strlen(title) > 0) {
-        strncpy(book->title, title, sizeof(book->title) - 1);
-        book->title[sizeof(book->title) - 1] = '\0';
+int delete_book_by_id(book_id id) {
+    pthread_rwlock_wrlock(&store_lock);
+    if (!remove_book(id)) {
+        pthread_rwlock_unlock(&store_lock);
+        return 0;
     }
-    
-    if (author != NULL && strlen(author) > 0) {
-        strncpy(book->author, author, sizeof(book->author) - 1);
-        book->author[sizeof(book->author) - 1] = '\0';
+    BookView removed = {id, "", "", "", "", ""};
+    return persist_and_unlock(BOOK_LOG_DELETE, &removed);
+}
+
+// Applies a recovered change without logging it again. Records from before
+// ids were UUIDs whose id does not parse come with a nil id and are skipped.
+static void replay_book(book_log_op op, const Book *book) {
+    if (BOOK_ID_IS_NIL(book->id)) {
+        return;
     }
-    
-    if (description != NULL) {
-        strncpy(book->description, description, sizeof(book->description) - 1);
-        book->description[sizeof(book->description) - 1] = '\0';
+    if (op == BOOK_LOG_DELETE) {
+        remove_book(book->id);
+        return;
     }
-    
-    if (coverImageUrl != NULL) {
-        strncpy(book->coverImageUrl, coverImageUrl, sizeof(book->coverImageUrl) - 1);
-        book->coverImageUrl[sizeof(book->coverImageUrl) - 1] = '\0';
+    unsigned long long slot = find_book(book->id);
+    if (slot != BOOK_FILE_NO_SLOT) {
+        change_book(slot, book->title, book->author, book->description, book->coverImageUrl);
+    } else {
+        add_book(book->id, book->title, book->author, book->description, book->coverImageUrl);
     }
+}
+
+int enable_book_persistence(const char *dir, int sync, unsigned long long snapshot_every) {
+    pthread_rwlock_wrlock(&store_lock);
+    // Fold a long replay into a snapshot so the next start is quick
+    int ok = book_log_open(dir, sync, snapshot_every, replay_book) &&
+             (!book_log_snapshot_due() || snapshot_store());
+    pthread_rwlock_unlock(&store_lock);
+    return ok;
+}
+
+// Searches with up to this many results keep their slots on the stack
+#define STACK_SEARCH_SLOTS 128
 
-    return book;
+int search_books(const char *query, int limit, Book *results) {
+    unsigned long long stack_slots[STACK_SEARCH_SLOTS];
+    unsigned long long *slots = limit <= STACK_SEARCH_SLOTS
+        ? stack_slots : malloc((size_t)limit * sizeof(unsigned long long));
+    if (slots == NULL) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&store_lock);
+    int count = book_search_query(query, limit, slots);
+    for (int i = 0; i < count; i++) {
+        copy_book(slots[i], &results[i]);
+    }
+    pthread_rwlock_unlock(&store_lock);
+    if (slots != stack_slots) {
+        free(slots);
+    }
+    return count;
 }
 
-int delete_book_by_id(const char *id) {
-    for (int i = 0; i < book_count; i++) {
-        if (strcmp(books[i].id, id) == 0) {
-            // Shift all books after this one
-            for (int j = i; j < book_count - 1; j++) {
-                books[j] = books[j + 1];
+int get_next_book(unsigned long long *cursor, Book *book) {
+    int found = 0;
+    pthread_rwlock_rdlock(&store_lock);
+    for (size_t i = order_after(*cursor); i < order_len; i++) {
+        if (order[i].slot != BOOK_FILE_NO_SLOT) {
+            *cursor = order[i].seq;
+            if (book != NULL) {
+                copy_book(order[i].slot, book);
             }
-            book_count--;
-            return 1;
+            found = 1;
+            break;
         }
     }
-    return 0;
+    pthread_rwlock_unlock(&store_lock);
+    return found;
 }
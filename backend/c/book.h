@@ -1,25 +1,100 @@
 #ifndef BOOK_H
 #define BOOK_H
 
+#include "book_id.h"
+
+// A book with its fields inline, as parsed from a request body or read
+// back from the log. The sizes bound what the store keeps of each field.
 typedef struct {
-    char id[37];  // UUID
+    book_id id;   // Nil when not given
     char title[256];
     char author[256];
     char description[1024];
     char coverImageUrl[512];
 } Book;
 
-// Initialize storage
+// A stored book. The strings point into the store and stay valid until the
+// book is changed or deleted, so views only leave the store where nothing
+// else can change it (see get_all_books). Cover URLs are kept in two parts
+// so books can share the common prefix: coverImageUrl is cover_base then
+// cover_name.
+typedef struct {
+    book_id id;
+    const char *title;
+    const char *author;
+    const char *description;
+    const char *cover_base;
+    const char *cover_name;
+} BookView;
+
+// Points view at the fields of book
+void book_view_of(const Book *book, BookView *view);
+
+// The store is safe to use from many threads. Lookups share a read lock and
+// copy the books they return into the caller's Book, which holds every field
+// in full since the store keeps no more than a Book has room for. Changes
+// take the lock exclusively; with persistence enabled they are logged under
+// it, so the log has them in store order, and then wait for the disk without
+// it, so writers that finish together share one sync.
+
+// Initialize storage in memory
 void init_book_storage(void);
 
+// Initialize storage in a memory-mapped file instead, keeping the books
+// already in it (see book_file.h). Returns 0 if path cannot be used.
+int init_book_storage_file(const char *path);
+
 // Cleanup storage
 void cleanup_book_storage(void);
 
-// CRUD operations
-Book* create_book(const char *title, const char *author, const char *description, const char *coverImageUrl);
-Book** get_all_books(int *count);
-Book* get_book_by_id(const char *id);
-Book* update_book(const char *id, const char *title, const char *author, const char *description, const char *coverImageUrl);
-int delete_book_by_id(const char *id);
+// Makes the store durable: loads the books saved in dir, then logs every
+// change there before it is acknowledged (see book_log.h). Call right after
+// init_book_storage. Returns 0 if dir cannot be used.
+int enable_book_persistence(const char *dir, int sync, unsigned long long snapshot_every);
+
+// Returned by the changes below when, with persistence enabled, the store
+// has the change but the log could not record it. Other threads already see
+// it, but it may not survive a restart.
+#define BOOK_NOT_PERSISTED (-1)
+
+// CRUD operations. Each returns 1 and copies the book into *book (which may
+// be NULL) on success, or 0 if the book is missing or invalid or the store
+// cannot grow, leaving it unchanged. Changes may also return
+// BOOK_NOT_PERSISTED, having copied the book.
+int create_book(const char *title, const char *author, const char *description, const char *coverImageUrl, Book *book);
+int get_book_by_id(book_id id, Book *book);
+int update_book(book_id id, const char *title, const char *author, const char *description, const char *coverImageUrl, Book *book);
+int delete_book_by_id(book_id id);
+
+// Number of books stored
+int get_book_count(void);
+
+// A number that every change to the store increases. Read it before the
+// books to tell whether something built from them is still current.
+unsigned long long get_book_store_version(void);
+
+// Every book in creation order; free() the array. NULL if memory runs out.
+// The views are not copies, so only use this while no other thread can
+// change the store, as at startup or in a benchmark.
+BookView* get_all_books(int *count);
+
+// Creates count books in one pass over the store, for bulk imports. A book
+// whose id is set keeps it; a nil id gets a fresh one. created[i] is 1
+// if inputs[i] was stored, or 0 if it lacks a title or author, reuses an
+// existing id or the store cannot grow; books stored but not logged have
+// BOOK_NOT_PERSISTED instead of 1. Returns the number stored.
+int create_books(const Book *inputs, int count, int *created);
+
+// Full-text search over titles, authors and descriptions (see
+// book_search.h). Fills results, which has room for limit books, with
+// copies of the best matches for query, best first, and returns how many
+// there are.
+int search_books(const char *query, int limit, Book *results);
+
+// Cursor iteration in creation order. Copies the first book created after
+// *cursor (0 starts from the beginning) into *book (which may be NULL) and
+// advances *cursor to it, or returns 0 when no books follow. Cursors stay
+// valid across deletes.
+int get_next_book(unsigned long long *cursor, Book *book);
 
 #endif
@@ -0,0 +1,513 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "book_file.h"
+
+#define SLOTS_MAGIC "BOOKFIL3"
+#define STRINGS_MAGIC "BOOKSTR1"
+
+// Layout alignment; a multiple of every common page size
+#define LAYOUT_ALIGN 65536ULL
+
+// Address space reserved for each mapping: about 1.9 billion slots, and as
+// much arena as a book_str offset can address
+#define SLOTS_RESERVE (1ULL << 37)
+#define STRINGS_RESERVE (1ULL << 39)
+
+// The arena grows by at least this much at a time
+#define STRINGS_GROW (4ULL << 20)
+
+#define ALIGN_UP(n) (((n) + LAYOUT_ALIGN - 1) / LAYOUT_ALIGN * LAYOUT_ALIGN)
+
+#define HEADER_BYTES LAYOUT_ALIGN
+#define EXTENT_BYTES ALIGN_UP(BOOK_FILE_EXTENT_SLOTS * sizeof(book_slot))
+
+// book_str packing: [interned:1][offset:39][length:24]
+#define STR_INTERNED (1ULL << 63)
+#define STR_OFFSET(s) (((s) & ~STR_INTERNED) >> 24)
+#define STR_MAX_LEN 0xffffffULL
+
+// Arena blocks are multiples of 8 bytes. A free block starts with the
+// offset of the next free block of its size. Blocks too large for a free
+// list are not reused; no book field comes close.
+#define BLOCK_ALIGN 8ULL
+#define STRING_CLASSES 256
+
+// Precedes the bytes of an interned string
+typedef struct {
+    unsigned refs;
+    unsigned hash;
+} intern_header;
+
+typedef struct {
+    char magic[8];
+    unsigned slot_size;           // sizeof(book_slot) when written, to reject
+    unsigned extent_slots;        // another layout
+    unsigned long long extents;   // Extents in the file
+    unsigned long long used;      // Slots handed out so far
+    unsigned long long free_head; // First free slot + 1, 0 if none
+    unsigned long long next_seq;
+} slots_header;
+
+typedef struct {
+    char magic[8];
+    unsigned long long used;      // End of the allocated blocks
+    unsigned long long size;      // Bytes in the file
+    unsigned long long free_heads[STRING_CLASSES]; // By block size / 8, 0 if none
+} strings_header;
+
+typedef struct {
+    char *base;                   // Start of the reserved range
+    unsigned long long reserved;
+    int fd;                       // -1 for anonymous memory
+} mapping;
+
+static mapping slots_map = {NULL, 0, -1};
+static mapping strings_map = {NULL, 0, -1};
+static slots_header *slots = NULL;
+static strings_header *strings = NULL;
+
+// Interned strings by content, open addressing with linear probing; 0
+// marks an empty entry. Rebuilt from the slots on open.
+static book_str *interned = NULL;
+static unsigned long long interned_mask = 0;
+static unsigned long long interned_count = 0;
+
+typedef char book_slot_is_72_bytes[sizeof(book_slot) == 72 ? 1 : -1];
+
+static int map_reserve(mapping *m, unsigned long long bytes) {
+#ifdef _WIN32
+    m->base = VirtualAlloc(NULL, bytes, MEM_RESERVE, PAGE_NOACCESS);
+    if (m->base == NULL) {
+        return 0;
+    }
+#else
+    void *p = mmap(NULL, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        return 0;
+    }
+    m->base = p;
+#endif
+    m->reserved = bytes;
+    return 1;
+}
+
+// Maps bytes at offset of the reserved range (and of the file, if any)
+static int map_range(mapping *m, unsigned long long offset, unsigned long long bytes) {
+#ifdef _WIN32
+    return VirtualAlloc(m->base + offset, bytes, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+    void *p = m->fd >= 0
+        ? mmap(m->base + offset, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, m->fd, (off_t)offset)
+        : mmap(m->base + offset, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    return p != MAP_FAILED;
+#endif
+}
+
+// Extends the file and the mapping from size to new_size bytes
+static int map_grow(mapping *m, unsigned long long size, unsigned long long new_size) {
+    if (new_size > m->reserved) {
+        return 0;
+    }
+#ifndef _WIN32
+    if (m->fd >= 0 && ftruncate(m->fd, (off_t)new_size) != 0) {
+        return 0;
+    }
+#endif
+    return map_range(m, size, new_size - size);
+}
+
+static void map_release(mapping *m) {
+    if (m->base != NULL) {
+#ifdef _WIN32
+        VirtualFree(m->base, 0, MEM_RELEASE);
+#else
+        munmap(m->base, m->reserved);
+#endif
+    }
+    m->base = NULL;
+    if (m->fd >= 0) {
+        close(m->fd);
+        m->fd = -1;
+    }
+}
+
+// Reserves the range and maps what path already holds into it. *size is 0
+// for a new file or anonymous memory.
+static int map_open(mapping *m, const char *path, unsigned long long reserve, unsigned long long *size) {
+    *size = 0;
+    if (!map_reserve(m, reserve)) {
+        return 0;
+    }
+    if (path == NULL) {
+        return 1;
+    }
+#ifdef _WIN32
+    // File-backed storage needs mmap
+    return 0;
+#else
+    m->fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (m->fd < 0 || fstat(m->fd, &st) != 0) {
+        return 0;
+    }
+    *size = (unsigned long long)st.st_size;
+    return *size == 0 || (*size <= reserve && map_range(m, 0, *size));
+#endif
+}
+
+static unsigned hash_bytes(const char *s, size_t len) {
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static intern_header* header_of(book_str s) {
+    return (intern_header *)(strings_map.base + STR_OFFSET(s) - sizeof(intern_header));
+}
+
+// Returns the entry holding a string equal to s, or the empty entry where
+// it would go
+static book_str* intern_entry(const char *s, size_t len, unsigned hash) {
+    unsigned long long i = hash & interned_mask;
+    while (interned[i] != 0) {
+        book_str e = interned[i];
+        if (header_of(e)->hash == hash && BOOK_STR_LEN(e) == len &&
+            memcmp(book_file_string(e), s, len) == 0) {
+            break;
+        }
+        i = (i + 1) & interned_mask;
+    }
+    return &interned[i];
+}
+
+// Makes room for one more interned string
+static int intern_reserve(void) {
+    if (interned_mask != 0 && (interned_count + 1) * 2 <= interned_mask + 1) {
+        return 1;
+    }
+    unsigned long long capacity = interned_mask ? (interned_mask + 1) * 2 : 256;
+    unsigned long long old_capacity = interned_mask ? interned_mask + 1 : 0;
+    book_str *old = interned;
+    interned = calloc(capacity, sizeof(book_str));
+    if (interned == NULL) {
+        interned = old;
+        return 0;
+    }
+    interned_mask = capacity - 1;
+    for (unsigned long long i = 0; i < old_capacity; i++) {
+        if (old[i] != 0) {
+            unsigned long long j = header_of(old[i])->hash & interned_mask;
+            while (interned[j] != 0) {
+                j = (j + 1) & interned_mask;
+            }
+            interned[j] = old[i];
+        }
+    }
+    free(old);
+    return 1;
+}
+
+// Removes s, shifting later entries of its probe run back into the hole
+static void intern_remove(book_str s) {
+    if (interned == NULL) {
+        return;
+    }
+    unsigned long long hole = header_of(s)->hash & interned_mask;
+    while (interned[hole] != s) {
+        if (interned[hole] == 0) {
+            return;
+        }
+        hole = (hole + 1) & interned_mask;
+    }
+    unsigned long long i = hole;
+    for (;;) {
+        i = (i + 1) & interned_mask;
+        if (interned[i] == 0) {
+            break;
+        }
+        unsigned long long home = header_of(interned[i])->hash & interned_mask;
+        // Move it if its home is not between the hole and i (cyclically)
+        if (((i - home) & interned_mask) >= ((i - hole) & interned_mask)) {
+            interned[hole] = interned[i];
+            hole = i;
+        }
+    }
+    interned[hole] = 0;
+    interned_count--;
+}
+
+static unsigned long long block_bytes(size_t len, int intern) {
+    unsigned long long bytes = len + 1 + (intern ? sizeof(intern_header) : 0);
+    return (bytes + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+}
+
+// Returns the offset of a free block, or 0 if the arena cannot grow
+static unsigned long long alloc_block(unsigned long long bytes) {
+    unsigned long long size_class = bytes / BLOCK_ALIGN;
+    if (size_class < STRING_CLASSES && strings->free_heads[size_class] != 0) {
+        unsigned long long block = strings->free_heads[size_class];
+        memcpy(&strings->free_heads[size_class], strings_map.base + block, sizeof(unsigned long long));
+        return block;
+    }
+
+    if (strings->used + bytes > strings->size) {
+        unsigned long long size = ALIGN_UP(strings->used + bytes);
+        if (size < strings->size + STRINGS_GROW) {
+            size = strings->size + STRINGS_GROW;
+        }
+        if (!map_grow(&strings_map, strings->size, size)) {
+            return 0;
+        }
+        strings->size = size;
+    }
+    unsigned long long block = strings->used;
+    strings->used += bytes;
+    return block;
+}
+
+static void free_block(unsigned long long block, unsigned long long bytes) {
+    unsigned long long size_class = bytes / BLOCK_ALIGN;
+    if (size_class >= STRING_CLASSES) {
+        return;
+    }
+    memcpy(strings_map.base + block, &strings->free_heads[size_class], sizeof(unsigned long long));
+    strings->free_heads[size_class] = block;
+}
+
+// Appends one extent of slots, growing the file first
+static int grow_slots(void) {
+    unsigned long long size = HEADER_BYTES + slots->extents * EXTENT_BYTES;
+    if (!map_grow(&slots_map, size, size + EXTENT_BYTES)) {
+        return 0;
+    }
+    slots->extents++;
+    return 1;
+}
+
+static int create_headers(void) {
+    if (!map_grow(&slots_map, 0, HEADER_BYTES) || !map_grow(&strings_map, 0, HEADER_BYTES)) {
+        return 0;
+    }
+    slots = (slots_header *)slots_map.base;
+    memcpy(slots->magic, SLOTS_MAGIC, sizeof(slots->magic));
+    slots->slot_size = sizeof(book_slot);
+    slots->extent_slots = BOOK_FILE_EXTENT_SLOTS;
+    slots->extents = 0;
+    slots->used = 0;
+    slots->free_head = 0;
+    slots->next_seq = 1;
+
+    strings = (strings_header *)strings_map.base;
+    memcpy(strings->magic, STRINGS_MAGIC, sizeof(strings->magic));
+    strings->used = HEADER_BYTES;
+    strings->size = HEADER_BYTES;
+    memset(strings->free_heads, 0, sizeof(strings->free_heads));
+    return 1;
+}
+
+static int check_headers(unsigned long long slots_size, unsigned long long strings_size) {
+    if (slots_size < HEADER_BYTES || strings_size < HEADER_BYTES) {
+        return 0;
+    }
+    slots = (slots_header *)slots_map.base;
+    strings = (strings_header *)strings_map.base;
+    return memcmp(slots->magic, SLOTS_MAGIC, sizeof(slots->magic)) == 0 &&
+           slots->slot_size == sizeof(book_slot) &&
+           slots->extent_slots == BOOK_FILE_EXTENT_SLOTS &&
+           HEADER_BYTES + slots->extents * EXTENT_BYTES <= slots_size &&
+           slots->used <= slots->extents * BOOK_FILE_EXTENT_SLOTS &&
+           memcmp(strings->magic, STRINGS_MAGIC, sizeof(strings->magic)) == 0 &&
+           strings->used <= strings->size && strings->size <= strings_size;
+}
+
+// Finds the interned strings in use and frees the slots of books whose
+// store was cut short by a crash
+static int scan_slots(void) {
+    for (unsigned long long slot = 0; slot < slots->used; slot++) {
+        book_slot *meta = book_file_slot(slot);
+        if (meta->seq == 0) {
+            continue;
+        }
+        if (BOOK_ID_IS_NIL(meta->id)) {
+            book_file_release(slot);
+            continue;
+        }
+        book_str shared[2] = {meta->author, meta->cover_base};
+        for (int i = 0; i < 2; i++) {
+            if ((shared[i] & STR_INTERNED) == 0) {
+                continue;
+            }
+            if (!intern_reserve()) {
+                return 0;
+            }
+            book_str *entry = intern_entry(book_file_string(shared[i]), BOOK_STR_LEN(shared[i]),
+                                           header_of(shared[i])->hash);
+            if (*entry == 0) {
+                *entry = shared[i];
+                interned_count++;
+            }
+        }
+    }
+    return 1;
+}
+
+int book_file_open(const char *path) {
+    book_file_close();
+
+    char *strings_path = NULL;
+    if (path != NULL) {
+        size_t len = strlen(path);
+        strings_path = malloc(len + sizeof(".strings"));
+        if (strings_path == NULL) {
+            return 0;
+        }
+        memcpy(strings_path, path, len);
+        memcpy(strings_path + len, ".strings", sizeof(".strings"));
+    }
+
+    unsigned long long slots_size;
+    unsigned long long strings_size;
+    int ok = map_open(&slots_map, path, SLOTS_RESERVE, &slots_size) &&
+             map_open(&strings_map, strings_path, STRINGS_RESERVE, &strings_size);
+    free(strings_path);
+    if (ok) {
+        ok = slots_size == 0 && strings_size == 0
+            ? create_headers()
+            : check_headers(slots_size, strings_size) && scan_slots();
+    }
+    if (!ok) {
+        book_file_close();
+    }
+    return ok;
+}
+
+void book_file_close(void) {
+    map_release(&slots_map);
+    map_release(&strings_map);
+    slots = NULL;
+    strings = NULL;
+    free(interned);
+    interned = NULL;
+    interned_mask = 0;
+    interned_count = 0;
+}
+
+unsigned long long book_file_slot_count(void) {
+    return slots != NULL ? slots->used : 0;
+}
+
+book_slot* book_file_slot(unsigned long long slot) {
+    char *extent = slots_map.base + HEADER_BYTES + slot / BOOK_FILE_EXTENT_SLOTS * EXTENT_BYTES;
+    return (book_slot *)extent + slot % BOOK_FILE_EXTENT_SLOTS;
+}
+
+unsigned long long book_file_alloc(void) {
+    if (slots == NULL) {
+        return BOOK_FILE_NO_SLOT;
+    }
+
+    unsigned long long slot;
+    if (slots->free_head != 0) {
+        slot = slots->free_head - 1;
+        slots->free_head = book_file_slot(slot)->next_free;
+    } else {
+        if (slots->used == slots->extents * BOOK_FILE_EXTENT_SLOTS && !grow_slots()) {
+            return BOOK_FILE_NO_SLOT;
+        }
+        slot = slots->used++;
+    }
+
+    book_slot *meta = book_file_slot(slot);
+    memset(meta, 0, sizeof(*meta));
+    meta->seq = slots->next_seq++;
+    return slot;
+}
+
+void book_file_release(unsigned long long slot) {
+    book_slot *meta = book_file_slot(slot);
+    book_file_drop_string(meta->title);
+    book_file_drop_string(meta->author);
+    book_file_drop_string(meta->description);
+    book_file_drop_string(meta->cover_base);
+    book_file_drop_string(meta->cover_name);
+    memset(meta, 0, sizeof(*meta));
+    meta->next_free = slots->free_head;
+    slots->free_head = slot + 1;
+}
+
+book_str book_file_put_string(const char *s, size_t len, int intern) {
+    if (len == 0) {
+        return 0;
+    }
+    if (strings == NULL || len > STR_MAX_LEN) {
+        return BOOK_FILE_NO_STR;
+    }
+
+    book_str *entry = NULL;
+    unsigned hash = 0;
+    if (intern) {
+        hash = hash_bytes(s, len);
+        if (!intern_reserve()) {
+            return BOOK_FILE_NO_STR;
+        }
+        entry = intern_entry(s, len, hash);
+        if (*entry != 0) {
+            header_of(*entry)->refs++;
+            return *entry;
+        }
+    }
+
+    unsigned long long block = alloc_block(block_bytes(len, intern));
+    if (block == 0) {
+        return BOOK_FILE_NO_STR;
+    }
+    unsigned long long offset = block;
+    if (intern) {
+        intern_header *header = (intern_header *)(strings_map.base + block);
+        header->refs = 1;
+        header->hash = hash;
+        offset += sizeof(intern_header);
+    }
+    memcpy(strings_map.base + offset, s, len);
+    strings_map.base[offset + len] = '\0';
+
+    book_str str = (offset << 24) | len;
+    if (intern) {
+        str |= STR_INTERNED;
+        *entry = str;
+        interned_count++;
+    }
+    return str;
+}
+
+void book_file_drop_string(book_str s) {
+    if (s == 0 || s == BOOK_FILE_NO_STR || strings == NULL) {
+        return;
+    }
+    size_t len = BOOK_STR_LEN(s);
+    if (s & STR_INTERNED) {
+        if (--header_of(s)->refs > 0) {
+            return;
+        }
+        intern_remove(s);
+        free_block(STR_OFFSET(s) - sizeof(intern_header), block_bytes(len, 1));
+    } else {
+        free_block(STR_OFFSET(s), block_bytes(len, 0));
+    }
+}
+
+const char* book_file_string(book_str s) {
+    return s == 0 ? "" : strings_map.base + STR_OFFSET(s);
+}
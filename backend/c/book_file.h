@@ -0,0 +1,81 @@
+#ifndef BOOK_FILE_H
+#define BOOK_FILE_H
+
+#include <stddef.h>
+#include "book_id.h"
+
+// Compact book records in memory mappings that grow on demand, optionally
+// backed by files so the store survives restarts.
+//
+// Each book is one 72-byte slot holding its id and references to its
+// strings, which live in a separate string arena. Author names and cover
+// URL prefixes are interned: books that share them share one reference
+// counted copy. Freed slots and strings go on free lists for reuse.
+//
+// The slot file is a header followed by extents of BOOK_FILE_EXTENT_SLOTS
+// slots, aligned to 64 KiB so every page size can map them; the arena lives
+// next to it in "<path>.strings". Rebuilding the id index at startup only
+// reads the slots; strings are paged in as they are used (the search index
+// reads them once at startup), so a catalog larger than RAM is paged in and
+// out by the kernel.
+//
+// The address range for the largest possible files is reserved up front and
+// extents are mapped into it as the files grow, so string pointers stay
+// valid until the string is dropped or book_file_close is called.
+//
+// A file-backed store survives the process exiting or crashing; surviving
+// power loss needs the write-ahead log instead (see book_log.h).
+
+// 8192 slots fill nine 64 KiB units exactly
+#define BOOK_FILE_EXTENT_SLOTS 8192
+
+// A string in the arena: an offset and a length packed into 64 bits, with
+// the top bit set for interned strings. 0 is the empty string.
+typedef unsigned long long book_str;
+
+#define BOOK_STR_LEN(s) ((size_t)((s) & 0xffffff))
+
+typedef struct {
+    unsigned long long seq;       // Creation cursor, 0 while the slot is free
+    unsigned long long next_free; // Next free slot + 1, 0 at the end of the list
+    book_id id;                   // Set last when a book is stored
+    book_str title;
+    book_str author;              // Interned
+    book_str description;
+    book_str cover_base;          // Interned coverImageUrl up to its last '/'
+    book_str cover_name;          // The rest of coverImageUrl
+} book_slot;
+
+#define BOOK_FILE_NO_SLOT ((unsigned long long)-1)
+#define BOOK_FILE_NO_STR ((book_str)-1)
+
+// Maps path and "<path>.strings", creating them if needed, or anonymous
+// memory if path is NULL. Returns 0 if the files cannot be opened or were
+// written with another layout.
+int book_file_open(const char *path);
+void book_file_close(void);
+
+// Slots handed out so far; every slot below this is free or in use
+unsigned long long book_file_slot_count(void);
+
+book_slot* book_file_slot(unsigned long long slot);
+
+// Takes a slot from the free list, or grows the mapping, and stamps it with
+// the next creation sequence. Returns BOOK_FILE_NO_SLOT if it cannot grow.
+unsigned long long book_file_alloc(void);
+
+// Drops a slot's strings, clears it and puts it on the free list
+void book_file_release(unsigned long long slot);
+
+// Copies len bytes into the arena, or takes another reference to an equal
+// interned string when intern is set. Returns BOOK_FILE_NO_STR if the arena
+// cannot grow.
+book_str book_file_put_string(const char *s, size_t len, int intern);
+
+// Releases a string returned by book_file_put_string
+void book_file_drop_string(book_str s);
+
+// The NUL-terminated bytes of s
+const char* book_file_string(book_str s);
+
+#endif
@@ -0,0 +1,148 @@
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <rpc.h>
+#else
+#include <uuid/uuid.h>
+#endif
+#include "book_id.h"
+
+// Offsets of the 32 hex digits in the text form
+static const unsigned char digit_at[32] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 9, 10, 11, 12, 14, 15, 16, 17,
+    19, 20, 21, 22, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,
+};
+
+static _Thread_local struct {
+    int seeded;
+    unsigned long long state[2]; // xorshift128+
+    unsigned long long last_ms;  // Time in the last id
+    unsigned counter;            // Counter in the last id
+} generator;
+
+// Seeds the calling thread's generator from the system's UUID generator,
+// the one syscall a thread makes for its ids
+static void seed_generator(void) {
+    unsigned char bytes[16];
+#ifdef _WIN32
+    UUID uuid;
+    UuidCreate(&uuid);
+    memcpy(bytes, &uuid, sizeof(bytes));
+#else
+    uuid_t uuid;
+    uuid_generate_random(uuid);
+    memcpy(bytes, uuid, sizeof(bytes));
+#endif
+    memcpy(generator.state, bytes, sizeof(generator.state));
+    generator.state[0] |= 1; // xorshift must not start from all zeros
+    generator.seeded = 1;
+}
+
+static unsigned long long next_random(void) {
+    unsigned long long s1 = generator.state[0];
+    unsigned long long s0 = generator.state[1];
+    generator.state[0] = s0;
+    s1 ^= s1 << 23;
+    generator.state[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+    return generator.state[1] + s0;
+}
+
+book_id book_id_generate(void) {
+    if (!generator.seeded) {
+        seed_generator();
+    }
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    unsigned long long ms = (unsigned long long)now.tv_sec * 1000 + (unsigned long long)now.tv_nsec / 1000000;
+
+    // A new millisecond starts the counter at a random point in its lower
+    // half, leaving room to count; running out borrows the next millisecond
+    if (ms > generator.last_ms) {
+        generator.last_ms = ms;
+        generator.counter = (unsigned)(next_random() >> 53);
+    } else if (++generator.counter > 0xfff) {
+        generator.last_ms++;
+        generator.counter = 0;
+    }
+
+    book_id id;
+    id.hi = (generator.last_ms & 0xffffffffffffULL) << 16 | 0x7000 | generator.counter;
+    id.lo = next_random() >> 2 | 0x8000000000000000ULL;
+    return id;
+}
+
+#define ONES 0x0101010101010101ULL
+#define HIGH_BITS 0x8080808080808080ULL
+
+// Reads 4 or 8 bytes, the first one lowest
+static unsigned long long load64(const char *p) {
+    unsigned long long x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap64(x);
+#endif
+    return x;
+}
+
+static unsigned long long load32(const char *p) {
+    unsigned x;
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = __builtin_bswap32(x);
+#endif
+    return x;
+}
+
+// Eight characters at once, one per byte: the high bit of each byte of the
+// result is set where that byte of x is at least c. Bytes of x must be
+// ASCII, so no sum carries into the next byte.
+static unsigned long long at_least(unsigned long long x, unsigned char c) {
+    return (x + (0x80 - c) * ONES) & HIGH_BITS;
+}
+
+static int all_hex(unsigned long long x) {
+    unsigned long long lower = x | 0x20 * ONES;
+    unsigned long long digit = at_least(x, '0') & ~at_least(x, '9' + 1);
+    unsigned long long letter = at_least(lower, 'a') & ~at_least(lower, 'f' + 1);
+    return (x & HIGH_BITS) == 0 && (digit | letter) == HIGH_BITS;
+}
+
+// The value of eight hex digits, the first one in the lowest byte
+static unsigned long long hex_value(unsigned long long x) {
+    // '0'-'9' end in their value, 'a'-'f' and 'A'-'F' in 1-6 and have 0x40 set
+    x = (x & 0x0f * ONES) + ((x & 0x40 * ONES) >> 6) * 9;
+    // Pack the nibbles, first digit highest: pairs, then quads, then all eight
+    x = (x << 4 | x >> 8) & 0x00ff00ff00ff00ffULL;
+    x = (x << 8 | x >> 16) & 0x0000ffff0000ffffULL;
+    return (x << 16 | x >> 32) & 0xffffffffULL;
+}
+
+// Checks and converts eight digits at a time, with no branch per character
+int book_id_parse(const char *text, size_t len, book_id *id) {
+    if (len != 36 || text[8] != '-' || text[13] != '-' || text[18] != '-' || text[23] != '-') {
+        return 0;
+    }
+    // The digits in four runs of eight, skipping the dashes
+    unsigned long long runs[4] = {
+        load64(text),
+        load32(text + 9) | load32(text + 14) << 32,
+        load32(text + 19) | load32(text + 24) << 32,
+        load64(text + 28),
+    };
+    if (!all_hex(runs[0]) || !all_hex(runs[1]) || !all_hex(runs[2]) || !all_hex(runs[3])) {
+        return 0;
+    }
+    id->hi = hex_value(runs[0]) << 32 | hex_value(runs[1]);
+    id->lo = hex_value(runs[2]) << 32 | hex_value(runs[3]);
+    return !BOOK_ID_IS_NIL(*id);
+}
+
+void book_id_format(book_id id, char text[BOOK_ID_TEXT_SIZE]) {
+    static const char hex[] = "0123456789abcdef";
+    memset(text, '-', 36);
+    for (int i = 0; i < 32; i++) {
+        unsigned long long word = i < 16 ? id.hi : id.lo;
+        text[digit_at[i]] = hex[(word >> (60 - 4 * (i % 16))) & 0xf];
+    }
+    text[36] = '\0';
+}
@@ -0,0 +1,51 @@
+#ifndef BOOK_ID_H
+#define BOOK_ID_H
+
+#include <stddef.h>
+
+// Book ids are 128-bit UUIDs held as two 64-bit words, hi being the first
+// eight bytes, so comparing (hi, lo) orders ids the way their text sorts.
+//
+// New ids are UUIDv7 (RFC 9562): 48 bits of Unix time in milliseconds, a
+// 12-bit counter and 62 random bits. Every thread has its own generator:
+// the time comes from timespec_get (the vDSO on Linux) and the random bits
+// from a xorshift generator seeded once per thread, so making an id takes
+// no lock and no syscall. The counter keeps each thread's ids increasing
+// within a millisecond and across clock steps back; the random bits keep
+// threads and processes apart. Ids made in order sort in order, so books
+// created together sit together in anything ordered by id.
+//
+// Text, the usual 36 characters of hex and dashes, only exists at the API
+// boundary: request paths and bodies, JSON responses and error messages.
+
+typedef struct {
+    unsigned long long hi;
+    unsigned long long lo;
+} book_id;
+
+// 36 characters and a NUL
+#define BOOK_ID_TEXT_SIZE 37
+
+book_id book_id_generate(void);
+
+// Parses the 36-character form, in either case. Returns 0 if text is not
+// one, or is the nil UUID, which stands for "no id".
+int book_id_parse(const char *text, size_t len, book_id *id);
+
+// Writes the 36-character lowercase form and a NUL
+void book_id_format(book_id id, char text[BOOK_ID_TEXT_SIZE]);
+
+#define BOOK_ID_EQUAL(a, b) ((a).hi == (b).hi && (a).lo == (b).lo)
+#define BOOK_ID_IS_NIL(id) (((id).hi | (id).lo) == 0)
+
+// Mixes both words, so index buckets stay spread even for ids that share
+// their time and counter
+static inline unsigned long long book_id_hash(book_id id) {
+    unsigned long long h = id.hi * 0x9e3779b97f4a7c15ULL ^ id.lo;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#endif
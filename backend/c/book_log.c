@@ -0,0 +1,747 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#define fsync _commit
+#define fdatasync _commit
+#else
+#include <unistd.h>
+#endif
+#include "book_log.h"
+
+#define SNAPSHOT_MAGIC "BKSNAPC1"
+#define SNAPSHOT_MAGIC_LEN 8
+#define FRAME_HEADER_SIZE 8
+#define MAX_RECORD_SIZE (1024 * 1024)
+#define MAX_PATH_LEN 4096
+#define SNAPSHOT_RETRY_SECONDS 10  // Before a snapshot is tried again after a failure
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} byte_buf;
+
+static struct {
+    char dir[MAX_PATH_LEN - 128];    // Leaves room for file names
+    int sync;
+    unsigned long long snapshot_every;
+    int open;
+    int fd;                          // Current segment
+    int failed;
+
+    pthread_mutex_t mutex;           // Guards everything below
+    pthread_cond_t flushed;
+    byte_buf pending;                // Encoded records not yet written
+    unsigned long long last_lsn;     // Last LSN handed out
+    unsigned long long durable_lsn;  // Last LSN written (and synced)
+    unsigned long long snapshot_lsn; // LSN covered by the newest snapshot
+    int flushing;                    // A thread is writing pending
+
+    pthread_t snapshot_thread;       // Writes snapshots off the request path
+    pthread_cond_t snapshot_ready;
+    byte_buf snapshot_data;          // Encoded snapshot for the thread to write
+    unsigned long long snapshot_data_lsn;
+    int snapshotting;                // snapshot_data is set or being written
+    time_t snapshot_retry_at;        // No new snapshot before then
+    int stopping;
+
+    int snapshot_books;
+    unsigned long long replayed;
+} wal = {
+    .fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .flushed = PTHREAD_COND_INITIALIZER,
+    .snapshot_ready = PTHREAD_COND_INITIALIZER,
+};
+
+static unsigned crc_table[256]; // Filled by book_log_open
+
+static void init_crc_table(void) {
+    for (unsigned i = 0; i < 256; i++) {
+        unsigned c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static unsigned crc32(const unsigned char *data, size_t len) {
+    unsigned crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+static int buf_reserve(byte_buf *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return 1;
+    }
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + extra) {
+        cap *= 2;
+    }
+    char *data = realloc(buf->data, cap);
+    if (data == NULL) {
+        return 0;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 1;
+}
+
+// Little-endian encoding, independent of the host
+
+static void put_u32(byte_buf *buf, unsigned v) {
+    for (int i = 0; i < 4; i++) {
+        buf->data[buf->len++] = (char)(v >> (8 * i));
+    }
+}
+
+static void put_u64(byte_buf *buf, unsigned long long v) {
+    for (int i = 0; i < 8; i++) {
+        buf->data[buf->len++] = (char)(v >> (8 * i));
+    }
+}
+
+static void put_bytes(byte_buf *buf, const char *s, size_t len) {
+    memcpy(buf->data + buf->len, s, len);
+    buf->len += len;
+}
+
+static void put_string(byte_buf *buf, const char *s) {
+    size_t len = strlen(s);
+    put_u32(buf, (unsigned)len);
+    put_bytes(buf, s, len);
+}
+
+// Ids are written as this tag and the 16 bytes of the UUID. Logs from before
+// ids were UUIDs have a string there instead, whose length is never the tag.
+#define ID_TAG 0xffffffffu
+#define ID_RECORD_SIZE (4 + 16)
+
+static void put_id(byte_buf *buf, book_id id) {
+    put_u32(buf, ID_TAG);
+    put_u64(buf, id.hi);
+    put_u64(buf, id.lo);
+}
+
+// Worst case size of an encoded book
+#define BOOK_RECORD_MAX (ID_RECORD_SIZE + 4 * 4 + sizeof(Book))
+
+static size_t book_record_size(const BookView *book) {
+    return ID_RECORD_SIZE + 4 * 4 + strlen(book->title) + strlen(book->author) +
+           strlen(book->description) + strlen(book->cover_base) + strlen(book->cover_name);
+}
+
+static void put_book(byte_buf *buf, const BookView *book) {
+    put_id(buf, book->id);
+    put_string(buf, book->title);
+    put_string(buf, book->author);
+    put_string(buf, book->description);
+    size_t base_len = strlen(book->cover_base);
+    size_t name_len = strlen(book->cover_name);
+    put_u32(buf, (unsigned)(base_len + name_len));
+    put_bytes(buf, book->cover_base, base_len);
+    put_bytes(buf, book->cover_name, name_len);
+}
+
+// Bounds-checked decoding; every get fails once the input runs out
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+} reader;
+
+static int get_u32(reader *r, unsigned *v) {
+    if (r->end - r->p < 4) {
+        return 0;
+    }
+    *v = 0;
+    for (int i = 0; i < 4; i++) {
+        *v |= (unsigned)*r->p++ << (8 * i);
+    }
+    return 1;
+}
+
+static int get_u64(reader *r, unsigned long long *v) {
+    if (r->end - r->p < 8) {
+        return 0;
+    }
+    *v = 0;
+    for (int i = 0; i < 8; i++) {
+        *v |= (unsigned long long)*r->p++ << (8 * i);
+    }
+    return 1;
+}
+
+// Copies a string into a fixed field, truncating like create_book does
+static int get_string(reader *r, char *dst, size_t cap) {
+    unsigned len;
+    if (!get_u32(r, &len) || (size_t)(r->end - r->p) < len) {
+        return 0;
+    }
+    size_t n = len < cap - 1 ? len : cap - 1;
+    memcpy(dst, r->p, n);
+    dst[n] = '\0';
+    r->p += len;
+    return 1;
+}
+
+// Reads an id in either form. An old string id that is not a UUID leaves id
+// nil, for the caller to skip the record; an empty one is damage.
+static int get_id(reader *r, book_id *id) {
+    unsigned len;
+    if (!get_u32(r, &len)) {
+        return 0;
+    }
+    id->hi = 0;
+    id->lo = 0;
+    if (len == ID_TAG) {
+        return get_u64(r, &id->hi) && get_u64(r, &id->lo) && !BOOK_ID_IS_NIL(*id);
+    }
+    if (len == 0 || (size_t)(r->end - r->p) < len) {
+        return 0;
+    }
+    book_id_parse((const char *)r->p, len, id);
+    r->p += len;
+    return 1;
+}
+
+static int get_book(reader *r, Book *book) {
+    return get_id(r, &book->id) &&
+           get_string(r, book->title, sizeof(book->title)) &&
+           get_string(r, book->author, sizeof(book->author)) &&
+           get_string(r, book->description, sizeof(book->description)) &&
+           get_string(r, book->coverImageUrl, sizeof(book->coverImageUrl));
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+static int sync_dir(void) {
+#ifdef _WIN32
+    return 1;
+#else
+    int fd = open(wal.dir, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+#endif
+}
+
+// Writes wal.dir/<prefix><lsn><suffix> to path (MAX_PATH_LEN bytes).
+// Returns 0 if it does not fit, as a cut-off path would name another file.
+static int file_path(char *path, const char *prefix, unsigned long long lsn, const char *suffix) {
+    int len = snprintf(path, MAX_PATH_LEN, "%s/%s%020llu%s", wal.dir, prefix, lsn, suffix);
+    return len > 0 && len < MAX_PATH_LEN;
+}
+
+// Writes wal.dir/<name> to path (MAX_PATH_LEN bytes); as file_path
+static int dir_path(char *path, const char *name) {
+    int len = snprintf(path, MAX_PATH_LEN, "%s/%s", wal.dir, name);
+    return len > 0 && len < MAX_PATH_LEN;
+}
+
+// Reads a whole file; returns NULL if it cannot be read
+static unsigned char* read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    unsigned char *data = NULL;
+    size_t cap = 0;
+    *len = 0;
+    for (;;) {
+        if (*len == cap) {
+            cap = cap ? cap * 2 : 65536;
+            unsigned char *grown = realloc(data, cap);
+            if (grown == NULL) {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = grown;
+        }
+        size_t n = fread(data + *len, 1, cap - *len, file);
+        if (n == 0) {
+            break;
+        }
+        *len += n;
+    }
+    fclose(file);
+    return data;
+}
+
+typedef struct {
+    unsigned long long lsn;
+    char name[64];
+} numbered_file;
+
+static int compare_numbered(const void *a, const void *b) {
+    unsigned long long la = ((const numbered_file *)a)->lsn;
+    unsigned long long lb = ((const numbered_file *)b)->lsn;
+    return la < lb ? -1 : la > lb;
+}
+
+// Lists files named <prefix><LSN><suffix> in the log directory, sorted by
+// LSN. Returns the count (free *files), or -1 on error.
+static int list_numbered(const char *prefix, const char *suffix, numbered_file **files) {
+    *files = NULL;
+    DIR *dir = opendir(wal.dir);
+    if (dir == NULL) {
+        return -1;
+    }
+    size_t prefix_len = strlen(prefix);
+    size_t suffix_len = strlen(suffix);
+    int count = 0;
+    int cap = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        size_t len = strlen(name);
+        if (len <= prefix_len + suffix_len || len >= sizeof((*files)->name) ||
+            strncmp(name, prefix, prefix_len) != 0 || strcmp(name + len - suffix_len, suffix) != 0) {
+            continue;
+        }
+        char *end;
+        unsigned long long lsn = strtoull(name + prefix_len, &end, 10);
+        if (end != name + len - suffix_len) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 8;
+            numbered_file *grown = realloc(*files, (size_t)cap * sizeof(numbered_file));
+            if (grown == NULL) {
+                free(*files);
+                closedir(dir);
+                return -1;
+            }
+            *files = grown;
+        }
+        (*files)[count].lsn = lsn;
+        memcpy((*files)[count].name, name, len + 1);
+        count++;
+    }
+    closedir(dir);
+    if (count > 1) {
+        qsort(*files, (size_t)count, sizeof(numbered_file), compare_numbered);
+    }
+    return count;
+}
+
+// Loads a snapshot; returns 0 if it is damaged
+static int load_snapshot(const char *path, book_log_replay_fn replay, unsigned long long *lsn) {
+    size_t len;
+    unsigned char *data = read_file(path, &len);
+    if (data == NULL) {
+        return 0;
+    }
+    int ok = len >= SNAPSHOT_MAGIC_LEN + 4 && memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == 0;
+    reader r = {data + SNAPSHOT_MAGIC_LEN, data + len - 4};
+    reader trailer = {data + len - 4, data + len};
+    unsigned crc;
+    unsigned long long count = 0;
+    ok = ok && get_u32(&trailer, &crc) && crc == crc32(r.p, (size_t)(r.end - r.p)) &&
+         get_u64(&r, lsn) && get_u64(&r, &count);
+
+    // Check every book before replaying any, so a bad snapshot loads nothing
+    reader check = r;
+    Book book;
+    for (unsigned long long i = 0; ok && i < count; i++) {
+        ok = get_book(&check, &book);
+    }
+    ok = ok && check.p == check.end;
+    for (unsigned long long i = 0; ok && i < count; i++) {
+        get_book(&r, &book);
+        replay(BOOK_LOG_PUT, &book);
+    }
+    if (ok) {
+        wal.snapshot_books = (int)count;
+    }
+    free(data);
+    return ok;
+}
+
+// Replays one segment up to its first torn or damaged record
+static void replay_segment(const char *path, book_log_replay_fn replay, unsigned long long *last) {
+    size_t len;
+    unsigned char *data = read_file(path, &len);
+    if (data == NULL) {
+        return;
+    }
+    reader frames = {data, data + len};
+    for (;;) {
+        unsigned size;
+        unsigned crc;
+        if (!get_u32(&frames, &size) || !get_u32(&frames, &crc) || size > MAX_RECORD_SIZE ||
+            (size_t)(frames.end - frames.p) < size || crc32(frames.p, size) != crc) {
+            break;
+        }
+        reader record = {frames.p, frames.p + size};
+        frames.p += size;
+
+        unsigned long long lsn;
+        Book book;
+        memset(&book, 0, sizeof(book));
+        if (!get_u64(&record, &lsn) || record.p == record.end) {
+            break;
+        }
+        int op = *record.p++;
+        if (op == BOOK_LOG_PUT) {
+            if (!get_book(&record, &book)) {
+                break;
+            }
+        } else if (op != BOOK_LOG_DELETE || !get_id(&record, &book.id)) {
+            break;
+        }
+        if (lsn > *last) {
+            replay((book_log_op)op, &book);
+            *last = lsn;
+            wal.replayed++;
+        }
+    }
+    free(data);
+}
+
+static int open_segment(unsigned long long first_lsn) {
+    // Any existing file with this name holds nothing that was acknowledged
+    char path[MAX_PATH_LEN];
+    if (!file_path(path, "wal-", first_lsn, ".log")) {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return 0;
+    }
+    if (wal.sync && !sync_dir()) {
+        close(fd);
+        return 0;
+    }
+    if (wal.fd >= 0) {
+        close(wal.fd);
+    }
+    wal.fd = fd;
+    return 1;
+}
+
+// Writes an encoded snapshot covering lsn, adding the checksum it has room
+// for, and drops the files it makes redundant. Returns 0 if it did not reach
+// the disk.
+static int write_snapshot(byte_buf *data, unsigned long long lsn) {
+    put_u32(data, crc32((const unsigned char *)data->data + SNAPSHOT_MAGIC_LEN, data->len - SNAPSHOT_MAGIC_LEN));
+
+    // Until the rename lands, recovery uses the previous snapshot and the
+    // segments after it
+    char path[MAX_PATH_LEN];
+    char tmp_path[MAX_PATH_LEN + 4];
+    if (!file_path(path, "snapshot-", lsn, ".bin")) {
+        return 0;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int ok = fd >= 0 && write_all(fd, data->data, data->len) && (!wal.sync || fsync(fd) == 0);
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (!ok || rename(tmp_path, path) != 0 || (wal.sync && !sync_dir())) {
+        unlink(tmp_path);
+        return 0;
+    }
+
+    // Keep the previous snapshot and the segments after it, so a damaged
+    // newest snapshot still leaves something to recover from
+    numbered_file *files;
+    int files_count = list_numbered("snapshot-", ".bin", &files);
+    if (files_count < 2) {
+        free(files);
+        return 1;
+    }
+    unsigned long long keep_from = files[files_count - 2].lsn;
+    for (int i = 0; i < files_count; i++) {
+        if (files[i].lsn < keep_from && dir_path(path, files[i].name)) {
+            unlink(path);
+        }
+    }
+    free(files);
+
+    files_count = list_numbered("wal-", ".log", &files);
+    for (int i = 0; i < files_count; i++) {
+        if (files[i].lsn <= keep_from && dir_path(path, files[i].name)) {
+            unlink(path);
+        }
+    }
+    free(files);
+    return 1;
+}
+
+// Snapshot thread: writes what book_log_snapshot hands over until the log
+// closes
+static void* run_snapshots(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&wal.mutex);
+    for (;;) {
+        while (!wal.snapshotting && !wal.stopping) {
+            pthread_cond_wait(&wal.snapshot_ready, &wal.mutex);
+        }
+        if (!wal.snapshotting) {
+            break;
+        }
+        byte_buf data = wal.snapshot_data;
+        unsigned long long lsn = wal.snapshot_data_lsn;
+        memset(&wal.snapshot_data, 0, sizeof(wal.snapshot_data));
+        pthread_mutex_unlock(&wal.mutex);
+
+        int ok = write_snapshot(&data, lsn);
+        free(data.data);
+
+        // Only now is the snapshot due again in snapshot_every records. A
+        // failed one is due right away, but waits out SNAPSHOT_RETRY_SECONDS
+        // so a full disk does not cost every write a pass over the store.
+        pthread_mutex_lock(&wal.mutex);
+        wal.snapshotting = 0;
+        if (ok) {
+            wal.snapshot_lsn = lsn;
+        } else {
+            wal.snapshot_retry_at = time(NULL) + SNAPSHOT_RETRY_SECONDS;
+        }
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return NULL;
+}
+
+int book_log_open(const char *dir, int sync, unsigned long long snapshot_every,
+                  book_log_replay_fn replay) {
+    if (wal.open || strlen(dir) >= sizeof(wal.dir)) {
+        return 0;
+    }
+#ifdef _WIN32
+    mkdir(dir);
+#else
+    mkdir(dir, 0755);
+#endif
+    init_crc_table();
+    snprintf(wal.dir, sizeof(wal.dir), "%s", dir);
+    wal.sync = sync;
+    wal.snapshot_every = snapshot_every;
+    wal.failed = 0;
+    wal.snapshot_books = 0;
+    wal.replayed = 0;
+
+    // Newest snapshot that checks out, then every logged change after it
+    unsigned long long last = 0;
+    numbered_file *files;
+    int count = list_numbered("snapshot-", ".bin", &files);
+    if (count < 0) {
+        return 0;
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        char path[MAX_PATH_LEN];
+        if (dir_path(path, files[i].name) && load_snapshot(path, replay, &last)) {
+            break;
+        }
+    }
+    free(files);
+    wal.snapshot_lsn = last;
+
+    count = list_numbered("wal-", ".log", &files);
+    if (count < 0) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LEN];
+        if (dir_path(path, files[i].name)) {
+            replay_segment(path, replay, &last);
+        }
+    }
+    free(files);
+
+    wal.last_lsn = last;
+    wal.durable_lsn = last;
+    wal.snapshotting = 0;
+    wal.snapshot_retry_at = 0;
+    wal.stopping = 0;
+    if (!open_segment(last + 1) || pthread_create(&wal.snapshot_thread, NULL, run_snapshots, NULL) != 0) {
+        return 0;
+    }
+    wal.open = 1;
+    return 1;
+}
+
+void book_log_close(void) {
+    if (!wal.open) {
+        return;
+    }
+    // Lets a snapshot already handed over reach the disk
+    pthread_mutex_lock(&wal.mutex);
+    wal.stopping = 1;
+    pthread_cond_signal(&wal.snapshot_ready);
+    pthread_mutex_unlock(&wal.mutex);
+    pthread_join(wal.snapshot_thread, NULL);
+
+    close(wal.fd);
+    wal.fd = -1;
+    free(wal.pending.data);
+    memset(&wal.pending, 0, sizeof(wal.pending));
+    wal.open = 0;
+}
+
+int book_log_is_open(void) {
+    return wal.open;
+}
+
+unsigned long long book_log_append(book_log_op op, const BookView *book) {
+    pthread_mutex_lock(&wal.mutex);
+    unsigned long long lsn = 0;
+    if (!wal.failed && buf_reserve(&wal.pending, FRAME_HEADER_SIZE + 9 + BOOK_RECORD_MAX)) {
+        lsn = ++wal.last_lsn;
+        size_t frame = wal.pending.len;
+        wal.pending.len += FRAME_HEADER_SIZE;
+        put_u64(&wal.pending, lsn);
+        wal.pending.data[wal.pending.len++] = (char)op;
+        if (op == BOOK_LOG_PUT) {
+            put_book(&wal.pending, book);
+        } else {
+            put_id(&wal.pending, book->id);
+        }
+
+        size_t payload = wal.pending.len - frame - FRAME_HEADER_SIZE;
+        size_t end = wal.pending.len;
+        wal.pending.len = frame;
+        put_u32(&wal.pending, (unsigned)payload);
+        put_u32(&wal.pending, crc32((const unsigned char *)wal.pending.data + frame + FRAME_HEADER_SIZE, payload));
+        wal.pending.len = end;
+    } else {
+        wal.failed = 1;
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return lsn;
+}
+
+int book_log_wait(unsigned long long lsn) {
+    pthread_mutex_lock(&wal.mutex);
+    while (wal.durable_lsn < lsn && !wal.failed) {
+        if (wal.flushing) {
+            pthread_cond_wait(&wal.flushed, &wal.mutex);
+            continue;
+        }
+
+        // Become the leader: write out everything buffered so far, including
+        // records from threads now waiting on us
+        wal.flushing = 1;
+        byte_buf batch = wal.pending;
+        memset(&wal.pending, 0, sizeof(wal.pending));
+        unsigned long long target = wal.last_lsn;
+        int fd = wal.fd;
+        pthread_mutex_unlock(&wal.mutex);
+
+        int ok = write_all(fd, batch.data, batch.len) && (!wal.sync || fdatasync(fd) == 0);
+
+        pthread_mutex_lock(&wal.mutex);
+        wal.flushing = 0;
+        if (ok) {
+            wal.durable_lsn = target;
+        } else {
+            wal.failed = 1;
+        }
+        if (wal.pending.data == NULL) {
+            // Hand the grown buffer back so the next batch does not allocate
+            batch.len = 0;
+            wal.pending = batch;
+        } else {
+            free(batch.data);
+        }
+        pthread_cond_broadcast(&wal.flushed);
+    }
+    int ok = !wal.failed;
+    pthread_mutex_unlock(&wal.mutex);
+    return ok;
+}
+
+int book_log_snapshot_due(void) {
+    pthread_mutex_lock(&wal.mutex);
+    int due = wal.snapshot_every != 0 && !wal.snapshotting &&
+              wal.last_lsn - wal.snapshot_lsn >= wal.snapshot_every &&
+              time(NULL) >= wal.snapshot_retry_at;
+    pthread_mutex_unlock(&wal.mutex);
+    return due;
+}
+
+int book_log_snapshot(const BookView *books, int count) {
+    pthread_mutex_lock(&wal.mutex);
+    unsigned long long lsn = wal.last_lsn;
+    int busy = wal.snapshotting;
+    pthread_mutex_unlock(&wal.mutex);
+
+    if (busy || !book_log_wait(lsn)) {
+        return 0;
+    }
+    pthread_mutex_lock(&wal.mutex);
+    int ok = open_segment(lsn + 1);
+    if (!ok) {
+        wal.failed = 1;
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    if (!ok) {
+        return 0;
+    }
+
+    // Encoding is the only pass over the store; the caller may change it
+    // as soon as this returns
+    size_t size = SNAPSHOT_MAGIC_LEN + 20;
+    for (int i = 0; i < count; i++) {
+        size += book_record_size(&books[i]);
+    }
+    byte_buf data = {NULL, 0, 0};
+    ok = buf_reserve(&data, size);
+    if (ok) {
+        memcpy(data.data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+        data.len = SNAPSHOT_MAGIC_LEN;
+        put_u64(&data, lsn);
+        put_u64(&data, (unsigned long long)count);
+        for (int i = 0; i < count; i++) {
+            put_book(&data, &books[i]);
+        }
+    }
+    pthread_mutex_lock(&wal.mutex);
+    if (ok) {
+        wal.snapshot_data = data;
+        wal.snapshot_data_lsn = lsn;
+        wal.snapshotting = 1;
+        pthread_cond_signal(&wal.snapshot_ready);
+    } else {
+        wal.snapshot_retry_at = time(NULL) + SNAPSHOT_RETRY_SECONDS;
+    }
+    pthread_mutex_unlock(&wal.mutex);
+    return ok;
+}
+
+void book_log_recovery_stats(int *snapshot_books, unsigned long long *replayed) {
+    *snapshot_books = wal.snapshot_books;
+    *replayed = wal.replayed;
+}
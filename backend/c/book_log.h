@@ -0,0 +1,59 @@
+#ifndef BOOK_LOG_H
+#define BOOK_LOG_H
+
+#include "book.h"
+
+// Durable write-ahead log and snapshots behind the book store.
+//
+// Every change is appended to the current log segment as a checksummed
+// record numbered by a log sequence number (LSN). Threads that wait for
+// their records at the same time share one write() and fdatasync() (group
+// commit). A snapshot starts a new segment and writes the whole store from a
+// background thread; the previous snapshot and the segments after it are
+// kept as a fallback and older files are deleted.
+//
+// On disk, in dir:
+//   wal-<first LSN>.log       [u32 size][u32 crc32][size bytes: u64 LSN, op, book]
+//   snapshot-<LSN>.bin        header, books in store order, crc32 of the rest
+//
+// Once a write or sync fails the log refuses further records, since memory
+// and disk may no longer agree.
+
+typedef enum {
+    BOOK_LOG_PUT = 1,    // Book created or replaced
+    BOOK_LOG_DELETE = 2  // Only book->id is set
+} book_log_op;
+
+// Called for every recovered change, oldest first
+typedef void (*book_log_replay_fn)(book_log_op op, const Book *book);
+
+// Replays the newest snapshot and the log after it through replay, then
+// opens a new segment. sync=0 skips fdatasync. Returns 0 on failure.
+int book_log_open(const char *dir, int sync, unsigned long long snapshot_every,
+                  book_log_replay_fn replay);
+void book_log_close(void);
+int book_log_is_open(void);
+
+// Buffers a record and returns its LSN, or 0 if the log has failed. Callers
+// must append in the order the changes were made to the store.
+unsigned long long book_log_append(book_log_op op, const BookView *book);
+
+// Waits until every record up to lsn is on disk. Returns 0 if the log failed.
+int book_log_wait(unsigned long long lsn);
+
+// True once snapshot_every records were appended since the last snapshot
+// reached the disk, unless one is still being written or one failed less
+// than a few seconds ago
+int book_log_snapshot_due(void);
+
+// Starts a snapshot of books (the whole store, in order) covering every
+// record appended so far: starts a new segment and encodes books, then
+// leaves writing the file to a background thread. Nothing may be appended
+// while it runs, but the store may change once it returns. Returns 0 if the
+// snapshot could not be started.
+int book_log_snapshot(const BookView *books, int count);
+
+// Books loaded from the snapshot and records replayed by book_log_open
+void book_log_recovery_stats(int *snapshot_books, unsigned long long *replayed);
+
+#endif
@@ -0,0 +1,506 @@
+#include <string.h>
+#include "book_parser.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BOOK_PARSER_X86 1
+#endif
+
+#define MAX_DEPTH 64
+#define MAX_KEY_LEN 32
+
+// Non-zero for bytes that end a run of plain string content: '"', '\\' and
+// control characters
+static const unsigned char string_special[256] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+};
+
+static const char* scan_string_scalar(const char *p, const char *end) {
+    while (p < end && !string_special[(unsigned char)*p]) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef BOOK_PARSER_X86
+static const char* scan_string_sse2(const char *p, const char *end) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        // max(c, 0x1f) == 0x1f is an unsigned c <= 0x1f
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz((unsigned)mask);
+        }
+        p += 16;
+    }
+    return scan_string_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* scan_string_avx2(const char *p, const char *end) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return scan_string_sse2(p, end);
+}
+#endif
+
+// Returns the first '"', '\\' or control character in [p, end), or end
+static const char* scan_string(const char *p, const char *end) {
+#ifdef BOOK_PARSER_X86
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_string_avx2(p, end);
+    }
+    return scan_string_sse2(p, end);
+#else
+    return scan_string_scalar(p, end);
+#endif
+}
+
+typedef struct {
+    const char *p;
+    const char *end;
+} parser;
+
+static void skip_whitespace(parser *ps) {
+    while (ps->p < ps->end &&
+           (*ps->p == ' ' || *ps->p == '\n' || *ps->p == '\r' || *ps->p == '\t')) {
+        ps->p++;
+    }
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int parse_hex4(parser *ps, unsigned *value) {
+    if (ps->end - ps->p < 4) {
+        return 0;
+    }
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = hex_value(ps->p[i]);
+        if (digit < 0) {
+            return 0;
+        }
+        *value = (*value << 4) | (unsigned)digit;
+    }
+    ps->p += 4;
+    return 1;
+}
+
+// Appends bytes to a bounded field, dropping whatever does not fit
+typedef struct {
+    char *dst;   // NULL when the string is being skipped
+    size_t cap;  // Including the terminating NUL
+    size_t len;
+} field_writer;
+
+static void write_bytes(field_writer *w, const char *src, size_t n) {
+    if (w->dst == NULL || w->len + 1 >= w->cap) {
+        return;
+    }
+    size_t room = w->cap - 1 - w->len;
+    if (n > room) {
+        n = room;
+    }
+    memcpy(w->dst + w->len, src, n);
+    w->len += n;
+}
+
+static int write_code_point(field_writer *w, unsigned cp) {
+    char utf8[4];
+    size_t n;
+    if (cp < 0x80) {
+        utf8[0] = (char)cp;
+        n = 1;
+    } else if (cp < 0x800) {
+        utf8[0] = (char)(0xc0 | (cp >> 6));
+        utf8[1] = (char)(0x80 | (cp & 0x3f));
+        n = 2;
+    } else if (cp < 0x10000) {
+        utf8[0] = (char)(0xe0 | (cp >> 12));
+        utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        utf8[2] = (char)(0x80 | (cp & 0x3f));
+        n = 3;
+    } else {
+        utf8[0] = (char)(0xf0 | (cp >> 18));
+        utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+        utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        utf8[3] = (char)(0x80 | (cp & 0x3f));
+        n = 4;
+    }
+    write_bytes(w, utf8, n);
+    return 1;
+}
+
+// Decodes the string starting at the opening quote into w
+static int parse_string(parser *ps, field_writer *w) {
+    ps->p++; // Opening quote
+    for (;;) {
+        const char *special = scan_string(ps->p, ps->end);
+        write_bytes(w, ps->p, (size_t)(special - ps->p));
+        ps->p = special;
+        if (ps->p == ps->end) {
+            return 0;
+        }
+
+        char c = *ps->p++;
+        if (c == '"') {
+            if (w->dst != NULL) {
+                w->dst[w->len] = '\0';
+            }
+            return 1;
+        }
+        if (c != '\\' || ps->p == ps->end) {
+            return 0; // Raw control character or truncated escape
+        }
+
+        char escaped;
+        switch (*ps->p++) {
+        case '"':  escaped = '"'; break;
+        case '\\': escaped = '\\'; break;
+        case '/':  escaped = '/'; break;
+        case 'b':  escaped = '\b'; break;
+        case 'f':  escaped = '\f'; break;
+        case 'n':  escaped = '\n'; break;
+        case 'r':  escaped = '\r'; break;
+        case 't':  escaped = '\t'; break;
+        case 'u': {
+            unsigned cp;
+            if (!parse_hex4(ps, &cp)) {
+                return 0;
+            }
+            if (cp >= 0xd800 && cp <= 0xdbff) {
+                unsigned low;
+                if (ps->end - ps->p < 2 || ps->p[0] != '\\' || ps->p[1] != 'u') {
+                    return 0;
+                }
+                ps->p += 2;
+                if (!parse_hex4(ps, &low) || low < 0xdc00 || low > 0xdfff) {
+                    return 0;
+                }
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+            } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                return 0; // Lone low surrogate
+            }
+            write_code_point(w, cp);
+            continue;
+        }
+        default:
+            return 0;
+        }
+        write_bytes(w, &escaped, 1);
+    }
+}
+
+static int skip_literal(parser *ps, const char *literal, size_t len) {
+    if ((size_t)(ps->end - ps->p) < len || memcmp(ps->p, literal, len) != 0) {
+        return 0;
+    }
+    ps->p += len;
+    return 1;
+}
+
+static int skip_digits(parser *ps) {
+    const char *start = ps->p;
+    while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+        ps->p++;
+    }
+    return ps->p > start;
+}
+
+static int skip_number(parser *ps) {
+    if (ps->p < ps->end && *ps->p == '-') {
+        ps->p++;
+    }
+    if (ps->p < ps->end && *ps->p == '0') {
+        ps->p++;
+    } else if (!skip_digits(ps)) {
+        return 0;
+    }
+    if (ps->p < ps->end && *ps->p == '.') {
+        ps->p++;
+        if (!skip_digits(ps)) {
+            return 0;
+        }
+    }
+    if (ps->p < ps->end && (*ps->p == 'e' || *ps->p == 'E')) {
+        ps->p++;
+        if (ps->p < ps->end && (*ps->p == '+' || *ps->p == '-')) {
+            ps->p++;
+        }
+        if (!skip_digits(ps)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int skip_value(parser *ps, int depth);
+
+// Skips the members of an object or array whose opening bracket is at p
+static int skip_container(parser *ps, int depth, char close, int is_object) {
+    if (depth >= MAX_DEPTH) {
+        return 0;
+    }
+    ps->p++;
+    skip_whitespace(ps);
+    if (ps->p < ps->end && *ps->p == close) {
+        ps->p++;
+        return 1;
+    }
+
+    for (;;) {
+        if (is_object) {
+            field_writer skip = {NULL, 0, 0};
+            if (ps->p == ps->end || *ps->p != '"' || !parse_string(ps, &skip)) {
+                return 0;
+            }
+            skip_whitespace(ps);
+            if (ps->p == ps->end || *ps->p++ != ':') {
+                return 0;
+            }
+        }
+        if (!skip_value(ps, depth + 1)) {
+            return 0;
+        }
+        skip_whitespace(ps);
+        if (ps->p == ps->end) {
+            return 0;
+        }
+        char c = *ps->p++;
+        if (c == close) {
+            return 1;
+        }
+        if (c != ',') {
+            return 0;
+        }
+        skip_whitespace(ps);
+    }
+}
+
+static int skip_value(parser *ps, int depth) {
+    skip_whitespace(ps);
+    if (ps->p == ps->end) {
+        return 0;
+    }
+    switch (*ps->p) {
+    case '"': {
+        field_writer skip = {NULL, 0, 0};
+        return parse_string(ps, &skip);
+    }
+    case '{':
+        return skip_container(ps, depth, '}', 1);
+    case '[':
+        return skip_container(ps, depth, ']', 0);
+    case 't':
+        return skip_literal(ps, "true", 4);
+    case 'f':
+        return skip_literal(ps, "false", 5);
+    case 'n':
+        return skip_literal(ps, "null", 4);
+    default:
+        return skip_number(ps);
+    }
+}
+
+int parse_book_json(const char *data, size_t len, Book *book) {
+    // Room for a UUID and then some, so a longer id cannot pass as one
+    char id_text[40];
+    struct {
+        const char *key;
+        size_t key_len;
+        char *dst;
+        size_t cap;
+        int bit;
+    } fields[] = {
+        {"title", 5, book->title, sizeof(book->title), BOOK_FIELD_TITLE},
+        {"author", 6, book->author, sizeof(book->author), BOOK_FIELD_AUTHOR},
+        {"description", 11, book->description, sizeof(book->description), BOOK_FIELD_DESCRIPTION},
+        {"coverImageUrl", 13, book->coverImageUrl, sizeof(book->coverImageUrl), BOOK_FIELD_COVER_IMAGE_URL},
+        {"id", 2, id_text, sizeof(id_text), BOOK_FIELD_ID},
+    };
+    const int field_count = (int)(sizeof(fields) / sizeof(fields[0]));
+
+    parser ps = {data, data + len};
+    int present = 0;
+    for (int i = 0; i < field_count; i++) {
+        fields[i].dst[0] = '\0';
+    }
+
+    skip_whitespace(&ps);
+    if (ps.p == ps.end || *ps.p++ != '{') {
+        return -1;
+    }
+    skip_whitespace(&ps);
+    if (ps.p < ps.end && *ps.p == '}') {
+        ps.p++;
+    } else {
+        for (;;) {
+            char key[MAX_KEY_LEN + 1];
+            field_writer key_writer = {key, sizeof(key), 0};
+            if (ps.p == ps.end || *ps.p != '"' || !parse_string(&ps, &key_writer)) {
+                return -1;
+            }
+            skip_whitespace(&ps);
+            if (ps.p == ps.end || *ps.p++ != ':') {
+                return -1;
+            }
+            skip_whitespace(&ps);
+
+            int field = -1;
+            for (int i = 0; i < field_count; i++) {
+                if (key_writer.len == fields[i].key_len && memcmp(key, fields[i].key, key_writer.len) == 0) {
+                    field = i;
+                    break;
+                }
+            }
+
+            if (field < 0) {
+                if (!skip_value(&ps, 1)) {
+                    return -1;
+                }
+            } else if (ps.p < ps.end && *ps.p == '"') {
+                // Later duplicates win, as with json-c
+                field_writer w = {fields[field].dst, fields[field].cap, 0};
+                if (!parse_string(&ps, &w)) {
+                    return -1;
+                }
+                present |= fields[field].bit;
+            } else if (skip_literal(&ps, "null", 4)) {
+                fields[field].dst[0] = '\0';
+                present &= ~fields[field].bit;
+            } else {
+                return -1;
+            }
+
+            skip_whitespace(&ps);
+            if (ps.p == ps.end) {
+                return -1;
+            }
+            char c = *ps.p++;
+            if (c == '}') {
+                break;
+            }
+            if (c != ',') {
+                return -1;
+            }
+            skip_whitespace(&ps);
+        }
+    }
+
+    skip_whitespace(&ps);
+    if (ps.p != ps.end) {
+        return -1;
+    }
+
+    book->id.hi = 0;
+    book->id.lo = 0;
+    if ((present & BOOK_FIELD_ID) && id_text[0] != '\0' &&
+        !book_id_parse(id_text, strlen(id_text), &book->id)) {
+        present |= BOOK_FIELD_INVALID_ID;
+    }
+    return present;
+}
+
+size_t json_value_length(const char *data, size_t len) {
+    parser ps = {data, data + len};
+    if (!skip_value(&ps, 0)) {
+        return (size_t)-1;
+    }
+    return (size_t)(ps.p - data);
+}
+
+void bulk_reader_init(bulk_reader *reader, const char *data, size_t len) {
+    parser ps = {data, data + len};
+    skip_whitespace(&ps);
+    reader->is_array = ps.p < ps.end && *ps.p == '[';
+    reader->p = reader->is_array ? ps.p + 1 : ps.p;
+    reader->end = ps.end;
+    reader->started = 0;
+    reader->failed = 0;
+}
+
+// Consumes the closing ']'; only whitespace may follow it
+static int finish_array(bulk_reader *reader, parser *ps) {
+    ps->p++;
+    skip_whitespace(ps);
+    reader->p = ps->p;
+    reader->failed = ps->p != ps->end;
+    return 0;
+}
+
+int bulk_reader_next(bulk_reader *reader, const char **item, size_t *item_len) {
+    if (reader->failed) {
+        return 0;
+    }
+
+    if (!reader->is_array) {
+        // NDJSON: one document per line
+        while (reader->p < reader->end) {
+            const char *line = reader->p;
+            const char *newline = memchr(line, '\n', (size_t)(reader->end - line));
+            const char *line_end = newline != NULL ? newline : reader->end;
+            reader->p = newline != NULL ? newline + 1 : reader->end;
+
+            parser ps = {line, line_end};
+            skip_whitespace(&ps);
+            if (ps.p != ps.end) {
+                *item = line;
+                *item_len = (size_t)(line_end - line);
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    parser ps = {reader->p, reader->end};
+    skip_whitespace(&ps);
+    if (ps.p < ps.end && *ps.p == ']') {
+        return finish_array(reader, &ps);
+    }
+    if (reader->started) {
+        if (ps.p == ps.end || *ps.p != ',') {
+            reader->failed = 1;
+            return 0;
+        }
+        ps.p++;
+    }
+    reader->started = 1;
+
+    size_t len = json_value_length(ps.p, (size_t)(ps.end - ps.p));
+    if (len == (size_t)-1) {
+        reader->failed = 1;
+        return 0;
+    }
+    *item = ps.p;
+    *item_len = len;
+    reader->p = ps.p + len;
+    return 1;
+}
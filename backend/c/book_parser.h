@@ -0,0 +1,50 @@
+#ifndef BOOK_PARSER_H
+#define BOOK_PARSER_H
+
+#include <stddef.h>
+#include "book.h"
+
+// Bits returned by parse_book_json for the string fields it found
+#define BOOK_FIELD_TITLE           0x1
+#define BOOK_FIELD_AUTHOR          0x2
+#define BOOK_FIELD_DESCRIPTION     0x4
+#define BOOK_FIELD_COVER_IMAGE_URL 0x8
+#define BOOK_FIELD_ID              0x10
+#define BOOK_FIELD_INVALID_ID      0x20 // An id is given but is not a UUID
+
+// Parses a create/update body straight into book, without building a DOM or
+// allocating. String scanning uses AVX2 or SSE2 where available.
+//
+// The body must be a single JSON object. The known keys (id and the four
+// content fields) must hold a string or null; any other key may hold any
+// JSON value and is validated and skipped. Strings longer than their Book
+// field are truncated like create_book does.
+//
+// The id is parsed into book->id, which is nil when it is absent or empty.
+//
+// Returns a mask of the BOOK_FIELD_* strings present (null counts as
+// absent), or -1 if the body is malformed.
+int parse_book_json(const char *data, size_t len, Book *book);
+
+// Returns the length of the JSON value at the start of data, including any
+// leading whitespace, or (size_t)-1 if it is malformed.
+size_t json_value_length(const char *data, size_t len);
+
+// Splits a bulk request body into one JSON document per book: either a JSON
+// array of objects or NDJSON (one object per line, blank lines ignored).
+// Elements are only delimited here; parse each with parse_book_json.
+typedef struct {
+    const char *p;
+    const char *end;
+    int is_array;
+    int started;
+    int failed;   // Set when the array framing is broken
+} bulk_reader;
+
+void bulk_reader_init(bulk_reader *reader, const char *data, size_t len);
+
+// Points *item at the next element. Returns 0 at the end of the body or when
+// the framing is broken.
+int bulk_reader_next(bulk_reader *reader, const char **item, size_t *item_len);
+
+#endif
@@ -0,0 +1,955 @@
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "book_search.h"
+
+// Longer words are cut to this many bytes
+#define MAX_WORD_SIZE 32
+
+// Words a book can have: its fields hold at most 1533 bytes
+#define MAX_DOC_WORDS 768
+
+#define MAX_QUERY_WORDS 8
+#define MAX_PREFIX_TERMS 32
+
+// Queries with up to this many results keep their hits on the stack
+#define STACK_HITS 128
+
+// Terms of a prefix looked at when picking its most common completions
+#define MAX_PREFIX_SCAN 4096
+
+// Prefixes up to this long have their completions cached in a table of
+// COMPLETION_CACHE_SIZE entries, each used until this many books have changed
+#define CACHED_PREFIX_SIZE 3
+#define COMPLETION_CACHE_SIZE 4096
+#define COMPLETIONS_MAX_AGE 4096
+
+// Terms get a bitset once they have this many postings and are in at least
+// 1/DENSE_RATIO of the docs
+#define DENSE_MIN_POSTINGS 1024
+#define DENSE_RATIO 32
+
+// Docs of this many words or more share a bucket
+#define LONG_DOC 128
+
+// New terms wait here until they are merged into sorted_terms
+#define PENDING_TERMS 1024
+
+// BM25 parameters
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+#define NO_TERM UINT_MAX
+#define NO_DOC UINT_MAX
+#define DEAD_DOC ((unsigned long long)-1)
+
+typedef struct {
+    unsigned doc;
+    unsigned length; // Words in the doc
+} posting;
+
+typedef struct {
+    unsigned length;   // Doc length, or LONG_DOC for longer ones
+    unsigned count;
+    unsigned cap;
+    posting *postings; // Sorted by doc, dead docs included
+} bucket;
+
+typedef struct {
+    char *text;
+    bucket *buckets;          // Sorted by length
+    unsigned bucket_count;
+    unsigned bucket_cap;
+    unsigned long long *bits; // Docs with the word, if it is common
+    size_t bits_len;
+    unsigned postings;        // Dead docs included
+    unsigned live;            // Postings of live docs
+} term;
+
+static term *terms = NULL;
+static unsigned term_count = 0;
+static unsigned term_cap = 0;
+
+// text -> term + 1, open addressing with linear probing; 0 marks an empty entry
+static unsigned *term_index = NULL;
+static unsigned term_index_mask = 0; // Capacity - 1, a power of two
+
+// Term ids sorted by text, and the ones added since they were last merged
+static unsigned *sorted_terms = NULL;
+static unsigned sorted_count = 0;
+static unsigned pending_terms[PENDING_TERMS];
+static unsigned pending_count = 0;
+
+// Slot of each doc, DEAD_DOC once it is dropped
+static unsigned long long *doc_slots = NULL;
+static unsigned doc_count = 0;
+static unsigned doc_cap = 0;
+static unsigned dead_docs = 0;
+
+// Doc of each slot, NO_DOC if it has none
+static unsigned *slot_docs = NULL;
+static unsigned long long slot_docs_len = 0;
+
+static unsigned live_docs = 0;
+static unsigned long long total_length = 0; // Words in live docs
+static unsigned long long changes = 0;      // Books indexed or dropped so far
+
+typedef struct {
+    char prefix[CACHED_PREFIX_SIZE + 1];
+    unsigned long long changes; // changes when they were found
+    int count;
+    unsigned terms[MAX_PREFIX_TERMS];
+} cached_completions;
+
+// Queries share the store's read lock, so the one thing they change has a
+// lock of its own
+static cached_completions *completion_cache = NULL;
+static pthread_mutex_t completion_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Scratch space for the words of the book being indexed
+static char doc_words[MAX_DOC_WORDS][MAX_WORD_SIZE + 1];
+
+static int is_word_byte(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+// Appends the lowercased words of text to words[count..max) and returns the
+// new count
+static int split_words(const char *text, char (*words)[MAX_WORD_SIZE + 1], int count, int max) {
+    size_t len = 0;
+    for (const char *p = text; count < max; p++) {
+        unsigned char c = (unsigned char)*p;
+        if (c != '\0' && is_word_byte(c)) {
+            if (len < MAX_WORD_SIZE) {
+                words[count][len++] = (char)(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+            }
+            continue;
+        }
+        if (len > 0) {
+            words[count++][len] = '\0';
+            len = 0;
+        }
+        if (c == '\0') {
+            break;
+        }
+    }
+    return count;
+}
+
+static int compare_words(const void *a, const void *b) {
+    return strcmp(a, b);
+}
+
+// Fills doc_words with the distinct words of a book, sorted, and returns
+// how many there are
+static int book_words(const char *title, const char *author, const char *description) {
+    int count = split_words(title, doc_words, 0, MAX_DOC_WORDS);
+    count = split_words(author, doc_words, count, MAX_DOC_WORDS);
+    count = split_words(description, doc_words, count, MAX_DOC_WORDS);
+    qsort(doc_words, (size_t)count, sizeof(doc_words[0]), compare_words);
+
+    int distinct = 0;
+    for (int i = 0; i < count; i++) {
+        if (distinct == 0 || strcmp(doc_words[i], doc_words[distinct - 1]) != 0) {
+            if (distinct != i) {
+                memcpy(doc_words[distinct], doc_words[i], sizeof(doc_words[0]));
+            }
+            distinct++;
+        }
+    }
+    return distinct;
+}
+
+static unsigned hash_word(const char *word) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (; *word != '\0'; word++) {
+        hash ^= (unsigned char)*word;
+        hash *= 1099511628211ULL;
+    }
+    return (unsigned)(hash ^ (hash >> 32));
+}
+
+// Returns the index entry holding word, or the empty entry where it would go
+static unsigned* term_entry(const char *word) {
+    unsigned i = hash_word(word) & term_index_mask;
+    while (term_index[i] != 0 && strcmp(terms[term_index[i] - 1].text, word) != 0) {
+        i = (i + 1) & term_index_mask;
+    }
+    return &term_index[i];
+}
+
+static unsigned find_term(const char *word) {
+    if (term_index == NULL) {
+        return NO_TERM;
+    }
+    unsigned entry = *term_entry(word);
+    return entry != 0 ? entry - 1 : NO_TERM;
+}
+
+static int term_index_grow(void) {
+    unsigned capacity = term_index_mask ? (term_index_mask + 1) * 2 : 1024;
+    unsigned *old = term_index;
+    unsigned old_capacity = term_index_mask ? term_index_mask + 1 : 0;
+    term_index = calloc(capacity, sizeof(unsigned));
+    if (term_index == NULL) {
+        term_index = old;
+        return 0;
+    }
+    term_index_mask = capacity - 1;
+    for (unsigned i = 0; i < old_capacity; i++) {
+        if (old[i] != 0) {
+            *term_entry(terms[old[i] - 1].text) = old[i];
+        }
+    }
+    free(old);
+    return 1;
+}
+
+static int compare_term_ids(const void *a, const void *b) {
+    return strcmp(terms[*(const unsigned *)a].text, terms[*(const unsigned *)b].text);
+}
+
+// Moves the pending terms into sorted_terms
+static int merge_pending(void) {
+    unsigned *merged = realloc(sorted_terms, (size_t)(sorted_count + pending_count) * sizeof(unsigned));
+    if (merged == NULL) {
+        return 0;
+    }
+    sorted_terms = merged;
+    qsort(pending_terms, pending_count, sizeof(unsigned), compare_term_ids);
+
+    // Merge from the back, so nothing is overwritten before it is moved
+    unsigned i = sorted_count;
+    unsigned j = pending_count;
+    unsigned k = sorted_count + pending_count;
+    while (j > 0) {
+        if (i > 0 && strcmp(terms[sorted_terms[i - 1]].text, terms[pending_terms[j - 1]].text) > 0) {
+            sorted_terms[--k] = sorted_terms[--i];
+        } else {
+            sorted_terms[--k] = pending_terms[--j];
+        }
+    }
+    sorted_count += pending_count;
+    pending_count = 0;
+    return 1;
+}
+
+// Returns the id of word's term, adding it if it is new, or NO_TERM if
+// memory runs out
+static unsigned acquire_term(const char *word) {
+    if ((term_count + 1) * 2 > term_index_mask + 1 && !term_index_grow()) {
+        return NO_TERM;
+    }
+    unsigned *entry = term_entry(word);
+    if (*entry != 0) {
+        return *entry - 1;
+    }
+    if (pending_count == PENDING_TERMS && !merge_pending()) {
+        return NO_TERM;
+    }
+    if (term_count == term_cap) {
+        unsigned cap = term_cap ? term_cap * 2 : 1024;
+        term *grown = realloc(terms, cap * sizeof(term));
+        if (grown == NULL) {
+            return NO_TERM;
+        }
+        terms = grown;
+        term_cap = cap;
+    }
+    char *text = malloc(strlen(word) + 1);
+    if (text == NULL) {
+        return NO_TERM;
+    }
+    strcpy(text, word);
+
+    term *t = &terms[term_count];
+    memset(t, 0, sizeof(term));
+    t->text = text;
+    *entry = term_count + 1;
+    pending_terms[pending_count++] = term_count;
+    return term_count++;
+}
+
+// Index of the first bucket of t holding docs of length or longer
+static unsigned bucket_position(const term *t, unsigned length) {
+    unsigned key = length < LONG_DOC ? length : LONG_DOC;
+    unsigned lo = 0;
+    unsigned hi = t->bucket_count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (t->buckets[mid].length < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// The bucket of t holding docs of length, or NULL
+static const bucket* term_bucket(const term *t, unsigned length) {
+    unsigned i = bucket_position(t, length);
+    unsigned key = length < LONG_DOC ? length : LONG_DOC;
+    return i < t->bucket_count && t->buckets[i].length == key ? &t->buckets[i] : NULL;
+}
+
+static int term_append(term *t, unsigned doc, unsigned length) {
+    unsigned key = length < LONG_DOC ? length : LONG_DOC;
+    unsigned i = bucket_position(t, length);
+    if (i == t->bucket_count || t->buckets[i].length != key) {
+        if (t->bucket_count == t->bucket_cap) {
+            unsigned cap = t->bucket_cap ? t->bucket_cap * 2 : 1;
+            bucket *grown = realloc(t->buckets, cap * sizeof(bucket));
+            if (grown == NULL) {
+                return 0;
+            }
+            t->buckets = grown;
+            t->bucket_cap = cap;
+        }
+        memmove(&t->buckets[i + 1], &t->buckets[i], (t->bucket_count - i) * sizeof(bucket));
+        t->buckets[i].length = key;
+        t->buckets[i].count = 0;
+        t->buckets[i].cap = 0;
+        t->buckets[i].postings = NULL;
+        t->bucket_count++;
+    }
+
+    bucket *b = &t->buckets[i];
+    if (b->count == b->cap) {
+        unsigned cap = b->cap ? b->cap * 2 : 1;
+        posting *grown = realloc(b->postings, cap * sizeof(posting));
+        if (grown == NULL) {
+            return 0;
+        }
+        b->postings = grown;
+        b->cap = cap;
+    }
+    b->postings[b->count].doc = doc;
+    b->postings[b->count].length = length;
+    b->count++;
+    t->postings++;
+
+    if (t->bits != NULL) {
+        if (doc / 64 >= t->bits_len) {
+            size_t len = t->bits_len * 2 > doc / 64 + 1 ? t->bits_len * 2 : doc / 64 + 1;
+            unsigned long long *grown = realloc(t->bits, len * sizeof(unsigned long long));
+            if (grown == NULL) {
+                // The bitset is only a shortcut; the buckets still have every doc
+                free(t->bits);
+                t->bits = NULL;
+                t->bits_len = 0;
+                return 1;
+            }
+            memset(grown + t->bits_len, 0, (len - t->bits_len) * sizeof(unsigned long long));
+            t->bits = grown;
+            t->bits_len = len;
+        }
+        t->bits[doc / 64] |= 1ULL << (doc % 64);
+    }
+    return 1;
+}
+
+// Gives a term a bitset once it is common enough
+static void update_bits(term *t) {
+    if (t->bits != NULL || t->postings < DENSE_MIN_POSTINGS ||
+        (unsigned long long)t->postings * DENSE_RATIO < doc_count) {
+        return;
+    }
+    size_t len = doc_count / 64 + 1;
+    t->bits = calloc(len, sizeof(unsigned long long));
+    if (t->bits == NULL) {
+        return;
+    }
+    t->bits_len = len;
+    for (unsigned i = 0; i < t->bucket_count; i++) {
+        const bucket *b = &t->buckets[i];
+        for (unsigned k = 0; k < b->count; k++) {
+            t->bits[b->postings[k].doc / 64] |= 1ULL << (b->postings[k].doc % 64);
+        }
+    }
+}
+
+// Renumbers the live docs in order, so postings stay sorted, and drops the
+// dead ones' postings
+static void compact(void) {
+    unsigned *renumbered = malloc((size_t)doc_count * sizeof(unsigned));
+    if (renumbered == NULL) {
+        return;
+    }
+    unsigned live = 0;
+    for (unsigned doc = 0; doc < doc_count; doc++) {
+        if (doc_slots[doc] == DEAD_DOC) {
+            renumbered[doc] = NO_DOC;
+            continue;
+        }
+        renumbered[doc] = live;
+        doc_slots[live] = doc_slots[doc];
+        slot_docs[doc_slots[live]] = live;
+        live++;
+    }
+    doc_count = live;
+    dead_docs = 0;
+
+    for (unsigned id = 0; id < term_count; id++) {
+        term *t = &terms[id];
+        unsigned kept_buckets = 0;
+        t->postings = 0;
+        for (unsigned i = 0; i < t->bucket_count; i++) {
+            bucket b = t->buckets[i];
+            unsigned kept = 0;
+            for (unsigned k = 0; k < b.count; k++) {
+                if (renumbered[b.postings[k].doc] != NO_DOC) {
+                    b.postings[kept].doc = renumbered[b.postings[k].doc];
+                    b.postings[kept].length = b.postings[k].length;
+                    kept++;
+                }
+            }
+            b.count = kept;
+            t->postings += kept;
+            if (kept == 0) {
+                free(b.postings);
+            } else {
+                t->buckets[kept_buckets++] = b;
+            }
+        }
+        t->bucket_count = kept_buckets;
+        free(t->bits);
+        t->bits = NULL;
+        t->bits_len = 0;
+        update_bits(t);
+    }
+    free(renumbered);
+}
+
+void book_search_clear(void) {
+    for (unsigned id = 0; id < term_count; id++) {
+        for (unsigned i = 0; i < terms[id].bucket_count; i++) {
+            free(terms[id].buckets[i].postings);
+        }
+        free(terms[id].buckets);
+        free(terms[id].bits);
+        free(terms[id].text);
+    }
+    free(terms);
+    free(term_index);
+    free(sorted_terms);
+    free(doc_slots);
+    free(slot_docs);
+    free(completion_cache);
+    terms = NULL;
+    term_count = 0;
+    term_cap = 0;
+    term_index = NULL;
+    term_index_mask = 0;
+    sorted_terms = NULL;
+    sorted_count = 0;
+    pending_count = 0;
+    doc_slots = NULL;
+    doc_count = 0;
+    doc_cap = 0;
+    dead_docs = 0;
+    slot_docs = NULL;
+    slot_docs_len = 0;
+    live_docs = 0;
+    total_length = 0;
+    changes = 0;
+    completion_cache = NULL;
+}
+
+int book_search_add(unsigned long long slot, const char *title, const char *author, const char *description) {
+    if (slot >= slot_docs_len) {
+        unsigned long long len = slot_docs_len ? slot_docs_len * 2 : 1024;
+        if (len <= slot) {
+            len = slot + 1;
+        }
+        unsigned *grown = realloc(slot_docs, (size_t)len * sizeof(unsigned));
+        if (grown == NULL) {
+            return 0;
+        }
+        for (unsigned long long i = slot_docs_len; i < len; i++) {
+            grown[i] = NO_DOC;
+        }
+        slot_docs = grown;
+        slot_docs_len = len;
+    }
+    if (doc_count == doc_cap) {
+        unsigned cap = doc_cap ? doc_cap * 2 : 1024;
+        unsigned long long *grown = realloc(doc_slots, cap * sizeof(unsigned long long));
+        if (grown == NULL) {
+            return 0;
+        }
+        doc_slots = grown;
+        doc_cap = cap;
+    }
+
+    unsigned doc = doc_count;
+    unsigned count = (unsigned)book_words(title, author, description);
+    for (unsigned i = 0; i < count; i++) {
+        unsigned id = acquire_term(doc_words[i]);
+        if (id == NO_TERM || !term_append(&terms[id], doc, count)) {
+            // The postings added so far stay behind under a dead doc
+            for (unsigned k = 0; k < i; k++) {
+                terms[find_term(doc_words[k])].live--;
+            }
+            doc_slots[doc_count++] = DEAD_DOC;
+            dead_docs++;
+            return 0;
+        }
+        terms[id].live++;
+        update_bits(&terms[id]);
+    }
+
+    doc_slots[doc_count++] = slot;
+    slot_docs[slot] = doc;
+    live_docs++;
+    total_length += count;
+    changes++;
+    return 1;
+}
+
+void book_search_remove(unsigned long long slot, const char *title, const char *author, const char *description) {
+    if (slot >= slot_docs_len || slot_docs[slot] == NO_DOC) {
+        return;
+    }
+    unsigned doc = slot_docs[slot];
+    int count = book_words(title, author, description);
+    for (int i = 0; i < count; i++) {
+        unsigned id = find_term(doc_words[i]);
+        if (id != NO_TERM) {
+            terms[id].live--;
+        }
+    }
+    live_docs--;
+    total_length -= (unsigned long long)count;
+    changes++;
+
+    doc_slots[doc] = DEAD_DOC;
+    slot_docs[slot] = NO_DOC;
+    dead_docs++;
+    if (dead_docs > 1024 && dead_docs * 2 > doc_count) {
+        compact();
+    }
+}
+
+// Keeps ids[0..*count) the `wanted` most common terms offered, most common
+// first
+static void offer_completion(unsigned *ids, int *count, int wanted, unsigned id) {
+    unsigned live = terms[id].live;
+    if (live == 0 || (*count == wanted && terms[ids[*count - 1]].live >= live)) {
+        return;
+    }
+    int i = *count < wanted ? (*count)++ : *count - 1;
+    while (i > 0 && terms[ids[i - 1]].live < live) {
+        ids[i] = ids[i - 1];
+        i--;
+    }
+    ids[i] = id;
+}
+
+// Fills ids with the most common live terms starting with prefix, most
+// common first, and returns how many there are
+static int expand_prefix(const char *prefix, unsigned *ids) {
+    size_t prefix_len = strlen(prefix);
+    cached_completions *cached = NULL;
+    if (prefix_len <= CACHED_PREFIX_SIZE) {
+        pthread_mutex_lock(&completion_mutex);
+        if (completion_cache == NULL) {
+            completion_cache = calloc(COMPLETION_CACHE_SIZE, sizeof(cached_completions));
+        }
+        if (completion_cache != NULL) {
+            cached = &completion_cache[hash_word(prefix) & (COMPLETION_CACHE_SIZE - 1)];
+            if (strcmp(cached->prefix, prefix) == 0 && changes - cached->changes < COMPLETIONS_MAX_AGE) {
+                int count = 0;
+                for (int i = 0; i < cached->count; i++) {
+                    if (terms[cached->terms[i]].live > 0) {
+                        ids[count++] = cached->terms[i];
+                    }
+                }
+                pthread_mutex_unlock(&completion_mutex);
+                return count;
+            }
+        }
+        pthread_mutex_unlock(&completion_mutex);
+    }
+
+    // Shorter prefixes say less about the word, so they get fewer terms
+    int wanted = prefix_len < 3 ? MAX_PREFIX_TERMS >> (3 - prefix_len) : MAX_PREFIX_TERMS;
+    int count = 0;
+    unsigned lo = 0;
+    unsigned hi = sorted_count;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (strcmp(terms[sorted_terms[mid]].text, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (unsigned i = lo, scanned = 0; i < sorted_count && scanned < MAX_PREFIX_SCAN &&
+                                       strncmp(terms[sorted_terms[i]].text, prefix, prefix_len) == 0;
+         i++, scanned++) {
+        offer_completion(ids, &count, wanted, sorted_terms[i]);
+    }
+    for (unsigned i = 0; i < pending_count; i++) {
+        if (strncmp(terms[pending_terms[i]].text, prefix, prefix_len) == 0) {
+            offer_completion(ids, &count, wanted, pending_terms[i]);
+        }
+    }
+
+    if (cached != NULL) {
+        pthread_mutex_lock(&completion_mutex);
+        memcpy(cached->prefix, prefix, prefix_len + 1);
+        cached->changes = changes;
+        cached->count = count;
+        memcpy(cached->terms, ids, (size_t)count * sizeof(unsigned));
+        pthread_mutex_unlock(&completion_mutex);
+    }
+    return count;
+}
+
+// Looks up docs of one length in a term. Docs must be asked for in
+// increasing order.
+typedef struct {
+    const unsigned long long *bits;
+    size_t bits_len;
+    const bucket *bucket;
+    unsigned next;
+} cursor;
+
+static void cursor_init(cursor *c, const term *t, unsigned length) {
+    c->bits = t->bits;
+    c->bits_len = t->bits_len;
+    c->bucket = t->bits != NULL ? NULL : term_bucket(t, length);
+    c->next = 0;
+}
+
+static int cursor_contains(cursor *c, unsigned doc) {
+    if (c->bits != NULL) {
+        return doc / 64 < c->bits_len && (c->bits[doc / 64] >> (doc % 64) & 1) != 0;
+    }
+    if (c->bucket == NULL) {
+        return 0;
+    }
+
+    // Gallop from the last position, then binary search the last step
+    const posting *postings = c->bucket->postings;
+    unsigned count = c->bucket->count;
+    unsigned low = c->next;
+    unsigned high = low;
+    for (unsigned step = 1; high < count && postings[high].doc < doc; step *= 2) {
+        low = high + 1;
+        high = low + step;
+    }
+    if (high > count) {
+        high = count;
+    }
+    while (low < high) {
+        unsigned mid = low + (high - low) / 2;
+        if (postings[mid].doc < doc) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    c->next = low;
+    return low < count && postings[low].doc == doc;
+}
+
+typedef struct {
+    const term *term;
+    double idf;
+} query_term;
+
+typedef struct {
+    double score;
+    unsigned doc;
+} hit;
+
+typedef struct {
+    hit *hits; // The best hits so far, with the worst on top
+    int count;
+    int limit;
+    double average_length;
+    query_term completions[MAX_PREFIX_TERMS]; // Rarest first
+    int completion_count;
+} search_state;
+
+static int better(const hit *a, const hit *b) {
+    return a->score > b->score || (a->score == b->score && a->doc < b->doc);
+}
+
+static int compare_hits(const void *a, const void *b) {
+    return better(a, b) ? -1 : better(b, a);
+}
+
+static void sift_up(hit *hits, int i) {
+    while (i > 0 && better(&hits[(i - 1) / 2], &hits[i])) {
+        hit swap = hits[i];
+        hits[i] = hits[(i - 1) / 2];
+        hits[(i - 1) / 2] = swap;
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(hit *hits, int count, int i) {
+    for (;;) {
+        int worst = i;
+        for (int child = 2 * i + 1; child <= 2 * i + 2 && child < count; child++) {
+            if (better(&hits[worst], &hits[child])) {
+                worst = child;
+            }
+        }
+        if (worst == i) {
+            return;
+        }
+        hit swap = hits[i];
+        hits[i] = hits[worst];
+        hits[worst] = swap;
+        i = worst;
+    }
+}
+
+static void push_hit(search_state *s, double score, unsigned doc, int may_repeat) {
+    if (may_repeat) {
+        // A doc with several completions of the prefix keeps its best score
+        for (int i = 0; i < s->count; i++) {
+            if (s->hits[i].doc == doc) {
+                if (score > s->hits[i].score) {
+                    s->hits[i].score = score;
+                    sift_down(s->hits, s->count, i);
+                }
+                return;
+            }
+        }
+    }
+    hit h = {score, doc};
+    if (s->count < s->limit) {
+        s->hits[s->count] = h;
+        sift_up(s->hits, s->count++);
+    } else if (better(&h, &s->hits[0])) {
+        s->hits[0] = h;
+        sift_down(s->hits, s->count, 0);
+    }
+}
+
+static double threshold(const search_state *s) {
+    return s->count < s->limit ? -1.0 : s->hits[0].score;
+}
+
+// BM25 weight of a word in a doc of length words, with tf = 1
+static double weight(const search_state *s, unsigned length) {
+    return (BM25_K1 + 1) / (1 + BM25_K1 * (1 - BM25_B + BM25_B * length / s->average_length));
+}
+
+// Best score a word can add to any doc
+static double term_bound(const search_state *s, const query_term *q) {
+    return q->idf * weight(s, q->term->buckets[0].length);
+}
+
+static query_term make_query_term(unsigned id) {
+    double n = live_docs;
+    double df = terms[id].live;
+    query_term q = {&terms[id], log(1 + (n - df + 0.5) / (df + 0.5))};
+    return q;
+}
+
+// Scores the docs in driver's postings that also contain every word in
+// others and, if completion_count > 0, one of completions. All of a doc's
+// words have the same weight, so its score is known before finding them,
+// and a bucket's docs all score the same or, for long docs, no better than
+// its length allows.
+static void run(search_state *s, const query_term *driver, const query_term **others, int other_count,
+                const query_term *completions, int completion_count, int may_repeat) {
+    double idf = driver->idf;
+    for (int k = 0; k < other_count; k++) {
+        idf += others[k]->idf;
+    }
+    double best_completion = completion_count > 0 ? completions[0].idf : 0;
+    cursor cursors[MAX_QUERY_WORDS];
+    cursor completion_cursors[MAX_PREFIX_TERMS];
+
+    const term *t = driver->term;
+    for (unsigned i = 0; i < t->bucket_count; i++) {
+        const bucket *b = &t->buckets[i];
+        // Later buckets hold longer docs, which score less
+        if ((idf + best_completion) * weight(s, b->length) <= threshold(s)) {
+            break;
+        }
+        for (int k = 0; k < other_count; k++) {
+            cursor_init(&cursors[k], others[k]->term, b->length);
+        }
+        for (int k = 0; k < completion_count; k++) {
+            cursor_init(&completion_cursors[k], completions[k].term, b->length);
+        }
+
+        for (unsigned p = 0; p < b->count; p++) {
+            const posting *posting = &b->postings[p];
+            double w = weight(s, posting->length);
+            if ((idf + best_completion) * w <= threshold(s)) {
+                // Docs further on in the bucket tie at best
+                if (b->length < LONG_DOC) {
+                    break;
+                }
+                continue;
+            }
+
+            int matched = 1;
+            for (int k = 0; k < other_count && matched; k++) {
+                matched = cursor_contains(&cursors[k], posting->doc);
+            }
+            double score = idf;
+            if (matched && completion_count > 0) {
+                // Only completions that could still make the cut matter
+                matched = 0;
+                for (int k = 0; k < completion_count; k++) {
+                    if ((idf + completions[k].idf) * w <= threshold(s)) {
+                        break;
+                    }
+                    if (cursor_contains(&completion_cursors[k], posting->doc)) {
+                        score += completions[k].idf;
+                        matched = 1;
+                        break;
+                    }
+                }
+            }
+            // Only now look the doc up, as a miss per posting would cost
+            // more than all the matching
+            if (matched && doc_slots[posting->doc] != DEAD_DOC) {
+                push_hit(s, score * w, posting->doc, may_repeat);
+            }
+        }
+    }
+}
+
+int book_search_query(const char *query, int limit, unsigned long long *slots) {
+    char words[MAX_QUERY_WORDS + 1][MAX_WORD_SIZE + 1];
+    int word_count = split_words(query, words, 0, MAX_QUERY_WORDS + 1);
+    if (word_count == 0 || limit <= 0 || live_docs == 0) {
+        return 0;
+    }
+    // The last word is a prefix unless the query ends between words or has
+    // more words than are used
+    const char *prefix = NULL;
+    if (word_count > MAX_QUERY_WORDS) {
+        word_count = MAX_QUERY_WORDS;
+    } else if (is_word_byte((unsigned char)query[strlen(query) - 1])) {
+        prefix = words[--word_count];
+    }
+
+    search_state s;
+    s.count = 0;
+    s.limit = limit;
+    s.average_length = (double)total_length / live_docs;
+    if (s.average_length < 1) {
+        s.average_length = 1;
+    }
+
+    query_term exact[MAX_QUERY_WORDS];
+    int exact_count = 0;
+    double exact_bound = 0;
+    for (int i = 0; i < word_count; i++) {
+        int repeated = 0;
+        for (int k = 0; k < i && !repeated; k++) {
+            repeated = strcmp(words[k], words[i]) == 0;
+        }
+        if (repeated) {
+            continue;
+        }
+        unsigned id = find_term(words[i]);
+        if (id == NO_TERM || terms[id].live == 0) {
+            return 0;
+        }
+        exact[exact_count] = make_query_term(id);
+        exact_bound += term_bound(&s, &exact[exact_count]);
+        exact_count++;
+    }
+
+    s.completion_count = 0;
+    double completion_postings = 0;
+    if (prefix != NULL) {
+        unsigned ids[MAX_PREFIX_TERMS];
+        int count = expand_prefix(prefix, ids);
+        if (count == 0) {
+            return 0;
+        }
+        // Rarest first: a doc's best completion is the first one it has
+        for (int i = 0; i < count; i++) {
+            s.completions[i] = make_query_term(ids[count - 1 - i]);
+            completion_postings += terms[ids[i]].live;
+        }
+        s.completion_count = count;
+    }
+
+    hit stack_hits[STACK_HITS];
+    s.hits = limit <= STACK_HITS ? stack_hits : malloc((size_t)limit * sizeof(hit));
+    if (s.hits == NULL) {
+        return 0;
+    }
+
+    // Candidates come from whichever side needs the fewest lookups: the
+    // rarest exact word, checking each candidate against the others and
+    // those that have them all against the completions (estimating the
+    // words as independent), or each completion in turn
+    const query_term *driver = NULL;
+    for (int i = 0; i < exact_count; i++) {
+        if (driver == NULL || exact[i].term->live < driver->term->live) {
+            driver = &exact[i];
+        }
+    }
+    int exact_driven = driver != NULL;
+    if (driver != NULL && s.completion_count > 0) {
+        double matches = driver->term->live;
+        for (int i = 0; i < exact_count; i++) {
+            if (&exact[i] != driver) {
+                matches *= (double)exact[i].term->live / live_docs;
+            }
+        }
+        double exact_cost = (double)driver->term->live * exact_count + matches * s.completion_count;
+        exact_driven = exact_cost <= completion_postings * (exact_count + 1);
+    }
+
+    const query_term *all_exact[MAX_QUERY_WORDS];
+    const query_term *others[MAX_QUERY_WORDS];
+    int other_count = 0;
+    for (int i = 0; i < exact_count; i++) {
+        all_exact[i] = &exact[i];
+        if (&exact[i] != driver) {
+            others[other_count++] = &exact[i];
+        }
+    }
+
+    // The rarest completions, while together still rarer than the driver,
+    // drive their own runs first: checked from the driver, their high
+    // scores would keep its scan from stopping early long after their few
+    // docs were found
+    int self_driven = s.completion_count;
+    if (exact_driven) {
+        double rare_postings = 0;
+        self_driven = 0;
+        while (self_driven < s.completion_count &&
+               rare_postings + s.completions[self_driven].term->live <= driver->term->live) {
+            rare_postings += s.completions[self_driven].term->live;
+            self_driven++;
+        }
+    }
+    for (int i = 0; i < self_driven; i++) {
+        if (term_bound(&s, &s.completions[i]) + exact_bound > threshold(&s)) {
+            run(&s, &s.completions[i], all_exact, exact_count, NULL, 0, 1);
+        }
+    }
+    if (exact_driven && (s.completion_count == 0 || self_driven < s.completion_count)) {
+        run(&s, driver, others, other_count, s.completions + self_driven,
+            s.completion_count - self_driven, self_driven > 0);
+    }
+
+    qsort(s.hits, (size_t)s.count, sizeof(hit), compare_hits);
+    for (int i = 0; i < s.count; i++) {
+        slots[i] = doc_slots[s.hits[i].doc];
+    }
+    if (s.hits != stack_hits) {
+        free(s.hits);
+    }
+    return s.count;
+}
@@ -0,0 +1,46 @@
+#ifndef BOOK_SEARCH_H
+#define BOOK_SEARCH_H
+
+// Full-text index over the title, author and description of stored books,
+// for GET /book/search. book.c keeps it in step with the store; books are
+// identified by their slot.
+//
+// Text is split into lowercase words of ASCII letters and digits (bytes
+// above 0x7f count as letters, so UTF-8 words stay whole). Every indexed
+// book gets a new doc number, and each word keeps postings of the docs that
+// contain it along with their lengths. A changed or removed book's doc is
+// only marked dead; once dead docs outnumber live ones the postings are
+// renumbered without them. Words are never forgotten, only left without
+// postings.
+//
+// A query matches books that contain all of its words. The last word is a
+// prefix unless the query ends in a space, so "harry pot" finds "Harry
+// Potter"; a prefix stands for its most common completions, up to 32 of
+// them for three letters or more and fewer for shorter prefixes. Completions
+// of prefixes up to three letters are cached for a while since finding them
+// is slow. Matches are ranked with BM25, counting a word once per book, so a
+// doc's score depends only on the query's words and the doc's length. Each
+// word's postings are split into one bucket per doc length and scanned
+// shortest first, so the scan stops at the first bucket whose docs cannot
+// beat the `limit` hits found so far. Candidates come from the rarest word,
+// or from each completion that is rarer still, and the others are looked up
+// in their bucket for the same length; words in more than 1/32 of the books
+// also keep a bitset of their docs.
+
+// Queries may run at the same time as each other but not as changes.
+
+// Drops every book from the index
+void book_search_clear(void);
+
+// Indexes the book in slot. Returns 0 if memory runs out, leaving the book
+// unindexed.
+int book_search_add(unsigned long long slot, const char *title, const char *author, const char *description);
+
+// Drops the book in slot, given the text it was indexed with
+void book_search_remove(unsigned long long slot, const char *title, const char *author, const char *description);
+
+// Fills slots with up to limit books matching query, best first, and
+// returns how many it found
+int book_search_query(const char *query, int limit, unsigned long long *slots);
+
+#endif
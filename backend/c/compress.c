@@ -0,0 +1,369 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <zstd.h>
+#include "compress.h"
+
+// Levels by compress_level: zstd 1 runs at over 300 MB/s on book JSON; gzip
+// 6 and zstd 9 take several times the CPU for a few percent less
+static const int gzip_levels[] = {1, 6};
+static const int zstd_levels[] = {1, 9};
+
+#define POOL_KEEP 16 // Idle encoders kept per encoding and level
+#define STREAM_INPUT_SIZE (16 * 1024)
+
+typedef struct encoder {
+    struct encoder *next; // In the pool, while idle
+    content_encoding encoding;
+    compress_level level;
+    z_stream zlib;
+    ZSTD_CCtx *zstd;
+} encoder;
+
+static struct {
+    pthread_mutex_t mutex;
+    encoder *idle[2][2]; // By zstd or not, then level
+    unsigned count[2][2];
+} pool = {PTHREAD_MUTEX_INITIALIZER, {{NULL}}, {{0}}};
+
+struct compress_stream {
+    encoder *encoder;
+    compress_source source;
+    void *cls;
+    int owned;     // Allocated with malloc
+    int ended;     // The source has returned 0
+    int finished;  // The end of the stream is written, or something failed
+    int failed;    // The source or the encoder failed
+    size_t pos;    // Input not yet compressed: in[pos..len)
+    size_t len;
+    char in[STREAM_INPUT_SIZE];
+};
+
+static void encoder_destroy(encoder *e) {
+    if (e->encoding == ENCODING_GZIP) {
+        deflateEnd(&e->zlib);
+    } else {
+        ZSTD_freeCCtx(e->zstd);
+    }
+    free(e);
+}
+
+// Takes an idle encoder and resets it, or makes one. NULL if memory runs out.
+static encoder* encoder_get(content_encoding encoding, compress_level level) {
+    int kind = encoding == ENCODING_ZSTD;
+    pthread_mutex_lock(&pool.mutex);
+    encoder *e = pool.idle[kind][level];
+    if (e != NULL) {
+        pool.idle[kind][level] = e->next;
+        pool.count[kind][level]--;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    if (e != NULL) {
+        if (encoding == ENCODING_GZIP) {
+            deflateReset(&e->zlib);
+        } else {
+            ZSTD_CCtx_reset(e->zstd, ZSTD_reset_session_only);
+        }
+        return e;
+    }
+
+    e = calloc(1, sizeof(encoder));
+    if (e == NULL) {
+        return NULL;
+    }
+    e->encoding = encoding;
+    e->level = level;
+    if (encoding == ENCODING_GZIP) {
+        // 15 window bits, plus 16 for a gzip header and trailer
+        if (deflateInit2(&e->zlib, gzip_levels[level], Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            free(e);
+            return NULL;
+        }
+    } else {
+        e->zstd = ZSTD_createCCtx();
+        if (e->zstd == NULL) {
+            free(e);
+            return NULL;
+        }
+        ZSTD_CCtx_setParameter(e->zstd, ZSTD_c_compressionLevel, zstd_levels[level]);
+    }
+    return e;
+}
+
+static void encoder_put(encoder *e) {
+    int kind = e->encoding == ENCODING_ZSTD;
+    pthread_mutex_lock(&pool.mutex);
+    if (pool.count[kind][e->level] < POOL_KEEP) {
+        e->next = pool.idle[kind][e->level];
+        pool.idle[kind][e->level] = e;
+        pool.count[kind][e->level]++;
+        e = NULL;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    if (e != NULL) {
+        encoder_destroy(e);
+    }
+}
+
+// Compresses from *in into *out, advancing both past what was used. With
+// finish set, *in holds the rest of the body. Returns 1 once the end of the
+// stream is written, -1 if the encoder fails, else 0.
+static int encoder_step(encoder *e, const char **in, size_t *in_len, char **out, size_t *out_len, int finish) {
+    if (e->encoding == ENCODING_GZIP) {
+        // zlib counts in 32 bits
+        uInt in_step = *in_len < UINT_MAX ? (uInt)*in_len : UINT_MAX;
+        uInt out_step = *out_len < UINT_MAX ? (uInt)*out_len : UINT_MAX;
+        e->zlib.next_in = (Bytef *)*in;
+        e->zlib.avail_in = in_step;
+        e->zlib.next_out = (Bytef *)*out;
+        e->zlib.avail_out = out_step;
+        int result = deflate(&e->zlib, finish && in_step == *in_len ? Z_FINISH : Z_NO_FLUSH);
+        *in += in_step - e->zlib.avail_in;
+        *in_len -= in_step - e->zlib.avail_in;
+        *out += out_step - e->zlib.avail_out;
+        *out_len -= out_step - e->zlib.avail_out;
+        if (result == Z_STREAM_END) {
+            return 1;
+        }
+        // Z_BUF_ERROR only means no progress was possible
+        return result == Z_OK || result == Z_BUF_ERROR ? 0 : -1;
+    }
+
+    ZSTD_inBuffer input = {*in, *in_len, 0};
+    ZSTD_outBuffer output = {*out, *out_len, 0};
+    size_t result = ZSTD_compressStream2(e->zstd, &output, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+    *in += input.pos;
+    *in_len -= input.pos;
+    *out += output.pos;
+    *out_len -= output.pos;
+    if (ZSTD_isError(result)) {
+        return -1;
+    }
+    return finish && result == 0 ? 1 : 0;
+}
+
+static int equals_lower(const char *text, size_t len, const char *lower) {
+    if (len != strlen(lower)) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i] >= 'A' && text[i] <= 'Z' ? (char)(text[i] - 'A' + 'a') : text[i];
+        if (c != lower[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void trim(const char **text, size_t *len) {
+    while (*len > 0 && (**text == ' ' || **text == '\t')) {
+        (*text)++;
+        (*len)--;
+    }
+    while (*len > 0 && ((*text)[*len - 1] == ' ' || (*text)[*len - 1] == '\t')) {
+        (*len)--;
+    }
+}
+
+// A q value in thousandths: "1", "0.5", "0.125". Malformed values count as 1,
+// as if the parameter were not there.
+static int parse_q(const char *value, size_t len) {
+    if (len == 0 || (value[0] != '0' && value[0] != '1')) {
+        return 1000;
+    }
+    int q = (value[0] - '0') * 1000;
+    if (len > 1) {
+        if (value[1] != '.' || len > 5) {
+            return 1000;
+        }
+        int scale = 100;
+        for (size_t i = 2; i < len; i++, scale /= 10) {
+            if (value[i] < '0' || value[i] > '9') {
+                return 1000;
+            }
+            q += (value[i] - '0') * scale;
+        }
+    }
+    return q < 1000 ? q : 1000;
+}
+
+content_encoding negotiate_encoding(const char *accept_encoding, size_t len) {
+    // q of zstd, gzip and *, or -1 where not listed
+    int zstd = -1;
+    int gzip = -1;
+    int any = -1;
+    const char *end = accept_encoding + len;
+    const char *item = accept_encoding;
+    while (item != NULL && item < end) {
+        const char *comma = memchr(item, ',', (size_t)(end - item));
+        const char *item_end = comma != NULL ? comma : end;
+
+        const char *semicolon = memchr(item, ';', (size_t)(item_end - item));
+        const char *coding = item;
+        size_t coding_len = (size_t)((semicolon != NULL ? semicolon : item_end) - item);
+        trim(&coding, &coding_len);
+        int q = 1000;
+        while (semicolon != NULL) {
+            const char *param = semicolon + 1;
+            semicolon = memchr(param, ';', (size_t)(item_end - param));
+            size_t param_len = (size_t)((semicolon != NULL ? semicolon : item_end) - param);
+            trim(&param, &param_len);
+            if (param_len >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                const char *value = param + 2;
+                size_t value_len = param_len - 2;
+                trim(&value, &value_len);
+                q = parse_q(value, value_len);
+            }
+        }
+
+        if (equals_lower(coding, coding_len, "zstd")) {
+            zstd = q;
+        } else if (equals_lower(coding, coding_len, "gzip") || equals_lower(coding, coding_len, "x-gzip")) {
+            gzip = q;
+        } else if (coding_len == 1 && coding[0] == '*') {
+            any = q;
+        }
+        item = comma != NULL ? comma + 1 : NULL;
+    }
+
+    zstd = zstd >= 0 ? zstd : any;
+    gzip = gzip >= 0 ? gzip : any;
+    if (zstd > 0 && zstd >= gzip) {
+        return ENCODING_ZSTD;
+    }
+    if (gzip > 0) {
+        return ENCODING_GZIP;
+    }
+    return ENCODING_IDENTITY;
+}
+
+const char* encoding_name(content_encoding encoding) {
+    switch (encoding) {
+    case ENCODING_GZIP:
+        return "gzip";
+    case ENCODING_ZSTD:
+        return "zstd";
+    default:
+        return "identity";
+    }
+}
+
+char* compress_buffer(arena *a, content_encoding encoding, compress_level level,
+                      const char *data, size_t len, size_t *out_len) {
+    encoder *e = encoder_get(encoding, level);
+    if (e == NULL) {
+        return NULL;
+    }
+    size_t bound;
+    if (encoding == ENCODING_GZIP) {
+        // deflateBound takes 32 bits; a body that big adds a block header per
+        // 64K of input at worst
+        bound = len <= UINT_MAX ? deflateBound(&e->zlib, (uLong)len) : len + len / 1000 + 64;
+    } else {
+        ZSTD_CCtx_setPledgedSrcSize(e->zstd, len);
+        bound = ZSTD_compressBound(len);
+    }
+    char *out = a != NULL ? arena_alloc(a, bound) : malloc(bound);
+    if (out == NULL) {
+        encoder_put(e);
+        return NULL;
+    }
+
+    char *next = out;
+    size_t room = bound;
+    int result;
+    do {
+        result = encoder_step(e, &data, &len, &next, &room, 1);
+    } while (result == 0 && room > 0);
+    encoder_put(e);
+    if (result != 1) {
+        if (a == NULL) {
+            free(out);
+        }
+        return NULL;
+    }
+    *out_len = bound - room;
+    return out;
+}
+
+compress_stream* compress_stream_new(arena *a, content_encoding encoding, compress_level level,
+                                     compress_source source, void *cls) {
+    compress_stream *stream = a != NULL ? arena_alloc(a, sizeof(compress_stream)) : malloc(sizeof(compress_stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->encoder = encoder_get(encoding, level);
+    if (stream->encoder == NULL) {
+        if (a == NULL) {
+            free(stream);
+        }
+        return NULL;
+    }
+    stream->source = source;
+    stream->cls = cls;
+    stream->owned = a == NULL;
+    stream->ended = 0;
+    stream->finished = 0;
+    stream->failed = 0;
+    stream->pos = 0;
+    stream->len = 0;
+    return stream;
+}
+
+size_t compress_stream_read(compress_stream *stream, char *buf, size_t max) {
+    char *out = buf;
+    size_t room = max;
+    // Output may lag input, so keep feeding the encoder until it has written
+    // something or the stream is done
+    while (room > 0 && !stream->finished && (out == buf || stream->pos < stream->len)) {
+        if (stream->pos == stream->len && !stream->ended) {
+            stream->pos = 0;
+            stream->len = stream->source(stream->cls, stream->in, sizeof(stream->in));
+            if (stream->len == COMPRESS_FAILED) {
+                stream->len = 0;
+                stream->failed = 1;
+                stream->finished = 1;
+                break;
+            }
+            stream->ended = stream->len == 0;
+        }
+        const char *in = stream->in + stream->pos;
+        size_t in_len = stream->len - stream->pos;
+        int result = encoder_step(stream->encoder, &in, &in_len, &out, &room, stream->ended);
+        stream->pos = stream->len - in_len;
+        if (result != 0) {
+            stream->finished = 1;
+            stream->failed = result < 0;
+        }
+    }
+    // What was written goes out before the failure is reported
+    return out == buf && stream->failed ? COMPRESS_FAILED : (size_t)(out - buf);
+}
+
+void compress_stream_free(compress_stream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    encoder_put(stream->encoder);
+    if (stream->owned) {
+        free(stream);
+    }
+}
+
+void compress_cleanup(void) {
+    pthread_mutex_lock(&pool.mutex);
+    for (int kind = 0; kind < 2; kind++) {
+        for (int level = 0; level < 2; level++) {
+            while (pool.idle[kind][level] != NULL) {
+                encoder *e = pool.idle[kind][level];
+                pool.idle[kind][level] = e->next;
+                encoder_destroy(e);
+            }
+            pool.count[kind][level] = 0;
+        }
+    }
+    pthread_mutex_unlock(&pool.mutex);
+}
@@ -0,0 +1,68 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include "arena.h"
+
+// Response compression with gzip (zlib) or zstd, picked by the request's
+// Accept-Encoding.
+//
+// Setting up an encoder costs more than compressing a small body: zlib
+// allocates its window and hash chains, zstd its context. Encoders that
+// have finished a body go back to a pool shared by all threads and the next
+// body resets and reuses one, so once the pool is warm compressing a
+// response makes no malloc calls of its own.
+
+typedef enum { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_ZSTD } content_encoding;
+
+// Bodies smaller than this are sent as they are: they fit in a packet
+// either way, so compressing them would cost CPU and save no round trip
+#define COMPRESS_MIN_SIZE 1400
+
+// FAST keeps up with serializing a response; SMALL spends several times the
+// CPU for a few percent less, for bodies compressed once and sent many times
+typedef enum { COMPRESS_FAST, COMPRESS_SMALL } compress_level;
+
+// The coding to answer an Accept-Encoding header value (len bytes, NULL for
+// none) with: the one it gives the highest q, zstd before gzip on a tie, or
+// ENCODING_IDENTITY if it accepts neither
+content_encoding negotiate_encoding(const char *accept_encoding, size_t len);
+
+// The Content-Encoding header value, e.g. "gzip"
+const char* encoding_name(content_encoding encoding);
+
+// Compresses len bytes of data into the arena (malloc() with a NULL arena)
+// and sets *out_len. NULL if memory runs out.
+char* compress_buffer(arena *a, content_encoding encoding, compress_level level,
+                      const char *data, size_t len, size_t *out_len);
+
+// Returned by a source that cannot produce the rest of its body, and by
+// compress_stream_read once the source or the encoder has failed
+#define COMPRESS_FAILED ((size_t)-1)
+
+// Compresses a body as it is produced. The source copies up to max bytes of
+// the body into buf and returns how many, 0 once it has ended, or
+// COMPRESS_FAILED.
+typedef size_t (*compress_source)(void *cls, char *buf, size_t max);
+
+typedef struct compress_stream compress_stream;
+
+// Starts compressing what source produces, with the stream and its input
+// buffer in the arena (malloc() with a NULL arena). encoding must not be
+// ENCODING_IDENTITY. NULL if memory runs out.
+compress_stream* compress_stream_new(arena *a, content_encoding encoding, compress_level level,
+                                     compress_source source, void *cls);
+
+// Copies up to max bytes of compressed output into buf. Returns 0 once the
+// body has ended, or COMPRESS_FAILED so a cut-off body is not taken for a
+// whole one.
+size_t compress_stream_read(compress_stream *stream, char *buf, size_t max);
+
+// Hands the encoder back to the pool. Needed even for a stream in an arena,
+// finished or not.
+void compress_stream_free(compress_stream *stream);
+
+// Frees the pooled encoders
+void compress_cleanup(void);
+
+#endif
@@ -0,0 +1,922 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cover_store.h"
+
+// Whether url may be fetched, and put in a Location header
+static int usable_url(const char *url) {
+    size_t prefix = strncmp(url, "https://", 8) == 0 ? 8 : strncmp(url, "http://", 7) == 0 ? 7 : 0;
+    if (prefix == 0 || url[prefix] == '\0') {
+        return 0;
+    }
+    for (const unsigned char *p = (const unsigned char *)url; *p != '\0'; p++) {
+        if (*p <= ' ' || *p >= 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#ifndef _WIN32
+
+#include <curl/curl.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATH_LEN 4096
+#define MAX_WORKERS 64
+#define QUEUE_SIZE 1024    // URLs waiting for a worker
+#define BLOB_BUCKETS 4096  // A power of two
+#define FETCH_TIMEOUT 30   // Seconds per download, redirects included
+#define MAX_REDIRECTS 5
+#define RETRY_SECONDS 600  // Before a URL whose download failed is tried again
+#define DOWNLOAD_KEEP_MAX (1024 * 1024) // Bigger download buffers are freed once stored
+#define URL_SIZE sizeof(((Book *)0)->coverImageUrl)
+#define INDEX_LINE_SIZE (64 + 1 + 20 + 1 + COVER_TYPE_SIZE + 1 + URL_SIZE + 2)
+
+typedef enum { URL_QUEUED, URL_STORED, URL_FAILED } url_state;
+
+// A URL that is queued, being fetched, stored or failed. Entries last until
+// cover_store_close. A failed URL is queued again when it is next asked
+// for, once RETRY_SECONDS have passed.
+typedef struct url_entry {
+    struct url_entry *next; // In its bucket
+    uint64_t hash;
+    url_state state;
+    time_t retry_at;        // When failed
+    unsigned char sha[32];
+    size_t size;
+    char content_type[COVER_TYPE_SIZE];
+    char url[];
+} url_entry;
+
+// An open, mapped blob. Being in the hot set holds one reference and every
+// cover handed out another; the last one closes it.
+typedef struct blob {
+    struct blob *next;          // In its bucket, while hot
+    struct blob *newer, *older; // Hot set order
+    unsigned char sha[32];
+    int fd;
+    unsigned char *data;
+    size_t size;
+    int refs;
+} blob;
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+} download;
+
+static struct {
+    int open;
+    char dir[MAX_PATH_LEN - 128]; // Leaves room for file names
+    int index_fd;
+    size_t hot_budget;
+    int allow_private;            // Fetch from loopback, private and link-local addresses
+    int stopping;                 // Read by downloads in progress without the lock
+
+    pthread_mutex_t mutex;        // Guards everything below
+    pthread_cond_t queued;
+    url_entry **urls;
+    size_t url_buckets;           // A power of two
+    size_t url_count;
+    url_entry *queue[QUEUE_SIZE];
+    unsigned queue_head;          // Entries waiting run from queue_head to queue_tail
+    unsigned queue_tail;
+    blob *blobs[BLOB_BUCKETS];
+    blob *newest, *oldest;
+    size_t hot_size;
+
+    pthread_t threads[MAX_WORKERS];
+    unsigned workers;
+} store = {
+    .index_fd = -1,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+};
+
+// SHA-256 (FIPS 180-4) of a whole buffer
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(uint32_t h[8], const unsigned char *p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+static void sha256(const unsigned char *data, size_t len, unsigned char out[32]) {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    size_t full = len / 64 * 64;
+    for (size_t offset = 0; offset < full; offset += 64) {
+        sha256_block(h, data + offset);
+    }
+
+    // The rest, a 1 bit, zeros and the length in bits fill one or two blocks
+    unsigned char tail[128] = {0};
+    size_t rest = len - full;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+    uint64_t bits = (uint64_t)len * 8;
+    for (int i = 0; i < 8; i++) {
+        tail[tail_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+    }
+    for (size_t offset = 0; offset < tail_len; offset += 64) {
+        sha256_block(h, tail + offset);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = (unsigned char)(h[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(h[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(h[i] >> 8);
+        out[4 * i + 3] = (unsigned char)h[i];
+    }
+}
+
+static void sha_to_hex(const unsigned char sha[32], char hex[65]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 32; i++) {
+        hex[2 * i] = digits[sha[i] >> 4];
+        hex[2 * i + 1] = digits[sha[i] & 0xf];
+    }
+    hex[64] = '\0';
+}
+
+static int hex_to_sha(const char *hex, unsigned char sha[32]) {
+    for (int i = 0; i < 64; i++) {
+        char ch = hex[i];
+        int v = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : -1;
+        if (v < 0) {
+            return 0;
+        }
+        sha[i / 2] = (unsigned char)(i % 2 == 0 ? v << 4 : sha[i / 2] | v);
+    }
+    return 1;
+}
+
+static void blob_path(char *path, const unsigned char sha[32]) {
+    char hex[65];
+    sha_to_hex(sha, hex);
+    snprintf(path, MAX_PATH_LEN, "%s/blobs/%s", store.dir, hex);
+}
+
+// The URL map, guarded by store.mutex
+
+// FNV-1a
+static uint64_t hash_url(const char *url) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = (const unsigned char *)url; *p != '\0'; p++) {
+        h = (h ^ *p) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static url_entry* find_url(const char *url, uint64_t hash) {
+    for (url_entry *e = store.urls[hash & (store.url_buckets - 1)]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->url, url) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Doubles the buckets once there are as many entries
+static void grow_urls(void) {
+    size_t buckets = store.url_buckets * 2;
+    url_entry **urls = calloc(buckets, sizeof(url_entry *));
+    if (urls == NULL) {
+        return; // Chains just get longer
+    }
+    for (size_t i = 0; i < store.url_buckets; i++) {
+        url_entry *next;
+        for (url_entry *e = store.urls[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = urls[e->hash & (buckets - 1)];
+            urls[e->hash & (buckets - 1)] = e;
+        }
+    }
+    free(store.urls);
+    store.urls = urls;
+    store.url_buckets = buckets;
+}
+
+static url_entry* add_url(const char *url, uint64_t hash) {
+    size_t len = strlen(url);
+    url_entry *e = calloc(1, sizeof(url_entry) + len + 1);
+    if (e == NULL) {
+        return NULL;
+    }
+    if (store.url_count >= store.url_buckets) {
+        grow_urls();
+    }
+    e->hash = hash;
+    memcpy(e->url, url, len + 1);
+    e->next = store.urls[hash & (store.url_buckets - 1)];
+    store.urls[hash & (store.url_buckets - 1)] = e;
+    store.url_count++;
+    return e;
+}
+
+// Queues url unless it is queued, stored or failed recently, or the queue
+// is full. Returns its entry, or NULL if it has none.
+static url_entry* request_url(const char *url, uint64_t hash) {
+    url_entry *e = find_url(url, hash);
+    if (e != NULL && (e->state != URL_FAILED || time(NULL) < e->retry_at)) {
+        return e;
+    }
+    if (store.queue_tail - store.queue_head == QUEUE_SIZE || store.workers == 0) {
+        return e;
+    }
+    if (e == NULL && (e = add_url(url, hash)) == NULL) {
+        return NULL;
+    }
+    e->state = URL_QUEUED;
+    store.queue[store.queue_tail++ % QUEUE_SIZE] = e;
+    pthread_cond_signal(&store.queued);
+    return e;
+}
+
+// The hot set, guarded by store.mutex
+
+static blob** blob_bucket(const unsigned char sha[32]) {
+    uint32_t h;
+    memcpy(&h, sha, sizeof(h));
+    return &store.blobs[h & (BLOB_BUCKETS - 1)];
+}
+
+static blob* find_blob(const unsigned char sha[32]) {
+    for (blob *b = *blob_bucket(sha); b != NULL; b = b->next) {
+        if (memcmp(b->sha, sha, 32) == 0) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Opens and maps a blob; NULL if it is missing or not the size indexed
+static blob* open_blob(const unsigned char sha[32], size_t size) {
+    char path[MAX_PATH_LEN];
+    blob_path(path, sha);
+    blob *b = calloc(1, sizeof(blob));
+    if (b == NULL) {
+        return NULL;
+    }
+    struct stat st;
+    b->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (b->fd < 0 || fstat(b->fd, &st) != 0 || (unsigned long long)st.st_size != size) {
+        goto fail;
+    }
+    b->data = mmap(NULL, size, PROT_READ, MAP_SHARED, b->fd, 0);
+    if (b->data == MAP_FAILED) {
+        goto fail;
+    }
+    memcpy(b->sha, sha, 32);
+    b->size = size;
+    return b;
+
+fail:
+    if (b->fd >= 0) {
+        close(b->fd);
+    }
+    free(b);
+    return NULL;
+}
+
+static void close_blob(blob *b) {
+    munmap(b->data, b->size);
+    close(b->fd);
+    free(b);
+}
+
+static void unlink_order(blob *b) {
+    if (b->newer != NULL) {
+        b->newer->older = b->older;
+    } else {
+        store.newest = b->older;
+    }
+    if (b->older != NULL) {
+        b->older->newer = b->newer;
+    } else {
+        store.oldest = b->newer;
+    }
+    b->newer = b->older = NULL;
+}
+
+static void link_newest(blob *b) {
+    b->older = store.newest;
+    if (store.newest != NULL) {
+        store.newest->newer = b;
+    } else {
+        store.oldest = b;
+    }
+    store.newest = b;
+}
+
+static void evict(blob *b) {
+    blob **link = blob_bucket(b->sha);
+    while (*link != b) {
+        link = &(*link)->next;
+    }
+    *link = b->next;
+    unlink_order(b);
+    store.hot_size -= b->size;
+    if (--b->refs == 0) {
+        close_blob(b);
+    }
+}
+
+static void make_hot(blob *b) {
+    blob **bucket = blob_bucket(b->sha);
+    b->next = *bucket;
+    *bucket = b;
+    link_newest(b);
+    b->refs = 1;
+    store.hot_size += b->size;
+    while (store.hot_size > store.hot_budget && store.oldest != b) {
+        evict(store.oldest);
+    }
+}
+
+static void touch(blob *b) {
+    if (store.newest != b) {
+        unlink_order(b);
+        link_newest(b);
+    }
+}
+
+// Downloads
+
+static size_t receive_data(char *data, size_t size, size_t count, void *user) {
+    download *d = user;
+    size_t len = size * count;
+    if (len > COVER_MAX_SIZE - d->len) {
+        return 0; // Aborts the transfer
+    }
+    if (d->len + len > d->cap) {
+        size_t cap = d->cap > 0 ? d->cap : 64 * 1024;
+        while (cap < d->len + len) {
+            cap *= 2;
+        }
+        unsigned char *grown = realloc(d->data, cap);
+        if (grown == NULL) {
+            return 0;
+        }
+        d->data = grown;
+        d->cap = cap;
+    }
+    memcpy(d->data + d->len, data, len);
+    d->len += len;
+    return len;
+}
+
+static int check_stopping(void *user, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)user;
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    return __atomic_load_n(&store.stopping, __ATOMIC_RELAXED);
+}
+
+// Whether an IPv4 address (in host order) is one a client must not make
+// the server fetch from: this host, private and shared networks, link-local
+// (cloud metadata services live there), multicast and reserved
+static int private_ipv4(uint32_t a) {
+    return (a >> 24) == 0 || (a >> 24) == 10 || (a >> 24) == 127 || (a >> 22) == (100u << 2 | 1) ||
+           (a >> 16) == (169u << 8 | 254) || (a >> 20) == (172u << 4 | 1) || (a >> 16) == (192u << 8 | 168) ||
+           (a >> 8) == (192u << 16) || (a >> 17) == (198u << 7 | 9) || (a >> 28) >= 14;
+}
+
+static int private_address(const struct sockaddr *addr) {
+    if (addr->sa_family == AF_INET) {
+        return private_ipv4(ntohl(((const struct sockaddr_in *)addr)->sin_addr.s_addr));
+    }
+    if (addr->sa_family != AF_INET6) {
+        return 1;
+    }
+    const unsigned char *b = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+    static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    static const unsigned char zeros[12] = {0};
+    if (memcmp(b, mapped, 12) == 0 || memcmp(b, zeros, 12) == 0) {
+        // IPv4-mapped and -compatible addresses, and :: and ::1
+        return private_ipv4((uint32_t)b[12] << 24 | (uint32_t)b[13] << 16 | (uint32_t)b[14] << 8 | b[15]);
+    }
+    // Unique local fc00::/7, link-local and site-local fe80::/9, multicast ff00::/8
+    return (b[0] & 0xfe) == 0xfc || (b[0] == 0xfe && (b[1] & 0x80) != 0) || b[0] == 0xff;
+}
+
+// Opens every connection curl makes, the first and each redirect's, so
+// the address checked is the one connected to, whatever a name resolved to
+static curl_socket_t open_socket(void *user, curlsocktype purpose, struct curl_sockaddr *address) {
+    (void)user;
+    if (purpose != CURLSOCKTYPE_IPCXN || (!store.allow_private && private_address(&address->addr))) {
+        return CURL_SOCKET_BAD;
+    }
+    return socket(address->family, address->socktype, address->protocol);
+}
+
+// Fetches an image into d, and its media type without parameters into type
+static int fetch(CURL *curl, const char *url, download *d, char type[COVER_TYPE_SIZE]) {
+    d->len = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    if (curl_easy_perform(curl) != CURLE_OK || d->len == 0) {
+        return 0;
+    }
+    char *content_type = NULL;
+    curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+    if (content_type == NULL || strncasecmp(content_type, "image/", 6) != 0) {
+        return 0;
+    }
+    size_t len = 0;
+    while (content_type[len] > ' ' && content_type[len] < 0x7f && content_type[len] != ';') {
+        len++;
+    }
+    if (len >= COVER_TYPE_SIZE) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        type[i] = (char)(content_type[i] >= 'A' && content_type[i] <= 'Z' ? content_type[i] + 32 : content_type[i]);
+    }
+    type[len] = '\0';
+    return 1;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 0;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// Stores the bytes as blobs/<sha>, unless an identical blob is there already
+static int write_blob(const unsigned char sha[32], const unsigned char *data, size_t len) {
+    char path[MAX_PATH_LEN];
+    blob_path(path, sha);
+    struct stat st;
+    if (stat(path, &st) == 0 && (unsigned long long)st.st_size == len) {
+        return 1;
+    }
+    char tmp_path[MAX_PATH_LEN];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/blobs/.tmp-XXXXXX", store.dir);
+    int fd = mkstemp(tmp_path);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = fchmod(fd, 0644) == 0 && write_all(fd, data, len);
+    ok = close(fd) == 0 && ok && rename(tmp_path, path) == 0;
+    if (!ok) {
+        unlink(tmp_path);
+    }
+    return ok;
+}
+
+// Appends a stored entry to the index. A line lost in a crash only means
+// the image is fetched again, so nothing is synced.
+static void append_index(const url_entry *e) {
+    char hex[65];
+    char line[INDEX_LINE_SIZE];
+    sha_to_hex(e->sha, hex);
+    int len = snprintf(line, sizeof(line), "%s %zu %s %s\n", hex, e->size, e->content_type, e->url);
+    if (len > 0 && (size_t)len < sizeof(line)) {
+        write_all(store.index_fd, (const unsigned char *)line, (size_t)len);
+    }
+}
+
+static void* run_worker(void *arg) {
+    (void)arg;
+    download d = {NULL, 0, 0};
+    CURL *curl = curl_easy_init();
+    if (curl != NULL) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, receive_data);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &d);
+        curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, check_stopping);
+        curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(curl, CURLOPT_OPENSOCKETFUNCTION, open_socket);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_MAXREDIRS, (long)MAX_REDIRECTS);
+        curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https");
+        curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS_STR, "http,https");
+        curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(curl, CURLOPT_MAXFILESIZE, (long)COVER_MAX_SIZE);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)FETCH_TIMEOUT);
+        curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(curl, CURLOPT_USERAGENT, "book-api");
+    }
+
+    pthread_mutex_lock(&store.mutex);
+    for (;;) {
+        while (!store.stopping && store.queue_head == store.queue_tail) {
+            pthread_cond_wait(&store.queued, &store.mutex);
+        }
+        if (store.stopping) {
+            break;
+        }
+        // Queued entries stay as they are until their worker is done
+        url_entry *e = store.queue[store.queue_head++ % QUEUE_SIZE];
+        pthread_mutex_unlock(&store.mutex);
+
+        char type[COVER_TYPE_SIZE];
+        unsigned char sha[32];
+        int ok = curl != NULL && fetch(curl, e->url, &d, type);
+        if (ok) {
+            sha256(d.data, d.len, sha);
+            ok = write_blob(sha, d.data, d.len);
+        }
+        if (d.cap > DOWNLOAD_KEEP_MAX) {
+            free(d.data);
+            d.data = NULL;
+            d.cap = 0;
+        }
+
+        pthread_mutex_lock(&store.mutex);
+        if (ok) {
+            memcpy(e->sha, sha, sizeof(sha));
+            e->size = d.len;
+            memcpy(e->content_type, type, sizeof(type));
+            e->state = URL_STORED;
+            append_index(e);
+        } else {
+            e->state = URL_FAILED;
+            e->retry_at = time(NULL) + RETRY_SECONDS;
+        }
+    }
+    pthread_mutex_unlock(&store.mutex);
+
+    free(d.data);
+    if (curl != NULL) {
+        curl_easy_cleanup(curl);
+    }
+    return NULL;
+}
+
+// Startup
+
+// Parses "<sha hex> <size> <type> <url>\n"; returns 0 for a malformed line
+static int parse_index_line(char *line, unsigned char sha[32], size_t *size, char **type, char **url) {
+    size_t len = strlen(line);
+    if (len < 68 || line[len - 1] != '\n' || line[64] != ' ' || !hex_to_sha(line, sha)) {
+        return 0;
+    }
+    line[len - 1] = '\0';
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(line + 65, &end, 10);
+    if (*end != ' ' || errno != 0 || value == 0 || value > COVER_MAX_SIZE) {
+        return 0;
+    }
+    *size = (size_t)value;
+    *type = end + 1;
+    char *space = strchr(*type, ' ');
+    if (space == NULL || space == *type || (size_t)(space - *type) >= COVER_TYPE_SIZE) {
+        return 0;
+    }
+    *space = '\0';
+    *url = space + 1;
+    return strlen(*url) < URL_SIZE && usable_url(*url);
+}
+
+static int load_index(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return errno == ENOENT;
+    }
+    char line[INDEX_LINE_SIZE];
+    int skipping = 0; // In the rest of an overlong line
+    while (fgets(line, sizeof(line), file) != NULL) {
+        int whole = strchr(line, '\n') != NULL;
+        unsigned char sha[32];
+        size_t size;
+        char *type;
+        char *url;
+        if (!skipping && parse_index_line(line, sha, &size, &type, &url)) {
+            // Later lines win
+            uint64_t hash = hash_url(url);
+            url_entry *e = find_url(url, hash);
+            if (e == NULL && (e = add_url(url, hash)) == NULL) {
+                fclose(file);
+                return 0;
+            }
+            e->state = URL_STORED;
+            memcpy(e->sha, sha, sizeof(sha));
+            e->size = size;
+            snprintf(e->content_type, sizeof(e->content_type), "%s", type);
+        }
+        skipping = !whole;
+    }
+    fclose(file);
+    return 1;
+}
+
+// Deletes temporary files a crash left behind
+static void remove_temporary_blobs(void) {
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/blobs", store.dir);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, ".tmp-", 5) != 0) {
+            continue;
+        }
+        // A cut-off path would name some other file
+        int len = snprintf(path, sizeof(path), "%s/blobs/%s", store.dir, entry->d_name);
+        if (len > 0 && (size_t)len < sizeof(path)) {
+            unlink(path);
+        }
+    }
+    closedir(dir);
+}
+
+// Opens the index for appending, ending a line torn by a crash first
+static int open_index(const char *path) {
+    store.index_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (store.index_fd < 0) {
+        return 0;
+    }
+    char last;
+    off_t size = lseek(store.index_fd, 0, SEEK_END);
+    if (size > 0 && pread(store.index_fd, &last, 1, size - 1) == 1 && last != '\n') {
+        return write_all(store.index_fd, (const unsigned char *)"\n", 1);
+    }
+    return size >= 0;
+}
+
+static void free_urls(void) {
+    for (size_t i = 0; i < store.url_buckets; i++) {
+        url_entry *next;
+        for (url_entry *e = store.urls[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+    }
+    free(store.urls);
+    store.urls = NULL;
+    store.url_buckets = 0;
+    store.url_count = 0;
+}
+
+static void stop_workers(void) {
+    pthread_mutex_lock(&store.mutex);
+    __atomic_store_n(&store.stopping, 1, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&store.queued);
+    pthread_mutex_unlock(&store.mutex);
+    for (unsigned i = 0; i < store.workers; i++) {
+        pthread_join(store.threads[i], NULL);
+    }
+    store.workers = 0;
+}
+
+int cover_store_open(const char *dir, unsigned workers, size_t hot_bytes, int allow_private) {
+    if (store.open || strlen(dir) >= sizeof(store.dir) || workers == 0 || workers > MAX_WORKERS) {
+        return 0;
+    }
+    snprintf(store.dir, sizeof(store.dir), "%s", dir);
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/blobs", dir);
+    mkdir(dir, 0755);
+    mkdir(path, 0755);
+    remove_temporary_blobs();
+
+    store.url_buckets = 1024;
+    store.urls = calloc(store.url_buckets, sizeof(url_entry *));
+    snprintf(path, sizeof(path), "%s/covers.idx", dir);
+    if (store.urls == NULL || !load_index(path) || !open_index(path) ||
+        curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        if (store.index_fd >= 0) {
+            close(store.index_fd);
+            store.index_fd = -1;
+        }
+        free_urls();
+        return 0;
+    }
+    store.hot_budget = hot_bytes;
+    store.allow_private = allow_private;
+    store.stopping = 0;
+    store.queue_head = store.queue_tail = 0;
+    for (; store.workers < workers; store.workers++) {
+        if (pthread_create(&store.threads[store.workers], NULL, run_worker, NULL) != 0) {
+            stop_workers();
+            close(store.index_fd);
+            store.index_fd = -1;
+            free_urls();
+            curl_global_cleanup();
+            return 0;
+        }
+    }
+    store.open = 1;
+    return 1;
+}
+
+void cover_store_close(void) {
+    if (!store.open) {
+        return;
+    }
+    stop_workers();
+    pthread_mutex_lock(&store.mutex);
+    while (store.oldest != NULL) {
+        evict(store.oldest);
+    }
+    free_urls();
+    close(store.index_fd);
+    store.index_fd = -1;
+    store.open = 0;
+    pthread_mutex_unlock(&store.mutex);
+    curl_global_cleanup();
+}
+
+void cover_store_ingest(const char *url) {
+    if (!store.open || url == NULL || strlen(url) >= URL_SIZE || !usable_url(url)) {
+        return;
+    }
+    uint64_t hash = hash_url(url);
+    pthread_mutex_lock(&store.mutex);
+    request_url(url, hash);
+    pthread_mutex_unlock(&store.mutex);
+}
+
+// Hands out the stored cover of url, opening its blob if it is not hot.
+// A URL that is not stored is queued, if it may be.
+static int acquire(const char *url, cover *found) {
+    if (!store.open) {
+        return 0;
+    }
+    uint64_t hash = hash_url(url);
+    pthread_mutex_lock(&store.mutex);
+    url_entry *e = request_url(url, hash);
+    if (e == NULL || e->state != URL_STORED) {
+        pthread_mutex_unlock(&store.mutex);
+        return 0;
+    }
+    memcpy(found->content_type, e->content_type, sizeof(found->content_type));
+    blob *b = find_blob(e->sha);
+    if (b == NULL) {
+        unsigned char sha[32];
+        size_t size = e->size;
+        memcpy(sha, e->sha, sizeof(sha));
+        pthread_mutex_unlock(&store.mutex);
+        blob *opened = open_blob(sha, size);
+        pthread_mutex_lock(&store.mutex);
+        if (opened == NULL) {
+            // Lost or damaged: fetch it again, unless another request already did
+            e = find_url(url, hash);
+            if (e != NULL && e->state == URL_STORED && memcmp(e->sha, sha, sizeof(sha)) == 0) {
+                e->state = URL_FAILED;
+                e->retry_at = 0;
+                request_url(url, hash);
+            }
+            pthread_mutex_unlock(&store.mutex);
+            return 0;
+        }
+        b = find_blob(opened->sha);
+        if (b == NULL) {
+            b = opened;
+            make_hot(b);
+        } else {
+            close_blob(opened);
+        }
+    }
+    touch(b);
+    b->refs++;
+    pthread_mutex_unlock(&store.mutex);
+
+    char hex[65];
+    sha_to_hex(b->sha, hex);
+    snprintf(found->etag, sizeof(found->etag), "\"%s\"", hex);
+    found->fd = b->fd;
+    found->data = b->data;
+    found->size = b->size;
+    found->blob = b;
+    return 1;
+}
+
+void cover_release(cover *found) {
+    blob *b = found->blob;
+    pthread_mutex_lock(&store.mutex);
+    if (--b->refs == 0) {
+        close_blob(b);
+    }
+    pthread_mutex_unlock(&store.mutex);
+    found->blob = NULL;
+}
+
+#else
+
+int cover_store_open(const char *dir, unsigned workers, size_t hot_bytes, int allow_private) {
+    (void)dir;
+    (void)workers;
+    (void)hot_bytes;
+    (void)allow_private;
+    return 0;
+}
+
+void cover_store_close(void) {
+}
+
+void cover_store_ingest(const char *url) {
+    (void)url;
+}
+
+static int acquire(const char *url, cover *found) {
+    (void)url;
+    (void)found;
+    return 0;
+}
+
+void cover_release(cover *found) {
+    (void)found;
+}
+
+#endif
+
+cover_lookup find_book_cover(const char *id, Book *book, cover *found) {
+    book_id key;
+    if (!book_id_parse(id, strlen(id), &key) || !get_book_by_id(key, book)) {
+        return COVER_NO_BOOK;
+    }
+    if (!usable_url(book->coverImageUrl)) {
+        return COVER_NO_IMAGE;
+    }
+    return acquire(book->coverImageUrl, found) ? COVER_STORED : COVER_REMOTE;
+}
+
+int cover_etag_matches(const cover *found, const char *if_none_match, size_t len) {
+    if (if_none_match == NULL) {
+        return 0;
+    }
+    while (len > 0 && (*if_none_match == ' ' || *if_none_match == '\t')) {
+        if_none_match++;
+        len--;
+    }
+    if (len >= 1 && *if_none_match == '*') {
+        return 1;
+    }
+    // Any entry of the list, weak or not; the hex ETag cannot match across entries
+    size_t etag_len = strlen(found->etag);
+    for (size_t i = 0; i + etag_len <= len; i++) {
+        if (memcmp(if_none_match + i, found->etag, etag_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,86 @@
+#ifndef COVER_STORE_H
+#define COVER_STORE_H
+
+#include <stddef.h>
+#include "book.h"
+
+// Local copies of cover images behind GET /book/:id/cover, enabled with
+// BOOK_COVER_DIR.
+//
+// Creating or updating a book queues its coverImageUrl for a pool of worker
+// threads that download it with libcurl. Images are stored by the SHA-256
+// of their bytes, so books sharing a cover share one file, and the hash
+// doubles as the ETag. A full queue drops the URL; it is queued again the
+// next time its cover is asked for, which also fills in books that were
+// stored before covers were enabled. A failed download (not an image, too
+// big, unreachable) is retried that way too, ten minutes later at the
+// earliest.
+//
+// On disk, in dir:
+//   blobs/<sha256 hex>        the image, written to a temporary file and renamed
+//   covers.idx                "<sha256 hex> <size> <content type> <url>" per line
+//
+// The index is read at startup and appended to as images arrive. A line
+// whose blob is missing or has the wrong size is dropped when it is first
+// served and the URL fetched again.
+//
+// Recently served blobs stay open and mapped in a hot set, least recently
+// used first out once their total size passes the budget, so serving one
+// takes no open() or stat(). The bytes themselves stay in the page cache
+// and go out with sendfile (libmicrohttpd) or a zero-copy send (io_uring).
+//
+// Only http and https URLs made of printable ASCII are fetched, or
+// redirected to while their image is not stored. Unless allowed at open,
+// downloads never connect to loopback, private, link-local, multicast or
+// reserved addresses, on the first request or after a redirect, so a
+// client cannot have the server fetch from its own network and serve the
+// result back.
+
+#define COVER_MAX_SIZE (8 * 1024 * 1024) // Bigger images are not stored
+#define COVER_TYPE_SIZE 64
+
+// Stored covers may be cached for a day, then revalidated by ETag
+#define COVER_CACHE_CONTROL "public, max-age=86400"
+
+// A stored cover, held open until cover_release
+typedef struct {
+    int fd;                    // The blob, read-only; dup() it to hand it on
+    const unsigned char *data; // The whole blob, mapped read-only
+    size_t size;
+    char content_type[COVER_TYPE_SIZE];
+    char etag[68];             // Quoted hex SHA-256
+    void *blob;                // Private
+} cover;
+
+typedef enum {
+    COVER_NO_BOOK,  // No book has the id
+    COVER_NO_IMAGE, // The book has no usable coverImageUrl
+    COVER_REMOTE,   // Not stored (yet): redirect to book->coverImageUrl
+    COVER_STORED    // Serve *found, then cover_release it
+} cover_lookup;
+
+// Loads the index in dir, creating it if needed, and starts `workers`
+// download threads. Up to hot_bytes of blobs stay open. allow_private lets
+// downloads reach private addresses, for a local image server. Returns 0 if
+// dir cannot be used or the threads cannot start.
+int cover_store_open(const char *dir, unsigned workers, size_t hot_bytes, int allow_private);
+
+// Stops the workers, abandoning queued downloads, and closes every blob
+// that is not being served
+void cover_store_close(void);
+
+// Queues url for download unless it is stored, queued, unusable or covers
+// are disabled. Never blocks on the network.
+void cover_store_ingest(const char *url);
+
+// Finds the cover of the book with the given id (text form), copying the
+// book into *book
+cover_lookup find_book_cover(const char *id, Book *book, cover *found);
+
+void cover_release(cover *found);
+
+// Whether an If-None-Match header value (len bytes, NULL for none) names
+// the cover's ETag
+int cover_etag_matches(const cover *found, const char *if_none_match, size_t len);
+
+#endif
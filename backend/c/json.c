@@ -1,111 +1,395 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <json-c/json.h>
 #include "json.h"
+#include "json_writer.h"
 #include "book.h"
+#include "book_parser.h"
+#include "cover_store.h"
 
-static char* book_to_json_string(Book *book) {
-    struct json_object *jobj = json_object_new_object();
-    json_object_object_add(jobj, "id", json_object_new_string(book->id));
-    json_object_object_add(jobj, "title", json_object_new_string(book->title));
-    json_object_object_add(jobj, "author", json_object_new_string(book->author));
-    json_object_object_add(jobj, "description", json_object_new_string(book->description));
-    json_object_object_add(jobj, "coverImageUrl", json_object_new_string(book->coverImageUrl));
-    
-    const char *json_str = json_object_to_json_string(jobj);
-    char *result = strdup(json_str);
-    json_object_put(jobj);
-    return result;
-}
-
-char* get_all_books_json(void) {
-    int count;
-    Book **book_list = get_all_books(&count);
-    
-    struct json_object *jarray = json_object_new_array();
-    for (int i = 0; i < count; i++) {
-        struct json_object *jobj = json_object_new_object();
-        json_object_object_add(jobj, "id", json_object_new_string(book_list[i]->id));
-        json_object_object_add(jobj, "title", json_object_new_string(book_list[i]->title));
-        json_object_object_add(jobj, "author", json_object_new_string(book_list[i]->author));
-        json_object_object_add(jobj, "description", json_object_new_string(book_list[i]->description));
-        json_object_object_add(jobj, "coverImageUrl", json_object_new_string(book_list[i]->coverImageUrl));
-        json_object_array_add(jarray, jobj);
-    }
-    
-    const char *json_str = json_object_to_json_string(jarray);
-    char *result = strdup(json_str);
-    json_object_put(jarray);
-    free(book_list);
-    return result;
-}
-
-char* get_book_by_id_json(const char *id) {
-    Book *book = get_book_by_id(id);
-    if (book == NULL) {
+// Scratch memory for building a response: from the arena when there is one
+static void* scratch_grow(arena *a, void *ptr, size_t old_size, size_t new_size) {
+    return a != NULL ? arena_grow(a, ptr, old_size, new_size) : realloc(ptr, new_size);
+}
+
+static void scratch_free(arena *a, void *ptr) {
+    if (a == NULL) {
+        free(ptr);
+    }
+}
+
+static char* book_to_json_string(arena *a, const Book *book) {
+    BookView view;
+    book_view_of(book, &view);
+    json_buf buf;
+    json_buf_init_arena(&buf, a);
+    if (!json_buf_append_book(&buf, &view)) {
+        json_buf_free(&buf);
         return NULL;
     }
-    return book_to_json_string(book);
+    return json_buf_release(&buf);
 }
 
-static char* get_json_string_field(struct json_object *jobj, const char *key) {
-    struct json_object *field;
-    if (json_object_object_get_ex(jobj, key, &field)) {
-        const char *value = json_object_get_string(field);
-        return (value != NULL && strlen(value) > 0) ? strdup(value) : NULL;
+char* get_all_books_json(arena *a) {
+    json_buf buf;
+    json_buf_init_arena(&buf, a);
+    int ok = json_buf_reserve(&buf, (size_t)get_book_count() * 512) && json_buf_append_char(&buf, '[');
+    unsigned long long cursor = 0;
+    Book book;
+    for (int i = 0; ok && get_next_book(&cursor, &book); i++) {
+        BookView view;
+        book_view_of(&book, &view);
+        ok = (i == 0 || json_buf_append_char(&buf, ',')) && json_buf_append_book(&buf, &view);
     }
-    return NULL;
+    ok = ok && json_buf_append_char(&buf, ']');
+
+    if (!ok) {
+        json_buf_free(&buf);
+        return NULL;
+    }
+    return json_buf_release(&buf);
 }
 
-char* create_book_json(const char *json_data) {
-    struct json_object *jobj = json_tokener_parse(json_data);
-    if (jobj == NULL) {
+char* get_book_by_id_json(arena *a, const char *id) {
+    book_id key;
+    Book book;
+    if (!book_id_parse(id, strlen(id), &key) || !get_book_by_id(key, &book)) {
         return NULL;
     }
+    return book_to_json_string(a, &book);
+}
+
+char* search_books_json(arena *a, const char *query, int limit) {
+    Book *found = scratch_grow(a, NULL, 0, (limit > 0 ? (size_t)limit : 1) * sizeof(Book));
+    if (found == NULL) {
+        return NULL;
+    }
+    int count = search_books(query, limit, found);
+
+    json_buf buf;
+    json_buf_init_arena(&buf, a);
+    int ok = json_buf_append_char(&buf, '[');
+    for (int i = 0; ok && i < count; i++) {
+        BookView view;
+        book_view_of(&found[i], &view);
+        ok = (i == 0 || json_buf_append_char(&buf, ',')) && json_buf_append_book(&buf, &view);
+    }
+    ok = ok && json_buf_append_char(&buf, ']');
+    scratch_free(a, found);
+
+    if (!ok) {
+        json_buf_free(&buf);
+        return NULL;
+    }
+    return json_buf_release(&buf);
+}
+
+// Returns a parsed field, or NULL if it was absent, null or empty
+static const char* parsed_field(int present, int bit, const char *value) {
+    return (present & bit) && value[0] != '\0' ? value : NULL;
+}
+
+char* create_book_json(arena *a, const char *json_data, int *result) {
+    *result = 0;
+    Book input;
+    int present = parse_book_json(json_data, strlen(json_data), &input);
+    if (present < 0) {
+        return NULL;
+    }
+
+    Book new_book;
+    *result = create_book(parsed_field(present, BOOK_FIELD_TITLE, input.title),
+                          parsed_field(present, BOOK_FIELD_AUTHOR, input.author),
+                          parsed_field(present, BOOK_FIELD_DESCRIPTION, input.description),
+                          parsed_field(present, BOOK_FIELD_COVER_IMAGE_URL, input.coverImageUrl),
+                          &new_book);
+    if (*result == 0) {
+        return NULL;
+    }
+
+    cover_store_ingest(new_book.coverImageUrl);
+    return *result == 1 ? book_to_json_string(a, &new_book) : NULL;
+}
+
+char* update_book_json(arena *a, const char *id, const char *json_data, int *result) {
+    *result = 0;
+    book_id key;
+    if (!book_id_parse(id, strlen(id), &key)) {
+        return NULL;
+    }
+    Book input;
+    int present = parse_book_json(json_data, strlen(json_data), &input);
+    if (present < 0) {
+        return NULL;
+    }
+
+    Book updated_book;
+    *result = update_book(key,
+                          parsed_field(present, BOOK_FIELD_TITLE, input.title),
+                          parsed_field(present, BOOK_FIELD_AUTHOR, input.author),
+                          parsed_field(present, BOOK_FIELD_DESCRIPTION, input.description),
+                          parsed_field(present, BOOK_FIELD_COVER_IMAGE_URL, input.coverImageUrl),
+                          &updated_book);
+    if (*result == 0) {
+        return NULL;
+    }
+
+    cover_store_ingest(updated_book.coverImageUrl);
+    return *result == 1 ? book_to_json_string(a, &updated_book) : NULL;
+}
+
+// Books handed to create_books at a time by a bulk import
+#define BULK_BATCH_SIZE 64
+
+typedef struct {
+    size_t index;
+    const char *message;
+} bulk_error;
+
+typedef struct {
+    bulk_error *items;
+    size_t count;
+    size_t cap;
+    arena *arena;
+} bulk_error_list;
+
+static int add_bulk_error(bulk_error_list *errors, size_t index, const char *message) {
+    if (errors->count == errors->cap) {
+        size_t cap = errors->cap ? errors->cap * 2 : 16;
+        bulk_error *items = scratch_grow(errors->arena, errors->items, errors->cap * sizeof(bulk_error),
+                                         cap * sizeof(bulk_error));
+        if (items == NULL) {
+            return 0;
+        }
+        errors->items = items;
+        errors->cap = cap;
+    }
+    errors->items[errors->count].index = index;
+    errors->items[errors->count].message = message;
+    errors->count++;
+    return 1;
+}
 
-    char *title = get_json_string_field(jobj, "title");
-    char *author = get_json_string_field(jobj, "author");
-    char *description = get_json_string_field(jobj, "description");
-    char *coverImageUrl = get_json_string_field(jobj, "coverImageUrl");
+static int compare_bulk_errors(const void *a, const void *b) {
+    size_t ia = ((const bulk_error *)a)->index;
+    size_t ib = ((const bulk_error *)b)->index;
+    return ia < ib ? -1 : ia > ib;
+}
 
-    Book *new_book = create_book(title, author, description, coverImageUrl);
-    
-    free(title);
-    free(author);
-    free(description);
-    free(coverImageUrl);
-    json_object_put(jobj);
+// Stores a batch of parsed books and records the ones the store refused.
+// Returns 0 if memory runs out or the batch could not be logged.
+static int flush_bulk_batch(Book *batch, const size_t *batch_index, int count,
+                            int *created, bulk_error_list *errors) {
+    int stored[BULK_BATCH_SIZE];
+    int persisted = 1;
+    *created += create_books(batch, count, stored);
+    for (int i = 0; i < count; i++) {
+        if (stored[i]) {
+            cover_store_ingest(batch[i].coverImageUrl);
+            persisted = persisted && stored[i] != BOOK_NOT_PERSISTED;
+        } else if (!add_bulk_error(errors, batch_index[i], "Duplicate id or storage full")) {
+            return 0;
+        }
+    }
+    return persisted;
+}
+
+char* bulk_create_books_json(arena *a, const char *data, size_t len) {
+    Book *batch = scratch_grow(a, NULL, 0, BULK_BATCH_SIZE * sizeof(Book));
+    size_t batch_index[BULK_BATCH_SIZE];
+    int batch_count = 0;
+    int created = 0;
+    bulk_error_list errors = {NULL, 0, 0, a};
+    int ok = batch != NULL;
 
-    if (new_book == NULL) {
+    bulk_reader reader;
+    bulk_reader_init(&reader, data, len);
+    const char *item;
+    size_t item_len;
+    size_t index = 0;
+    for (; ok && bulk_reader_next(&reader, &item, &item_len); index++) {
+        Book *input = &batch[batch_count];
+        int present = parse_book_json(item, item_len, input);
+        if (present < 0) {
+            ok = add_bulk_error(&errors, index, "Invalid JSON");
+            continue;
+        }
+        if (parsed_field(present, BOOK_FIELD_TITLE, input->title) == NULL ||
+            parsed_field(present, BOOK_FIELD_AUTHOR, input->author) == NULL) {
+            ok = add_bulk_error(&errors, index, "Title and author are required");
+            continue;
+        }
+        if (present & BOOK_FIELD_INVALID_ID) {
+            ok = add_bulk_error(&errors, index, "Invalid id");
+            continue;
+        }
+
+        batch_index[batch_count++] = index;
+        if (batch_count == BULK_BATCH_SIZE) {
+            ok = flush_bulk_batch(batch, batch_index, batch_count, &created, &errors);
+            batch_count = 0;
+        }
+    }
+    if (ok && batch_count > 0) {
+        ok = flush_bulk_batch(batch, batch_index, batch_count, &created, &errors);
+    }
+    if (ok && reader.failed) {
+        ok = add_bulk_error(&errors, index, "Malformed bulk body");
+    }
+    scratch_free(a, batch);
+
+    // Refused books are only known once their batch is stored, after later
+    // parse errors were recorded
+    if (errors.count > 1) {
+        qsort(errors.items, errors.count, sizeof(bulk_error), compare_bulk_errors);
+    }
+
+    json_buf buf;
+    json_buf_init_arena(&buf, a);
+    char number[64];
+    if (ok) {
+        snprintf(number, sizeof(number), "{\"created\":%d,\"failed\":%zu,\"errors\":[",
+                 created, errors.count);
+        ok = json_buf_append(&buf, number, strlen(number));
+    }
+    for (size_t i = 0; ok && i < errors.count; i++) {
+        snprintf(number, sizeof(number), "%s{\"index\":%zu,\"error\":",
+                 i > 0 ? "," : "", errors.items[i].index);
+        ok = json_buf_append(&buf, number, strlen(number)) &&
+             json_buf_append_string(&buf, errors.items[i].message) &&
+             json_buf_append_char(&buf, '}');
+    }
+    ok = ok && json_buf_append(&buf, "]}", 2);
+    scratch_free(a, errors.items);
+
+    if (!ok) {
+        json_buf_free(&buf);
         return NULL;
     }
+    return json_buf_release(&buf);
+}
+
+struct book_list_stream {
+    arena *arena;              // Owns the stream, or NULL if it was malloc()ed
+    unsigned long long cursor; // Last book written
+    unsigned long long last;   // Last book of the page when limited
+    int limited;
+    int ndjson;                // One object per line instead of an array
+    int started;
+    int finished;
+    int failed;                // Memory ran out; nothing more is written
+    int items;                 // Books written so far
+    json_buf pending;          // Bytes not yet handed out, reused per book
+    size_t pending_off;
+    Book book;                 // Copy of the book being written
+};
 
-    return book_to_json_string(new_book);
+static book_list_stream* new_stream(arena *a) {
+    book_list_stream *stream = scratch_grow(a, NULL, 0, sizeof(book_list_stream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    memset(stream, 0, sizeof(*stream));
+    stream->arena = a;
+    json_buf_init_arena(&stream->pending, a);
+    return stream;
 }
 
-char* update_book_json(const char *id, const char *json_data) {
-    struct json_object *jobj = json_tokener_parse(json_data);
-    if (jobj == NULL) {
+book_list_stream* book_list_stream_new(arena *a, unsigned long long cursor, int limit,
+                                       unsigned long long *next_cursor) {
+    book_list_stream *stream = new_stream(a);
+    if (stream == NULL) {
         return NULL;
     }
+    stream->cursor = cursor;
+    *next_cursor = 0;
 
-    char *title = get_json_string_field(jobj, "title");
-    char *author = get_json_string_field(jobj, "author");
-    char *description = get_json_string_field(jobj, "description");
-    char *coverImageUrl = get_json_string_field(jobj, "coverImageUrl");
+    // Fix the end of the page up front so the cursor handed back in the
+    // response headers matches what the body ends up containing
+    if (limit > 0) {
+        unsigned long long c = cursor;
+        for (int i = 0; i < limit && get_next_book(&c, NULL); i++) {
+        }
+        stream->limited = 1;
+        stream->last = c;
 
-    Book *updated_book = update_book(id, title, author, description, coverImageUrl);
-    
-    free(title);
-    free(author);
-    free(description);
-    free(coverImageUrl);
-    json_object_put(jobj);
+        unsigned long long probe = c;
+        if (get_next_book(&probe, NULL)) {
+            *next_cursor = c;
+        }
+    }
+    return stream;
+}
 
-    if (updated_book == NULL) {
+book_list_stream* book_export_stream_new(arena *a) {
+    book_list_stream *stream = new_stream(a);
+    if (stream == NULL) {
         return NULL;
     }
+    stream->ndjson = 1;
+    stream->started = 1;
+    return stream;
+}
+
+// Notes whether queueing a piece of the body worked
+static int queued(book_list_stream *stream, int ok) {
+    stream->failed = !ok;
+    return ok;
+}
+
+// Queues the next piece of the body; returns 0 when nothing is left or, with
+// failed set, when memory runs out
+static int refill(book_list_stream *stream) {
+    json_buf_reset(&stream->pending);
+    stream->pending_off = 0;
+
+    if (!stream->started) {
+        stream->started = 1;
+        return queued(stream, json_buf_append_char(&stream->pending, '['));
+    }
+    if (stream->finished) {
+        return 0;
+    }
+
+    unsigned long long c = stream->cursor;
+    if (!get_next_book(&c, &stream->book) || (stream->limited && c > stream->last)) {
+        stream->finished = 1;
+        return !stream->ndjson && queued(stream, json_buf_append_char(&stream->pending, ']'));
+    }
+
+    stream->cursor = c;
+    BookView view;
+    book_view_of(&stream->book, &view);
+    if (stream->ndjson) {
+        return queued(stream, json_buf_append_book(&stream->pending, &view) &&
+                                  json_buf_append_char(&stream->pending, '\n'));
+    }
+    return queued(stream, (stream->items++ == 0 || json_buf_append_char(&stream->pending, ',')) &&
+                              json_buf_append_book(&stream->pending, &view));
+}
 
-    return book_to_json_string(updated_book);
+size_t book_list_stream_read(book_list_stream *stream, char *buf, size_t max) {
+    size_t written = 0;
+    while (written < max && !stream->failed) {
+        if (stream->pending_off == stream->pending.len && !refill(stream)) {
+            break;
+        }
+        size_t chunk = stream->pending.len - stream->pending_off;
+        if (chunk > max - written) {
+            chunk = max - written;
+        }
+        memcpy(buf + written, stream->pending.data + stream->pending_off, chunk);
+        stream->pending_off += chunk;
+        written += chunk;
+    }
+    // What was copied goes out before the failure is reported
+    return written == 0 && stream->failed ? BOOK_LIST_FAILED : written;
+}
+
+void book_list_stream_free(book_list_stream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    json_buf_free(&stream->pending);
+    scratch_free(stream->arena, stream);
 }
@@ -1,12 +1,56 @@
 #ifndef JSON_H
 #define JSON_H
 
+#include <stddef.h>
+#include "arena.h"
 #include "book.h"
 
-// JSON serialization and deserialization
-char* get_all_books_json(void);
-char* get_book_by_id_json(const char *id);
-char* create_book_json(const char *json_data);
-char* update_book_json(const char *id, const char *json_data);
+// JSON serialization and deserialization. Each function builds its result,
+// and any scratch space it needs, in the arena a, where it stays until the
+// arena is reset; with a NULL arena the result is malloc()ed instead (free()
+// it). NULL means the book is missing or invalid, or memory ran out.
+char* get_all_books_json(arena *a);
+char* get_book_by_id_json(arena *a, const char *id);
+
+// As above, also setting *result to what create_book or update_book returned
+// (0 if the body is invalid), which tells a refused change from one the store
+// made but could not log (BOOK_NOT_PERSISTED, with a NULL result)
+char* create_book_json(arena *a, const char *json_data, int *result);
+char* update_book_json(arena *a, const char *id, const char *json_data, int *result);
+
+// JSON array of the best limit matches for a GET /book/search query
+char* search_books_json(arena *a, const char *query, int limit);
+
+// Imports a JSON array or NDJSON body of books (see bulk_reader) and returns
+// {"created":N,"failed":M,"errors":[{"index":i,"error":"..."}]}. Books
+// that carry an id, which must be a UUID, keep it. Returns NULL if memory
+// runs out or, with persistence enabled, books were stored but could not be
+// logged; the import stops there.
+char* bulk_create_books_json(arena *a, const char *data, size_t len);
+
+// Streams the GET /book array one book at a time, so memory per request
+// stays constant however large the shelf is
+typedef struct book_list_stream book_list_stream;
+
+// Starts a stream of up to `limit` books after `cursor` (limit <= 0 streams
+// all of them). *next_cursor is set to the cursor of the following page, or
+// 0 if the page reaches the end. A stream built in an arena lives there and
+// needs no book_list_stream_free.
+book_list_stream* book_list_stream_new(arena *a, unsigned long long cursor, int limit,
+                                       unsigned long long *next_cursor);
+
+// Starts a stream of every book as NDJSON, one object per line, for
+// GET /book/_export
+book_list_stream* book_export_stream_new(arena *a);
+
+// Returned by book_list_stream_read once memory ran out before the end, so
+// the body must not be passed off as complete
+#define BOOK_LIST_FAILED ((size_t)-1)
+
+// Copies up to max bytes of the array into buf. Returns 0 once it is done,
+// or BOOK_LIST_FAILED.
+size_t book_list_stream_read(book_list_stream *stream, char *buf, size_t max);
+
+void book_list_stream_free(book_list_stream *stream);
 
 #endif
@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <string.h>
+#include "json_writer.h"
+
+// Non-zero for bytes that cannot appear unescaped inside a JSON string
+static const unsigned char needs_escape[256] = {
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // '"'
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, // '\\'
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+void json_buf_init(json_buf *buf) {
+    json_buf_init_arena(buf, NULL);
+}
+
+void json_buf_init_arena(json_buf *buf, arena *a) {
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+    buf->arena = a;
+}
+
+void json_buf_free(json_buf *buf) {
+    if (buf->arena == NULL) {
+        free(buf->data);
+    }
+    json_buf_init_arena(buf, buf->arena);
+}
+
+void json_buf_reset(json_buf *buf) {
+    buf->len = 0;
+    if (buf->data != NULL) {
+        buf->data[0] = '\0';
+    }
+}
+
+char* json_buf_release(json_buf *buf) {
+    if (buf->data == NULL && !json_buf_reserve(buf, 0)) {
+        return NULL;
+    }
+    char *data = buf->data;
+    json_buf_init_arena(buf, buf->arena);
+    return data;
+}
+
+int json_buf_reserve(json_buf *buf, size_t extra) {
+    size_t needed = buf->len + extra + 1;
+    if (needed <= buf->cap) {
+        return 1;
+    }
+
+    size_t cap = buf->cap > 0 ? buf->cap : 256;
+    while (cap < needed) {
+        cap *= 2;
+    }
+    char *data = buf->arena != NULL ? arena_grow(buf->arena, buf->data, buf->cap, cap) : realloc(buf->data, cap);
+    if (data == NULL) {
+        return 0;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 1;
+}
+
+int json_buf_append(json_buf *buf, const char *data, size_t len) {
+    if (!json_buf_reserve(buf, len)) {
+        return 0;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return 1;
+}
+
+int json_buf_append_char(json_buf *buf, char c) {
+    return json_buf_append(buf, &c, 1);
+}
+
+// Appends str escaped, without quotes
+static int append_escaped(json_buf *buf, const char *str) {
+    size_t len = strlen(str);
+
+    // Fast path: most titles and names need no escaping at all
+    size_t clean = 0;
+    while (clean < len && !needs_escape[(unsigned char)str[clean]]) {
+        clean++;
+    }
+    if (clean == len) {
+        return json_buf_append(buf, str, len);
+    }
+
+    // Worst case every remaining byte becomes a six byte \u00XX escape
+    if (!json_buf_reserve(buf, clean + (len - clean) * 6)) {
+        return 0;
+    }
+    char *out = buf->data + buf->len;
+    memcpy(out, str, clean);
+    out += clean;
+
+    for (size_t i = clean; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (!needs_escape[c]) {
+            *out++ = (char)c;
+            continue;
+        }
+        *out++ = '\\';
+        switch (c) {
+        case '"':  *out++ = '"'; break;
+        case '\\': *out++ = '\\'; break;
+        case '\b': *out++ = 'b'; break;
+        case '\f': *out++ = 'f'; break;
+        case '\n': *out++ = 'n'; break;
+        case '\r': *out++ = 'r'; break;
+        case '\t': *out++ = 't'; break;
+        default:
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex_digits[c >> 4];
+            *out++ = hex_digits[c & 0xf];
+            break;
+        }
+    }
+
+    buf->len = (size_t)(out - buf->data);
+    buf->data[buf->len] = '\0';
+    return 1;
+}
+
+int json_buf_append_string(json_buf *buf, const char *str) {
+    size_t start = buf->len;
+    if (!json_buf_append_char(buf, '"')) {
+        return 0;
+    }
+    if (append_escaped(buf, str) && json_buf_append_char(buf, '"')) {
+        return 1;
+    }
+    buf->len = start;
+    buf->data[start] = '\0';
+    return 0;
+}
+
+// Appends a literal key such as "\"id\":" without strlen
+#define APPEND_LITERAL(buf, lit) json_buf_append((buf), (lit), sizeof(lit) - 1)
+
+int json_buf_append_book(json_buf *buf, const BookView *book) {
+    // The fields are bounded, so one reservation covers the common case
+    size_t start = buf->len;
+    if (!json_buf_reserve(buf, sizeof(Book) + BOOK_ID_TEXT_SIZE + 96)) {
+        return 0;
+    }
+    // Hex and dashes need no escaping
+    char id[BOOK_ID_TEXT_SIZE];
+    book_id_format(book->id, id);
+    int ok = APPEND_LITERAL(buf, "{\"id\":\"") &&
+           json_buf_append(buf, id, BOOK_ID_TEXT_SIZE - 1) &&
+           APPEND_LITERAL(buf, "\",\"title\":") &&
+           json_buf_append_string(buf, book->title) &&
+           APPEND_LITERAL(buf, ",\"author\":") &&
+           json_buf_append_string(buf, book->author) &&
+           APPEND_LITERAL(buf, ",\"description\":") &&
+           json_buf_append_string(buf, book->description) &&
+           APPEND_LITERAL(buf, ",\"coverImageUrl\":") &&
+           json_buf_append_char(buf, '"') &&
+           append_escaped(buf, book->cover_base) &&
+           append_escaped(buf, book->cover_name) &&
+           APPEND_LITERAL(buf, "\"}");
+    if (!ok) {
+        buf->len = start;
+        buf->data[start] = '\0';
+    }
+    return ok;
+}
@@ -0,0 +1,43 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <stddef.h>
+#include "arena.h"
+#include "book.h"
+
+// Growable output buffer for hand-written JSON. Reset and reuse it across
+// books and requests so serialization stops allocating once it has grown to
+// the largest body it has seen. data is always NUL-terminated.
+//
+// A buffer can instead take its memory from an arena, which owns it: freeing
+// or releasing the buffer then leaves the bytes in the arena until it is
+// reset.
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    arena *arena; // NULL for malloc
+} json_buf;
+
+void json_buf_init(json_buf *buf);
+void json_buf_init_arena(json_buf *buf, arena *a);
+void json_buf_free(json_buf *buf);
+
+// Empties the buffer but keeps its memory
+void json_buf_reset(json_buf *buf);
+
+// Hands the contents to the caller (free() them) and empties the buffer
+char* json_buf_release(json_buf *buf);
+
+// Each returns 0 if memory runs out, leaving the buffer unchanged
+int json_buf_reserve(json_buf *buf, size_t extra);
+int json_buf_append(json_buf *buf, const char *data, size_t len);
+int json_buf_append_char(json_buf *buf, char c);
+
+// Appends a quoted, escaped JSON string
+int json_buf_append_string(json_buf *buf, const char *str);
+
+// Appends a stored book as a JSON object
+int json_buf_append_book(json_buf *buf, const BookView *book);
+
+#endif
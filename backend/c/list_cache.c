@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "book.h"
+#include "json.h"
+#include "list_cache.h"
+
+#define BUILD_STEP (64 * 1024)
+
+typedef struct list_entry list_entry;
+
+// One per encoding
+typedef struct {
+    pthread_mutex_t build; // Held while compressing, so only one thread does
+    pthread_mutex_t mutex; // Guards current and every refs
+    list_entry *current;
+} list_slot;
+
+struct list_entry {
+    cached_list list; // First, so a cached_list* is its entry
+    list_slot *slot;
+    unsigned refs;    // The cache's and each response's
+    char data[];
+};
+
+static list_slot slots[2] = {
+    {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL},
+    {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, NULL}
+};
+
+typedef struct {
+    book_list_stream *stream;
+    size_t bytes;
+} counting_source;
+
+static size_t read_counted(void *cls, char *buf, size_t max) {
+    counting_source *source = cls;
+    size_t n = book_list_stream_read(source->stream, buf, max);
+    if (n == BOOK_LIST_FAILED) {
+        return COMPRESS_FAILED;
+    }
+    source->bytes += n;
+    return n;
+}
+
+// The current entry with a reference taken, if it was built at version
+static list_entry* take_current(list_slot *slot, unsigned long long version) {
+    pthread_mutex_lock(&slot->mutex);
+    list_entry *entry = slot->current;
+    if (entry != NULL && entry->list.version == version) {
+        entry->refs++;
+    } else {
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&slot->mutex);
+    return entry;
+}
+
+static list_entry* build(list_slot *slot, content_encoding encoding, unsigned long long version) {
+    unsigned long long next_cursor;
+    counting_source source = {book_list_stream_new(NULL, 0, 0, &next_cursor), 0};
+    if (source.stream == NULL) {
+        return NULL;
+    }
+    compress_stream *compressed = compress_stream_new(NULL, encoding, COMPRESS_SMALL, read_counted, &source);
+    if (compressed == NULL) {
+        book_list_stream_free(source.stream);
+        return NULL;
+    }
+
+    // The entry grows in place, the compressed bytes after its header
+    size_t size = 0;
+    size_t capacity = BUILD_STEP;
+    list_entry *entry = malloc(sizeof(list_entry) + capacity);
+    for (;;) {
+        if (entry == NULL) {
+            break;
+        }
+        size_t n = compress_stream_read(compressed, entry->data + size, capacity - size);
+        if (n == COMPRESS_FAILED) {
+            // A cut-off list must not be cached
+            free(entry);
+            entry = NULL;
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        size += n;
+        if (size == capacity) {
+            capacity *= 2;
+            list_entry *grown = realloc(entry, sizeof(list_entry) + capacity);
+            if (grown == NULL) {
+                free(entry);
+            }
+            entry = grown;
+        }
+    }
+    compress_stream_free(compressed);
+    book_list_stream_free(source.stream);
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    list_entry *shrunk = realloc(entry, sizeof(list_entry) + size);
+    if (shrunk != NULL) {
+        entry = shrunk;
+    }
+    entry->list.data = entry->data;
+    entry->list.size = size;
+    entry->list.json_size = source.bytes;
+    entry->list.version = version;
+    entry->slot = slot;
+    entry->refs = 1;
+    return entry;
+}
+
+// Drops a reference with the slot mutex held; the last one frees the entry
+static void release_locked(list_entry *entry) {
+    if (--entry->refs == 0) {
+        free(entry);
+    }
+}
+
+const cached_list* cached_list_get(content_encoding encoding) {
+    list_slot *slot = &slots[encoding == ENCODING_ZSTD];
+    list_entry *entry = take_current(slot, get_book_store_version());
+    if (entry != NULL) {
+        return &entry->list;
+    }
+
+    pthread_mutex_lock(&slot->build);
+    // Read before the books, so a write made while building leaves the
+    // entry stale rather than wrongly current
+    unsigned long long version = get_book_store_version();
+    entry = take_current(slot, version); // Another thread may have built it
+    if (entry == NULL) {
+        entry = build(slot, encoding, version);
+        if (entry != NULL) {
+            pthread_mutex_lock(&slot->mutex);
+            if (slot->current != NULL) {
+                release_locked(slot->current);
+            }
+            slot->current = entry;
+            entry->refs++;
+            pthread_mutex_unlock(&slot->mutex);
+        }
+    }
+    pthread_mutex_unlock(&slot->build);
+    return entry != NULL ? &entry->list : NULL;
+}
+
+void cached_list_release(const cached_list *list) {
+    if (list == NULL) {
+        return;
+    }
+    list_entry *entry = (list_entry *)list;
+    list_slot *slot = entry->slot;
+    pthread_mutex_lock(&slot->mutex);
+    release_locked(entry);
+    pthread_mutex_unlock(&slot->mutex);
+}
+
+void list_cache_clear(void) {
+    for (size_t i = 0; i < sizeof(slots) / sizeof(slots[0]); i++) {
+        pthread_mutex_lock(&slots[i].mutex);
+        if (slots[i].current != NULL) {
+            release_locked(slots[i].current);
+            slots[i].current = NULL;
+        }
+        pthread_mutex_unlock(&slots[i].mutex);
+    }
+}
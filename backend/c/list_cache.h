@@ -0,0 +1,31 @@
+#ifndef LIST_CACHE_H
+#define LIST_CACHE_H
+
+#include <stddef.h>
+#include "compress.h"
+
+// The whole GET /book array, compressed once per store version.
+//
+// Compressing the full shelf costs far more than sending it, so the first
+// request for it in an encoding after a write compresses it at
+// COMPRESS_SMALL, other requests for that encoding waiting meanwhile, and
+// later requests send those bytes until the store changes again. A copy a
+// response is still sending outlives its replacement until released.
+
+typedef struct {
+    const char *data;           // The compressed array
+    size_t size;
+    size_t json_size;           // Size of the array before compression
+    unsigned long long version; // The get_book_store_version() it was built at
+} cached_list;
+
+// The array compressed with encoding (not ENCODING_IDENTITY) for the current
+// store version, held until cached_list_release. NULL if memory runs out.
+const cached_list* cached_list_get(content_encoding encoding);
+
+void cached_list_release(const cached_list *list);
+
+// Drops the cached copies; those still being sent go when released
+void list_cache_clear(void);
+
+#endif
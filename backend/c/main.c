@@ -1,192 +1,771 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <microhttpd.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <unistd.h>
+#endif
+#include "arena.h"
 #include "book.h"
+#include "book_log.h"
+#include "compress.h"
+#include "cover_store.h"
 #include "json.h"
+#include "list_cache.h"
+#include "uring_server.h"
 
 #define PORT 3000
 #define POSTBUFFERSIZE 4096
+#define STREAM_BLOCK_SIZE (32 * 1024)
+#define DEFAULT_SNAPSHOT_EVERY 100000
+#define DEFAULT_SEARCH_LIMIT 20
+#define MAX_SEARCH_LIMIT 100
+#define MAX_HTTP_THREADS 1024
+#define DEFAULT_COVER_WORKERS 2
+#define DEFAULT_COVER_HOT_MB 64
+#define MAX_COVER_WORKERS 64
+#define RESERVED_FDS 64 // Kept free of connections for the store, log and listening sockets
 
+// One per connection, kept across its keep-alive requests. Everything a
+// request allocates comes from memory, which is reset once its response has
+// been sent, so a connection stops allocating after its first few requests.
 struct connection_info {
-    char *data;
+    arena memory;
+    char *data; // Request body, in memory
     size_t size;
+    size_t cap;
 };
 
+// Responses whose bodies never change, built once at startup and queued
+// as often as needed
+static struct {
+    struct MHD_Response *empty;          // CORS preflight and deletes
+    struct MHD_Response *no_data;
+    struct MHD_Response *title_and_author;
+    struct MHD_Response *invalid_page;
+    struct MHD_Response *invalid_search;
+    struct MHD_Response *route_not_found;
+    struct MHD_Response *no_cover;
+    struct MHD_Response *internal_error;
+} constant;
+
+static void add_cors_headers(struct MHD_Response *response)
+{
+    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
+    MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE");
+    MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type");
+}
+
+static struct MHD_Response *constant_response(const char *body)
+{
+    struct MHD_Response *response = MHD_create_response_from_buffer(strlen(body), (void *)body,
+                                                                    MHD_RESPMEM_PERSISTENT);
+    if (response != NULL) {
+        if (*body != '\0') {
+            MHD_add_response_header(response, "Content-Type", "application/json");
+        }
+        add_cors_headers(response);
+    }
+    return response;
+}
+
+static int build_constant_responses(void)
+{
+    constant.empty = constant_response("");
+    constant.no_data = constant_response("{\"error\":\"No data provided\"}");
+    constant.title_and_author = constant_response("{\"error\":\"Title and author are required\"}");
+    constant.invalid_page = constant_response("{\"error\":\"Invalid limit or cursor\"}");
+    constant.invalid_search = constant_response("{\"error\":\"Missing q or invalid limit\"}");
+    constant.route_not_found = constant_response("{\"error\":\"Route not found\"}");
+    constant.no_cover = constant_response("{\"error\":\"Book has no cover image\"}");
+    constant.internal_error = constant_response("{\"error\":\"Internal server error\"}");
+    return constant.empty != NULL && constant.no_data != NULL && constant.title_and_author != NULL &&
+           constant.invalid_page != NULL && constant.invalid_search != NULL &&
+           constant.route_not_found != NULL && constant.no_cover != NULL && constant.internal_error != NULL;
+}
+
+static void destroy_constant_responses(void)
+{
+    struct MHD_Response *all[] = {constant.empty, constant.no_data, constant.title_and_author,
+                                  constant.invalid_page, constant.invalid_search,
+                                  constant.route_not_found, constant.no_cover, constant.internal_error};
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (all[i] != NULL) {
+            MHD_destroy_response(all[i]);
+        }
+    }
+}
+
+// The content coding the request's Accept-Encoding asks for
+static content_encoding accepted_encoding(struct MHD_Connection *connection)
+{
+    const char *accept = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                     MHD_HTTP_HEADER_ACCEPT_ENCODING);
+    return negotiate_encoding(accept, accept != NULL ? strlen(accept) : 0);
+}
+
+// Marks a response whose body depends on Accept-Encoding, and its coding
+static void add_encoding_headers(struct MHD_Response *response, content_encoding encoding)
+{
+    MHD_add_response_header(response, "Vary", "Accept-Encoding");
+    if (encoding != ENCODING_IDENTITY) {
+        MHD_add_response_header(response, "Content-Encoding", encoding_name(encoding));
+    }
+}
+
+// Sends a JSON body that lives in the connection's arena; MHD_RESPMEM_PERSISTENT
+// holds, as the arena is only reset once the response has been sent. Bodies
+// of COMPRESS_MIN_SIZE and up are compressed, into the arena too, if the
+// client accepts it.
+static enum MHD_Result send_json(struct MHD_Connection *connection, arena *memory, unsigned int status,
+                                 const char *body)
+{
+    size_t size = strlen(body);
+    int compressible = size >= COMPRESS_MIN_SIZE;
+    content_encoding encoding = compressible ? accepted_encoding(connection) : ENCODING_IDENTITY;
+    if (encoding != ENCODING_IDENTITY) {
+        size_t compressed_size;
+        char *compressed = compress_buffer(memory, encoding, COMPRESS_FAST, body, size, &compressed_size);
+        if (compressed != NULL) {
+            body = compressed;
+            size = compressed_size;
+        } else {
+            encoding = ENCODING_IDENTITY;
+        }
+    }
+
+    struct MHD_Response *response = MHD_create_response_from_buffer(size, (void *)body,
+                                                                    MHD_RESPMEM_PERSISTENT);
+    if (response == NULL) {
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    add_cors_headers(response);
+    if (compressible) {
+        add_encoding_headers(response, encoding);
+    }
+    enum MHD_Result ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+static enum MHD_Result send_not_found(struct MHD_Connection *connection, arena *memory, const char *id)
+{
+    char *body = arena_alloc(memory, 256);
+    if (body == NULL) {
+        return MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, constant.internal_error);
+    }
+    snprintf(body, 256, "{\"error\":\"Book with ID %s not found\"}", id);
+    return send_json(connection, memory, MHD_HTTP_NOT_FOUND, body);
+}
+
+static ssize_t read_book_list(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    (void)pos;
+    size_t written = book_list_stream_read(cls, buf, max);
+    if (written == BOOK_LIST_FAILED) {
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    return written == 0 ? MHD_CONTENT_READER_END_OF_STREAM : (ssize_t)written;
+}
+
+static size_t read_list_source(void *cls, char *buf, size_t max)
+{
+    size_t written = book_list_stream_read(cls, buf, max);
+    return written == BOOK_LIST_FAILED ? COMPRESS_FAILED : written;
+}
+
+static ssize_t read_compressed(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    (void)pos;
+    size_t written = compress_stream_read(cls, buf, max);
+    if (written == COMPRESS_FAILED) {
+        return MHD_CONTENT_READER_END_WITH_ERROR;
+    }
+    return written == 0 ? MHD_CONTENT_READER_END_OF_STREAM : (ssize_t)written;
+}
+
+static void free_compressed(void *cls)
+{
+    compress_stream_free(cls);
+}
+
+static ssize_t read_cached_list(void *cls, uint64_t pos, char *buf, size_t max)
+{
+    const cached_list *list = cls;
+    size_t left = list->size - (size_t)pos;
+    size_t written = left < max ? left : max;
+    memcpy(buf, list->data + pos, written);
+    return written == 0 ? MHD_CONTENT_READER_END_OF_STREAM : (ssize_t)written;
+}
+
+static void release_cached_list(void *cls)
+{
+    cached_list_release(cls);
+}
+
+// A response streaming a list or export in encoding. Compressed, the size
+// of a body is unknown up front, so it is compressed whenever the client
+// accepts it. The compressor is malloc()ed: libmicrohttpd frees a response
+// after the request's arena has been reset.
+static struct MHD_Response *list_stream_response(book_list_stream *stream, content_encoding encoding)
+{
+    if (encoding == ENCODING_IDENTITY) {
+        return MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, STREAM_BLOCK_SIZE,
+                                                 &read_book_list, stream, NULL);
+    }
+    compress_stream *compressed = compress_stream_new(NULL, encoding, COMPRESS_FAST, read_list_source, stream);
+    if (compressed == NULL) {
+        return NULL;
+    }
+    struct MHD_Response *response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, STREAM_BLOCK_SIZE,
+                                                                      &read_compressed, compressed,
+                                                                      &free_compressed);
+    if (response == NULL) {
+        compress_stream_free(compressed);
+    }
+    return response;
+}
+
+// Parses an optional non-negative integer query argument; returns 0 if it is malformed
+static int get_uint_argument(struct MHD_Connection *connection, const char *key,
+                             unsigned long long *value)
+{
+    const char *text = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, key);
+    if (text == NULL) {
+        return 1;
+    }
+    char *end;
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    return *text != '\0' && *text != '-' && *end == '\0' && errno == 0;
+}
+
+// Sends the whole GET /book array from its compressed copy (see
+// list_cache.h), which the response releases once sent
+static enum MHD_Result send_cached_list(struct MHD_Connection *connection, const cached_list *list,
+                                        content_encoding encoding)
+{
+    struct MHD_Response *response = MHD_create_response_from_callback(list->size, STREAM_BLOCK_SIZE,
+                                                                      &read_cached_list, (void *)list,
+                                                                      &release_cached_list);
+    if (response == NULL) {
+        cached_list_release(list);
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    add_cors_headers(response);
+    add_encoding_headers(response, encoding);
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Streams GET /book[?limit=N&cursor=X] as a chunked JSON array, compressed
+// if the client accepts it
+static enum MHD_Result send_book_list(struct MHD_Connection *connection, arena *memory)
+{
+    unsigned long long limit = 0;
+    unsigned long long cursor = 0;
+    unsigned long long next_cursor;
+    struct MHD_Response *response;
+    enum MHD_Result ret;
+
+    if (!get_uint_argument(connection, "limit", &limit) ||
+        !get_uint_argument(connection, "cursor", &cursor) || limit > INT_MAX) {
+        return MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, constant.invalid_page);
+    }
+
+    content_encoding encoding = accepted_encoding(connection);
+    if (encoding != ENCODING_IDENTITY && limit == 0 && cursor == 0) {
+        const cached_list *list = cached_list_get(encoding);
+        if (list != NULL && list->json_size >= COMPRESS_MIN_SIZE) {
+            return send_cached_list(connection, list, encoding);
+        }
+        // Too small to be worth compressing, or out of memory
+        cached_list_release(list);
+        encoding = ENCODING_IDENTITY;
+    }
+
+    // The stream lives in the arena, so there is nothing to free
+    book_list_stream *stream = book_list_stream_new(memory, cursor, (int)limit, &next_cursor);
+    if (stream == NULL) {
+        return MHD_NO;
+    }
+
+    response = list_stream_response(stream, encoding);
+    if (response == NULL) {
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", "application/json");
+    add_cors_headers(response);
+    add_encoding_headers(response, encoding);
+    if (next_cursor != 0) {
+        char header[32];
+        snprintf(header, sizeof(header), "%llu", next_cursor);
+        MHD_add_response_header(response, "X-Next-Cursor", header);
+        MHD_add_response_header(response, "Access-Control-Expose-Headers", "X-Next-Cursor");
+    }
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Streams GET /book/_export as NDJSON, compressed if the client accepts it
+static enum MHD_Result send_book_export(struct MHD_Connection *connection, arena *memory)
+{
+    book_list_stream *stream = book_export_stream_new(memory);
+    if (stream == NULL) {
+        return MHD_NO;
+    }
+
+    content_encoding encoding = accepted_encoding(connection);
+    struct MHD_Response *response = list_stream_response(stream, encoding);
+    if (response == NULL) {
+        return MHD_NO;
+    }
+    MHD_add_response_header(response, "Content-Type", "application/x-ndjson");
+    add_cors_headers(response);
+    add_encoding_headers(response, encoding);
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Whether url, which starts with /book/, is /book/:id/cover
+static int is_cover_path(const char *url)
+{
+    size_t len = strlen(url);
+    return len > 6 + strlen("/cover") && strcmp(url + len - strlen("/cover"), "/cover") == 0;
+}
+
+// Serves GET /book/:id/cover. A stored cover goes out from its blob with
+// sendfile; one that is not stored yet redirects to the original image.
+static enum MHD_Result send_cover(struct MHD_Connection *connection, arena *memory, const char *id)
+{
+    Book *book = arena_alloc(memory, sizeof(Book));
+    if (book == NULL) {
+        return MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, constant.internal_error);
+    }
+    cover found;
+    cover_lookup lookup = find_book_cover(id, book, &found);
+    if (lookup == COVER_NO_BOOK) {
+        return send_not_found(connection, memory, id);
+    }
+    if (lookup == COVER_NO_IMAGE) {
+        return MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, constant.no_cover);
+    }
+
+    struct MHD_Response *response;
+    unsigned int status;
+    if (lookup == COVER_REMOTE) {
+        response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+        if (response == NULL) {
+            return MHD_NO;
+        }
+        MHD_add_response_header(response, "Location", book->coverImageUrl);
+        MHD_add_response_header(response, "Cache-Control", "no-cache");
+        status = MHD_HTTP_FOUND;
+    } else {
+        const char *if_none_match = MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                                                MHD_HTTP_HEADER_IF_NONE_MATCH);
+        if (cover_etag_matches(&found, if_none_match, if_none_match != NULL ? strlen(if_none_match) : 0)) {
+            response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
+            status = MHD_HTTP_NOT_MODIFIED;
+        } else {
+            // The response owns, and closes, its own descriptor for the blob
+            int fd = dup(found.fd);
+            response = fd >= 0 ? MHD_create_response_from_fd(found.size, fd) : NULL;
+            if (response == NULL && fd >= 0) {
+                close(fd);
+            }
+            status = MHD_HTTP_OK;
+        }
+        if (response != NULL) {
+            if (status == MHD_HTTP_OK) {
+                MHD_add_response_header(response, "Content-Type", found.content_type);
+            }
+            MHD_add_response_header(response, "ETag", found.etag);
+            MHD_add_response_header(response, "Cache-Control", COVER_CACHE_CONTROL);
+        }
+        cover_release(&found);
+        if (response == NULL) {
+            return MHD_NO;
+        }
+    }
+    add_cors_headers(response);
+    enum MHD_Result ret = MHD_queue_response(connection, status, response);
+    MHD_destroy_response(response);
+    return ret;
+}
+
+// Sets up and tears down the per-connection state
+static void notify_connection(void *cls, struct MHD_Connection *connection,
+                              void **socket_context, enum MHD_ConnectionNotificationCode code)
+{
+    (void)cls;
+    (void)connection;
+    if (code == MHD_CONNECTION_NOTIFY_STARTED) {
+        struct connection_info *info = malloc(sizeof(struct connection_info));
+        if (info != NULL) {
+            arena_init(&info->memory);
+            info->data = NULL;
+            info->size = 0;
+            info->cap = 0;
+        }
+        *socket_context = info;
+    } else if (code == MHD_CONNECTION_NOTIFY_CLOSED && *socket_context != NULL) {
+        struct connection_info *info = *socket_context;
+        arena_free(&info->memory);
+        free(info);
+        *socket_context = NULL;
+    }
+}
+
+// Hands a finished request's memory back to its connection
+static void request_completed(void *cls, struct MHD_Connection *connection,
+                              void **con_cls, enum MHD_RequestTerminationCode toe)
+{
+    (void)cls;
+    (void)connection;
+    (void)toe;
+    struct connection_info *info = *con_cls;
+    if (info != NULL) {
+        arena_reset(&info->memory);
+        info->data = NULL;
+        info->size = 0;
+        info->cap = 0;
+        *con_cls = NULL;
+    }
+}
+
 static enum MHD_Result
 answer_to_connection(void *cls, struct MHD_Connection *connection,
                       const char *url, const char *method,
                       const char *version, const char *upload_data,
                       size_t *upload_data_size, void **con_cls)
 {
-    struct MHD_Response *response;
-    enum MHD_Result ret;
     char *response_text = NULL;
     int status_code = MHD_HTTP_OK;
 
     // Handle CORS preflight
     if (strcmp(method, "OPTIONS") == 0) {
-        response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
-        MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-        MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE");
-        MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type");
-        ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-        MHD_destroy_response(response);
-        return ret;
+        return MHD_queue_response(connection, MHD_HTTP_OK, constant.empty);
     }
 
-    // Initialize connection info on first call
+    // Attach the connection's state on the first call of a request
     if (*con_cls == NULL) {
+        const union MHD_ConnectionInfo *info =
+            MHD_get_connection_info(connection, MHD_CONNECTION_INFO_SOCKET_CONTEXT);
+        if (info == NULL || info->socket_context == NULL) {
+            return MHD_NO;
+        }
+        *con_cls = info->socket_context;
         if (strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0) {
-            struct connection_info *con_info = malloc(sizeof(struct connection_info));
-            con_info->data = NULL;
-            con_info->size = 0;
-            *con_cls = con_info;
             return MHD_YES;
         }
-        *con_cls = (void *)1; // Mark as initialized for GET/DELETE
     }
+    struct connection_info *con_info = *con_cls;
+    arena *memory = &con_info->memory;
 
-    // Handle POST/PUT data accumulation
+    // Handle POST/PUT data accumulation, doubling the buffer in the arena
     if (*upload_data_size != 0) {
-        struct connection_info *con_info = *con_cls;
-        if (con_info->data == NULL) {
-            con_info->data = malloc(*upload_data_size + 1);
-            memcpy(con_info->data, upload_data, *upload_data_size);
-            con_info->data[*upload_data_size] = '\0';
-            con_info->size = *upload_data_size;
-        } else {
-            con_info->data = realloc(con_info->data, con_info->size + *upload_data_size + 1);
-            memcpy(con_info->data + con_info->size, upload_data, *upload_data_size);
-            con_info->size += *upload_data_size;
-            con_info->data[con_info->size] = '\0';
+        if (con_info->size + *upload_data_size + 1 > con_info->cap) {
+            size_t cap = con_info->cap > 0 ? con_info->cap : POSTBUFFERSIZE;
+            while (cap < con_info->size + *upload_data_size + 1) {
+                cap *= 2;
+            }
+            char *data = arena_grow(memory, con_info->data, con_info->cap, cap);
+            if (data == NULL) {
+                return MHD_NO;
+            }
+            con_info->data = data;
+            con_info->cap = cap;
         }
+        memcpy(con_info->data + con_info->size, upload_data, *upload_data_size);
+        con_info->size += *upload_data_size;
+        con_info->data[con_info->size] = '\0';
         *upload_data_size = 0;
         return MHD_YES;
     }
 
-    // GET /book - Get all books
+    // GET /book - Get all books (streamed, optionally paged)
     if (strcmp(method, "GET") == 0 && strcmp(url, "/book") == 0) {
-        response_text = get_all_books_json();
-        status_code = MHD_HTTP_OK;
+        return send_book_list(connection, memory);
+    }
+    // GET /book/search?q=text&limit=N - Books matching text, best first
+    else if (strcmp(method, "GET") == 0 && strcmp(url, "/book/search") == 0) {
+        const char *query = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "q");
+        unsigned long long limit = DEFAULT_SEARCH_LIMIT;
+        if (query == NULL || !get_uint_argument(connection, "limit", &limit) || limit == 0) {
+            return MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, constant.invalid_search);
+        }
+        response_text = search_books_json(memory, query, limit < MAX_SEARCH_LIMIT ? (int)limit : MAX_SEARCH_LIMIT);
+    }
+    // GET /book/_export - Export every book as NDJSON (streamed)
+    else if (strcmp(method, "GET") == 0 && strcmp(url, "/book/_export") == 0) {
+        return send_book_export(connection, memory);
+    }
+    // GET /book/:id/cover - The book's cover image
+    else if (strcmp(method, "GET") == 0 && strncmp(url, "/book/", 6) == 0 && is_cover_path(url)) {
+        size_t id_len = strlen(url) - 6 - strlen("/cover");
+        char *id = arena_alloc(memory, id_len + 1);
+        if (id == NULL) {
+            return MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, constant.internal_error);
+        }
+        memcpy(id, url + 6, id_len);
+        id[id_len] = '\0';
+        return send_cover(connection, memory, id);
     }
     // GET /book/:id - Get a specific book
     else if (strcmp(method, "GET") == 0 && strncmp(url, "/book/", 6) == 0) {
         const char *id = url + 6;
-        response_text = get_book_by_id_json(id);
+        response_text = get_book_by_id_json(memory, id);
         if (response_text == NULL) {
-            char error_msg[256];
-            snprintf(error_msg, sizeof(error_msg), "{\"error\":\"Book with ID %s not found\"}", id);
-            response_text = strdup(error_msg);
-            status_code = MHD_HTTP_NOT_FOUND;
+            return send_not_found(connection, memory, id);
         }
     }
     // POST /book - Create a book
     else if (strcmp(method, "POST") == 0 && strcmp(url, "/book") == 0) {
-        struct connection_info *con_info = *con_cls;
-        if (con_info != NULL && con_info->data != NULL) {
-            response_text = create_book_json(con_info->data);
-            if (response_text == NULL) {
-                response_text = strdup("{\"error\":\"Title and author are required\"}");
-                status_code = MHD_HTTP_BAD_REQUEST;
-            } else {
-                status_code = MHD_HTTP_CREATED;
-            }
-        } else {
-            response_text = strdup("{\"error\":\"No data provided\"}");
-            status_code = MHD_HTTP_BAD_REQUEST;
+        if (con_info->data == NULL) {
+            return MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, constant.no_data);
+        }
+        int result;
+        response_text = create_book_json(memory, con_info->data, &result);
+        if (response_text == NULL && result == 0) {
+            return MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, constant.title_and_author);
         }
+        status_code = MHD_HTTP_CREATED;
+    }
+    // POST /book/_bulk - Create many books from a JSON array or NDJSON
+    else if (strcmp(method, "POST") == 0 && strcmp(url, "/book/_bulk") == 0) {
+        if (con_info->data == NULL) {
+            return MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, constant.no_data);
+        }
+        response_text = bulk_create_books_json(memory, con_info->data, con_info->size);
     }
     // PUT /book/:id - Update a book
     else if (strcmp(method, "PUT") == 0 && strncmp(url, "/book/", 6) == 0) {
         const char *id = url + 6;
-        struct connection_info *con_info = *con_cls;
-        if (con_info != NULL && con_info->data != NULL) {
-            response_text = update_book_json(id, con_info->data);
-            if (response_text == NULL) {
-                char error_msg[256];
-                snprintf(error_msg, sizeof(error_msg), "{\"error\":\"Book with ID %s not found\"}", id);
-                response_text = strdup(error_msg);
-                status_code = MHD_HTTP_NOT_FOUND;
-            }
-        } else {
-            response_text = strdup("{\"error\":\"No data provided\"}");
-            status_code = MHD_HTTP_BAD_REQUEST;
+        if (con_info->data == NULL) {
+            return MHD_queue_response(connection, MHD_HTTP_BAD_REQUEST, constant.no_data);
+        }
+        int result;
+        response_text = update_book_json(memory, id, con_info->data, &result);
+        if (response_text == NULL && result == 0) {
+            return send_not_found(connection, memory, id);
         }
     }
     // DELETE /book/:id - Delete a book
     else if (strcmp(method, "DELETE") == 0 && strncmp(url, "/book/", 6) == 0) {
         const char *id = url + 6;
-        int deleted = delete_book_by_id(id);
-        if (deleted) {
-            response = MHD_create_response_from_buffer(0, "", MHD_RESPMEM_PERSISTENT);
-            MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-            MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE");
-            MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type");
-            ret = MHD_queue_response(connection, MHD_HTTP_NO_CONTENT, response);
-            MHD_destroy_response(response);
-            return ret;
-        } else {
-            char error_msg[256];
-            snprintf(error_msg, sizeof(error_msg), "{\"error\":\"Book with ID %s not found\"}", id);
-            response_text = strdup(error_msg);
-            status_code = MHD_HTTP_NOT_FOUND;
+        book_id key;
+        int result = book_id_parse(id, strlen(id), &key) ? delete_book_by_id(key) : 0;
+        if (result == 0) {
+            return send_not_found(connection, memory, id);
+        }
+        if (result == BOOK_NOT_PERSISTED) {
+            return MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, constant.internal_error);
         }
+        return MHD_queue_response(connection, MHD_HTTP_NO_CONTENT, constant.empty);
     }
     // 404 for unmatched routes
     else {
-        response_text = strdup("{\"error\":\"Route not found\"}");
-        status_code = MHD_HTTP_NOT_FOUND;
+        return MHD_queue_response(connection, MHD_HTTP_NOT_FOUND, constant.route_not_found);
     }
 
-    // Create and send response
     if (response_text == NULL) {
-        response_text = strdup("{\"error\":\"Internal server error\"}");
-        status_code = MHD_HTTP_INTERNAL_SERVER_ERROR;
+        return MHD_queue_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR, constant.internal_error);
     }
+    return send_json(connection, memory, status_code, response_text);
+}
 
-    response = MHD_create_response_from_buffer(strlen(response_text),
-                                               (void *)response_text,
-                                               MHD_RESPMEM_MUST_FREE);
-    MHD_add_response_header(response, "Content-Type", "application/json");
-    MHD_add_response_header(response, "Access-Control-Allow-Origin", "*");
-    MHD_add_response_header(response, "Access-Control-Allow-Methods", "GET, POST, PUT, DELETE");
-    MHD_add_response_header(response, "Access-Control-Allow-Headers", "Content-Type");
-    
-    ret = MHD_queue_response(connection, status_code, response);
-    MHD_destroy_response(response);
+static unsigned online_cores(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (unsigned)info.dwNumberOfProcessors : 1;
+#else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (unsigned)cores : 1;
+#endif
+}
 
-    // Cleanup connection info
-    if (*con_cls != NULL && *con_cls != (void *)1) {
-        struct connection_info *con_info = *con_cls;
-        if (con_info->data != NULL) {
-            free(con_info->data);
+// Raises the descriptor limit as far as the process may, for tens of
+// thousands of keep-alive connections, and returns how many connections to
+// accept. Without epoll, libmicrohttpd stays within select()'s FD_SETSIZE.
+static unsigned raise_fd_limit(void)
+{
+#ifdef __linux__
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        rlim_t wanted = limit.rlim_max == RLIM_INFINITY ? 1 << 20 : limit.rlim_max;
+        if (limit.rlim_cur < wanted) {
+            limit.rlim_cur = wanted;
+            if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+                getrlimit(RLIMIT_NOFILE, &limit);
+            }
+        }
+        if (limit.rlim_cur > 2 * RESERVED_FDS) {
+            return limit.rlim_cur - RESERVED_FDS < UINT_MAX ? (unsigned)(limit.rlim_cur - RESERVED_FDS) : UINT_MAX;
         }
-        free(con_info);
-        *con_cls = NULL;
     }
+#endif
+    return FD_SETSIZE - 4;
+}
 
-    return ret;
+// Reads an optional numeric setting into *value, which keeps its default
+// if the variable is unset. Returns 0, having said why, if it is invalid.
+static int get_env_number(const char *name, unsigned long min, unsigned long max, unsigned long *value)
+{
+    const char *text = getenv(name);
+    if (text == NULL) {
+        return 1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (*text == '\0' || *text == '-' || *end != '\0' || errno != 0 || parsed < min || parsed > max) {
+        fprintf(stderr, "%s must be between %lu and %lu\n", name, min, max);
+        return 0;
+    }
+    *value = parsed;
+    return 1;
 }
 
 int main(void)
 {
     struct MHD_Daemon *daemon;
 
-    init_book_storage();
+    // BOOK_STORE_FILE=<path> keeps the books in a memory-mapped file that
+    // is reopened as-is on the next start, instead of in memory.
+    const char *store_file = getenv("BOOK_STORE_FILE");
+    const char *data_dir = getenv("BOOK_DATA_DIR");
+    if (store_file != NULL && data_dir != NULL) {
+        fprintf(stderr, "Set either BOOK_STORE_FILE or BOOK_DATA_DIR, not both\n");
+        return 1;
+    }
+    if (store_file != NULL) {
+        if (!init_book_storage_file(store_file)) {
+            fprintf(stderr, "Failed to open BOOK_STORE_FILE %s\n", store_file);
+            return 1;
+        }
+        printf("Opened %s with %d books\n", store_file, get_book_count());
+    } else {
+        init_book_storage();
+    }
+
+    // Optional persistence: BOOK_DATA_DIR=<dir> logs every change there and
+    // reloads it on startup. BOOK_WAL_SYNC=0 skips fdatasync;
+    // BOOK_SNAPSHOT_EVERY=N sets the records between snapshots.
+    if (data_dir != NULL) {
+        const char *sync = getenv("BOOK_WAL_SYNC");
+        unsigned long snapshot_every = DEFAULT_SNAPSHOT_EVERY;
+        if (!get_env_number("BOOK_SNAPSHOT_EVERY", 0, ULONG_MAX, &snapshot_every)) {
+            return 1;
+        }
+        if (!enable_book_persistence(data_dir, sync == NULL || strcmp(sync, "0") != 0, snapshot_every)) {
+            fprintf(stderr, "Failed to open BOOK_DATA_DIR %s\n", data_dir);
+            return 1;
+        }
+
+        int snapshot_books;
+        unsigned long long replayed;
+        book_log_recovery_stats(&snapshot_books, &replayed);
+        printf("Loaded %d books from snapshot and replayed %llu log records\n", snapshot_books, replayed);
+    }
+
+    // BOOK_HTTP_THREADS=N serves requests on a pool of N threads, each
+    // polling its own share of the connections (with epoll where there is
+    // one). Defaults to one per core; 1 serves everything on one thread.
+    unsigned long threads = online_cores();
+    if (threads > MAX_HTTP_THREADS) {
+        threads = MAX_HTTP_THREADS;
+    }
+    if (!get_env_number("BOOK_HTTP_THREADS", 1, MAX_HTTP_THREADS, &threads)) {
+        return 1;
+    }
+
+    // Optional cover images: BOOK_COVER_DIR=<dir> downloads the books'
+    // cover images into a blob store there and serves them from
+    // GET /book/:id/cover (see cover_store.h). BOOK_COVER_WORKERS=N sets the
+    // download threads and BOOK_COVER_HOT_MB=N the blobs kept open;
+    // BOOK_COVER_ALLOW_PRIVATE=1 lets downloads reach private addresses.
+    const char *cover_dir = getenv("BOOK_COVER_DIR");
+    if (cover_dir != NULL) {
+        unsigned long workers = DEFAULT_COVER_WORKERS;
+        unsigned long hot_mb = DEFAULT_COVER_HOT_MB;
+        unsigned long allow_private = 0;
+        if (!get_env_number("BOOK_COVER_WORKERS", 1, MAX_COVER_WORKERS, &workers) ||
+            !get_env_number("BOOK_COVER_HOT_MB", 0, 1 << 20, &hot_mb) ||
+            !get_env_number("BOOK_COVER_ALLOW_PRIVATE", 0, 1, &allow_private)) {
+            return 1;
+        }
+        if (!cover_store_open(cover_dir, (unsigned)workers, (size_t)hot_mb * 1024 * 1024, (int)allow_private)) {
+            fprintf(stderr, "Failed to open BOOK_COVER_DIR %s\n", cover_dir);
+            return 1;
+        }
+    }
 
-    daemon = MHD_start_daemon(MHD_USE_INTERNAL_POLLING_THREAD, PORT, NULL, NULL,
-                               &answer_to_connection, NULL, MHD_OPTION_END);
-    if (NULL == daemon) {
-        fprintf(stderr, "Failed to start server\n");
+    // BOOK_HTTP_MODE=uring serves HTTP from io_uring event loops (Linux
+    // only, see uring_server.h) instead of libmicrohttpd.
+    const char *mode = getenv("BOOK_HTTP_MODE");
+    int use_uring = mode != NULL && strcmp(mode, "uring") == 0;
+    if (mode != NULL && !use_uring && strcmp(mode, "microhttpd") != 0) {
+        fprintf(stderr, "BOOK_HTTP_MODE must be microhttpd or uring\n");
         return 1;
     }
 
-    printf("Plain C API listening at http://localhost:%d\n", PORT);
+    unsigned connection_limit = raise_fd_limit();
+    uring_server *uring = NULL;
+    if (use_uring) {
+        uring = uring_server_start(PORT, (unsigned)threads);
+        if (uring == NULL) {
+            fprintf(stderr, "Failed to start server\n");
+            return 1;
+        }
+    } else {
+        if (!build_constant_responses()) {
+            fprintf(stderr, "Failed to build responses\n");
+            return 1;
+        }
+
+        // A pool of one is the single polling thread
+        daemon = MHD_start_daemon(MHD_USE_AUTO_INTERNAL_THREAD, PORT, NULL, NULL,
+                                   &answer_to_connection, NULL,
+                                   MHD_OPTION_THREAD_POOL_SIZE, (unsigned)threads,
+                                   MHD_OPTION_CONNECTION_LIMIT, connection_limit,
+                                   MHD_OPTION_NOTIFY_CONNECTION, &notify_connection, NULL,
+                                   MHD_OPTION_NOTIFY_COMPLETED, &request_completed, NULL,
+                                   MHD_OPTION_END);
+        if (NULL == daemon) {
+            fprintf(stderr, "Failed to start server\n");
+            return 1;
+        }
+    }
+
+    printf("Plain C API listening at http://localhost:%d on %lu %sthread%s\n", PORT, threads,
+           use_uring ? "io_uring " : "", threads == 1 ? "" : "s");
     printf("Press Enter to stop the server...\n");
     getchar();
 
-    MHD_stop_daemon(daemon);
+    if (use_uring) {
+        uring_server_stop(uring);
+    } else {
+        MHD_stop_daemon(daemon);
+        destroy_constant_responses();
+    }
+    cover_store_close();
+    list_cache_clear();
+    compress_cleanup();
     cleanup_book_storage();
 
     return 0;
@@ -0,0 +1,1486 @@
+// For syscall(), SOCK_CLOEXEC and gmtime_r
+#define _GNU_SOURCE
+#include "uring_server.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "arena.h"
+#include "book.h"
+#include "compress.h"
+#include "cover_store.h"
+#include "json.h"
+#include "list_cache.h"
+
+#define RING_ENTRIES 1024
+#define CQ_ENTRIES (RING_ENTRIES * 8)
+#define RECV_BUFFERS 1024 // A power of two
+#define RECV_BUFFER_SIZE (8 * 1024)
+#define RECV_GROUP 0
+#define LISTEN_BACKLOG 4096
+#define MAX_HEADER_SIZE (16 * 1024)
+#define MAX_BODY_SIZE (64 * 1024 * 1024)
+#define OUT_HIGH_WATER (256 * 1024) // Pipelined requests wait while this much is unsent
+#define BUFFER_KEEP_MAX (1024 * 1024) // Bigger input and output buffers are freed once empty
+#define ACCEPT_RETRY_NANOS 10000000 // Wait before accepting again when out of descriptors
+#define CHUNK_HEADER_SIZE 10        // Eight hex digits and CRLF
+#define COVER_SUFFIX "/cover"
+
+// Same as the libmicrohttpd front end in main.c
+#define STREAM_BLOCK_SIZE (32 * 1024)
+#define DEFAULT_SEARCH_LIMIT 20
+#define MAX_SEARCH_LIMIT 100
+
+// What a completion is for, in the low bits of its user_data; the rest is
+// the connection or loop it belongs to, both at least 8-byte aligned
+enum {
+    OP_ACCEPT = 1, OP_ACCEPT_RETRY = 2, OP_RECV = 3, OP_SEND = 4, OP_WAKE = 5, OP_CANCEL = 6, OP_SEND_FILE = 7,
+    OP_MASK = 7
+};
+
+typedef struct loop loop;
+
+// One per connection. Everything a request allocates comes from memory,
+// which is reset once its response is in out, so a connection stops
+// allocating after its first few requests.
+typedef struct connection {
+    loop *owner;
+    struct connection *prev, *next; // In owner's list of connections
+    int fd;
+    int pending;          // Operations in flight; an armed recv counts as one
+    int closing;          // Shut down; freed once pending drops to 0
+    int sending;          // out is being sent, so it must not move or grow
+    int close_after_send; // The last response in out ends the connection
+    int keep_alive_10;    // The request was HTTP/1.0 with Connection: keep-alive
+    int sent_continue;    // 100 Continue went out for the request being received
+    char *in;             // Received but not yet answered, from in_start
+    size_t in_start, in_len, in_cap;
+    char *out;            // Responses to send, from out_sent
+    size_t out_sent, out_len, out_cap;
+    content_encoding accept;  // What the request being answered accepts
+    book_list_stream *stream; // Chunked body still to be sent, or NULL
+    compress_stream *compressed; // Compresses stream when the client accepts it, or NULL
+    const char *file;         // Body sent after out without copying, while set
+    size_t file_size, file_sent;
+    int file_notifs;          // Zero-copy sends whose pages the kernel still holds
+    cover cover;              // Holds file while cover.blob is set: a cover image
+    const cached_list *list;  // Or the compressed GET /book array
+    arena memory;
+} connection;
+
+struct loop {
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, sq_mask, sq_entries;
+    unsigned sq_local_tail; // Past the last SQE filled in, ahead of *sq_tail until submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_map;
+    size_t ring_map_size;
+    size_t sqes_map_size;
+
+    // Receive buffers the kernel picks from, handed back as soon as their
+    // data has been answered or copied
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned short buf_tail;
+
+    int listen_fd;
+    int accept_armed; // An accept or its retry timer is in flight
+    struct __kernel_timespec accept_retry;
+    int wake_fd;
+    uint64_t wake_value;
+    int stop;
+    int copy_sends; // The kernel refused zero-copy sends, so files go out with plain ones
+    connection *connections;
+    pthread_t thread;
+    char date[48]; // Date header line for date_time
+    time_t date_time;
+};
+
+struct uring_server {
+    unsigned count;
+    loop *loops;
+};
+
+typedef enum { METHOD_GET, METHOD_POST, METHOD_PUT, METHOD_DELETE, METHOD_OPTIONS, METHOD_OTHER } http_method;
+
+typedef enum {
+    ROUTE_LIST_BOOKS,
+    ROUTE_SEARCH_BOOKS,
+    ROUTE_EXPORT_BOOKS,
+    ROUTE_GET_BOOK,
+    ROUTE_GET_COVER, // GET /book/:id/cover, told apart from ROUTE_GET_BOOK by its suffix
+    ROUTE_CREATE_BOOK,
+    ROUTE_BULK_CREATE_BOOKS,
+    ROUTE_UPDATE_BOOK,
+    ROUTE_DELETE_BOOK
+} route_kind;
+
+// The API, tried in order so exact paths win over the /book/ prefix. Path
+// lengths are fixed at compile time and compared before any bytes.
+#define ROUTE(method, path, prefix, kind) {method, path, sizeof(path) - 1, prefix, kind}
+static const struct route {
+    http_method method;
+    const char *path;
+    size_t length;
+    int prefix; // Also matches longer paths, the rest being the book id
+    route_kind kind;
+} routes[] = {
+    ROUTE(METHOD_GET, "/book", 0, ROUTE_LIST_BOOKS),
+    ROUTE(METHOD_GET, "/book/search", 0, ROUTE_SEARCH_BOOKS),
+    ROUTE(METHOD_GET, "/book/_export", 0, ROUTE_EXPORT_BOOKS),
+    ROUTE(METHOD_GET, "/book/", 1, ROUTE_GET_BOOK),
+    ROUTE(METHOD_POST, "/book", 0, ROUTE_CREATE_BOOK),
+    ROUTE(METHOD_POST, "/book/_bulk", 0, ROUTE_BULK_CREATE_BOOKS),
+    ROUTE(METHOD_PUT, "/book/", 1, ROUTE_UPDATE_BOOK),
+    ROUTE(METHOD_DELETE, "/book/", 1, ROUTE_DELETE_BOOK),
+};
+#undef ROUTE
+
+typedef struct {
+    http_method method;
+    const char *path; // Still percent-encoded
+    size_t path_len;
+    const char *query; // After the '?', or NULL
+    size_t query_len;
+    const char *body;
+    size_t body_len;
+    const char *if_none_match; // The header's value, or NULL
+    size_t if_none_match_len;
+    const char *accept_encoding; // Likewise
+    size_t accept_encoding_len;
+} request;
+
+static const char cors_headers[] =
+    "Access-Control-Allow-Origin: *\r\n"
+    "Access-Control-Allow-Methods: GET, POST, PUT, DELETE\r\n"
+    "Access-Control-Allow-Headers: Content-Type\r\n";
+
+// The libmicrohttpd front end's constant bodies
+static const char no_data[] = "{\"error\":\"No data provided\"}";
+static const char title_and_author[] = "{\"error\":\"Title and author are required\"}";
+static const char invalid_page[] = "{\"error\":\"Invalid limit or cursor\"}";
+static const char invalid_search[] = "{\"error\":\"Missing q or invalid limit\"}";
+static const char route_not_found[] = "{\"error\":\"Route not found\"}";
+static const char no_cover[] = "{\"error\":\"Book has no cover image\"}";
+static const char internal_error[] = "{\"error\":\"Internal server error\"}";
+
+static int ring_setup(unsigned entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned count) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Hands the queued SQEs to the kernel and, with wait set, blocks until at
+// least one completion is ready
+static int submit(loop *l, int wait) {
+    __atomic_store_n(l->sq_tail, l->sq_local_tail, __ATOMIC_RELEASE);
+    for (;;) {
+        unsigned queued = l->sq_local_tail - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE);
+        if (queued == 0 && !wait) {
+            return 0;
+        }
+        int ret = ring_enter(l->ring_fd, queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+        if (ret >= 0 || errno != EINTR) {
+            return ret;
+        }
+    }
+}
+
+// Returns a zeroed SQE to fill in, or NULL if the queue is full and cannot
+// be submitted
+static struct io_uring_sqe* get_sqe(loop *l) {
+    if (l->sq_local_tail - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE) >= l->sq_entries) {
+        submit(l, 0);
+        if (l->sq_local_tail - __atomic_load_n(l->sq_head, __ATOMIC_ACQUIRE) >= l->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &l->sqes[l->sq_local_tail & l->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    l->sq_local_tail++;
+    return sqe;
+}
+
+static void recycle_buffer(loop *l, unsigned short bid) {
+    struct io_uring_buf *buf = &l->buf_ring->bufs[l->buf_tail & (RECV_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(l->buffers + (size_t)bid * RECV_BUFFER_SIZE);
+    buf->len = RECV_BUFFER_SIZE;
+    buf->bid = bid;
+    l->buf_tail++;
+    __atomic_store_n(&l->buf_ring->tail, l->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void arm_accept(loop *l) {
+    struct io_uring_sqe *sqe = get_sqe(l);
+    if (sqe == NULL) {
+        fprintf(stderr, "io_uring: cannot queue accept\n");
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uint64_t)(uintptr_t)l | OP_ACCEPT;
+    l->accept_armed = 1;
+}
+
+// Accepts again after a pause, when accepting failed for lack of
+// descriptors or memory and would only fail again straight away
+static void arm_accept_retry(loop *l) {
+    struct io_uring_sqe *sqe = get_sqe(l);
+    if (sqe == NULL) {
+        return;
+    }
+    l->accept_retry.tv_sec = 0;
+    l->accept_retry.tv_nsec = ACCEPT_RETRY_NANOS;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&l->accept_retry;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t)(uintptr_t)l | OP_ACCEPT_RETRY;
+    l->accept_armed = 1;
+}
+
+static void cancel_accept(loop *l) {
+    struct io_uring_sqe *sqe = get_sqe(l);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)l | OP_ACCEPT;
+    sqe->user_data = (uint64_t)(uintptr_t)l | OP_CANCEL;
+}
+
+static void arm_wake(loop *l) {
+    struct io_uring_sqe *sqe = get_sqe(l);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = l->wake_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&l->wake_value;
+    sqe->len = sizeof(l->wake_value);
+    sqe->user_data = (uint64_t)(uintptr_t)l | OP_WAKE;
+}
+
+static int arm_recv(connection *c) {
+    struct io_uring_sqe *sqe = get_sqe(c->owner);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_RECV;
+    c->pending++;
+    return 1;
+}
+
+// Sends the rest of the file body straight from where it lives, without
+// copying it, unless the kernel cannot
+static int start_file_send(connection *c) {
+    struct io_uring_sqe *sqe = get_sqe(c->owner);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = c->owner->copy_sends ? IORING_OP_SEND : IORING_OP_SEND_ZC;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->file + c->file_sent);
+    sqe->len = (unsigned)(c->file_size - c->file_sent < UINT_MAX ? c->file_size - c->file_sent : UINT_MAX);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_SEND_FILE;
+    c->pending++;
+    c->sending = 1;
+    return 1;
+}
+
+static int start_send(connection *c) {
+    struct io_uring_sqe *sqe = get_sqe(c->owner);
+    if (sqe == NULL) {
+        return 0;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(c->out + c->out_sent);
+    sqe->len = (unsigned)(c->out_len - c->out_sent < UINT_MAX ? c->out_len - c->out_sent : UINT_MAX);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_SEND;
+    c->pending++;
+    c->sending = 1;
+    return 1;
+}
+
+// Lets go of the file body once the kernel is done with it
+static void release_file(connection *c) {
+    if (c->cover.blob != NULL) {
+        cover_release(&c->cover);
+    }
+    if (c->list != NULL) {
+        cached_list_release(c->list);
+        c->list = NULL;
+    }
+    c->file = NULL;
+}
+
+static void free_connection(connection *c) {
+    loop *l = c->owner;
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        l->connections = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    close(c->fd);
+    release_file(c);
+    compress_stream_free(c->compressed);
+    arena_free(&c->memory);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+// Shutting the socket down ends its recv; the connection is freed by
+// whoever sees its last operation finish
+static void close_connection(connection *c) {
+    if (!c->closing) {
+        c->closing = 1;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+static void refresh_date(loop *l) {
+    time_t now = time(NULL);
+    if (now != l->date_time) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(l->date, sizeof(l->date), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        l->date_time = now;
+    }
+}
+
+static int out_reserve(connection *c, size_t size) {
+    if (c->out_len + size <= c->out_cap) {
+        return 1;
+    }
+    size_t cap = c->out_cap > 0 ? c->out_cap : 16 * 1024;
+    while (cap < c->out_len + size) {
+        cap *= 2;
+    }
+    char *out = realloc(c->out, cap);
+    if (out == NULL) {
+        return 0;
+    }
+    c->out = out;
+    c->out_cap = cap;
+    return 1;
+}
+
+static int out_append(connection *c, const char *data, size_t size) {
+    if (!out_reserve(c, size)) {
+        return 0;
+    }
+    memcpy(c->out + c->out_len, data, size);
+    c->out_len += size;
+    return 1;
+}
+
+static int out_str(connection *c, const char *text) {
+    return out_append(c, text, strlen(text));
+}
+
+static const char* status_text(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 505: return "HTTP Version Not Supported";
+    default: return "Internal Server Error";
+    }
+}
+
+// Appends a status line and headers. length is the body's size, or -1 for
+// a chunked body; extra holds any further header lines.
+static int append_head(connection *c, int status, const char *content_type, long long length, const char *extra) {
+    char line[96];
+    snprintf(line, sizeof(line), "HTTP/1.1 %d %s\r\n", status, status_text(status));
+    if (!out_str(c, line) || !out_str(c, c->owner->date) || !out_str(c, cors_headers)) {
+        return 0;
+    }
+    if (content_type != NULL) {
+        snprintf(line, sizeof(line), "Content-Type: %s\r\n", content_type);
+        if (!out_str(c, line)) {
+            return 0;
+        }
+    }
+    if (length < 0) {
+        snprintf(line, sizeof(line), "Transfer-Encoding: chunked\r\n");
+    } else if (status != 204 && status != 304) {
+        snprintf(line, sizeof(line), "Content-Length: %lld\r\n", length);
+    } else {
+        line[0] = '\0';
+    }
+    const char *connection_header = c->close_after_send ? "Connection: close\r\n"
+                                    : c->keep_alive_10  ? "Connection: keep-alive\r\n"
+                                                        : "";
+    return out_str(c, line) && out_str(c, connection_header) && out_str(c, extra) && out_str(c, "\r\n");
+}
+
+// Header lines for a body that depends on Accept-Encoding, sent in encoding
+static const char* encoding_headers(content_encoding encoding) {
+    switch (encoding) {
+    case ENCODING_GZIP:
+        return "Vary: Accept-Encoding\r\nContent-Encoding: gzip\r\n";
+    case ENCODING_ZSTD:
+        return "Vary: Accept-Encoding\r\nContent-Encoding: zstd\r\n";
+    default:
+        return "Vary: Accept-Encoding\r\n";
+    }
+}
+
+// Appends a response with a JSON body, or none if body is empty. Bodies of
+// COMPRESS_MIN_SIZE and up are compressed if the client accepts it.
+static int respond(connection *c, int status, const char *body) {
+    size_t length = strlen(body);
+    if (length < COMPRESS_MIN_SIZE) {
+        return append_head(c, status, length > 0 ? "application/json" : NULL, (long long)length, "") &&
+               out_append(c, body, length);
+    }
+    content_encoding encoding = c->accept;
+    if (encoding != ENCODING_IDENTITY) {
+        size_t compressed_size;
+        char *compressed = compress_buffer(&c->memory, encoding, COMPRESS_FAST, body, length, &compressed_size);
+        if (compressed != NULL) {
+            body = compressed;
+            length = compressed_size;
+        } else {
+            encoding = ENCODING_IDENTITY;
+        }
+    }
+    return append_head(c, status, "application/json", (long long)length, encoding_headers(encoding)) &&
+           out_append(c, body, length);
+}
+
+static int send_not_found(connection *c, const char *id) {
+    char *body = arena_alloc(&c->memory, 256);
+    if (body == NULL) {
+        return respond(c, 500, internal_error);
+    }
+    snprintf(body, 256, "{\"error\":\"Book with ID %s not found\"}", id);
+    return respond(c, 404, body);
+}
+
+// Moves the next blocks of the chunked body into out, and ends the body
+// once the stream runs dry
+static int fill_stream(connection *c) {
+    while (c->stream != NULL && c->out_len - c->out_sent < 2 * STREAM_BLOCK_SIZE) {
+        if (!out_reserve(c, CHUNK_HEADER_SIZE + STREAM_BLOCK_SIZE + 2)) {
+            return 0;
+        }
+        char *chunk = c->out + c->out_len;
+        size_t size = c->compressed != NULL
+                          ? compress_stream_read(c->compressed, chunk + CHUNK_HEADER_SIZE, STREAM_BLOCK_SIZE)
+                          : book_list_stream_read(c->stream, chunk + CHUNK_HEADER_SIZE, STREAM_BLOCK_SIZE);
+        if (size == COMPRESS_FAILED || size == BOOK_LIST_FAILED) {
+            // Ending the chunks here would pass a cut-off list off as
+            // whole, so the connection is dropped instead
+            return 0;
+        }
+        if (size == 0) {
+            // The streams lived in the arena
+            compress_stream_free(c->compressed);
+            c->compressed = NULL;
+            c->stream = NULL;
+            arena_reset(&c->memory);
+            return out_str(c, "0\r\n\r\n");
+        }
+        char header[CHUNK_HEADER_SIZE + 1];
+        snprintf(header, sizeof(header), "%08x\r\n", (unsigned)size);
+        memcpy(chunk, header, CHUNK_HEADER_SIZE);
+        memcpy(chunk + CHUNK_HEADER_SIZE + size, "\r\n", 2);
+        c->out_len += CHUNK_HEADER_SIZE + size + 2;
+    }
+    return 1;
+}
+
+static size_t read_list_source(void *cls, char *buf, size_t max) {
+    size_t written = book_list_stream_read(cls, buf, max);
+    return written == BOOK_LIST_FAILED ? COMPRESS_FAILED : written;
+}
+
+// Starts a chunked body, compressed in encoding. Compressed, the size of a
+// body is unknown up front, so it is compressed whenever the client accepts
+// it. extra holds the encoding_headers.
+static int start_stream(connection *c, book_list_stream *stream, content_encoding encoding,
+                        const char *content_type, const char *extra) {
+    if (stream == NULL) {
+        return 0;
+    }
+    if (encoding != ENCODING_IDENTITY) {
+        c->compressed = compress_stream_new(&c->memory, encoding, COMPRESS_FAST, read_list_source, stream);
+        if (c->compressed == NULL) {
+            return 0;
+        }
+    }
+    c->stream = stream;
+    return append_head(c, 200, content_type, -1, extra) && fill_stream(c);
+}
+
+static int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// Percent-decodes part of a URL into the arena; query values also turn '+'
+// into a space
+static char* url_decode(arena *a, const char *text, size_t len, int plus_is_space) {
+    char *out = arena_alloc(a, len + 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '%' && i + 2 < len && hex_value(text[i + 1]) >= 0 && hex_value(text[i + 2]) >= 0) {
+            out[n++] = (char)(hex_value(text[i + 1]) * 16 + hex_value(text[i + 2]));
+            i += 2;
+        } else if (plus_is_space && text[i] == '+') {
+            out[n++] = ' ';
+        } else {
+            out[n++] = text[i];
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+// The decoded value of the first query argument named key, or NULL if the
+// query has none
+static const char* query_argument(arena *a, const request *r, const char *key) {
+    size_t key_len = strlen(key);
+    const char *p = r->query;
+    const char *end = r->query + r->query_len;
+    while (p != NULL && p < end) {
+        const char *amp = memchr(p, '&', (size_t)(end - p));
+        const char *field_end = amp != NULL ? amp : end;
+        const char *eq = memchr(p, '=', (size_t)(field_end - p));
+        const char *name_end = eq != NULL ? eq : field_end;
+        if ((size_t)(name_end - p) == key_len && memcmp(p, key, key_len) == 0) {
+            const char *value = eq != NULL ? eq + 1 : field_end;
+            return url_decode(a, value, (size_t)(field_end - value), 1);
+        }
+        p = field_end + 1;
+    }
+    return NULL;
+}
+
+// Parses an optional non-negative integer query argument; returns 0 if it is malformed
+static int get_uint_argument(arena *a, const request *r, const char *key, unsigned long long *value) {
+    const char *text = query_argument(a, r, key);
+    if (text == NULL) {
+        return 1;
+    }
+    char *end;
+    errno = 0;
+    *value = strtoull(text, &end, 10);
+    return *text != '\0' && *text != '-' && *end == '\0' && errno == 0;
+}
+
+static http_method parse_method(const char *text, size_t len) {
+    switch (len) {
+    case 3:
+        if (memcmp(text, "GET", 3) == 0) {
+            return METHOD_GET;
+        }
+        if (memcmp(text, "PUT", 3) == 0) {
+            return METHOD_PUT;
+        }
+        break;
+    case 4:
+        if (memcmp(text, "POST", 4) == 0) {
+            return METHOD_POST;
+        }
+        break;
+    case 6:
+        if (memcmp(text, "DELETE", 6) == 0) {
+            return METHOD_DELETE;
+        }
+        break;
+    case 7:
+        if (memcmp(text, "OPTIONS", 7) == 0) {
+            return METHOD_OPTIONS;
+        }
+        break;
+    }
+    return METHOD_OTHER;
+}
+
+static const struct route* match_route(const request *r) {
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        const struct route *route = &routes[i];
+        if (route->method == r->method &&
+            (route->prefix ? r->path_len >= route->length : r->path_len == route->length) &&
+            memcmp(r->path, route->path, route->length) == 0) {
+            return route;
+        }
+    }
+    return NULL;
+}
+
+// Streams GET /book[?limit=N&cursor=X] as a chunked JSON array, compressed
+// if the client accepts it. The whole array goes out from its compressed
+// copy (see list_cache.h) like a cover, without copying.
+static int send_book_list(connection *c, const request *r) {
+    unsigned long long limit = 0;
+    unsigned long long cursor = 0;
+    unsigned long long next_cursor;
+    if (!get_uint_argument(&c->memory, r, "limit", &limit) ||
+        !get_uint_argument(&c->memory, r, "cursor", &cursor) || limit > INT_MAX) {
+        return respond(c, 400, invalid_page);
+    }
+
+    content_encoding encoding = c->accept;
+    if (encoding != ENCODING_IDENTITY && limit == 0 && cursor == 0) {
+        const cached_list *list = cached_list_get(encoding);
+        if (list != NULL && list->json_size >= COMPRESS_MIN_SIZE) {
+            if (!append_head(c, 200, "application/json", (long long)list->size, encoding_headers(encoding))) {
+                cached_list_release(list);
+                return 0;
+            }
+            c->list = list;
+            c->file = list->data;
+            c->file_size = list->size;
+            c->file_sent = 0;
+            return 1;
+        }
+        // Too small to be worth compressing, or out of memory
+        cached_list_release(list);
+        encoding = ENCODING_IDENTITY;
+    }
+
+    book_list_stream *stream = book_list_stream_new(&c->memory, cursor, (int)limit, &next_cursor);
+    char extra[192];
+    int n = snprintf(extra, sizeof(extra), "%s", encoding_headers(encoding));
+    if (next_cursor != 0) {
+        snprintf(extra + n, sizeof(extra) - (size_t)n,
+                 "X-Next-Cursor: %llu\r\nAccess-Control-Expose-Headers: X-Next-Cursor\r\n", next_cursor);
+    }
+    return start_stream(c, stream, encoding, "application/json", extra);
+}
+
+// Answers GET /book/:id/cover. A stored cover's head goes into out and its
+// bytes follow from the blob once out has gone; one that is not stored yet
+// redirects to the original image.
+static int send_cover(connection *c, const request *r, const char *id) {
+    Book *book = arena_alloc(&c->memory, sizeof(Book));
+    if (book == NULL) {
+        return respond(c, 500, internal_error);
+    }
+    cover found;
+    cover_lookup lookup = find_book_cover(id, book, &found);
+    if (lookup == COVER_NO_BOOK) {
+        return send_not_found(c, id);
+    }
+    if (lookup == COVER_NO_IMAGE) {
+        return respond(c, 404, no_cover);
+    }
+    if (lookup == COVER_REMOTE) {
+        size_t size = strlen(book->coverImageUrl) + 64;
+        char *extra = arena_alloc(&c->memory, size);
+        if (extra == NULL) {
+            return respond(c, 500, internal_error);
+        }
+        snprintf(extra, size, "Location: %s\r\nCache-Control: no-cache\r\n", book->coverImageUrl);
+        return append_head(c, 302, NULL, 0, extra);
+    }
+
+    char extra[160];
+    snprintf(extra, sizeof(extra), "ETag: %s\r\nCache-Control: %s\r\n", found.etag, COVER_CACHE_CONTROL);
+    if (cover_etag_matches(&found, r->if_none_match, r->if_none_match_len)) {
+        cover_release(&found);
+        return append_head(c, 304, NULL, 0, extra);
+    }
+    if (!append_head(c, 200, found.content_type, (long long)found.size, extra)) {
+        cover_release(&found);
+        return 0;
+    }
+    c->cover = found;
+    c->file = (const char *)found.data;
+    c->file_size = found.size;
+    c->file_sent = 0;
+    return 1;
+}
+
+// Answers one request into c->out, as main.c's answer_to_connection does.
+// Returns 0 if the connection has to be dropped.
+static int answer(connection *c, const request *r) {
+    arena *memory = &c->memory;
+    if (r->method == METHOD_OPTIONS) {
+        return respond(c, 200, "");
+    }
+    const struct route *route = match_route(r);
+    if (route == NULL) {
+        return respond(c, 404, route_not_found);
+    }
+
+    route_kind kind = route->kind;
+    size_t id_len = r->path_len - route->length;
+    size_t suffix_len = strlen(COVER_SUFFIX);
+    if (kind == ROUTE_GET_BOOK && id_len > suffix_len &&
+        memcmp(r->path + r->path_len - suffix_len, COVER_SUFFIX, suffix_len) == 0) {
+        kind = ROUTE_GET_COVER;
+        id_len -= suffix_len;
+    }
+
+    const char *id = NULL;
+    if (route->prefix) {
+        id = url_decode(memory, r->path + route->length, id_len, 0);
+        if (id == NULL) {
+            return respond(c, 500, internal_error);
+        }
+    }
+    char *body = NULL;
+    if (r->body_len > 0) {
+        body = arena_alloc(memory, r->body_len + 1);
+        if (body == NULL) {
+            return respond(c, 500, internal_error);
+        }
+        memcpy(body, r->body, r->body_len);
+        body[r->body_len] = '\0';
+    }
+
+    char *response_text = NULL;
+    int status = 200;
+    int result;  // What a change returned (see book.h)
+    switch (kind) {
+    case ROUTE_LIST_BOOKS:
+        return send_book_list(c, r);
+    case ROUTE_SEARCH_BOOKS: {
+        const char *query = query_argument(memory, r, "q");
+        unsigned long long limit = DEFAULT_SEARCH_LIMIT;
+        if (query == NULL || !get_uint_argument(memory, r, "limit", &limit) || limit == 0) {
+            return respond(c, 400, invalid_search);
+        }
+        response_text = search_books_json(memory, query, limit < MAX_SEARCH_LIMIT ? (int)limit : MAX_SEARCH_LIMIT);
+        break;
+    }
+    case ROUTE_EXPORT_BOOKS:
+        return start_stream(c, book_export_stream_new(memory), c->accept, "application/x-ndjson",
+                            encoding_headers(c->accept));
+    case ROUTE_GET_BOOK:
+        response_text = get_book_by_id_json(memory, id);
+        if (response_text == NULL) {
+            return send_not_found(c, id);
+        }
+        break;
+    case ROUTE_GET_COVER:
+        return send_cover(c, r, id);
+    case ROUTE_CREATE_BOOK:
+        if (body == NULL) {
+            return respond(c, 400, no_data);
+        }
+        response_text = create_book_json(memory, body, &result);
+        if (response_text == NULL && result == 0) {
+            return respond(c, 400, title_and_author);
+        }
+        status = 201;
+        break;
+    case ROUTE_BULK_CREATE_BOOKS:
+        if (body == NULL) {
+            return respond(c, 400, no_data);
+        }
+        response_text = bulk_create_books_json(memory, body, r->body_len);
+        break;
+    case ROUTE_UPDATE_BOOK:
+        if (body == NULL) {
+            return respond(c, 400, no_data);
+        }
+        response_text = update_book_json(memory, id, body, &result);
+        if (response_text == NULL && result == 0) {
+            return send_not_found(c, id);
+        }
+        break;
+    case ROUTE_DELETE_BOOK: {
+        book_id key;
+        result = book_id_parse(id, strlen(id), &key) ? delete_book_by_id(key) : 0;
+        if (result == 0) {
+            return send_not_found(c, id);
+        }
+        return result == BOOK_NOT_PERSISTED ? respond(c, 500, internal_error) : respond(c, 204, "");
+    }
+    }
+
+    if (response_text == NULL) {
+        return respond(c, 500, internal_error);
+    }
+    return respond(c, status, response_text);
+}
+
+// Answers a request that cannot be parsed and ends the connection after
+// it, taking up the rest of the data
+static size_t reject(connection *c, int status, size_t len) {
+    c->close_after_send = 1;
+    c->keep_alive_10 = 0;
+    if (!respond(c, status, "")) {
+        close_connection(c);
+    }
+    return len;
+}
+
+// Length of the head (request line and headers, with the blank line after
+// them), or 0 if it has not all arrived
+static size_t head_length(const char *data, size_t len) {
+    const char *p = data;
+    const char *end = data + len;
+    while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        p++;
+        if (end - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+            return (size_t)(p + 2 - data);
+        }
+    }
+    return 0;
+}
+
+static int header_is(const char *name, size_t name_len, const char *expected) {
+    return name_len == strlen(expected) && strncasecmp(name, expected, name_len) == 0;
+}
+
+// Answers the request at the start of data if all of it has arrived.
+// Returns the bytes it took up, or 0 if more are needed.
+static size_t serve_one(connection *c, const char *data, size_t len) {
+    size_t head_len = head_length(data, len < MAX_HEADER_SIZE ? len : MAX_HEADER_SIZE);
+    if (head_len == 0) {
+        return len >= MAX_HEADER_SIZE ? reject(c, 431, len) : 0;
+    }
+    const char *head_end = data + head_len - 2; // At the blank line
+
+    // Request line: method, target and version
+    const char *eol = memchr(data, '\n', head_len);
+    const char *sp1 = memchr(data, ' ', (size_t)(eol - data));
+    const char *sp2 = sp1 != NULL ? memchr(sp1 + 1, ' ', (size_t)(eol - sp1 - 1)) : NULL;
+    if (sp2 == NULL || eol[-1] != '\r' || sp1[1] != '/') {
+        return reject(c, 400, len);
+    }
+    size_t version_len = (size_t)(eol - 1 - (sp2 + 1));
+    int http10;
+    if (version_len == 8 && memcmp(sp2 + 1, "HTTP/1.1", 8) == 0) {
+        http10 = 0;
+    } else if (version_len == 8 && memcmp(sp2 + 1, "HTTP/1.0", 8) == 0) {
+        http10 = 1;
+    } else {
+        return reject(c, 505, len);
+    }
+
+    request r = {0};
+    r.method = parse_method(data, (size_t)(sp1 - data));
+    r.path = sp1 + 1;
+    r.path_len = (size_t)(sp2 - r.path);
+    const char *question = memchr(r.path, '?', r.path_len);
+    if (question != NULL) {
+        r.query = question + 1;
+        r.query_len = (size_t)(sp2 - r.query);
+        r.path_len = (size_t)(question - r.path);
+    }
+
+    unsigned long long content_length = 0;
+    int chunked = 0;
+    int close = http10;
+    int expect_continue = 0;
+    for (const char *line = eol + 1; line < head_end; line = eol + 1) {
+        eol = memchr(line, '\n', (size_t)(head_end + 2 - line));
+        const char *colon = memchr(line, ':', (size_t)(eol - line));
+        if (colon == NULL || eol[-1] != '\r') {
+            return reject(c, 400, len);
+        }
+        const char *value = colon + 1;
+        const char *value_end = eol - 1;
+        while (value < value_end && (*value == ' ' || *value == '\t')) {
+            value++;
+        }
+        while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+        size_t name_len = (size_t)(colon - line);
+        size_t value_len = (size_t)(value_end - value);
+        if (header_is(line, name_len, "content-length")) {
+            content_length = 0;
+            if (value_len == 0 || value_len > 18) {
+                return reject(c, 400, len);
+            }
+            for (size_t i = 0; i < value_len; i++) {
+                if (value[i] < '0' || value[i] > '9') {
+                    return reject(c, 400, len);
+                }
+                content_length = content_length * 10 + (unsigned)(value[i] - '0');
+            }
+        } else if (header_is(line, name_len, "transfer-encoding")) {
+            chunked = !(value_len == 8 && strncasecmp(value, "identity", 8) == 0);
+        } else if (header_is(line, name_len, "connection")) {
+            if (value_len == 5 && strncasecmp(value, "close", 5) == 0) {
+                close = 1;
+            } else if (value_len == 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+                close = 0;
+            }
+        } else if (header_is(line, name_len, "if-none-match")) {
+            r.if_none_match = value;
+            r.if_none_match_len = value_len;
+        } else if (header_is(line, name_len, "accept-encoding")) {
+            r.accept_encoding = value;
+            r.accept_encoding_len = value_len;
+        } else if (header_is(line, name_len, "expect")) {
+            expect_continue = value_len == 12 && strncasecmp(value, "100-continue", 12) == 0;
+        }
+    }
+    if (chunked) {
+        return reject(c, 411, len);
+    }
+    if (content_length > MAX_BODY_SIZE) {
+        return reject(c, 413, len);
+    }
+    if (len - head_len < content_length) {
+        if (expect_continue && !c->sent_continue) {
+            c->sent_continue = 1;
+            if (!out_str(c, "HTTP/1.1 100 Continue\r\n\r\n")) {
+                close_connection(c);
+                return len;
+            }
+        }
+        return 0;
+    }
+
+    r.body = data + head_len;
+    r.body_len = (size_t)content_length;
+    c->sent_continue = 0;
+    c->close_after_send = close;
+    c->keep_alive_10 = http10 && !close;
+    c->accept = negotiate_encoding(r.accept_encoding, r.accept_encoding_len);
+    if (!answer(c, &r)) {
+        close_connection(c);
+        return len;
+    }
+    if (c->stream == NULL) {
+        arena_reset(&c->memory);
+    }
+    return head_len + r.body_len;
+}
+
+static int can_answer(const connection *c) {
+    return !c->closing && !c->sending && c->stream == NULL && c->file == NULL && !c->close_after_send;
+}
+
+// Answers the complete requests at the start of data, as many as may be
+// answered now, and returns the bytes they took up
+static size_t serve(connection *c, const char *data, size_t len) {
+    size_t used = 0;
+    while (used < len && can_answer(c) && c->out_len < OUT_HIGH_WATER) {
+        size_t n = serve_one(c, data + used, len - used);
+        if (n == 0) {
+            break;
+        }
+        used += n;
+    }
+    return used;
+}
+
+static void serve_buffered(connection *c) {
+    c->in_start += serve(c, c->in + c->in_start, c->in_len - c->in_start);
+    if (c->in_start == c->in_len) {
+        c->in_start = c->in_len = 0;
+        if (c->in_cap > BUFFER_KEEP_MAX) {
+            free(c->in);
+            c->in = NULL;
+            c->in_cap = 0;
+        }
+    }
+}
+
+static int in_append(connection *c, const char *data, size_t len) {
+    if (c->in_start > 0) {
+        memmove(c->in, c->in + c->in_start, c->in_len - c->in_start);
+        c->in_len -= c->in_start;
+        c->in_start = 0;
+    }
+    if (c->in_len + len > c->in_cap) {
+        size_t cap = c->in_cap > 0 ? c->in_cap : RECV_BUFFER_SIZE;
+        while (cap < c->in_len + len) {
+            cap *= 2;
+        }
+        char *in = realloc(c->in, cap);
+        if (in == NULL) {
+            return 0;
+        }
+        c->in = in;
+        c->in_cap = cap;
+    }
+    memcpy(c->in + c->in_len, data, len);
+    c->in_len += len;
+    return 1;
+}
+
+// Sends what has been answered, or ends the connection after its last response
+static void flush(connection *c) {
+    if (c->sending || c->closing) {
+        return;
+    }
+    if (c->out_len > c->out_sent) {
+        if (!start_send(c)) {
+            close_connection(c);
+        }
+    } else if (c->close_after_send) {
+        close_connection(c);
+    }
+}
+
+static void receive(connection *c, const char *data, size_t len) {
+    // Requests are usually answered straight from the receive buffer; only
+    // a partial one, or one that has to wait, is copied
+    size_t used = c->in_len == c->in_start ? serve(c, data, len) : 0;
+    if (used < len && !c->closing) {
+        if (!in_append(c, data + used, len - used)) {
+            close_connection(c);
+            return;
+        }
+        serve_buffered(c);
+    }
+    flush(c);
+}
+
+static void on_accept(loop *l, int res, unsigned flags) {
+    if (res >= 0) {
+        connection *c = l->stop ? NULL : calloc(1, sizeof(connection));
+        if (c == NULL) {
+            close(res);
+        } else {
+            c->owner = l;
+            c->fd = res;
+            arena_init(&c->memory);
+            int one = 1;
+            setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            c->next = l->connections;
+            if (l->connections != NULL) {
+                l->connections->prev = c;
+            }
+            l->connections = c;
+            if (!arm_recv(c)) {
+                free_connection(c);
+            }
+        }
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+        l->accept_armed = 0;
+        if (l->stop) {
+            return;
+        }
+        if (res == -EMFILE || res == -ENFILE || res == -ENOBUFS || res == -ENOMEM) {
+            arm_accept_retry(l);
+        } else {
+            if (res < 0 && res != -ECANCELED) {
+                fprintf(stderr, "io_uring accept: %s\n", strerror(-res));
+            }
+            arm_accept(l);
+        }
+    }
+}
+
+static void on_recv(connection *c, int res, unsigned flags) {
+    loop *l = c->owner;
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->pending--;
+    }
+    if (res > 0) {
+        unsigned short bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+        if (!c->closing) {
+            receive(c, l->buffers + (size_t)bid * RECV_BUFFER_SIZE, (size_t)res);
+        }
+        recycle_buffer(l, bid);
+    } else if (res != -ENOBUFS) {
+        // The peer closed (0) or the socket failed. Out of buffers, the recv
+        // is just armed again below, as this batch hands them back.
+        close_connection(c);
+    }
+    if (!(flags & IORING_CQE_F_MORE) && !c->closing && !arm_recv(c)) {
+        close_connection(c);
+    }
+    if (c->closing && c->pending == 0) {
+        free_connection(c);
+    }
+}
+
+static void on_send(connection *c, int res) {
+    c->pending--;
+    c->sending = 0;
+    if (res <= 0 || c->closing) {
+        close_connection(c);
+    } else {
+        c->out_sent += (size_t)res;
+        if (c->out_sent < c->out_len) {
+            if (!start_send(c)) {
+                close_connection(c);
+            }
+        } else {
+            c->out_sent = c->out_len = 0;
+            if (c->out_cap > BUFFER_KEEP_MAX) {
+                free(c->out);
+                c->out = NULL;
+                c->out_cap = 0;
+            }
+            if (c->stream != NULL && !fill_stream(c)) {
+                close_connection(c);
+            } else if (c->file != NULL) {
+                if (!start_file_send(c)) {
+                    close_connection(c);
+                }
+            } else {
+                serve_buffered(c);
+                flush(c);
+            }
+        }
+    }
+    if (c->closing && c->pending == 0) {
+        free_connection(c);
+    }
+}
+
+// A zero-copy send completes twice: once sent, and again (IORING_CQE_F_NOTIF)
+// once the kernel no longer needs the pages, which is when the file may go
+static void on_send_file(connection *c, int res, unsigned flags) {
+    if (flags & IORING_CQE_F_NOTIF) {
+        c->pending--;
+        c->file_notifs--;
+    } else {
+        if (flags & IORING_CQE_F_MORE) {
+            c->file_notifs++;
+        } else {
+            c->pending--;
+        }
+        c->sending = 0;
+        if ((res == -EOPNOTSUPP || res == -EINVAL) && !c->owner->copy_sends && !c->closing) {
+            c->owner->copy_sends = 1;
+            if (!start_file_send(c)) {
+                close_connection(c);
+            }
+        } else if (res <= 0 || c->closing) {
+            close_connection(c);
+        } else {
+            c->file_sent += (size_t)res;
+            if (c->file_sent < c->file_size && !start_file_send(c)) {
+                close_connection(c);
+            }
+        }
+    }
+    if (c->file != NULL && !c->sending && c->file_notifs == 0 &&
+        (c->file_sent == c->file_size || c->closing)) {
+        release_file(c);
+        if (!c->closing) {
+            serve_buffered(c);
+            flush(c);
+        }
+    }
+    if (c->closing && c->pending == 0) {
+        free_connection(c);
+    }
+}
+
+// Stopping: ends the accept and every connection; the loop runs on until
+// all of their operations have finished, so none outlives its buffers
+static void begin_stop(loop *l) {
+    l->stop = 1;
+    if (l->accept_armed) {
+        cancel_accept(l);
+    }
+    connection *next;
+    for (connection *c = l->connections; c != NULL; c = next) {
+        next = c->next;
+        close_connection(c);
+        if (c->pending == 0) {
+            free_connection(c);
+        }
+    }
+}
+
+static void* run_loop(void *arg) {
+    loop *l = arg;
+    arm_wake(l);
+    arm_accept(l);
+    while (!l->stop || l->connections != NULL || l->accept_armed) {
+        if (submit(l, 1) < 0 && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+        refresh_date(l);
+
+        unsigned head = *l->cq_head;
+        while (head != __atomic_load_n(l->cq_tail, __ATOMIC_ACQUIRE)) {
+            const struct io_uring_cqe *cqe = &l->cqes[head & l->cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(l->cq_head, ++head, __ATOMIC_RELEASE);
+
+            void *owner = (void *)(uintptr_t)(user_data & ~(uint64_t)OP_MASK);
+            switch (user_data & OP_MASK) {
+            case OP_ACCEPT:
+                on_accept(l, res, flags);
+                break;
+            case OP_ACCEPT_RETRY:
+                l->accept_armed = 0;
+                if (!l->stop) {
+                    arm_accept(l);
+                }
+                break;
+            case OP_RECV:
+                on_recv(owner, res, flags);
+                break;
+            case OP_SEND:
+                on_send(owner, res);
+                break;
+            case OP_SEND_FILE:
+                on_send_file(owner, res, flags);
+                break;
+            case OP_WAKE:
+                begin_stop(l);
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void loop_cleanup(loop *l) {
+    if (l->ring_fd >= 0) {
+        close(l->ring_fd);
+    }
+    while (l->connections != NULL) {
+        free_connection(l->connections);
+    }
+    if (l->sqes != NULL) {
+        munmap(l->sqes, l->sqes_map_size);
+    }
+    if (l->ring_map != NULL) {
+        munmap(l->ring_map, l->ring_map_size);
+    }
+    if (l->buf_ring != NULL) {
+        munmap(l->buf_ring, l->buf_ring_size);
+    }
+    free(l->buffers);
+    if (l->listen_fd >= 0) {
+        close(l->listen_fd);
+    }
+    if (l->wake_fd >= 0) {
+        close(l->wake_fd);
+    }
+}
+
+static int loop_init(loop *l, unsigned short port) {
+    memset(l, 0, sizeof(*l));
+    l->ring_fd = l->listen_fd = l->wake_fd = -1;
+
+    // Completions are only reaped by this loop's thread, so the kernel need
+    // not interrupt it to run their work (COOP_TASKRUN, Linux 5.19)
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = CQ_ENTRIES;
+    l->ring_fd = ring_setup(RING_ENTRIES, &params);
+    if (l->ring_fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = CQ_ENTRIES;
+        l->ring_fd = ring_setup(RING_ENTRIES, &params);
+    }
+    if (l->ring_fd < 0) {
+        perror("io_uring_setup");
+        return 0;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "io_uring: this kernel is too old\n");
+        return 0;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    l->ring_map_size = sq_size > cq_size ? sq_size : cq_size;
+    void *ring = mmap(NULL, l->ring_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, l->ring_fd,
+                      IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        perror("io_uring mmap");
+        return 0;
+    }
+    l->ring_map = ring;
+    char *base = ring;
+    l->sq_head = (unsigned *)(base + params.sq_off.head);
+    l->sq_tail = (unsigned *)(base + params.sq_off.tail);
+    l->sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    l->sq_entries = params.sq_entries;
+    l->sq_local_tail = *l->sq_tail;
+    // SQEs are used in ring order, so the index array never changes
+    unsigned *array = (unsigned *)(base + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+    l->cq_head = (unsigned *)(base + params.cq_off.head);
+    l->cq_tail = (unsigned *)(base + params.cq_off.tail);
+    l->cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    l->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    l->sqes_map_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, l->sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, l->ring_fd,
+                      IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        perror("io_uring mmap");
+        return 0;
+    }
+    l->sqes = sqes;
+
+    // Receive buffers, registered as a ring the kernel takes them from
+    // (Linux 5.19)
+    l->buf_ring_size = RECV_BUFFERS * sizeof(struct io_uring_buf);
+    void *buf_ring = mmap(NULL, l->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    l->buffers = malloc((size_t)RECV_BUFFERS * RECV_BUFFER_SIZE);
+    if (buf_ring == MAP_FAILED || l->buffers == NULL) {
+        fprintf(stderr, "io_uring: out of memory for receive buffers\n");
+        return 0;
+    }
+    l->buf_ring = buf_ring;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)l->buf_ring;
+    reg.ring_entries = RECV_BUFFERS;
+    reg.bgid = RECV_GROUP;
+    if (ring_register(l->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        perror("io_uring buffer ring");
+        return 0;
+    }
+    for (unsigned i = 0; i < RECV_BUFFERS; i++) {
+        recycle_buffer(l, (unsigned short)i);
+    }
+
+    // Every loop listens on the port itself and the kernel balances new
+    // connections between them
+    l->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (l->listen_fd < 0 || setsockopt(l->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        setsockopt(l->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+        bind(l->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(l->listen_fd, LISTEN_BACKLOG) != 0) {
+        perror("listen");
+        return 0;
+    }
+
+    l->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (l->wake_fd < 0) {
+        perror("eventfd");
+        return 0;
+    }
+    refresh_date(l);
+    return 1;
+}
+
+static void stop_loops(uring_server *server, unsigned started) {
+    for (unsigned i = 0; i < started; i++) {
+        uint64_t one = 1;
+        if (write(server->loops[i].wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("eventfd write");
+        }
+    }
+    for (unsigned i = 0; i < started; i++) {
+        pthread_join(server->loops[i].thread, NULL);
+    }
+    for (unsigned i = 0; i < server->count; i++) {
+        loop_cleanup(&server->loops[i]);
+    }
+    free(server->loops);
+    free(server);
+}
+
+uring_server* uring_server_start(unsigned short port, unsigned threads) {
+    uring_server *server = calloc(1, sizeof(uring_server));
+    if (server == NULL || (server->loops = calloc(threads, sizeof(loop))) == NULL) {
+        free(server);
+        fprintf(stderr, "io_uring: out of memory\n");
+        return NULL;
+    }
+    for (; server->count < threads; server->count++) {
+        if (!loop_init(&server->loops[server->count], port)) {
+            server->count++; // Clean up what it did set up
+            stop_loops(server, 0);
+            return NULL;
+        }
+    }
+    for (unsigned i = 0; i < threads; i++) {
+        if (pthread_create(&server->loops[i].thread, NULL, run_loop, &server->loops[i]) != 0) {
+            fprintf(stderr, "io_uring: cannot start thread\n");
+            stop_loops(server, i);
+            return NULL;
+        }
+    }
+    return server;
+}
+
+void uring_server_stop(uring_server *server) {
+    stop_loops(server, server->count);
+}
+
+#else
+
+#include <stdio.h>
+
+uring_server* uring_server_start(unsigned short port, unsigned threads) {
+    (void)port;
+    (void)threads;
+    fprintf(stderr, "io_uring is only available on Linux\n");
+    return NULL;
+}
+
+void uring_server_stop(uring_server *server) {
+    (void)server;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef URING_SERVER_H
+#define URING_SERVER_H
+
+// HTTP front end built on io_uring, for Linux 6.0 and later, selected with
+// BOOK_HTTP_MODE=uring in place of libmicrohttpd.
+//
+// Each thread runs its own event loop with its own ring and its own
+// SO_REUSEPORT listening socket, so the kernel spreads new connections over
+// the threads and a connection stays on one thread for life. A loop keeps a
+// multishot accept armed, and one multishot recv per connection that
+// receives into a ring of buffers registered with the kernel; completions
+// are reaped and the sends they lead to submitted with one io_uring_enter
+// per batch, so a busy connection costs no syscall of its own per request.
+//
+// Requests are parsed where they were received and routed through a table
+// fixed at compile time. Pipelined requests are answered in order and their
+// responses go out in one send. Bodies and headers are the same as the
+// libmicrohttpd front end's, built by the json.h functions in a
+// per-connection arena. Request bodies need a Content-Length; chunked
+// uploads are refused with 411. A stored cover image (see cover_store.h)
+// follows its headers in a zero-copy send from the blob's mapping.
+
+typedef struct uring_server uring_server;
+
+// Listens on port and starts `threads` event loops. Returns NULL, having
+// printed why to stderr, if io_uring or the sockets cannot be set up.
+uring_server* uring_server_start(unsigned short port, unsigned threads);
+
+// Stops the loops and closes their connections.
+void uring_server_stop(uring_server *server);
+
+#endif
@@ -0,0 +1,129 @@
+// Change feed benchmark.
+//
+// First measures publishes per second into the ring as writer threads are
+// added, with nobody subscribed. Then, for growing numbers of subscribers
+// whose send only counts frames, measures the CPU the feed uses per second
+// while the store is idle, and the time from publishing one change to every
+// subscriber having been handed its frame.
+//
+// Usage: changes_bench [seconds=1] [max_threads=cores] [max_subscribers=10000] [samples=200]
+
+#include "../change_feed.h"
+#include "../sharded_book_store.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t books = 1000;
+
+std::string book_id(std::size_t i) {
+    return "bench-" + std::to_string(i);
+}
+
+double cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+double publish_rate(ChangeFeed& feed, unsigned threads, double seconds) {
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> total{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::string id = book_id(t);
+            std::uint64_t published = 0;
+            while (!stop.load(std::memory_order_relaxed)) {
+                feed.publish(id);
+                ++published;
+            }
+            total += published;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return total / seconds;
+}
+
+double percentile(std::vector<double>& samples, double p) {
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))];
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? std::atof(argv[1]) : 1.0;
+    unsigned max_threads = argc > 2 ? static_cast<unsigned>(std::atoi(argv[2]))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+    std::size_t max_subscribers = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 10000;
+    int samples = argc > 4 ? std::atoi(argv[4]) : 200;
+    if (seconds <= 0 || max_threads == 0 || max_subscribers == 0 || samples <= 0) {
+        std::fprintf(stderr, "seconds, max_threads, max_subscribers and samples must be positive\n");
+        return 1;
+    }
+
+    ShardedBookStore store;
+    for (std::size_t i = 0; i < books; ++i) {
+        store.insert(std::make_shared<const Book>(BookFields{
+            book_id(i), "Title " + std::to_string(i), "Author " + std::to_string(i % 100), "1985-10-14",
+            "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg"}));
+    }
+
+    {
+        ChangeFeed feed(store);
+        std::printf("%8s %16s\n", "threads", "publishes/sec");
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            std::printf("%8u %16.0f\n", threads, publish_rate(feed, threads, seconds));
+        }
+    }
+
+    std::printf("\n%12s %14s %14s %14s\n", "subscribers", "idle cpu ms/s", "fan-out p50", "fan-out p99");
+    for (std::size_t subscribers = 1; subscribers <= max_subscribers; subscribers *= 10) {
+        ChangeFeed feed(store);
+        std::atomic<std::uint64_t> frames{0};
+        std::vector<char> keys(subscribers);
+        for (char& key : keys) {
+            feed.subscribe(&key, {}, [&](const std::string&) { frames.fetch_add(1, std::memory_order_relaxed); });
+        }
+        // Let the hello frames and the first round go by
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        double cpu_before = cpu_seconds();
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        double idle_ms = (cpu_seconds() - cpu_before) / seconds * 1e3;
+
+        // Stays under the window, so nobody needs to acknowledge
+        std::vector<double> latencies;
+        int count = std::min<int>(samples, static_cast<int>(ChangeFeed::window) - 1);
+        for (int i = 0; i < count; ++i) {
+            std::uint64_t target = frames.load() + subscribers;
+            auto start = std::chrono::steady_clock::now();
+            feed.publish(book_id(static_cast<std::size_t>(i) % books));
+            while (frames.load(std::memory_order_relaxed) < target) {
+                std::this_thread::yield();
+            }
+            latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::printf("%12zu %14.2f %12.0fus %12.0fus\n", subscribers, idle_ms, percentile(latencies, 0.5),
+                    percentile(latencies, 0.99));
+
+        for (char& key : keys) {
+            feed.unsubscribe(&key);
+        }
+    }
+    return 0;
+}
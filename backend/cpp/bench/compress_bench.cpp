@@ -0,0 +1,181 @@
+// Response compression benchmark: bytes on the wire against CPU per request.
+//
+// Fills a store with generated books, then builds the bodies of GET /book
+// (whole and one page), GET /book/<id> and GET /book/_export as the server
+// does, in every content coding it can send them in, and prints the bytes
+// each request puts on the wire and the CPU it takes. "cached" is the
+// whole list served from its compressed copy, whose one-off cost per store
+// version is printed as build time; "per request" compresses each response
+// as it is sent, streaming for the export.
+//
+// Usage: compress_bench [books=100000] [rounds=20] [page=20]
+
+#include "../compression.h"
+#include "../list_cache.h"
+#include "../sharded_book_store.h"
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char* const words[] = {"night", "house", "river", "secret", "garden", "war", "peace", "winter",
+                             "love", "dark", "city", "lost", "time", "shadow", "king", "sea"};
+
+BookFields make_book(std::size_t i, std::mt19937_64& rng) {
+    std::string title = "The";
+    for (int w = 0; w < 3; ++w) {
+        title += ' ';
+        title += words[rng() % std::size(words)];
+    }
+    return {
+        std::nullopt,
+        title + " " + std::to_string(i),
+        "Author " + std::to_string(rng() % 5000),
+        std::to_string(1900 + rng() % 125) + "-0" + std::to_string(1 + rng() % 9) + "-1" + std::to_string(rng() % 10),
+        "https://covers.openlibrary.org/b/id/" + std::to_string(rng() % 10000000) + "-L.jpg"
+    };
+}
+
+double cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Runs request() until it has taken at least `rounds` calls and 0.2 s of
+// CPU, and prints its average body size, next to the uncompressed size
+// (json_bytes, set by the first call for a shape), and CPU per call
+void measure(const char* shape, const char* coding, double& json_bytes, std::size_t rounds,
+             const std::function<std::size_t()>& request) {
+    std::size_t bytes = 0;
+    std::size_t calls = 0;
+    double start = cpu_seconds();
+    double elapsed = 0;
+    while (calls < rounds || elapsed < 0.2) {
+        bytes += request();
+        ++calls;
+        elapsed = cpu_seconds() - start;
+    }
+    double per_call = static_cast<double>(bytes) / calls;
+    if (json_bytes == 0) {
+        json_bytes = per_call;
+    }
+    std::printf("%-8s %-22s %14.0f %8.1f%% %14.1f\n", shape, coding, per_call, 100.0 * per_call / json_bytes,
+                elapsed / calls * 1e6);
+}
+
+std::string books_json(const std::vector<BookStore::BookPtr>& books) {
+    std::string body = "[";
+    for (std::size_t i = 0; i < books.size(); ++i) {
+        if (i > 0) {
+            body += ',';
+        }
+        body += books[i]->to_json().dump();
+    }
+    body += ']';
+    return body;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    std::size_t rounds = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 20;
+    std::size_t page_size = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 20;
+
+    ShardedBookStore books;
+    std::mt19937_64 rng(1);
+    std::vector<std::string> ids;
+    for (std::size_t i = 0; i < count; ++i) {
+        BookFields book = make_book(i, rng);
+        book.id = "bench-" + std::to_string(i);
+        ids.push_back(*book.id);
+        books.insert(std::make_shared<const Book>(std::move(book)));
+    }
+    ListCache list_cache(books);
+    const CachedList& list = list_cache.get();
+
+    std::printf("books=%zu page=%zu min_compress_size=%zu\n", count, page_size, min_compress_size);
+    std::printf("%-8s %-22s %14s %9s %14s\n", "shape", "coding", "bytes/request", "of json", "cpu us/request");
+
+    const ContentEncoding encodings[] = {ContentEncoding::Gzip, ContentEncoding::Zstd};
+    std::string name;
+
+    // GET /book: the cached body as is, compressed per request, and the
+    // compressed copies cached per store version
+    double list_bytes = 0;
+    measure("list", "identity", list_bytes, rounds, [&] { return std::string(list.body).size(); });
+    for (ContentEncoding encoding : encodings) {
+        name = std::string(encoding_name(encoding)) + " per request";
+        measure("list", name.c_str(), list_bytes, 2,
+                [&] { return compress(list.body, encoding, CompressionLevel::Fast).size(); });
+    }
+    for (ContentEncoding encoding : encodings) {
+        auto start = std::chrono::steady_clock::now();
+        const CachedList::Encoded& encoded = list.encoded(encoding);
+        double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        name = std::string(encoding_name(encoding)) + " cached";
+        measure("list", name.c_str(), list_bytes, rounds, [&] { return std::string(encoded.body).size(); });
+        std::printf("%-8s %-22s %14s %9s %14.0f (build, once per version)\n", "", "", "", "", build * 1e6);
+    }
+
+    // GET /book?limit=N: serialized per request
+    std::vector<BookStore::BookPtr> page;
+    books.page_after(0, page_size, page);
+    double page_bytes = 0;
+    measure("page", "identity", page_bytes, rounds * 100, [&] { return books_json(page).size(); });
+    for (ContentEncoding encoding : encodings) {
+        name = std::string(encoding_name(encoding)) + " per request";
+        measure("page", name.c_str(), page_bytes, rounds * 100,
+                [&] { return compress(books_json(page), encoding, CompressionLevel::Fast).size(); });
+    }
+
+    // GET /book/<id>: under min_compress_size, so the server sends it as is;
+    // the compressed rows show what that saves
+    std::size_t next = 0;
+    auto book_body = [&] { return books.find(ids[next++ % ids.size()])->to_json().dump(); };
+    double book_bytes = 0;
+    measure("book", "identity (sent)", book_bytes, rounds * 1000, [&] { return book_body().size(); });
+    for (ContentEncoding encoding : encodings) {
+        name = std::string(encoding_name(encoding)) + " per request";
+        measure("book", name.c_str(), book_bytes, rounds * 1000,
+                [&] { return compress(book_body(), encoding, CompressionLevel::Fast).size(); });
+    }
+
+    // GET /book/_export: NDJSON, compressed as it is serialized
+    std::vector<BookStore::BookPtr> order = books.books();
+    auto export_body = [&](ContentEncoding encoding) {
+        std::string body;
+        if (encoding == ContentEncoding::Identity) {
+            for (const auto& book : order) {
+                body += book->to_json().dump();
+                body += '\n';
+            }
+            return body.size();
+        }
+        Compressor compressor(encoding, CompressionLevel::Fast);
+        for (const auto& book : order) {
+            std::string line = book->to_json().dump();
+            line += '\n';
+            compressor.write(line, body);
+        }
+        compressor.finish({}, body);
+        return body.size();
+    };
+    double export_bytes = 0;
+    measure("export", "identity", export_bytes, 2, [&] { return export_body(ContentEncoding::Identity); });
+    for (ContentEncoding encoding : encodings) {
+        name = std::string(encoding_name(encoding)) + " streamed";
+        measure("export", name.c_str(), export_bytes, 2, [&] { return export_body(encoding); });
+    }
+    return 0;
+}
@@ -0,0 +1,213 @@
+// Secondary index benchmark for BookStore.
+//
+// Fills stores of growing size (10x steps up to `books`) and times sorted
+// listings through the author and publication date indexes against the same
+// listing done by scanning every book, filtering and sorting. Also prints
+// insert throughput, which now pays for keeping both indexes sorted.
+//
+// Usage: index_bench [books=1000000] [queries=2000] [limit=100]
+
+#include "../book_store.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using BookPtr = BookStore::BookPtr;
+using Clock = std::chrono::steady_clock;
+
+constexpr std::size_t author_count = 20000;
+
+double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::string author_name(std::size_t i) {
+    return "Author " + std::to_string(i);
+}
+
+BookFields make_book(std::size_t i, std::mt19937_64& rng) {
+    BookFields fields;
+    fields.id = "bench-" + std::to_string(i);
+    fields.title = "Title " + std::to_string(i);
+    fields.author = author_name(rng() % author_count);
+    // One book in ten has no publication date
+    if (rng() % 10 != 0) {
+        char date[16];
+        std::snprintf(date, sizeof(date), "%04d-%02d-%02d", 1900 + static_cast<int>(rng() % 126),
+                      1 + static_cast<int>(rng() % 12), 1 + static_cast<int>(rng() % 28));
+        fields.published_date = date;
+    }
+    fields.coverImageUrl = "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg";
+    return fields;
+}
+
+// Orders books as BookStore::Query does, so both sides return the same page
+bool sorted_before(const BookStore::Query& query, const BookPtr& a, const BookPtr& b) {
+    if (query.order == BookStore::Order::Author && a->author() != b->author()) {
+        return query.descending ? a->author() > b->author() : a->author() < b->author();
+    }
+    return query.descending ? a->published_date() > b->published_date() : a->published_date() < b->published_date();
+}
+
+// The listing without the indexes: visit every book, keep the matches and
+// sort just enough of them for one page
+std::size_t scan(const BookStore& store, const BookStore::Query& query, std::size_t limit) {
+    std::vector<BookPtr> matches;
+    store.for_each([&](const BookPtr& book) {
+        auto date = book->published_date();
+        if (query.author && book->author() != *query.author) {
+            return;
+        }
+        if ((query.order == BookStore::Order::PublishedDate || query.published_from || query.published_to) &&
+            !date) {
+            return;
+        }
+        if (date && query.published_from && *date < *query.published_from) {
+            return;
+        }
+        if (date && query.published_to && date->compare(0, query.published_to->size(), *query.published_to) > 0) {
+            return;
+        }
+        matches.push_back(book);
+    });
+    std::size_t end = std::min(matches.size(), query.offset + limit);
+    auto before = [&](const BookPtr& a, const BookPtr& b) { return sorted_before(query, a, b); };
+    std::partial_sort(matches.begin(), matches.begin() + static_cast<std::ptrdiff_t>(end), matches.end(), before);
+    return end > query.offset ? end - query.offset : 0;
+}
+
+std::size_t indexed(const BookStore& store, const BookStore::Query& query, std::size_t limit) {
+    std::size_t count = 0;
+    store.for_each_sorted(query, limit, [&](std::uint64_t, const BookPtr&) { ++count; });
+    return count;
+}
+
+using Listing = std::function<std::size_t(const BookStore&, const BookStore::Query&, std::size_t)>;
+
+// Average microseconds per query and books returned per query
+std::pair<double, double> time_queries(const BookStore& store, const std::vector<BookStore::Query>& queries,
+                                       std::size_t limit, const Listing& listing) {
+    std::size_t returned = 0;
+    auto start = Clock::now();
+    for (const auto& query : queries) {
+        returned += listing(store, query, limit);
+    }
+    double seconds = seconds_since(start);
+    return {seconds * 1e6 / queries.size(), static_cast<double>(returned) / queries.size()};
+}
+
+// Queries of one shape, built from random numbers
+using MakeQuery = BookStore::Query (*)(std::mt19937_64& rng);
+
+BookStore::Query one_author(std::mt19937_64& rng) {
+    BookStore::Query query;
+    query.order = BookStore::Order::Author;
+    query.author = author_name(rng() % author_count);
+    return query;
+}
+
+BookStore::Query author_decade(std::mt19937_64& rng) {
+    BookStore::Query query = one_author(rng);
+    int decade = 1900 + static_cast<int>(rng() % 12) * 10;
+    query.published_from = std::to_string(decade);
+    query.published_to = std::to_string(decade + 9);
+    return query;
+}
+
+BookStore::Query one_year(std::mt19937_64& rng) {
+    BookStore::Query query;
+    std::string year = std::to_string(1900 + rng() % 126);
+    query.published_from = year;
+    query.published_to = year;
+    return query;
+}
+
+BookStore::Query newest(std::mt19937_64&) {
+    BookStore::Query query;
+    query.descending = true;
+    return query;
+}
+
+BookStore::Query deep_page(std::mt19937_64& rng) {
+    BookStore::Query query;
+    query.published_from = "1950";
+    query.published_to = "1999";
+    query.offset = 1000 + rng() % 1000;
+    return query;
+}
+
+BookStore::Query by_author_in_year(std::mt19937_64& rng) {
+    BookStore::Query query = one_year(rng);
+    query.order = BookStore::Order::Author;
+    return query;
+}
+
+const struct {
+    const char* name;
+    MakeQuery make;
+} shapes[] = {
+    {"one author", one_author},
+    {"author+decade", author_decade},
+    {"one year", one_year},
+    {"newest", newest},
+    {"deep page", deep_page},
+    {"year by author", by_author_in_year},
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t max_books = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t query_count = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 2000;
+    std::size_t limit = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 100;
+    if (max_books == 0 || query_count == 0 || limit == 0) {
+        std::fprintf(stderr, "books, queries and limit must be positive\n");
+        return 1;
+    }
+
+    std::printf("queries=%zu limit=%zu\n", query_count, limit);
+    for (std::size_t books = std::min<std::size_t>(10000, max_books); books <= max_books; books *= 10) {
+        std::mt19937_64 rng(books);
+        BookStore store;
+        store.reserve(books);
+        std::vector<BookPtr> prepared;
+        prepared.reserve(books);
+        for (std::size_t i = 0; i < books; ++i) {
+            prepared.push_back(std::make_shared<const Book>(make_book(i, rng)));
+        }
+        auto start = Clock::now();
+        for (auto& book : prepared) {
+            store.insert(std::move(book));
+        }
+        double insert_seconds = seconds_since(start);
+        prepared.clear();
+
+        std::printf("\nbooks=%zu: %.0f inserts/sec\n", books, books / insert_seconds);
+        std::printf("%-16s %12s %12s %10s %10s\n", "query", "index us", "scan us", "speedup", "returned");
+        for (const auto& shape : shapes) {
+            std::vector<BookStore::Query> queries;
+            for (std::size_t q = 0; q < query_count; ++q) {
+                queries.push_back(shape.make(rng));
+            }
+            // Scans take milliseconds per query on large stores; time fewer
+            std::size_t scan_count = std::max<std::size_t>(3, query_count * 10000 / books / 10);
+            std::vector<BookStore::Query> scan_queries(queries.begin(),
+                                                       queries.begin() + std::min(scan_count, queries.size()));
+
+            auto [index_us, returned] = time_queries(store, queries, limit, indexed);
+            auto [scan_us, scan_returned] = time_queries(store, scan_queries, limit, scan);
+            (void)scan_returned;
+            std::printf("%-16s %12.1f %12.1f %9.0fx %10.1f\n", shape.name, index_us, scan_us, scan_us / index_us,
+                        returned);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,698 @@
+// HTTP load generator and latency benchmark for a running server.
+//
+// Creates a set of books through POST /book, then drives a mix of
+// GET /book/<id>, GET /book?limit=20 and PUT /book/<id> over keep-alive
+// connections, one request in flight on each, and reports throughput and
+// latency percentiles as JSON on stdout (progress goes to stderr).
+//
+// Closed loop (rate=0): each connection sends its next request as soon as
+// the last one is answered, which finds peak throughput. Open loop (rate>0):
+// requests are sent on a fixed schedule of rate per second across all
+// connections, and latency is measured from when a request was due rather
+// than when it went out, so a stalled server shows up as queueing delay
+// instead of being hidden by the client slowing down with it.
+//
+// Requests carry Accept-Encoding: encoding unless it is "identity", and
+// the report includes the bytes each kind of response took on the wire,
+// head and body. list_limit=0 lists every book instead of a page of 20. Given
+// the server's pid (Linux), the report also has the server's CPU time per
+// request over the measured interval.
+//
+// format=msgpack asks for MessagePack responses (Accept: application/msgpack)
+// instead of JSON; request bodies stay JSON. With batch=N above 1, each get
+// fetches N random books in one POST /book/_mget instead of one
+// GET /book/<id>, and the report adds books fetched per second, to compare
+// against N single gets (C++ server only).
+//
+// Works against either backend: the C++ server listens on 8080, the C
+// server on 3000. Run it on cores the server is not using (taskset).
+// POSIX sockets only.
+//
+// Usage: load_bench [host=127.0.0.1] [port=8080] [seconds=10] [connections=16] [rate=0]
+//                   [write_percent=10] [list_percent=5] [books=1000] [warmup=1]
+//                   [encoding=identity] [list_limit=20] [server_pid=0] [format=json] [batch=1]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cctype>
+#include <cinttypes>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr unsigned max_connections = 256;
+
+// Latency histogram in the style of HdrHistogram: exact below 2048 ns, then
+// 1024 linear buckets per power of two, so every recorded value is within
+// 0.1% (three significant digits) at a fixed 216 KB per histogram. Values
+// above about 68 s are clamped.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts_(bucket_count, 0) {}
+
+    void record(std::uint64_t nanos) {
+        nanos = std::min(nanos, max_trackable);
+        ++counts_[index_of(nanos)];
+        ++total_;
+        sum_ += nanos;
+        min_ = std::min(min_, nanos);
+        max_ = std::max(max_, nanos);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    std::uint64_t count() const { return total_; }
+    std::uint64_t min() const { return total_ ? min_ : 0; }
+    std::uint64_t max() const { return max_; }
+    double mean() const { return total_ ? static_cast<double>(sum_) / total_ : 0; }
+
+    // Highest value equivalent to the one at percentile (0-100)
+    std::uint64_t percentile(double percentile) const {
+        if (total_ == 0) {
+            return 0;
+        }
+        auto rank = static_cast<std::uint64_t>(std::ceil(percentile / 100.0 * total_));
+        rank = std::clamp<std::uint64_t>(rank, 1, total_);
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            seen += counts_[i];
+            if (seen >= rank) {
+                return std::min(highest_equivalent(i), max_);
+            }
+        }
+        return max_;
+    }
+
+private:
+    static constexpr unsigned sub_bucket_bits = 11; // 2048 sub-buckets
+    static constexpr std::uint64_t sub_bucket_count = 1u << sub_bucket_bits;
+    static constexpr std::uint64_t sub_bucket_half = sub_bucket_count / 2;
+    static constexpr unsigned max_magnitude = 36;   // 2^36 ns
+    static constexpr std::uint64_t max_trackable = (std::uint64_t{1} << max_magnitude) - 1;
+    static constexpr std::size_t bucket_count = (max_magnitude - sub_bucket_bits + 1) * sub_bucket_half + sub_bucket_half;
+
+    // Values with their top bit at 2^(10 + shift) keep their top 11 bits
+    static unsigned shift_of(std::uint64_t value) {
+        if (value < sub_bucket_count) {
+            return 0;
+        }
+        unsigned magnitude = 63 - static_cast<unsigned>(__builtin_clzll(value));
+        return magnitude - (sub_bucket_bits - 1);
+    }
+
+    static std::size_t index_of(std::uint64_t value) {
+        unsigned shift = shift_of(value);
+        return static_cast<std::size_t>(shift * sub_bucket_half + (value >> shift));
+    }
+
+    static std::uint64_t highest_equivalent(std::size_t index) {
+        if (index < sub_bucket_count) {
+            return index;
+        }
+        std::uint64_t shift = (index - sub_bucket_half) / sub_bucket_half;
+        std::uint64_t top = index - shift * sub_bucket_half;
+        return ((top + 1) << shift) - 1;
+    }
+
+    std::vector<std::uint64_t> counts_;
+    std::uint64_t total_ = 0;
+    std::uint64_t sum_ = 0;
+    std::uint64_t min_ = UINT64_MAX;
+    std::uint64_t max_ = 0;
+};
+
+// One keep-alive HTTP/1.1 connection with a single request in flight
+class HttpConnection {
+public:
+    explicit HttpConnection(const sockaddr_in& server) : server_(server) {}
+    HttpConnection(const HttpConnection&) = delete;
+    HttpConnection& operator=(const HttpConnection&) = delete;
+    ~HttpConnection() { close(); }
+
+    bool open() {
+        close();
+        fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_ < 0) {
+            return false;
+        }
+        int on = 1;
+        ::setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (::connect(fd_, reinterpret_cast<const sockaddr*>(&server_), sizeof(server_)) != 0) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        buffer_.clear();
+    }
+
+    bool is_open() const { return fd_ >= 0; }
+
+    // Sent with every request from now on unless empty
+    void set_accept_encoding(std::string_view encoding) {
+        accept_encoding_ = encoding;
+    }
+
+    // Sent as Accept with every request from now on unless empty
+    void set_accept(std::string_view media_type) {
+        accept_ = media_type;
+    }
+
+    // Bytes the last response took, head and body
+    std::size_t response_bytes() const { return response_bytes_; }
+
+    // Sends a request and reads the whole response. Returns the status, or
+    // nothing if the connection failed (it is closed then).
+    std::optional<int> request(std::string_view method, std::string_view target,
+                               std::string_view body, std::string* response_body = nullptr) {
+        request_.clear();
+        request_.append(method).append(" ").append(target).append(" HTTP/1.1\r\nHost: localhost\r\n");
+        if (!accept_encoding_.empty()) {
+            request_.append("Accept-Encoding: ").append(accept_encoding_).append("\r\n");
+        }
+        if (!accept_.empty()) {
+            request_.append("Accept: ").append(accept_).append("\r\n");
+        }
+        if (!body.empty()) {
+            request_.append("Content-Type: application/json\r\nContent-Length: ")
+                .append(std::to_string(body.size()))
+                .append("\r\n");
+        }
+        request_.append("\r\n").append(body);
+        if (!send_all(request_)) {
+            close();
+            return std::nullopt;
+        }
+        auto status = read_response(response_body);
+        if (!status) {
+            close();
+        }
+        return status;
+    }
+
+private:
+    bool send_all(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t sent = ::send(fd_, data.data(), data.size(), MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return false;
+            }
+            data.remove_prefix(static_cast<std::size_t>(sent));
+        }
+        return true;
+    }
+
+    bool fill() {
+        char chunk[16384];
+        ssize_t got = ::recv(fd_, chunk, sizeof(chunk), 0);
+        if (got <= 0) {
+            return false;
+        }
+        buffer_.append(chunk, static_cast<std::size_t>(got));
+        return true;
+    }
+
+    // Returns the position just past the next CRLF at or after from
+    std::optional<std::size_t> line_end(std::size_t from) {
+        for (;;) {
+            auto pos = buffer_.find("\r\n", from);
+            if (pos != std::string::npos) {
+                return pos + 2;
+            }
+            if (!fill()) {
+                return std::nullopt;
+            }
+        }
+    }
+
+    bool await(std::size_t size) {
+        while (buffer_.size() < size) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool header_is(std::string_view line, std::string_view name) {
+        if (line.size() <= name.size() || line[name.size()] != ':') {
+            return false;
+        }
+        for (std::size_t i = 0; i < name.size(); ++i) {
+            if (std::tolower(static_cast<unsigned char>(line[i])) != name[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static std::string_view header_value(std::string_view line, std::size_t name_size) {
+        line.remove_prefix(name_size + 1);
+        while (!line.empty() && line.front() == ' ') {
+            line.remove_prefix(1);
+        }
+        return line;
+    }
+
+    std::optional<int> read_response(std::string* body) {
+        std::size_t head_end;
+        for (;;) {
+            head_end = buffer_.find("\r\n\r\n");
+            if (head_end != std::string::npos) {
+                break;
+            }
+            if (!fill()) {
+                return std::nullopt;
+            }
+        }
+
+        int status = 0;
+        if (std::sscanf(buffer_.c_str(), "HTTP/1.%*d %d", &status) != 1) {
+            return std::nullopt;
+        }
+        std::optional<std::size_t> length;
+        bool chunked = false;
+        bool closing = false;
+        std::size_t pos = buffer_.find("\r\n") + 2;
+        while (pos < head_end + 2) {
+            std::size_t next = buffer_.find("\r\n", pos);
+            std::string_view line(buffer_.data() + pos, next - pos);
+            if (header_is(line, "content-length")) {
+                length = std::strtoull(std::string(header_value(line, 14)).c_str(), nullptr, 10);
+            } else if (header_is(line, "transfer-encoding")) {
+                chunked = header_value(line, 17).find("chunked") != std::string_view::npos;
+            } else if (header_is(line, "connection")) {
+                closing = header_value(line, 10) == "close";
+            }
+            pos = next + 2;
+        }
+        pos = head_end + 4;
+        if (body) {
+            body->clear();
+        }
+
+        if (chunked) {
+            for (;;) {
+                auto size_end = line_end(pos);
+                if (!size_end) {
+                    return std::nullopt;
+                }
+                std::size_t size = std::strtoull(buffer_.c_str() + pos, nullptr, 16);
+                pos = *size_end;
+                if (size == 0) {
+                    break;
+                }
+                if (!await(pos + size + 2)) {
+                    return std::nullopt;
+                }
+                if (body) {
+                    body->append(buffer_, pos, size);
+                }
+                pos += size + 2;
+            }
+            // Trailers, if any, end with an empty line
+            for (;;) {
+                auto end = line_end(pos);
+                if (!end) {
+                    return std::nullopt;
+                }
+                bool empty = *end == pos + 2;
+                pos = *end;
+                if (empty) {
+                    break;
+                }
+            }
+        } else if (length) {
+            if (!await(pos + *length)) {
+                return std::nullopt;
+            }
+            if (body) {
+                body->append(buffer_, pos, *length);
+            }
+            pos += *length;
+        } else if (status != 204 && status != 304 && status >= 200) {
+            // Body runs to the end of the connection
+            while (fill()) {
+            }
+            if (body) {
+                body->append(buffer_, pos, std::string::npos);
+            }
+            pos = buffer_.size();
+            closing = true;
+        }
+
+        response_bytes_ = pos;
+        buffer_.erase(0, pos);
+        if (closing) {
+            close();
+        }
+        return status;
+    }
+
+    sockaddr_in server_;
+    int fd_ = -1;
+    std::string buffer_;  // Received bytes not yet consumed
+    std::string request_; // Reused for every request
+    std::string accept_encoding_;
+    std::string accept_;
+    std::size_t response_bytes_ = 0;
+};
+
+enum Operation { Get, List, Put, operation_count };
+
+constexpr const char* operation_names[operation_count] = {"get", "list", "put"};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    double seconds = 10;
+    unsigned connections = 16;
+    double rate = 0;
+    unsigned write_percent = 10;
+    unsigned list_percent = 5;
+    std::size_t books = 1000;
+    double warmup = 1;
+    std::string encoding = "identity";
+    std::size_t list_limit = 20;
+    long server_pid = 0;
+    std::string format = "json";
+    std::size_t batch = 1;
+};
+
+struct WorkerResult {
+    LatencyHistogram latency[operation_count];
+    std::uint64_t errors[operation_count] = {};
+    std::uint64_t bytes[operation_count] = {};
+    std::uint64_t reconnects = 0;
+};
+
+std::string book_json(std::size_t i, std::uint64_t version) {
+    return "{\"title\":\"Load test book " + std::to_string(i) + "\",\"author\":\"Author " + std::to_string(i % 100) +
+           "\",\"publishedDate\":\"1985-10-14\",\"description\":\"Revision " + std::to_string(version) +
+           "\",\"coverImageUrl\":\"https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg\"}";
+}
+
+// Pulls the id out of a created book, with or without spaces after the colon
+std::string extract_id(const std::string& json) {
+    auto key = json.find("\"id\"");
+    if (key == std::string::npos) {
+        return {};
+    }
+    auto open = json.find('"', json.find(':', key) + 1);
+    auto close = json.find('"', open + 1);
+    if (open == std::string::npos || close == std::string::npos) {
+        return {};
+    }
+    return json.substr(open + 1, close - open - 1);
+}
+
+bool create_books(const sockaddr_in& server, std::size_t count, std::vector<std::string>& ids) {
+    HttpConnection connection(server);
+    std::string body;
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!connection.is_open() && !connection.open()) {
+            return false;
+        }
+        auto status = connection.request("POST", "/book", book_json(i, 0), &body);
+        std::string id = status == 201 ? extract_id(body) : std::string();
+        if (id.empty()) {
+            std::fprintf(stderr, "POST /book failed with status %d: %s\n", status.value_or(0), body.c_str());
+            return false;
+        }
+        ids.push_back(std::move(id));
+    }
+    return true;
+}
+
+void run_worker(const sockaddr_in& server, const Options& options, const std::vector<std::string>& ids,
+                unsigned index, Clock::time_point start, Clock::time_point measure_from,
+                Clock::time_point end, WorkerResult& result) {
+    HttpConnection connection(server);
+    if (options.encoding != "identity") {
+        connection.set_accept_encoding(options.encoding);
+    }
+    if (options.format == "msgpack") {
+        connection.set_accept("application/msgpack");
+    }
+    std::mt19937_64 rng(index + 1);
+    std::uniform_int_distribution<std::size_t> pick(0, ids.size() - 1);
+    std::uniform_int_distribution<unsigned> percent(0, 99);
+    const std::string list_target = options.list_limit > 0 ? "/book?limit=" + std::to_string(options.list_limit)
+                                                           : std::string("/book");
+    std::string target;
+    std::string mget_body;
+
+    // Open loop: this connection's share of the rate, staggered so the
+    // connections do not all fire at once
+    bool open_loop = options.rate > 0;
+    Clock::duration interval{};
+    Clock::time_point due = start;
+    if (open_loop) {
+        interval = std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double>(options.connections / options.rate));
+        due = start + interval * index / options.connections;
+    }
+
+    for (std::uint64_t sent = 0;; ++sent) {
+        if (open_loop) {
+            if (due >= end) {
+                break;
+            }
+            std::this_thread::sleep_until(due);
+        } else if (Clock::now() >= end) {
+            break;
+        }
+        if (!connection.is_open()) {
+            if (!connection.open()) {
+                // Count the failure and back off instead of spinning on connect
+                result.errors[Get]++;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                due += interval;
+                continue;
+            }
+            result.reconnects += sent > 0;
+        }
+
+        unsigned roll = percent(rng);
+        Operation op = roll < options.write_percent ? Put
+                     : roll < options.write_percent + options.list_percent ? List
+                     : Get;
+        std::size_t book = pick(rng);
+        std::optional<int> status;
+        Clock::time_point sent_at = Clock::now();
+        switch (op) {
+            case Get:
+                if (options.batch > 1) {
+                    mget_body = "{\"ids\":[\"" + ids[book] + "\"";
+                    for (std::size_t i = 1; i < options.batch; ++i) {
+                        mget_body.append(",\"").append(ids[pick(rng)]).append("\"");
+                    }
+                    mget_body += "]}";
+                    status = connection.request("POST", "/book/_mget", mget_body);
+                    break;
+                }
+                target = "/book/" + ids[book];
+                status = connection.request("GET", target, {});
+                break;
+            case List:
+                status = connection.request("GET", list_target, {});
+                break;
+            case Put:
+                target = "/book/" + ids[book];
+                status = connection.request("PUT", target, book_json(book, sent + 1));
+                break;
+            default:
+                break;
+        }
+        Clock::time_point done = Clock::now();
+
+        Clock::time_point began = open_loop ? due : sent_at;
+        if (began >= measure_from) {
+            if (status == 200) {
+                result.latency[op].record(static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(done - began).count()));
+                result.bytes[op] += connection.response_bytes();
+            } else {
+                result.errors[op]++;
+            }
+        }
+        due += interval;
+    }
+}
+
+// CPU time pid has used, user and system, from /proc; 0 if unknown
+double process_cpu_seconds(long pid) {
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string text((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+    // Fields after the command name, which may hold spaces: utime and stime
+    // are the 12th and 13th of them
+    auto paren = text.rfind(')');
+    if (paren == std::string::npos) {
+        return 0;
+    }
+    const char* p = text.c_str() + paren + 1;
+    unsigned long long utime = 0;
+    unsigned long long stime = 0;
+    if (std::sscanf(p, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return static_cast<double>(utime + stime) / static_cast<double>(sysconf(_SC_CLK_TCK));
+}
+
+void print_latency(const LatencyHistogram& h) {
+    auto us = [](double nanos) { return nanos / 1000.0; };
+    std::printf("{\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p99.9\":%.1f,"
+                "\"p99.99\":%.1f,\"max\":%.1f}",
+                us(h.min()), us(h.mean()), us(h.percentile(50)), us(h.percentile(90)), us(h.percentile(99)),
+                us(h.percentile(99.9)), us(h.percentile(99.99)), us(h.max()));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options options;
+    if (argc > 1) options.host = argv[1];
+    if (argc > 2) options.port = std::atoi(argv[2]);
+    if (argc > 3) options.seconds = std::atof(argv[3]);
+    if (argc > 4) options.connections = static_cast<unsigned>(std::atoi(argv[4]));
+    if (argc > 5) options.rate = std::atof(argv[5]);
+    if (argc > 6) options.write_percent = static_cast<unsigned>(std::atoi(argv[6]));
+    if (argc > 7) options.list_percent = static_cast<unsigned>(std::atoi(argv[7]));
+    if (argc > 8) options.books = std::strtoull(argv[8], nullptr, 10);
+    if (argc > 9) options.warmup = std::atof(argv[9]);
+    if (argc > 10) options.encoding = argv[10];
+    if (argc > 11) options.list_limit = std::strtoull(argv[11], nullptr, 10);
+    if (argc > 12) options.server_pid = std::atol(argv[12]);
+    if (argc > 13) options.format = argv[13];
+    if (argc > 14) options.batch = std::strtoull(argv[14], nullptr, 10);
+
+    if (options.seconds <= 0 || options.warmup < 0 || options.rate < 0 || options.books == 0 ||
+        options.connections == 0 || options.connections > max_connections ||
+        options.write_percent + options.list_percent > 100 || options.batch == 0 ||
+        (options.format != "json" && options.format != "msgpack")) {
+        std::fprintf(stderr, "seconds, books and batch must be positive, connections between 1 and %u, "
+                             "write_percent + list_percent at most 100, and format json or msgpack\n",
+                     max_connections);
+        return 1;
+    }
+
+    sockaddr_in server{};
+    server.sin_family = AF_INET;
+    server.sin_port = htons(static_cast<unsigned short>(options.port));
+    if (inet_pton(AF_INET, options.host.c_str(), &server.sin_addr) != 1) {
+        std::fprintf(stderr, "host must be an IPv4 address\n");
+        return 1;
+    }
+
+    std::vector<std::string> ids;
+    ids.reserve(options.books);
+    std::fprintf(stderr, "Creating %zu books on %s:%d\n", options.books, options.host.c_str(), options.port);
+    if (!create_books(server, options.books, ids)) {
+        std::fprintf(stderr, "Could not create books on %s:%d\n", options.host.c_str(), options.port);
+        return 1;
+    }
+
+    std::fprintf(stderr, "Running %s loop on %u connections for %.1f s after %.1f s of warmup\n",
+                 options.rate > 0 ? "an open" : "a closed", options.connections, options.seconds, options.warmup);
+    std::vector<WorkerResult> results(options.connections);
+    std::vector<std::thread> workers;
+    auto start = Clock::now();
+    auto measure_from = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.warmup));
+    auto end = measure_from + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.seconds));
+    for (unsigned i = 0; i < options.connections; ++i) {
+        workers.emplace_back(run_worker, std::cref(server), std::cref(options), std::cref(ids), i,
+                             start, measure_from, end, std::ref(results[i]));
+    }
+    double server_cpu = 0;
+    if (options.server_pid > 0) {
+        std::this_thread::sleep_until(measure_from);
+        server_cpu = -process_cpu_seconds(options.server_pid);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - measure_from).count();
+    if (options.server_pid > 0) {
+        server_cpu += process_cpu_seconds(options.server_pid);
+    }
+
+    LatencyHistogram all;
+    LatencyHistogram by_operation[operation_count];
+    std::uint64_t errors[operation_count] = {};
+    std::uint64_t bytes[operation_count] = {};
+    std::uint64_t reconnects = 0;
+    for (const auto& result : results) {
+        for (int op = 0; op < operation_count; ++op) {
+            all.merge(result.latency[op]);
+            by_operation[op].merge(result.latency[op]);
+            errors[op] += result.errors[op];
+            bytes[op] += result.bytes[op];
+        }
+        reconnects += result.reconnects;
+    }
+    std::uint64_t total_errors = errors[Get] + errors[List] + errors[Put];
+
+    std::printf("{\"target\":\"%s:%d\",\"mode\":\"%s\",\"rate\":%.0f,\"connections\":%u,\"seconds\":%.3f,"
+                "\"warmup\":%.3f,\"books\":%zu,\"encoding\":\"%s\",\"list_limit\":%zu,"
+                "\"format\":\"%s\",\"batch\":%zu,\"mix\":{\"get\":%u,\"list\":%u,\"put\":%u},",
+                options.host.c_str(), options.port, options.rate > 0 ? "open" : "closed", options.rate,
+                options.connections, elapsed, options.warmup, options.books, options.encoding.c_str(),
+                options.list_limit, options.format.c_str(), options.batch,
+                100 - options.write_percent - options.list_percent, options.list_percent, options.write_percent);
+    if (by_operation[Get].count() > 0) {
+        std::printf("\"books_fetched_per_second\":%.1f,", by_operation[Get].count() * options.batch / elapsed);
+    }
+    if (options.server_pid > 0 && all.count() > 0) {
+        std::printf("\"server_cpu_us_per_request\":%.1f,", server_cpu / all.count() * 1e6);
+    }
+    std::printf("\"requests\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"reconnects\":%" PRIu64
+                ",\"throughput\":%.1f,\"latency_us\":",
+                all.count(), total_errors, reconnects, all.count() / elapsed);
+    print_latency(all);
+    std::printf(",\"operations\":{");
+    for (int op = 0; op < operation_count; ++op) {
+        std::uint64_t count = by_operation[op].count();
+        std::printf("%s\"%s\":{\"requests\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"throughput\":%.1f,"
+                    "\"bytes_per_response\":%.0f,\"latency_us\":",
+                    op > 0 ? "," : "", operation_names[op], count, errors[op], count / elapsed,
+                    count > 0 ? static_cast<double>(bytes[op]) / count : 0.0);
+        print_latency(by_operation[op]);
+        std::printf("}");
+    }
+    std::printf("}}\n");
+    return 0;
+}
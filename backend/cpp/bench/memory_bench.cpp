@@ -0,0 +1,143 @@
+// Memory benchmark for BookStore.
+//
+// Fills a store with a catalog of typical books and reports resident bytes
+// per book, next to the same catalog in the previous layout: a Book of five
+// std::string members per shared_ptr and an index keyed by std::string.
+//
+// Usage: memory_bench [books=1000000] [authors=20000]
+// Linux only: resident memory is read from /proc/self/statm, in a child
+// process per layout so neither inherits the other's heap.
+
+#include "../book_store.h"
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+std::size_t resident_bytes() {
+    unsigned long long pages = 0;
+    unsigned long long resident = 0;
+    if (FILE* f = std::fopen("/proc/self/statm", "r")) {
+        if (std::fscanf(f, "%llu %llu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        std::fclose(f);
+    }
+    return static_cast<std::size_t>(resident) * static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// A 36 character id like the server's UUIDs, a ~30 byte title, a shared
+// author and an Open Library cover URL
+BookFields make_book(std::size_t i, std::size_t authors) {
+    char id[40];
+    std::snprintf(id, sizeof(id), "3f2c8a4e-1b7d-4c1e-9a65-%012zu", i);
+    return {
+        std::string(id),
+        "The Collected Stories, Vol. " + std::to_string(i),
+        "Author Number " + std::to_string(i % authors),
+        "1985-10-14",
+        "https://covers.openlibrary.org/b/id/" + std::to_string(6000000 + i) + "-L.jpg"
+    };
+}
+
+// The layout BookStore used before books were compacted
+struct LegacyStore {
+    struct Slot {
+        std::shared_ptr<const BookFields> book;
+        std::uint32_t position;
+        std::uint32_t next_free;
+    };
+    struct Entry {
+        std::uint64_t seq;
+        std::uint32_t slot;
+    };
+
+    std::vector<Slot> slots;
+    std::unordered_map<std::string, std::uint32_t> index;
+    std::vector<Entry> order;
+
+    void insert(BookFields fields) {
+        auto slot = static_cast<std::uint32_t>(slots.size());
+        index.emplace(*fields.id, slot);
+        slots.push_back({std::make_shared<const BookFields>(std::move(fields)),
+                         static_cast<std::uint32_t>(order.size()), UINT32_MAX});
+        order.push_back({order.size() + 1, slot});
+    }
+};
+
+// Runs fill in a child process and returns how much it grew the child's
+// resident memory
+template <typename Fill>
+std::size_t measure(Fill&& fill) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 0;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        std::size_t before = resident_bytes();
+        fill();
+        std::size_t grown = resident_bytes() - before;
+        ssize_t written = write(fds[1], &grown, sizeof(grown));
+        _exit(written == sizeof(grown) ? 0 : 1);
+    }
+    close(fds[1]);
+    std::size_t grown = 0;
+    if (pid < 0 || read(fds[0], &grown, sizeof(grown)) != sizeof(grown)) {
+        grown = 0;
+    }
+    close(fds[0]);
+    if (pid > 0) {
+        waitpid(pid, nullptr, 0);
+    }
+    return grown;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t books = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t authors = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 20000;
+    if (books == 0 || authors == 0) {
+        std::fprintf(stderr, "books and authors must be positive\n");
+        return 1;
+    }
+
+    std::size_t legacy_bytes = measure([&] {
+        LegacyStore legacy;
+        legacy.slots.reserve(books);
+        legacy.index.reserve(books);
+        legacy.order.reserve(books);
+        for (std::size_t i = 0; i < books; ++i) {
+            legacy.insert(make_book(i, authors));
+        }
+    });
+    std::size_t store_bytes = measure([&] {
+        BookStore store;
+        store.reserve(books);
+        for (std::size_t i = 0; i < books; ++i) {
+            store.insert(std::make_shared<const Book>(make_book(i, authors)));
+        }
+    });
+    if (legacy_bytes == 0 || store_bytes == 0) {
+        std::fprintf(stderr, "Could not measure resident memory\n");
+        return 1;
+    }
+
+    std::printf("books=%zu authors=%zu\n", books, authors);
+    std::printf("%-16s %14s %12s\n", "layout", "resident MiB", "bytes/book");
+    std::printf("%-16s %14.1f %12.1f\n", "std::string Book", legacy_bytes / 1048576.0,
+                static_cast<double>(legacy_bytes) / books);
+    std::printf("%-16s %14.1f %12.1f\n", "compact Book", store_bytes / 1048576.0,
+                static_cast<double>(store_bytes) / books);
+    std::printf("reduction %.1fx\n", static_cast<double>(legacy_bytes) / store_bytes);
+    return 0;
+}
@@ -0,0 +1,161 @@
+// Instrumentation overhead benchmark.
+//
+// Runs the work of GET /book/<id> and PUT /book/<id> in process, with the
+// same timings the server records (request, JSON parse and serialize, store
+// lock wait and hold), alternating rounds with metrics off and on, and
+// prints requests per second for each and the difference. Without the HTTP
+// and socket work around each request this is the worst case: the share of
+// a real request's time is smaller still, which load_bench against servers
+// started with BOOK_METRICS=0 and =1 measures end to end.
+//
+// Usage: metrics_bench [books=100000] [seconds=1] [write_percent=10] [threads=cores] [rounds=5]
+
+#include "../book_parser.h"
+#include "../metrics.h"
+#include "../sharded_book_store.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+BookFields make_book(std::size_t i) {
+    return {
+        "bench-" + std::to_string(i),
+        "Title " + std::to_string(i),
+        "Author " + std::to_string(i % 1000),
+        "1985-10-14",
+        "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg"
+    };
+}
+
+std::string make_body(std::size_t i, unsigned version) {
+    return "{\"title\":\"Title " + std::to_string(i) + " v" + std::to_string(version) + "\",\"author\":\"Author " +
+           std::to_string(i % 1000) + "\",\"publishedDate\":\"1985-10-14\",\"coverImageUrl\":"
+           "\"https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg\"}";
+}
+
+// One request's work, timed as the server times it
+std::size_t handle(ShardedBookStore& store, std::size_t i, bool write, const std::string& body) {
+    bool on = metrics_enabled();
+    auto start = on ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+    std::string id = "bench-" + std::to_string(i);
+    std::string response;
+    int status = 200;
+
+    if (write) {
+        std::optional<ParsedBook> parsed;
+        {
+            ScopedTiming timing(MetricTiming::JsonParse);
+            parsed = parse_book_json(body);
+        }
+        BookFields book = std::move(parsed->book);
+        book.id = id;
+        auto updated = std::make_shared<const Book>(std::move(book));
+        store.update(updated);
+        ScopedTiming timing(MetricTiming::JsonSerialize);
+        response = updated->to_json().dump();
+    } else if (auto book = store.find(id)) {
+        ScopedTiming timing(MetricTiming::JsonSerialize);
+        response = book->to_json().dump();
+    } else {
+        status = 404;
+    }
+
+    if (on) {
+        record_request(write ? MetricRoute::UpdateBook : MetricRoute::GetBook, status,
+                       std::chrono::steady_clock::now() - start);
+    }
+    return response.size();
+}
+
+double run(ShardedBookStore& store, std::size_t books, unsigned threads, double seconds, unsigned write_percent,
+           const std::vector<std::string>& bodies) {
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> total{0};
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937_64 rng(t + 1);
+            std::uniform_int_distribution<std::size_t> pick(0, books - 1);
+            std::uniform_int_distribution<unsigned> percent(0, 99);
+            std::uint64_t requests = 0;
+            std::size_t bytes = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                std::size_t i = pick(rng);
+                bool write = percent(rng) < write_percent;
+                bytes += handle(store, i, write, bodies[i % bodies.size()]);
+                ++requests;
+            }
+            total += requests;
+            if (bytes == SIZE_MAX) {
+                std::puts(""); // Keep the responses from being optimized away
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return total / seconds;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t books = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    double seconds = argc > 2 ? std::atof(argv[2]) : 1.0;
+    unsigned write_percent = argc > 3 ? static_cast<unsigned>(std::atoi(argv[3])) : 10;
+    unsigned threads = argc > 4 ? static_cast<unsigned>(std::atoi(argv[4]))
+                                : std::max(1u, std::thread::hardware_concurrency());
+    int rounds = argc > 5 ? std::atoi(argv[5]) : 5;
+    if (books == 0 || threads == 0 || rounds <= 0 || seconds <= 0) {
+        std::fprintf(stderr, "books, seconds, threads and rounds must be positive\n");
+        return 1;
+    }
+
+    ShardedBookStore store;
+    std::vector<BookStore::BookPtr> catalog;
+    catalog.reserve(books);
+    for (std::size_t i = 0; i < books; ++i) {
+        catalog.push_back(std::make_shared<const Book>(make_book(i)));
+    }
+    store.insert_batch(catalog);
+
+    // Parsing is measured on bodies built up front, as the server gets them
+    std::vector<std::string> bodies;
+    for (std::size_t i = 0; i < std::min<std::size_t>(books, 1024); ++i) {
+        bodies.push_back(make_body(i, 1));
+    }
+
+    std::printf("books=%zu seconds=%.1f write_percent=%u threads=%u\n", books, seconds, write_percent, threads);
+    std::printf("%6s %16s %16s %10s\n", "round", "off req/sec", "on req/sec", "overhead");
+
+    // Alternate so drift in the machine's speed hits both sides alike, and
+    // compare the best rounds, which are the least disturbed
+    double best_off = 0;
+    double best_on = 0;
+    for (int round = 1; round <= rounds; ++round) {
+        set_metrics_enabled(false);
+        double off = run(store, books, threads, seconds, write_percent, bodies);
+        set_metrics_enabled(true);
+        double on = run(store, books, threads, seconds, write_percent, bodies);
+        best_off = std::max(best_off, off);
+        best_on = std::max(best_on, on);
+        std::printf("%6d %16.0f %16.0f %9.2f%%\n", round, off, on, (off - on) / off * 100);
+    }
+    std::printf("%6s %16.0f %16.0f %9.2f%%\n", "best", best_off, best_on, (best_off - best_on) / best_off * 100);
+    std::printf("per request: %.0f ns off, %.0f ns on\n", threads * 1e9 / best_off, threads * 1e9 / best_on);
+    return 0;
+}
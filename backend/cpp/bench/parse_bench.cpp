@@ -0,0 +1,187 @@
+// Request body parsing: parse_book_json against crow::json::load, which the
+// POST/PUT handlers used before.
+//
+// Before timing, generated bodies and mutated copies of them (truncated,
+// byte-flipped, spliced) go through both parsers. A body parse_book_json
+// accepts must load in Crow with the same field values, and every
+// well-formed body must be accepted. Crow decodes surrogate pairs
+// differently, so fields containing one are not compared.
+//
+// Usage: parse_bench [bodies=2000] [mutations=200000] [rounds=200]
+
+#include "../book_parser.h"
+#include <crow.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::mt19937_64 rng(42);
+
+std::size_t pick(std::size_t n) {
+    return std::uniform_int_distribution<std::size_t>(0, n - 1)(rng);
+}
+
+const char* string_pieces[] = {
+    "The C++ Programming Language", "Stroustrup", " and ", "\\\"quoted\\\"", "line\\nbreak",
+    "tab\\there", "back\\\\slash", "caf\\u00e9", "\\u20ac", "\\ud83d\\ude00", "slash\\/ed",
+    "caf\xc3\xa9 raw", "https://covers.openlibrary.org/b/id/6660100-L.jpg", "1985-10-14",
+    "a long run of plain text that crosses several simd blocks without any escapes at all",
+};
+
+const char* extra_members[] = {
+    "\"year\":1985", "\"rating\":-4.5e+1", "\"tags\":[\"c++\",\"classic\",[],{}]",
+    "\"meta\":{\"pages\":1376,\"ok\":true,\"x\":null,\"y\":false}", "\"description\":\"A classic\"",
+};
+
+const char* known_keys[] = {"title", "author", "published_date", "coverImageUrl"};
+const unsigned known_bits[] = {BookFieldTitle, BookFieldAuthor, BookFieldPublishedDate, BookFieldCoverImageUrl};
+
+std::string generate_body() {
+    const char* ws[] = {"", " ", "\n  ", "\t"};
+    std::string body = ws[pick(4)];
+    body += '{';
+    std::size_t members = pick(7);
+    for (std::size_t i = 0; i < members; ++i) {
+        body += i > 0 ? "," : "";
+        body += ws[pick(4)];
+        if (pick(3) == 0) {
+            body += extra_members[pick(std::size(extra_members))];
+            continue;
+        }
+        body += std::string("\"") + known_keys[pick(4)] + "\"" + ws[pick(4)] + ":" + ws[pick(4)];
+        if (pick(8) == 0) {
+            body += "null";
+            continue;
+        }
+        body += '"';
+        for (std::size_t n = pick(4); n > 0; --n) {
+            body += string_pieces[pick(std::size(string_pieces))];
+        }
+        body += '"';
+    }
+    body += ws[pick(4)];
+    body += '}';
+    return body;
+}
+
+std::string mutate_body(std::string body) {
+    static const char structural[] = "{}[]\",:\\ u0e-.";
+    if (body.empty()) {
+        return body;
+    }
+    std::size_t at = pick(body.size());
+    switch (pick(4)) {
+    case 0:
+        body.resize(at);
+        break;
+    case 1:
+        body[at] = static_cast<char>(1 + pick(255));
+        break;
+    case 2:
+        body[at] = structural[pick(sizeof(structural) - 1)];
+        break;
+    default:
+        body.insert(body.begin() + static_cast<std::ptrdiff_t>(at), structural[pick(sizeof(structural) - 1)]);
+        break;
+    }
+    return body;
+}
+
+// Returns false if parse_book_json and Crow disagree on a body
+bool compare(const std::string& body, bool must_accept, int& lenient) {
+    auto parsed = parse_book_json(body);
+    auto loaded = crow::json::load(body);
+    bool crow_ok = loaded && loaded.t() == crow::json::type::Object;
+
+    bool ok = true;
+    if (!parsed) {
+        ok = !must_accept;
+        lenient += crow_ok;
+    } else if (!crow_ok) {
+        ok = false;
+    } else {
+        const std::string values[] = {parsed->book.title, parsed->book.author,
+                                      parsed->book.published_date.value_or(""), parsed->book.coverImageUrl};
+        for (int i = 0; ok && i < 4; ++i) {
+            bool has = loaded.has(known_keys[i]) && loaded[known_keys[i]].t() == crow::json::type::String;
+            if (has != ((parsed->fields & known_bits[i]) != 0)) {
+                ok = false;
+            } else if (has && body.find("\\ud") == std::string::npos && body.find("\\uD") == std::string::npos) {
+                ok = loaded[known_keys[i]].s() == values[i];
+            }
+        }
+    }
+
+    if (!ok) {
+        std::fprintf(stderr, "parsers disagree on: %s\n", body.c_str());
+    }
+    return ok;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? std::atoi(argv[1]) : 2000;
+    int mutations = argc > 2 ? std::atoi(argv[2]) : 200000;
+    int rounds = argc > 3 ? std::atoi(argv[3]) : 200;
+
+    std::vector<std::string> bodies;
+    int lenient = 0;
+    int failures = 0;
+    std::size_t bytes = 0;
+
+    for (int i = 0; i < count; ++i) {
+        bodies.push_back(generate_body());
+        bytes += bodies.back().size();
+        failures += !compare(bodies.back(), true, lenient);
+    }
+    for (int i = 0; i < mutations; ++i) {
+        failures += !compare(mutate_body(bodies[pick(bodies.size())]), false, lenient);
+    }
+    std::printf("conformance: %d bodies, %d mutations, %d disagreements, %d accepted only by Crow\n",
+                count, mutations, failures, lenient);
+    if (failures > 0) {
+        return 1;
+    }
+
+    std::size_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (const auto& body : bodies) {
+            auto loaded = crow::json::load(body);
+            for (const char* key : known_keys) {
+                if (loaded.has(key) && loaded[key].t() == crow::json::type::String) {
+                    sink += loaded[key].s().size();
+                }
+            }
+        }
+    }
+    double crow_time = seconds_since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (const auto& body : bodies) {
+            if (auto parsed = parse_book_json(body)) {
+                sink += parsed->book.title.size() + parsed->book.author.size();
+            }
+        }
+    }
+    double parser_time = seconds_since(start);
+
+    double total = static_cast<double>(bytes) * rounds;
+    double ops = static_cast<double>(count) * rounds;
+    std::printf("%-16s %12s %12s\n", "parser", "ns/body", "MB/s");
+    std::printf("%-16s %12.1f %12.1f\n", "crow::json", crow_time / ops * 1e9, total / crow_time / 1e6);
+    std::printf("%-16s %12.1f %12.1f\n", "parse_book_json", parser_time / ops * 1e9, total / parser_time / 1e6);
+    std::printf("speedup %.1fx (checksum %zu)\n", crow_time / parser_time, sink);
+    return 0;
+}
@@ -0,0 +1,173 @@
+// Replication benchmark: how fast a follower loads the store, and catches
+// up after a disconnect.
+//
+// Runs a leader (store, change feed and ReplicationServer on a loopback
+// port) and its followers in one process, talking TCP as separate server
+// processes would, and prints:
+// - bootstrap: a new follower loading a snapshot of every book
+// - catch-up: a follower is stopped, the leader updates `writes` books, and
+//   a new follower resumes from where it stopped; events applied per second
+// - resync: the same with more updates than the change feed's ring holds,
+//   so the follower is sent a snapshot instead
+// - lag: with a writer updating `rate` books a second, the follower's
+//   staleness sampled every millisecond
+// and checks after each that the follower holds what the leader does. The
+// leader's threads and the follower's share the machine, so on few cores the
+// rates are for both ends together.
+//
+// Usage: replication_bench [books=100000] [writes=50000] [seconds=2] [rate=10000]
+
+#include "../change_feed.h"
+#include "../replication.h"
+#include "../sharded_book_store.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::string book_id(std::size_t i) {
+    return "bench-" + std::to_string(i);
+}
+
+// Bumps a book's version on the leader, as PUT /book/<id> does
+void update(ShardedBookStore& books, ChangeFeed& feed, const std::string& id) {
+    auto current = books.find(id);
+    BookFields fields = current->fields();
+    fields.title = "Title " + std::to_string(current->version());
+    fields.version = current->version() + 1;
+    books.update(std::make_shared<const Book>(std::move(fields)));
+    feed.publish(id);
+}
+
+// Waits until the follower has applied everything the leader has published,
+// and returns the seconds since start
+double wait_caught_up(const Follower& follower, const ChangeFeed& feed, Clock::time_point start) {
+    std::uint64_t target = feed.last_seq();
+    for (;;) {
+        Follower::Stats stats = follower.stats();
+        if (stats.loaded && stats.epoch == feed.epoch() && stats.applied_seq >= target) {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        if (Clock::now() - start > std::chrono::minutes(5)) {
+            std::fprintf(stderr, "follower did not catch up\n");
+            std::exit(1);
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+}
+
+bool same_books(const ShardedBookStore& leader, const ShardedBookStore& follower) {
+    if (leader.size() != follower.size()) {
+        return false;
+    }
+    for (const auto& book : leader.books()) {
+        auto copy = follower.find(book->id());
+        if (!copy || copy->version() != book->version() || copy->title() != book->title()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+double percentile(std::vector<double>& samples, double p) {
+    std::sort(samples.begin(), samples.end());
+    return samples[std::min(samples.size() - 1, static_cast<std::size_t>(p * samples.size()))];
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    std::size_t writes = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 50000;
+    double seconds = argc > 3 ? std::atof(argv[3]) : 2.0;
+    double rate = argc > 4 ? std::atof(argv[4]) : 10000;
+    if (count == 0 || seconds <= 0 || rate <= 0) {
+        std::fprintf(stderr, "books, seconds and rate must be positive\n");
+        return 1;
+    }
+
+    ShardedBookStore leader;
+    for (std::size_t i = 0; i < count; ++i) {
+        leader.insert(std::make_shared<const Book>(BookFields{
+            book_id(i), "Title " + std::to_string(i), "Author " + std::to_string(i % 1000), "1985-10-14",
+            "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg"}));
+    }
+    ChangeFeed feed(leader);
+    ReplicationServer server(leader, feed, 0);
+
+    ShardedBookStore replica;
+    std::mt19937_64 rng(1);
+    auto update_random = [&](std::size_t n) {
+        for (std::size_t i = 0; i < n; ++i) {
+            update(leader, feed, book_id(rng() % count));
+        }
+    };
+
+    std::printf("books=%zu writes=%zu port=%u\n", count, writes, static_cast<unsigned>(server.port()));
+    std::printf("%-10s %10s %12s %14s %10s\n", "phase", "events", "seconds", "per second", "matches");
+
+    // A new follower loads a snapshot
+    auto start = Clock::now();
+    auto follower = std::make_unique<Follower>(replica, "127.0.0.1", server.port(), nullptr);
+    double elapsed = wait_caught_up(*follower, feed, start);
+    std::printf("%-10s %10zu %12.3f %14.0f %10s\n", "bootstrap", count, elapsed, count / elapsed,
+                same_books(leader, replica) ? "yes" : "NO");
+
+    // Disconnect, fall behind by `writes` updates, resume; then the same
+    // past the end of the ring
+    std::size_t ring_writes = ChangeFeed::default_capacity + writes;
+    for (std::size_t behind : {writes, ring_writes}) {
+        ChangeFeed::Start position = follower->position();
+        follower.reset();
+        update_random(behind);
+
+        start = Clock::now();
+        follower = std::make_unique<Follower>(replica, "127.0.0.1", server.port(), nullptr, position);
+        elapsed = wait_caught_up(*follower, feed, start);
+        bool resynced = follower->stats().snapshots > 0;
+        std::printf("%-10s %10zu %12.3f %14.0f %10s\n", resynced ? "resync" : "catch-up", behind, elapsed,
+                    behind / elapsed, same_books(leader, replica) ? "yes" : "NO");
+    }
+
+    // Staleness under a steady stream of writes, sent on a fixed schedule
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> written{0};
+    std::thread writer([&] {
+        std::mt19937_64 writer_rng(2);
+        auto interval = std::chrono::duration<double>(1.0 / rate);
+        auto due = Clock::now();
+        while (!stop.load(std::memory_order_relaxed)) {
+            update(leader, feed, book_id(writer_rng() % count));
+            written.fetch_add(1, std::memory_order_relaxed);
+            due += std::chrono::duration_cast<Clock::duration>(interval);
+            std::this_thread::sleep_until(due);
+        }
+    });
+    std::vector<double> lags;
+    auto end = Clock::now() + std::chrono::duration<double>(seconds);
+    while (Clock::now() < end) {
+        lags.push_back(std::chrono::duration<double, std::milli>(follower->staleness()).count());
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    stop = true;
+    writer.join();
+    start = Clock::now();
+    double drain = wait_caught_up(*follower, feed, start);
+    std::printf("%-10s %10llu %12.3f %14.0f %10s\n", "lag", static_cast<unsigned long long>(written.load()),
+                seconds, written / seconds, same_books(leader, replica) ? "yes" : "NO");
+    double p50 = percentile(lags, 0.5);
+    double p99 = percentile(lags, 0.99);
+    std::printf("staleness under load: p50 %.1f ms, p99 %.1f ms, max %.1f ms; drained in %.1f ms\n", p50, p99,
+                lags.back(), drain * 1e3);
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Search benchmark for SearchIndex.
+//
+// Fills a store with generated books whose title words follow a Zipf-like
+// distribution, builds the index, then times queries of several shapes
+// (whole words, typeahead prefixes, author names, very common words) and
+// prints latency percentiles for each. Finally measures how fast the index
+// follows updates.
+//
+// Usage: search_bench [books=1000000] [queries=20000] [limit=20]
+
+#include "../book_store.h"
+#include "../search_index.h"
+#include "../sharded_book_store.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+const char* const syllables[] = {
+    "ka", "lo", "mi", "ren", "sa", "tor", "vel", "an", "bri", "dor", "el", "fa", "gun", "hal", "is",
+    "jor", "kin", "lu", "mar", "nov", "or", "pel", "qua", "ros", "sil", "tam", "ur", "vin", "wen", "yl",
+};
+constexpr std::size_t syllable_count = sizeof(syllables) / sizeof(syllables[0]);
+
+const char* const common_words[] = {"the", "of", "and", "a", "in", "to", "for", "with", "on", "at"};
+
+// Deterministic made-up word number i
+std::string make_word(std::size_t i) {
+    std::string word;
+    do {
+        word += syllables[i % syllable_count];
+        i /= syllable_count;
+    } while (i > 0);
+    return word;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct Catalog {
+    std::vector<std::string> vocabulary;
+    std::vector<std::string> first_names;
+    std::vector<std::string> last_names;
+};
+
+// Rank in [0, n) with low ranks much more likely, like word frequencies
+std::size_t zipf(std::mt19937_64& rng, std::size_t n) {
+    std::uniform_real_distribution<double> unit(0, 1);
+    return std::min(n - 1, static_cast<std::size_t>(std::pow(static_cast<double>(n), unit(rng))) - 1);
+}
+
+BookFields make_book(std::size_t i, const Catalog& catalog, std::mt19937_64& rng) {
+    std::uniform_int_distribution<int> words(2, 6);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::string title;
+    for (int w = words(rng); w > 0; --w) {
+        if (!title.empty()) {
+            title += ' ';
+        }
+        std::string word = percent(rng) < 25 ? common_words[zipf(rng, std::size(common_words))]
+                                              : catalog.vocabulary[zipf(rng, catalog.vocabulary.size())];
+        word[0] = static_cast<char>(word[0] - 'a' + 'A');
+        title += word;
+    }
+    std::string author = catalog.first_names[rng() % catalog.first_names.size()] + " " +
+                         catalog.last_names[zipf(rng, catalog.last_names.size())];
+    return {
+        "bench-" + std::to_string(i),
+        title,
+        author,
+        "1985-10-14",
+        "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg"
+    };
+}
+
+// Splits text on spaces
+std::vector<std::string> split(std::string_view text) {
+    std::vector<std::string> words;
+    std::size_t start = 0;
+    while (start < text.size()) {
+        std::size_t end = text.find(' ', start);
+        if (end == std::string_view::npos) {
+            end = text.size();
+        }
+        words.emplace_back(text.substr(start, end - start));
+        start = end + 1;
+    }
+    return words;
+}
+
+// A query shape: builds a query from a random stored book
+struct Shape {
+    const char* name;
+    std::string (*make)(const Book& book, std::mt19937_64& rng);
+};
+
+std::string random_word(std::string_view text, std::mt19937_64& rng) {
+    std::vector<std::string> words = split(text);
+    return words[rng() % words.size()];
+}
+
+const Shape shapes[] = {
+    {"word", [](const Book& book, std::mt19937_64& rng) { return random_word(book.title(), rng) + " "; }},
+    {"two words", [](const Book& book, std::mt19937_64& rng) {
+         return random_word(book.title(), rng) + " " + random_word(book.title(), rng) + " ";
+     }},
+    {"typeahead", [](const Book& book, std::mt19937_64& rng) {
+         // Every word but the last, then a prefix of the last
+         std::string title(book.title());
+         std::size_t cut = 1 + rng() % title.size();
+         while (cut < title.size() && title[cut - 1] == ' ') {
+             ++cut;
+         }
+         return title.substr(0, cut);
+     }},
+    {"author", [](const Book& book, std::mt19937_64& rng) {
+         std::string last = split(book.author()).back();
+         return last.substr(0, 2 + rng() % (last.size() - 1));
+     }},
+    {"common word", [](const Book&, std::mt19937_64& rng) {
+         return std::string(common_words[rng() % std::size(common_words)]) + " ";
+     }},
+    {"short prefix", [](const Book&, std::mt19937_64& rng) { return make_word(rng() % 1000).substr(0, 1); }},
+};
+
+double percentile(std::vector<double>& sorted, double p) {
+    return sorted[std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()))];
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t books = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    std::size_t queries = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 20000;
+    std::size_t limit = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 20;
+    if (books == 0 || queries == 0 || limit == 0) {
+        std::fprintf(stderr, "books, queries and limit must be positive\n");
+        return 1;
+    }
+
+    Catalog catalog;
+    for (std::size_t i = 0; i < 50000; ++i) {
+        catalog.vocabulary.push_back(make_word(i + syllable_count));
+    }
+    for (std::size_t i = 0; i < 300; ++i) {
+        catalog.first_names.push_back(make_word(i * 7 + 31));
+        catalog.first_names.back()[0] -= 'a' - 'A';
+    }
+    for (std::size_t i = 0; i < 20000; ++i) {
+        catalog.last_names.push_back(make_word(i * 13 + 1000));
+        catalog.last_names.back()[0] -= 'a' - 'A';
+    }
+
+    std::mt19937_64 rng(42);
+    ShardedBookStore store;
+    std::vector<BookStore::BookPtr> stored;
+    stored.reserve(books);
+    for (std::size_t i = 0; i < books; ++i) {
+        stored.push_back(std::make_shared<const Book>(make_book(i, catalog, rng)));
+    }
+    store.insert_batch(stored);
+
+    auto start = std::chrono::steady_clock::now();
+    SearchIndex index(store);
+    std::printf("books=%zu queries=%zu limit=%zu\n", books, queries, limit);
+    std::printf("index built in %.2f s\n\n", seconds_since(start));
+
+    std::printf("%-14s %10s %10s %10s %10s %10s\n", "query", "p50 us", "p99 us", "max us", "avg hits", "queries");
+    std::vector<double> all;
+    for (const Shape& shape : shapes) {
+        std::vector<double> latencies;
+        std::size_t hits = 0;
+        std::size_t count = queries / std::size(shapes);
+        for (std::size_t q = 0; q < count; ++q) {
+            std::string query = shape.make(*stored[rng() % books], rng);
+            auto query_start = std::chrono::steady_clock::now();
+            hits += index.search(query, limit).size();
+            latencies.push_back(seconds_since(query_start) * 1e6);
+        }
+        all.insert(all.end(), latencies.begin(), latencies.end());
+        std::sort(latencies.begin(), latencies.end());
+        std::printf("%-14s %10.1f %10.1f %10.1f %10.1f %10zu\n", shape.name, percentile(latencies, 0.5),
+                    percentile(latencies, 0.99), latencies.back(), static_cast<double>(hits) / count, count);
+    }
+    std::sort(all.begin(), all.end());
+    std::printf("%-14s %10.1f %10.1f %10.1f\n\n", "all", percentile(all, 0.5), percentile(all, 0.99), all.back());
+
+    // Replace random books with new titles and refresh the index for each
+    std::size_t updates = std::min<std::size_t>(books, 100000);
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < updates; ++i) {
+        std::size_t target = rng() % books;
+        auto updated = std::make_shared<const Book>(make_book(target, catalog, rng));
+        store.update(updated);
+        index.refresh(updated->id());
+    }
+    std::printf("%.0f updates/sec with index refresh\n", updates / seconds_since(start));
+    return 0;
+}
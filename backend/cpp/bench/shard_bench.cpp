@@ -0,0 +1,143 @@
+// Write-scaling benchmark for ShardedBookStore.
+//
+// Preloads a catalog, then runs a fixed-duration, write-heavy mix on 1, 2,
+// 4... threads for several shard counts and prints operations per second.
+// Writes replace a book with a new cover URL, like a bulk cover refresh;
+// reads look a book up by id. Given a log_dir, writes are also committed to
+// a BookLog there, as with BOOK_DATA_DIR but without fdatasync, to show how
+// the log's single ordering lock limits writes however many shards there
+// are.
+//
+// Usage: shard_bench [books=100000] [seconds=1] [write_percent=50] [max_threads=cores] [mode=rwlock] [log_dir]
+
+#include "../book_log.h"
+#include "../book_store.h"
+#include "../concurrent_book_store.h"
+#include "../sharded_book_store.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+BookFields make_book(std::size_t i, unsigned cover) {
+    return {
+        "bench-" + std::to_string(i),
+        "Title " + std::to_string(i),
+        "Author " + std::to_string(i % 1000),
+        "1985-10-14",
+        "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-" + std::to_string(cover) + ".jpg"
+    };
+}
+
+double run(ShardedBookStore& store, BookLog* log, std::size_t books, unsigned threads, double seconds,
+           unsigned write_percent) {
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> total_ops{0};
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937_64 rng(t + 1);
+            std::uniform_int_distribution<std::size_t> pick(0, books - 1);
+            std::uniform_int_distribution<unsigned> percent(0, 99);
+            std::uint64_t ops = 0;
+            std::size_t found = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                std::size_t i = pick(rng);
+                if (percent(rng) < write_percent) {
+                    // Built outside the store, as the server does
+                    auto book = std::make_shared<const Book>(make_book(i, static_cast<unsigned>(ops)));
+                    if (log) {
+                        log->commit([&](std::vector<LogRecord>& records) {
+                            bool updated = store.update(book);
+                            if (updated) {
+                                records.push_back(LogRecord::put(book));
+                            }
+                            return updated;
+                        });
+                    } else {
+                        store.update(book);
+                    }
+                } else {
+                    found += store.find("bench-" + std::to_string(i)) != nullptr;
+                }
+                ++ops;
+            }
+            total_ops += ops;
+            if (found == SIZE_MAX) {
+                std::puts(""); // Keep the lookups from being optimized away
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return total_ops / seconds;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t books = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    double seconds = argc > 2 ? std::atof(argv[2]) : 1.0;
+    unsigned write_percent = argc > 3 ? static_cast<unsigned>(std::atoi(argv[3])) : 50;
+    unsigned max_threads = argc > 4 ? static_cast<unsigned>(std::atoi(argv[4]))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+    auto mode = parse_store_mode(argc > 5 ? argv[5] : "rwlock");
+    std::string log_dir = argc > 6 ? argv[6] : "";
+    if (books == 0 || max_threads == 0 || !mode) {
+        std::fprintf(stderr, "books and max_threads must be positive and mode one of mutex, rwlock, leftright\n");
+        return 1;
+    }
+
+    std::printf("books=%zu seconds=%.1f write_percent=%u mode=%s log=%s\n", books, seconds, write_percent,
+                store_mode_name(*mode), log_dir.empty() ? "off" : log_dir.c_str());
+    std::printf("%8s %8s %16s %10s\n", "shards", "threads", "ops/sec", "speedup");
+
+    std::vector<BookStore::BookPtr> catalog;
+    catalog.reserve(books);
+    for (std::size_t i = 0; i < books; ++i) {
+        catalog.push_back(std::make_shared<const Book>(make_book(i, 0)));
+    }
+
+    // One shard is the unsharded store; the largest count gives every
+    // thread several shards so collisions stay rare
+    std::vector<std::size_t> shard_counts = {1, 4, 16};
+    shard_counts.push_back(std::max<std::size_t>(64, std::size_t{max_threads} * 4));
+    for (std::size_t shards : shard_counts) {
+        ShardedBookStore store(shards, *mode);
+        std::unique_ptr<BookLog> log;
+        if (!log_dir.empty()) {
+            // Opened on the empty store, which it would recover into
+            std::filesystem::remove_all(log_dir);
+            log = std::make_unique<BookLog>(BookLogOptions{log_dir, false, 0}, store);
+        }
+        store.insert_batch(catalog);
+
+        double baseline = 0;
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            double ops = run(store, log.get(), books, threads, seconds, write_percent);
+            if (threads == 1) {
+                baseline = ops;
+            }
+            std::printf("%8zu %8u %16.0f %9.2fx\n", shards, threads, ops, ops / baseline);
+        }
+    }
+    if (!log_dir.empty()) {
+        std::filesystem::remove_all(log_dir);
+    }
+    return 0;
+}
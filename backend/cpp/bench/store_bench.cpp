@@ -0,0 +1,114 @@
+// Thread-scaling benchmark for ConcurrentBookStore.
+//
+// Preloads a catalog, then runs a fixed-duration read/write mix on 1, 2, 4...
+// threads for every store mode and prints operations per second.
+//
+// Usage: store_bench [books=100000] [seconds=1] [write_percent=5] [max_threads=cores]
+
+#include "../book_id.h"
+#include "../book_store.h"
+#include "../concurrent_book_store.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+BookFields make_book(std::size_t i, std::string id) {
+    return {
+        std::move(id),
+        "Title " + std::to_string(i),
+        "Author " + std::to_string(i % 1000),
+        "1985-10-14",
+        "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg"
+    };
+}
+
+double run(ConcurrentBookStore& store, const std::vector<std::string>& ids, unsigned threads, double seconds,
+           unsigned write_percent) {
+    std::atomic<bool> stop{false};
+    std::atomic<std::uint64_t> total_ops{0};
+    std::vector<std::thread> workers;
+
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937_64 rng(t + 1);
+            std::uniform_int_distribution<std::size_t> pick(0, ids.size() - 1);
+            std::uniform_int_distribution<unsigned> percent(0, 99);
+            std::uint64_t ops = 0;
+            std::size_t found = 0;
+
+            while (!stop.load(std::memory_order_relaxed)) {
+                const std::string& id = ids[pick(rng)];
+                if (percent(rng) < write_percent) {
+                    auto updated = std::make_shared<const Book>(make_book(0, id));
+                    store.write([&](BookStore& s) { return s.update(updated); });
+                } else {
+                    found += store.read([&](const BookStore& s) { return s.find(id) != nullptr; });
+                }
+                ++ops;
+            }
+            total_ops += ops;
+            if (found == SIZE_MAX) {
+                std::puts(""); // Keep the lookups from being optimized away
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return total_ops / seconds;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t books = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    double seconds = argc > 2 ? std::atof(argv[2]) : 1.0;
+    unsigned write_percent = argc > 3 ? static_cast<unsigned>(std::atoi(argv[3])) : 5;
+    unsigned max_threads = argc > 4 ? static_cast<unsigned>(std::atoi(argv[4]))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+
+    std::printf("books=%zu seconds=%.1f write_percent=%u\n", books, seconds, write_percent);
+    std::printf("%-10s %8s %16s %10s\n", "mode", "threads", "ops/sec", "speedup");
+
+    // Ids as the server makes them
+    std::vector<std::string> ids;
+    std::vector<BookStore::BookPtr> catalog;
+    ids.reserve(books);
+    catalog.reserve(books);
+    for (std::size_t i = 0; i < books; ++i) {
+        ids.push_back(format_book_id(generate_book_id()));
+        catalog.push_back(std::make_shared<const Book>(make_book(i, ids.back())));
+    }
+
+    for (StoreMode mode : {StoreMode::Mutex, StoreMode::SharedMutex, StoreMode::LeftRight}) {
+        ConcurrentBookStore store(mode);
+        store.write([&](BookStore& s) {
+            s.reserve(books);
+            for (const auto& book : catalog) {
+                s.insert(book);
+            }
+        });
+
+        double baseline = 0;
+        for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+            double ops = run(store, ids, threads, seconds, write_percent);
+            if (threads == 1) {
+                baseline = ops;
+            }
+            std::printf("%-10s %8u %16.0f %9.2fx\n", store_mode_name(mode), threads, ops, ops / baseline);
+        }
+    }
+    return 0;
+}
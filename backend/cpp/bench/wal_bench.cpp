@@ -0,0 +1,131 @@
+// Write-ahead log benchmark for BookLog.
+//
+// First measures committed writes per second as writer threads are added,
+// which shows how well group commit shares each fdatasync. Then measures
+// startup time for the same catalog recovered from a log alone and from a
+// snapshot plus a short log tail.
+//
+// Usage: wal_bench [dir=wal_bench_data] [books=100000] [writes=20000] [max_threads=16] [sync=1]
+
+#include "../book_log.h"
+#include "../book_store.h"
+#include "../sharded_book_store.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+BookStore::BookPtr make_book(std::size_t i) {
+    return std::make_shared<const Book>(BookFields{
+        "bench-" + std::to_string(i),
+        "Title " + std::to_string(i),
+        "Author " + std::to_string(i % 1000),
+        "1985-10-14",
+        "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg"
+    });
+}
+
+void insert(BookLog& log, ShardedBookStore& books, std::size_t i) {
+    auto book = make_book(i);
+    log.commit([&](std::vector<LogRecord>& records) {
+        bool inserted = books.insert(book);
+        if (inserted) {
+            records.push_back(LogRecord::put(book));
+        }
+        return inserted;
+    });
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double commit_rate(const std::string& dir, std::size_t writes, unsigned threads, bool sync) {
+    fs::remove_all(dir);
+    ShardedBookStore books;
+    BookLog log({dir, sync, 0}, books);
+
+    std::atomic<std::size_t> next{0};
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            for (std::size_t i; (i = next.fetch_add(1)) < writes;) {
+                insert(log, books, i);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return writes / seconds_since(start);
+}
+
+// Fills dir with `books` inserts followed by `tail` updates, taking a
+// snapshot before the tail if asked
+void prepare(const std::string& dir, std::size_t books_count, std::size_t tail, bool snapshot) {
+    fs::remove_all(dir);
+    ShardedBookStore books;
+    BookLog log({dir, false, 0}, books);
+    for (std::size_t i = 0; i < books_count; ++i) {
+        insert(log, books, i);
+    }
+    if (snapshot) {
+        log.snapshot();
+    }
+    for (std::size_t i = 0; i < tail; ++i) {
+        auto book = make_book(i % books_count);
+        log.commit([&](std::vector<LogRecord>& records) {
+            books.update(book);
+            records.push_back(LogRecord::put(book));
+            return true;
+        });
+    }
+}
+
+void report_startup(const char* label, const std::string& dir) {
+    ShardedBookStore books;
+    BookLog log({dir, false, 0}, books);
+    const RecoveryStats& stats = log.recovery();
+    std::printf("%-22s %9zu books  %9zu replayed  %8.1f ms\n", label, stats.snapshot_books,
+                stats.replayed_records, stats.seconds * 1000);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::string dir = argc > 1 ? argv[1] : "wal_bench_data";
+    std::size_t books = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100000;
+    std::size_t writes = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 20000;
+    unsigned max_threads = argc > 4 ? static_cast<unsigned>(std::strtoul(argv[4], nullptr, 10)) : 16;
+    bool sync = argc > 5 ? std::atoi(argv[5]) != 0 : true;
+    if (books == 0 || writes == 0 || max_threads == 0) {
+        std::fprintf(stderr, "books, writes and max_threads must be positive\n");
+        return 1;
+    }
+
+    std::printf("committed inserts/sec, %zu writes, fdatasync %s\n", writes, sync ? "on" : "off");
+    std::printf("%8s %14s\n", "threads", "writes/sec");
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        std::printf("%8u %14.0f\n", threads, commit_rate(dir, writes, threads, sync));
+    }
+
+    std::size_t tail = books / 10;
+    std::printf("\nstartup with %zu books and %zu later updates\n", books, tail);
+    prepare(dir, books, tail, false);
+    report_startup("log only", dir);
+    prepare(dir, books, tail, true);
+    report_startup("snapshot + log tail", dir);
+
+    fs::remove_all(dir);
+    return 0;
+}
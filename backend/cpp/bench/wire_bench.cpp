@@ -0,0 +1,249 @@
+// Wire format benchmark: JSON against MessagePack for the bodies the /book
+// routes send and read, and N single lookups against one batch.
+//
+// For one book and for a page of `page` books, prints the bytes of each
+// format, the time to encode the body as the server does, and the time to
+// decode it back into book fields (parse_book_json or parse_book_msgpack,
+// which a request body goes through and a client does the like of), after
+// checking that every book comes back as it went out.
+//
+// Then, on a store of `books` books in `shards` shards, fetches `batch`
+// random books: as `batch` find() calls, each taking its shard's lock, and
+// as one find_many(), which holds the shards' locks together; and the same
+// with the response bodies built, which is the in-process work of `batch`
+// GET /book/<id> requests against one POST /book/_mget. Over HTTP each
+// single request also pays a round trip and the server's request handling,
+// which load_bench with batch= measures.
+//
+// Usage: wire_bench [books=100000] [page=100] [batch=100] [shards=16] [rounds=2000]
+
+#include "../book_parser.h"
+#include "../msgpack.h"
+#include "../sharded_book_store.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+using BookPtr = ShardedBookStore::BookPtr;
+
+BookFields make_book(std::size_t i) {
+    // Every eighth book is undated and every fifth title needs escaping in JSON
+    std::optional<std::string> date;
+    if (i % 8 != 0) {
+        date = std::to_string(1900 + i % 125) + "-10-14";
+    }
+    return {
+        "bench-" + std::to_string(i),
+        (i % 5 == 0 ? "The \"Collected\" Works, Vol. " : "The Night Garden, Part ") + std::to_string(i),
+        "Author " + std::to_string(i % 5000),
+        date,
+        "https://covers.openlibrary.org/b/id/" + std::to_string(i) + "-L.jpg"
+    };
+}
+
+std::string encode_json(const std::vector<BookPtr>& books) {
+    std::vector<crow::json::wvalue> items;
+    items.reserve(books.size());
+    for (const auto& book : books) {
+        items.push_back(book->to_json());
+    }
+    return crow::json::wvalue(std::move(items)).dump();
+}
+
+std::string encode_msgpack(const std::vector<BookPtr>& books) {
+    std::string body;
+    append_msgpack_array(body, books.size());
+    for (const auto& book : books) {
+        book->append_msgpack(body);
+    }
+    return body;
+}
+
+// Decodes an array body into books, or an empty vector if any is malformed
+std::vector<ParsedBook> decode(const std::string& body, WireFormat format) {
+    std::vector<ParsedBook> parsed;
+    BulkBodyReader reader(body, format);
+    while (auto item = reader.next()) {
+        auto book = format == WireFormat::Msgpack ? parse_book_msgpack(*item) : parse_book_json(*item);
+        if (!book) {
+            return {};
+        }
+        parsed.push_back(std::move(*book));
+    }
+    return reader.failed() ? std::vector<ParsedBook>() : parsed;
+}
+
+bool same_book(const ParsedBook& parsed, const Book& book) {
+    return parsed.book.id && *parsed.book.id == book.id() && parsed.book.title == book.title() &&
+           parsed.book.author == book.author() && parsed.book.coverImageUrl == book.coverImageUrl() &&
+           parsed.book.published_date == (book.published_date() ? std::optional<std::string>(*book.published_date())
+                                                                  : std::nullopt);
+}
+
+// Nanoseconds per call of fn over `rounds` calls
+double time_ns(std::size_t rounds, const std::function<std::size_t()>& fn, std::size_t& sink) {
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t r = 0; r < rounds; ++r) {
+        sink += fn();
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / rounds;
+}
+
+// The POST /book/_mget response body, built as the server builds it
+std::string encode_mget(const std::vector<BookPtr>& found, WireFormat format) {
+    if (format == WireFormat::Json) {
+        std::vector<crow::json::wvalue> items;
+        items.reserve(found.size());
+        for (const auto& book : found) {
+            items.push_back(book->to_json());
+        }
+        crow::json::wvalue result;
+        result["books"] = std::move(items);
+        result["missing"] = std::vector<crow::json::wvalue>();
+        return result.dump();
+    }
+    std::string body;
+    append_msgpack_map(body, 2);
+    append_msgpack_str(body, "books");
+    append_msgpack_array(body, found.size());
+    for (const auto& book : found) {
+        book->append_msgpack(body);
+    }
+    append_msgpack_str(body, "missing");
+    append_msgpack_array(body, 0);
+    return body;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000;
+    std::size_t page_size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 100;
+    std::size_t batch = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 100;
+    std::size_t shards = argc > 4 ? std::strtoull(argv[4], nullptr, 10) : 16;
+    std::size_t rounds = argc > 5 ? std::strtoull(argv[5], nullptr, 10) : 2000;
+    if (count == 0 || page_size == 0 || page_size > count || batch == 0 || rounds == 0) {
+        std::fprintf(stderr, "books, page, batch and rounds must be positive, and page at most books\n");
+        return 1;
+    }
+
+    ShardedBookStore store(shards);
+    std::vector<std::string> ids;
+    ids.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        auto book = std::make_shared<const Book>(make_book(i));
+        ids.emplace_back(book->id());
+        store.insert(book);
+    }
+    std::vector<BookPtr> all = store.books();
+    std::vector<BookPtr> page(all.begin(), all.begin() + static_cast<std::ptrdiff_t>(page_size));
+
+    // Both formats must give back every field of every book
+    for (WireFormat format : {WireFormat::Json, WireFormat::Msgpack}) {
+        std::string body = format == WireFormat::Json ? encode_json(page) : encode_msgpack(page);
+        std::vector<ParsedBook> parsed = decode(body, format);
+        bool ok = parsed.size() == page.size();
+        for (std::size_t i = 0; ok && i < page.size(); ++i) {
+            ok = same_book(parsed[i], *page[i]);
+        }
+        if (!ok) {
+            std::fprintf(stderr, "%s round trip lost a book\n", format == WireFormat::Json ? "JSON" : "MessagePack");
+            return 1;
+        }
+    }
+
+    std::size_t sink = 0;
+    std::printf("books=%zu page=%zu batch=%zu shards=%zu\n", count, page_size, batch, store.shard_count());
+    std::printf("%-12s %-8s %10s %12s %12s\n", "body", "format", "bytes", "encode ns", "decode ns");
+    const BookPtr& one = page.back();
+    for (WireFormat format : {WireFormat::Json, WireFormat::Msgpack}) {
+        bool json = format == WireFormat::Json;
+        const char* name = json ? "json" : "msgpack";
+
+        std::string body = json ? one->to_json().dump() : std::string();
+        if (!json) {
+            one->append_msgpack(body);
+        }
+        double encode = time_ns(rounds * 50, [&] {
+            if (json) {
+                return one->to_json().dump().size();
+            }
+            std::string out;
+            one->append_msgpack(out);
+            return out.size();
+        }, sink);
+        double decode_one = time_ns(rounds * 50, [&] {
+            auto parsed = json ? parse_book_json(body) : parse_book_msgpack(body);
+            return parsed->book.title.size();
+        }, sink);
+        std::printf("%-12s %-8s %10zu %12.0f %12.0f\n", "book", name, body.size(), encode, decode_one);
+
+        std::string page_body = json ? encode_json(page) : encode_msgpack(page);
+        double encode_page = time_ns(rounds, [&] {
+            return (json ? encode_json(page) : encode_msgpack(page)).size();
+        }, sink);
+        double decode_page = time_ns(rounds, [&] { return decode(page_body, format).size(); }, sink);
+        std::string label = "page of " + std::to_string(page_size);
+        std::printf("%-12s %-8s %10zu %12.0f %12.0f\n", label.c_str(), name, page_body.size(), encode_page,
+                    decode_page);
+    }
+
+    // The same random batches for every variant
+    std::mt19937_64 rng(1);
+    std::vector<std::vector<std::string_view>> batches(64);
+    for (auto& ids_in_batch : batches) {
+        for (std::size_t k = 0; k < batch; ++k) {
+            ids_in_batch.push_back(ids[rng() % count]);
+        }
+    }
+    std::size_t next_batch = 0;
+    auto take_batch = [&]() -> const std::vector<std::string_view>& {
+        return batches[next_batch++ % batches.size()];
+    };
+
+    std::printf("\nfetching %zu books %12s %12s\n", batch, "ns/batch", "ns/book");
+    auto report = [&](const char* name, double ns) {
+        std::printf("%-28s %12.0f %12.1f\n", name, ns, ns / batch);
+    };
+    std::size_t batch_rounds = std::max<std::size_t>(1, rounds * 10 / batch);
+    report("find() each", time_ns(batch_rounds, [&] {
+        std::size_t found = 0;
+        for (std::string_view id : take_batch()) {
+            found += store.find(id) != nullptr;
+        }
+        return found;
+    }, sink));
+    report("find_many()", time_ns(batch_rounds, [&] { return store.find_many(take_batch()).size(); }, sink));
+    for (WireFormat format : {WireFormat::Json, WireFormat::Msgpack}) {
+        bool json = format == WireFormat::Json;
+        report(json ? "GET /book/<id> each, json" : "GET /book/<id> each, msgpack", time_ns(batch_rounds, [&] {
+            std::size_t bytes = 0;
+            for (std::string_view id : take_batch()) {
+                BookPtr book = store.find(id);
+                if (json) {
+                    bytes += book->to_json().dump().size();
+                } else {
+                    std::string body;
+                    book->append_msgpack(body);
+                    bytes += body.size();
+                }
+            }
+            return bytes;
+        }, sink));
+        report(json ? "POST /book/_mget, json" : "POST /book/_mget, msgpack", time_ns(batch_rounds, [&] {
+            return encode_mget(store.find_many(take_batch()), format).size();
+        }, sink));
+    }
+    std::printf("(checksum %zu)\n", sink);
+    return 0;
+}
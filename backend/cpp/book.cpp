@@ -0,0 +1,150 @@
+#include "book.h"
+#include "msgpack.h"
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace {
+
+// Interned strings by value. A string lives as long as some book uses it;
+// the pool only keeps a weak reference and the last owner removes it.
+class StringPool {
+public:
+    std::shared_ptr<const std::string> intern(std::string_view value) {
+        if (value.empty()) {
+            return empty_;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = strings_.find(value);
+        if (it != strings_.end()) {
+            if (auto existing = it->second.lock()) {
+                return existing;
+            }
+            // Its last owner is on the way out; release() will skip this key
+            strings_.erase(it);
+        }
+
+        auto* copy = new std::string(value);
+        std::shared_ptr<const std::string> interned(copy, [this](const std::string* s) { release(s); });
+        strings_.emplace(*copy, interned);
+        return interned;
+    }
+
+private:
+    void release(const std::string* s) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = strings_.find(*s);
+            if (it != strings_.end() && it->first.data() == s->data()) {
+                strings_.erase(it);
+            }
+        }
+        delete s;
+    }
+
+    std::mutex mutex_;
+    std::unordered_map<std::string_view, std::weak_ptr<const std::string>> strings_; // Keys view the values
+    std::shared_ptr<const std::string> empty_ = std::make_shared<const std::string>();
+};
+
+// Never destroyed, so books that outlive main() can still release strings
+StringPool& string_pool() {
+    static StringPool* pool = new StringPool;
+    return *pool;
+}
+
+} // namespace
+
+Book::Book(const BookFields& fields) : author_(string_pool().intern(fields.author)) {
+    std::string_view url = fields.coverImageUrl;
+    std::size_t slash = url.rfind('/');
+    std::size_t base_size = slash == std::string_view::npos ? 0 : slash + 1;
+    cover_base_ = string_pool().intern(url.substr(0, base_size));
+    std::string_view cover_name = url.substr(base_size);
+
+    std::string_view id = fields.id ? std::string_view(*fields.id) : std::string_view();
+    std::string_view date = fields.published_date ? std::string_view(*fields.published_date) : std::string_view();
+    id_size_ = static_cast<std::uint32_t>(id.size());
+    title_size_ = static_cast<std::uint32_t>(fields.title.size());
+    date_size_ = static_cast<std::uint32_t>(date.size());
+    cover_name_size_ = static_cast<std::uint32_t>(cover_name.size());
+    version_ = fields.version;
+    has_date_ = fields.published_date.has_value();
+
+    text_.reset(new char[id.size() + fields.title.size() + date.size() + cover_name.size()]);
+    char* p = text_.get();
+    for (std::string_view part : {id, std::string_view(fields.title), date, cover_name}) {
+        if (!part.empty()) {
+            std::memcpy(p, part.data(), part.size());
+            p += part.size();
+        }
+    }
+}
+
+std::optional<std::string_view> Book::published_date() const {
+    if (!has_date_) {
+        return std::nullopt;
+    }
+    return std::string_view(text_.get() + id_size_ + title_size_, date_size_);
+}
+
+std::string Book::coverImageUrl() const {
+    std::string url;
+    url.reserve(cover_base_->size() + cover_name_size_);
+    url += *cover_base_;
+    url.append(text_.get() + id_size_ + title_size_ + date_size_, cover_name_size_);
+    return url;
+}
+
+BookFields Book::fields() const {
+    BookFields fields;
+    if (id_size_ > 0) {
+        fields.id = std::string(id());
+    }
+    fields.title = std::string(title());
+    fields.author = *author_;
+    if (auto date = published_date()) {
+        fields.published_date = std::string(*date);
+    }
+    fields.coverImageUrl = coverImageUrl();
+    fields.version = version_;
+    return fields;
+}
+
+crow::json::wvalue Book::to_json() const {
+    crow::json::wvalue x({});
+    if (id_size_ > 0) {
+        x["id"] = std::string(id());
+    }
+    x["title"] = std::string(title());
+    x["author"] = *author_;
+    if (auto date = published_date()) {
+        x["published_date"] = std::string(*date);
+    }
+    x["coverImageUrl"] = coverImageUrl();
+    return x;
+}
+
+void Book::append_msgpack(std::string& out) const {
+    auto date = published_date();
+    append_msgpack_map(out, 3 + (id_size_ > 0) + date.has_value());
+    if (id_size_ > 0) {
+        append_msgpack_str(out, "id");
+        append_msgpack_str(out, id());
+    }
+    append_msgpack_str(out, "title");
+    append_msgpack_str(out, title());
+    append_msgpack_str(out, "author");
+    append_msgpack_str(out, *author_);
+    if (date) {
+        append_msgpack_str(out, "published_date");
+        append_msgpack_str(out, *date);
+    }
+    // The cover URL goes out in its two parts, without joining them first
+    append_msgpack_str(out, "coverImageUrl");
+    std::string_view name(text_.get() + id_size_ + title_size_ + date_size_, cover_name_size_);
+    append_msgpack_str_header(out, cover_base_->size() + name.size());
+    out += *cover_base_;
+    out += name;
+}
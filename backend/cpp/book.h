@@ -0,0 +1,63 @@
+#ifndef BOOK_H
+#define BOOK_H
+
+#include <crow.h>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// A book's fields as parsed from a request or read back from the log
+struct BookFields {
+    std::optional<std::string> id;
+    std::string title;
+    std::string author;
+    std::optional<std::string> published_date;
+    std::string coverImageUrl;
+    std::uint32_t version = 1; // One more than the book it replaced
+};
+
+// A stored book. Immutable, and compact: the id, title, publication date and
+// the end of the cover URL share one allocation, while the author and the
+// cover URL up to its last '/' are interned, so books by the same author or
+// with covers from the same host share one reference counted copy.
+class Book {
+public:
+    explicit Book(const BookFields& fields);
+
+    Book(const Book&) = delete;
+    Book& operator=(const Book&) = delete;
+
+    // Empty if the fields had no id
+    std::string_view id() const { return {text_.get(), id_size_}; }
+    std::string_view title() const { return {text_.get() + id_size_, title_size_}; }
+    std::string_view author() const { return *author_; }
+    std::optional<std::string_view> published_date() const;
+    std::string coverImageUrl() const;
+
+    // Starts at 1 and goes up by one with every replacement; served as the
+    // book's ETag so If-Match can detect a concurrent edit
+    std::uint32_t version() const { return version_; }
+
+    BookFields fields() const;
+
+    // Helper to convert Book to Crow JSON
+    crow::json::wvalue to_json() const;
+
+    // Appends the same object as to_json() in MessagePack (see msgpack.h)
+    void append_msgpack(std::string& out) const;
+
+private:
+    std::unique_ptr<char[]> text_; // id, title, published_date, cover file name
+    std::shared_ptr<const std::string> author_;
+    std::shared_ptr<const std::string> cover_base_;
+    std::uint32_t id_size_ = 0;
+    std::uint32_t title_size_ = 0;
+    std::uint32_t date_size_ = 0;
+    std::uint32_t cover_name_size_ = 0;
+    std::uint32_t version_ = 1; // Takes what was padding, so books are no bigger
+    bool has_date_ = false;
+};
+
+#endif
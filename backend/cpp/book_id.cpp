@@ -0,0 +1,136 @@
+#include "book_id.h"
+#include <chrono>
+#include <cstring>
+#include <random>
+
+namespace {
+
+constexpr std::size_t text_size = 36;
+
+class Generator {
+public:
+    Generator() {
+        // std::random_device is the one syscall a thread makes for its ids
+        std::random_device device;
+        state_[0] = (std::uint64_t{device()} << 32 | device()) | 1; // xorshift must not start from all zeros
+        state_[1] = std::uint64_t{device()} << 32 | device();
+    }
+
+    BookId next() {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        auto ms = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+
+        // A new millisecond starts the counter at a random point in its lower
+        // half, leaving room to count; running out borrows the next millisecond
+        if (ms > last_ms_) {
+            last_ms_ = ms;
+            counter_ = static_cast<std::uint32_t>(random() >> 53);
+        } else if (++counter_ > 0xfff) {
+            ++last_ms_;
+            counter_ = 0;
+        }
+
+        BookId id;
+        id.high = (last_ms_ & 0xffffffffffffULL) << 16 | 0x7000 | counter_;
+        id.low = random() >> 2 | 0x8000000000000000ULL;
+        return id;
+    }
+
+private:
+    // xorshift128+
+    std::uint64_t random() {
+        std::uint64_t s1 = state_[0];
+        std::uint64_t s0 = state_[1];
+        state_[0] = s0;
+        s1 ^= s1 << 23;
+        state_[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+        return state_[1] + s0;
+    }
+
+    std::uint64_t state_[2];
+    std::uint64_t last_ms_ = 0;
+    std::uint32_t counter_ = 0;
+};
+
+// Offsets of the 32 hex digits in the text form
+constexpr unsigned char digit_at[32] = {0,  1,  2,  3,  4,  5,  6,  7,  9,  10, 11, 12, 14, 15, 16, 17,
+                                        19, 20, 21, 22, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35};
+
+constexpr std::uint64_t ones = 0x0101010101010101ULL;
+constexpr std::uint64_t high_bits = 0x8080808080808080ULL;
+
+// Reads N bytes, 4 or 8, the first one lowest
+template <typename T>
+std::uint64_t load(const unsigned char* p) {
+    T x;
+    std::memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = sizeof(x) == 8 ? static_cast<T>(__builtin_bswap64(x)) : static_cast<T>(__builtin_bswap32(x));
+#endif
+    return x;
+}
+
+// Eight characters at once, each in its own byte: the high bit of each byte
+// of the result is set where that byte of x is at least c. Bytes of x must
+// be ASCII, so no sum carries into the next byte.
+std::uint64_t at_least(std::uint64_t x, unsigned char c) {
+    return (x + (0x80 - c) * ones) & high_bits;
+}
+
+// Whether all eight bytes of x are hex digits
+bool all_hex(std::uint64_t x) {
+    std::uint64_t lower = x | 0x20 * ones;
+    std::uint64_t digit = at_least(x, '0') & ~at_least(x, '9' + 1);
+    std::uint64_t letter = at_least(lower, 'a') & ~at_least(lower, 'f' + 1);
+    return (x & high_bits) == 0 && (digit | letter) == high_bits;
+}
+
+// The value of eight hex digits, the first one in the lowest byte
+std::uint64_t hex_value(std::uint64_t x) {
+    // '0'-'9' end in their value, 'a'-'f' and 'A'-'F' in 1-6 and have 0x40 set
+    x = (x & 0x0f * ones) + ((x & 0x40 * ones) >> 6) * 9;
+    // Pack the nibbles, first digit highest: pairs, then quads, then all eight
+    x = (x << 4 | x >> 8) & 0x00ff00ff00ff00ffULL;
+    x = (x << 8 | x >> 16) & 0x0000ffff0000ffffULL;
+    return (x << 16 | x >> 32) & 0xffffffffULL;
+}
+
+} // namespace
+
+BookId generate_book_id() {
+    thread_local Generator generator;
+    return generator.next();
+}
+
+// Checks and converts eight digits at a time, with no branch per character
+std::optional<BookId> parse_book_id(std::string_view text) {
+    if (text.size() != text_size || text[8] != '-' || text[13] != '-' || text[18] != '-' || text[23] != '-') {
+        return std::nullopt;
+    }
+    const auto* p = reinterpret_cast<const unsigned char*>(text.data());
+    // The digits in four runs of eight, skipping the dashes
+    std::uint64_t runs[4] = {
+        load<std::uint64_t>(p),
+        load<std::uint32_t>(p + 9) | load<std::uint32_t>(p + 14) << 32,
+        load<std::uint32_t>(p + 19) | load<std::uint32_t>(p + 24) << 32,
+        load<std::uint64_t>(p + 28),
+    };
+    if (!all_hex(runs[0]) || !all_hex(runs[1]) || !all_hex(runs[2]) || !all_hex(runs[3])) {
+        return std::nullopt;
+    }
+    BookId id{hex_value(runs[0]) << 32 | hex_value(runs[1]), hex_value(runs[2]) << 32 | hex_value(runs[3])};
+    if ((id.high | id.low) == 0) {
+        return std::nullopt;
+    }
+    return id;
+}
+
+std::string format_book_id(const BookId& id) {
+    static constexpr char hex[] = "0123456789abcdef";
+    std::string text(text_size, '-');
+    for (std::size_t i = 0; i < 32; ++i) {
+        std::uint64_t word = i < 16 ? id.high : id.low;
+        text[digit_at[i]] = hex[(word >> (60 - 4 * (i % 16))) & 0xf];
+    }
+    return text;
+}
@@ -0,0 +1,52 @@
+#ifndef BOOK_ID_H
+#define BOOK_ID_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// A UUID as two 64-bit words, high being the first eight bytes, so comparing
+// (high, low) orders ids the way their text sorts.
+//
+// New ids are UUIDv7 (RFC 9562): 48 bits of Unix time in milliseconds, a
+// 12-bit counter and 62 random bits, from a generator per thread that reads
+// the clock through std::chrono and takes its random bits from a xorshift
+// generator seeded once per thread, so making one takes no lock and no
+// syscall. Ids made in order sort in order, and ids made by different
+// threads, processes or restarts do not collide.
+//
+// Books keep the id text they were created with, since ids that were stored
+// before ids were UUIDs, or that clients chose, need not be UUIDs. Stores
+// key the ones that are by their BookId.
+struct BookId {
+    std::uint64_t high = 0;
+    std::uint64_t low = 0;
+
+    bool operator==(const BookId& other) const { return high == other.high && low == other.low; }
+    bool operator!=(const BookId& other) const { return !(*this == other); }
+};
+
+// Mixes both words, so buckets stay spread even for ids that share their
+// time and counter
+struct BookIdHash {
+    std::size_t operator()(const BookId& id) const {
+        std::uint64_t h = id.high * 0x9e3779b97f4a7c15ULL ^ id.low;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<std::size_t>(h);
+    }
+};
+
+BookId generate_book_id();
+
+// Parses the 36-character form, in either case. Returns std::nullopt for
+// anything else, including the nil UUID.
+std::optional<BookId> parse_book_id(std::string_view text);
+
+// The 36-character lowercase form
+std::string format_book_id(const BookId& id);
+
+#endif
@@ -0,0 +1,547 @@
+#include "book_log.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Version 02 stores each book's version after it; 01 snapshots, from before
+// books had versions, still load with every book at version 1
+constexpr char snapshot_magic[8] = {'B', 'K', 'S', 'N', 'A', 'P', '0', '2'};
+constexpr char snapshot_magic_v1[8] = {'B', 'K', 'S', 'N', 'A', 'P', '0', '1'};
+
+// Frame header: payload size and its crc32
+constexpr std::size_t frame_header_size = 8;
+
+// Largest record accepted on replay; anything bigger is a torn size field
+constexpr std::uint32_t max_record_size = 64 * 1024 * 1024;
+
+std::uint32_t crc32(const char* data, std::size_t size) {
+    static const auto table = [] {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t i = 0; i < 256; ++i) {
+            std::uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+
+    std::uint32_t crc = 0xFFFFFFFFu;
+    for (std::size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// Little-endian encoding, independent of the host
+
+void put_u32(std::string& out, std::uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+        out += static_cast<char>(v >> (8 * i));
+    }
+}
+
+void put_u64(std::string& out, std::uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+        out += static_cast<char>(v >> (8 * i));
+    }
+}
+
+void put_string(std::string& out, std::string_view s) {
+    put_u32(out, static_cast<std::uint32_t>(s.size()));
+    out += s;
+}
+
+void put_book(std::string& out, const Book& book) {
+    put_string(out, book.id());
+    put_string(out, book.title());
+    put_string(out, book.author());
+    auto published_date = book.published_date();
+    out += static_cast<char>(published_date ? 1 : 0);
+    put_string(out, published_date.value_or(""));
+    put_string(out, book.coverImageUrl());
+}
+
+// Bounds-checked decoder; every get fails once the input runs out
+class Reader {
+public:
+    Reader(const char* data, std::size_t size) : p_(data), end_(data + size) {}
+
+    bool get_u8(std::uint8_t& v) {
+        if (end_ - p_ < 1) {
+            return false;
+        }
+        v = static_cast<std::uint8_t>(*p_++);
+        return true;
+    }
+
+    bool get_u32(std::uint32_t& v) {
+        if (end_ - p_ < 4) {
+            return false;
+        }
+        v = 0;
+        for (int i = 0; i < 4; ++i) {
+            v |= static_cast<std::uint32_t>(static_cast<unsigned char>(*p_++)) << (8 * i);
+        }
+        return true;
+    }
+
+    bool get_u64(std::uint64_t& v) {
+        if (end_ - p_ < 8) {
+            return false;
+        }
+        v = 0;
+        for (int i = 0; i < 8; ++i) {
+            v |= static_cast<std::uint64_t>(static_cast<unsigned char>(*p_++)) << (8 * i);
+        }
+        return true;
+    }
+
+    bool get_string(std::string& s) {
+        std::uint32_t size;
+        if (!get_u32(size) || static_cast<std::size_t>(end_ - p_) < size) {
+            return false;
+        }
+        s.assign(p_, size);
+        p_ += size;
+        return true;
+    }
+
+    bool get_book(BookFields& book) {
+        std::string id;
+        std::string published_date;
+        std::uint8_t has_date;
+        if (!get_string(id) || !get_string(book.title) || !get_string(book.author) || !get_u8(has_date) ||
+            !get_string(published_date) || !get_string(book.coverImageUrl) || id.empty()) {
+            return false;
+        }
+        book.id = std::move(id);
+        if (has_date) {
+            book.published_date = std::move(published_date);
+        }
+        return true;
+    }
+
+    // Points data at the next size bytes
+    bool get_bytes(const char*& data, std::size_t size) {
+        if (static_cast<std::size_t>(end_ - p_) < size) {
+            return false;
+        }
+        data = p_;
+        p_ += size;
+        return true;
+    }
+
+    bool done() const { return p_ == end_; }
+
+private:
+    const char* p_;
+    const char* end_;
+};
+
+void encode_record(std::string& out, std::uint64_t lsn, const LogRecord& record) {
+    std::size_t frame = out.size();
+    out.append(frame_header_size, '\0');
+    put_u64(out, lsn);
+    out += static_cast<char>(record.type);
+    if (record.type == LogRecord::Type::Put) {
+        put_book(out, *record.book);
+        put_u32(out, record.book->version());
+    } else {
+        put_string(out, record.id);
+    }
+
+    std::string header;
+    std::size_t payload = out.size() - frame - frame_header_size;
+    put_u32(header, static_cast<std::uint32_t>(payload));
+    put_u32(header, crc32(out.data() + frame + frame_header_size, payload));
+    out.replace(frame, frame_header_size, header);
+}
+
+bool write_all(int fd, const char* data, std::size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+bool sync_dir(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+std::string read_file(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+std::string numbered_name(const char* prefix, std::uint64_t lsn, const char* suffix) {
+    char name[64];
+    std::snprintf(name, sizeof(name), "%s%020" PRIu64 "%s", prefix, lsn, suffix);
+    return name;
+}
+
+// Parses "<prefix><number><suffix>"
+std::optional<std::uint64_t> parse_numbered_name(const std::string& name, const std::string& prefix,
+                                                 const std::string& suffix) {
+    if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0 ||
+        name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+        return std::nullopt;
+    }
+    std::string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+    if (digits.find_first_not_of("0123456789") != std::string::npos) {
+        return std::nullopt;
+    }
+    return std::stoull(digits);
+}
+
+// Files named <prefix><LSN><suffix> in dir, sorted by LSN
+std::vector<std::pair<std::uint64_t, fs::path>> list_numbered(const std::string& dir, const std::string& prefix,
+                                                               const std::string& suffix) {
+    std::vector<std::pair<std::uint64_t, fs::path>> files;
+    for (const auto& entry : fs::directory_iterator(dir)) {
+        if (auto lsn = parse_numbered_name(entry.path().filename().string(), prefix, suffix)) {
+            files.emplace_back(*lsn, entry.path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+void apply_record(BookStore& store, LogRecord::Type type, BookStore::BookPtr book, const std::string& id) {
+    if (type == LogRecord::Type::Put) {
+        if (!store.update(book)) {
+            store.insert(std::move(book));
+        }
+    } else {
+        store.erase(id);
+    }
+}
+
+} // namespace
+
+BookLog::BookLog(BookLogOptions options, ShardedBookStore& books)
+    : options_(std::move(options)), books_(books) {
+    fs::create_directories(options_.dir);
+    recover();
+    snapshot_thread_ = std::thread([this] { snapshot_loop(); });
+}
+
+BookLog::~BookLog() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    snapshot_cv_.notify_all();
+    snapshot_thread_.join();
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+void BookLog::recover() {
+    auto start = std::chrono::steady_clock::now();
+    BookStore store;
+    std::uint64_t last = 0;
+
+    // Newest snapshot that checks out
+    auto snapshots = list_numbered(options_.dir, "snapshot-", ".bin");
+    for (auto it = snapshots.rbegin(); it != snapshots.rend(); ++it) {
+        std::string data = read_file(it->second);
+        if (data.size() < sizeof(snapshot_magic) + 4) {
+            continue;
+        }
+        bool versioned = std::memcmp(data.data(), snapshot_magic, sizeof(snapshot_magic)) == 0;
+        if (!versioned && std::memcmp(data.data(), snapshot_magic_v1, sizeof(snapshot_magic_v1)) != 0) {
+            continue;
+        }
+        const char* body = data.data() + sizeof(snapshot_magic);
+        std::size_t body_size = data.size() - sizeof(snapshot_magic) - 4;
+        std::uint32_t crc;
+        Reader trailer(body + body_size, 4);
+        if (!trailer.get_u32(crc) || crc != crc32(body, body_size)) {
+            continue;
+        }
+
+        Reader reader(body, body_size);
+        std::uint64_t lsn;
+        std::uint64_t count;
+        BookStore loaded;
+        bool ok = reader.get_u64(lsn) && reader.get_u64(count);
+        if (ok) {
+            loaded.reserve(static_cast<std::size_t>(std::min<std::uint64_t>(count, body_size)));
+        }
+        for (std::uint64_t i = 0; ok && i < count; ++i) {
+            BookFields book;
+            ok = reader.get_book(book) && (!versioned || reader.get_u32(book.version)) &&
+                 loaded.insert(std::make_shared<const Book>(std::move(book)));
+        }
+        if (ok && reader.done()) {
+            store = std::move(loaded);
+            last = lsn;
+            recovery_.snapshot_books = store.size();
+            break;
+        }
+    }
+    snapshot_lsn_ = last;
+
+    // Then every logged change after it
+    for (const auto& segment : list_numbered(options_.dir, "wal-", ".log")) {
+        std::string data = read_file(segment.second);
+        Reader frames(data.data(), data.size());
+
+        // A frame that is short or fails its checksum is where a crash cut
+        // the segment off; nothing after it was acknowledged
+        for (;;) {
+            std::uint32_t size;
+            std::uint32_t crc;
+            const char* payload;
+            if (!frames.get_u32(size) || !frames.get_u32(crc) || size > max_record_size ||
+                !frames.get_bytes(payload, size) || crc32(payload, size) != crc) {
+                break;
+            }
+
+            Reader record(payload, size);
+            std::uint64_t lsn;
+            std::uint8_t type;
+            if (!record.get_u64(lsn) || !record.get_u8(type)) {
+                break;
+            }
+            if (type == static_cast<std::uint8_t>(LogRecord::Type::Put)) {
+                // Records from before books had versions end after the book
+                BookFields book;
+                if (!record.get_book(book) || (!record.done() && !record.get_u32(book.version))) {
+                    break;
+                }
+                if (lsn > last) {
+                    apply_record(store, LogRecord::Type::Put, std::make_shared<const Book>(std::move(book)), {});
+                }
+            } else if (type == static_cast<std::uint8_t>(LogRecord::Type::Erase)) {
+                std::string id;
+                if (!record.get_string(id)) {
+                    break;
+                }
+                if (lsn > last) {
+                    apply_record(store, LogRecord::Type::Erase, nullptr, id);
+                }
+            } else {
+                break;
+            }
+            if (lsn > last) {
+                last = lsn;
+                ++recovery_.replayed_records;
+            }
+        }
+    }
+
+    std::vector<BookStore::BookPtr> recovered;
+    recovered.reserve(store.size());
+    store.for_each([&](const BookStore::BookPtr& book) { recovered.push_back(book); });
+    books_.insert_batch(recovered);
+
+    last_lsn_ = last;
+    durable_lsn_ = last;
+    snapshot_wanted_ = options_.snapshot_every != 0 && last - snapshot_lsn_ >= options_.snapshot_every;
+    if (!open_segment(last + 1)) {
+        throw std::system_error(errno, std::generic_category(), "open log segment in " + options_.dir);
+    }
+    recovery_.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+bool BookLog::open_segment(std::uint64_t first_lsn) {
+    // Any existing file with this name holds nothing that was acknowledged
+    std::string path = (fs::path(options_.dir) / numbered_name("wal-", first_lsn, ".log")).string();
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    if (options_.sync && !sync_dir(options_.dir)) {
+        ::close(fd);
+        return false;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    fd_ = fd;
+    return true;
+}
+
+std::uint64_t BookLog::append(const std::vector<LogRecord>& records) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const LogRecord& record : records) {
+        encode_record(buffer_, ++last_lsn_, record);
+    }
+    if (options_.snapshot_every != 0 && !snapshot_wanted_ &&
+        last_lsn_ - snapshot_lsn_ >= options_.snapshot_every) {
+        snapshot_wanted_ = true;
+        snapshot_cv_.notify_one();
+    }
+    return last_lsn_;
+}
+
+bool BookLog::wait_durable(std::uint64_t lsn) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (durable_lsn_ < lsn && !failed_) {
+        if (flushing_) {
+            flushed_.wait(lock);
+            continue;
+        }
+
+        // Become the leader: flush everything buffered so far, including
+        // records appended by writers that are now waiting on us
+        flushing_ = true;
+        std::string batch;
+        batch.swap(buffer_);
+        std::uint64_t target = last_lsn_;
+        int fd = fd_;
+        lock.unlock();
+
+        bool ok = write_all(fd, batch.data(), batch.size()) && (!options_.sync || ::fdatasync(fd) == 0);
+
+        lock.lock();
+        flushing_ = false;
+        if (ok) {
+            durable_lsn_ = target;
+        } else {
+            failed_ = true;
+        }
+        if (buffer_.empty()) {
+            // Hand the grown buffer back so the next batch does not allocate
+            batch.clear();
+            buffer_.swap(batch);
+        }
+        flushed_.notify_all();
+    }
+    return !failed_;
+}
+
+bool BookLog::failed() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return failed_;
+}
+
+bool BookLog::snapshot() {
+    std::uint64_t lsn = 0;
+    bool ok = write_snapshot(lsn);
+
+    // Only a snapshot that reached the disk counts; a failed one is tried
+    // again at the next append instead of after snapshot_every more
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ok) {
+        snapshot_lsn_ = lsn;
+    }
+    snapshot_wanted_ = ok && options_.snapshot_every != 0 && last_lsn_ - snapshot_lsn_ >= options_.snapshot_every;
+    return ok;
+}
+
+bool BookLog::write_snapshot(std::uint64_t& lsn) {
+    std::vector<BookStore::BookPtr> order;
+    {
+        // No commits while the segment rotates, so the snapshot holds
+        // exactly the changes up to lsn
+        std::lock_guard<std::mutex> order_lock(order_mutex_);
+        order = books_.books();
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            lsn = last_lsn_;
+        }
+        if (!wait_durable(lsn)) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!open_segment(lsn + 1)) {
+            failed_ = true;
+            return false;
+        }
+    }
+
+    // Written outside the lock; until the rename lands, recovery uses the
+    // previous snapshot and the segments after it
+    std::string data(snapshot_magic, sizeof(snapshot_magic));
+    put_u64(data, lsn);
+    put_u64(data, order.size());
+    for (const auto& book : order) {
+        put_book(data, *book);
+        put_u32(data, book->version());
+    }
+    put_u32(data, crc32(data.data() + sizeof(snapshot_magic), data.size() - sizeof(snapshot_magic)));
+
+    fs::path final_path = fs::path(options_.dir) / numbered_name("snapshot-", lsn, ".bin");
+    fs::path tmp_path = final_path;
+    tmp_path += ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write_all(fd, data.data(), data.size()) && (!options_.sync || ::fsync(fd) == 0);
+    ::close(fd);
+    if (!ok || ::rename(tmp_path.c_str(), final_path.c_str()) != 0 ||
+        (options_.sync && !sync_dir(options_.dir))) {
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+
+    // Keep the previous snapshot and the segments after it, so a damaged
+    // newest snapshot still leaves something to recover from
+    auto snapshots = list_numbered(options_.dir, "snapshot-", ".bin");
+    if (snapshots.size() < 2) {
+        return true;
+    }
+    std::uint64_t keep_from = snapshots[snapshots.size() - 2].first;
+    std::error_code ignored;
+    for (const auto& segment : list_numbered(options_.dir, "wal-", ".log")) {
+        if (segment.first <= keep_from) {
+            fs::remove(segment.second, ignored);
+        }
+    }
+    for (const auto& old : snapshots) {
+        if (old.first < keep_from) {
+            fs::remove(old.second, ignored);
+        }
+    }
+    return true;
+}
+
+void BookLog::snapshot_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        snapshot_cv_.wait(lock, [this] { return stopping_ || snapshot_wanted_; });
+        if (stopping_) {
+            return;
+        }
+        lock.unlock();
+        snapshot();
+        lock.lock();
+    }
+}
@@ -0,0 +1,144 @@
+#ifndef BOOK_LOG_H
+#define BOOK_LOG_H
+
+#include "book_store.h"
+#include "sharded_book_store.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// One logged store change: a book was stored (created or replaced) or erased.
+struct LogRecord {
+    enum class Type : std::uint8_t { Put = 1, Erase = 2 };
+
+    Type type;
+    BookStore::BookPtr book; // Put
+    std::string id;          // Erase
+
+    static LogRecord put(BookStore::BookPtr book) { return {Type::Put, std::move(book), {}}; }
+    static LogRecord erase(std::string id) { return {Type::Erase, nullptr, std::move(id)}; }
+};
+
+struct BookLogOptions {
+    std::string dir;                      // Created if missing
+    bool sync = true;                     // fdatasync before a write is acknowledged
+    std::uint64_t snapshot_every = 100000; // Records between snapshots, 0 for never
+};
+
+// What BookLog found on disk at startup.
+struct RecoveryStats {
+    std::size_t snapshot_books = 0;
+    std::size_t replayed_records = 0;
+    double seconds = 0;
+};
+
+// Durable write-ahead log and snapshots for a ShardedBookStore.
+//
+// Every change is appended to the current log segment as a checksummed
+// record numbered by a log sequence number (LSN). Writers that commit at the
+// same time share one write() and fdatasync(): the first one to need a flush
+// writes out everything buffered so far and the rest wait for it (group
+// commit).
+//
+// Every snapshot_every records a background thread writes the whole store to
+// a snapshot file and starts a new segment. The previous snapshot and the
+// segments after it are kept as a fallback; older files are deleted. Startup
+// loads the newest snapshot and replays only the segments after it; a torn
+// record at the end of a segment (a crash mid-write) ends that segment's
+// replay.
+//
+// On disk, in dir:
+//   wal-<first LSN>.log       [u32 size][u32 crc32][size bytes: u64 LSN, record]
+//   snapshot-<LSN>.bin        header, books in store order, crc32 of the rest
+//
+// Puts and snapshots keep each book's version after it. Puts without one and
+// BKSNAP01 snapshots, written before books had versions, load at version 1.
+//
+// Once a write or sync fails the log stops accepting commits, since memory
+// and disk may no longer agree.
+class BookLog {
+public:
+    // Recovers dir into books (which should be empty) and opens a new
+    // segment for appends. Throws std::system_error if dir cannot be used.
+    BookLog(BookLogOptions options, ShardedBookStore& books);
+    ~BookLog();
+
+    BookLog(const BookLog&) = delete;
+    BookLog& operator=(const BookLog&) = delete;
+
+    const RecoveryStats& recovery() const { return recovery_; }
+
+    // Calls apply(std::vector<LogRecord>&), which should make one store
+    // write and push a record for each change it made. Changes are logged in
+    // the order they hit the store, then commit() waits until they are
+    // durable (without holding any lock other writers need). apply runs
+    // under one lock for the whole store, so logged writes to different
+    // shards do not run in parallel. Returns what apply returned, or
+    // std::nullopt if the log could not be written.
+    template <typename Apply>
+    auto commit(Apply&& apply) -> std::optional<std::decay_t<std::invoke_result_t<Apply&, std::vector<LogRecord>&>>> {
+        std::optional<std::decay_t<std::invoke_result_t<Apply&, std::vector<LogRecord>&>>> result;
+        std::vector<LogRecord> records;
+        std::uint64_t lsn;
+        {
+            std::lock_guard<std::mutex> lock(order_mutex_);
+            if (failed()) {
+                return std::nullopt;
+            }
+            result.emplace(apply(records));
+            if (records.empty()) {
+                return result;
+            }
+            lsn = append(records);
+        }
+        if (!wait_durable(lsn)) {
+            return std::nullopt;
+        }
+        return result;
+    }
+
+    // Writes a snapshot now and drops files older than the previous one.
+    bool snapshot();
+
+private:
+    std::uint64_t append(const std::vector<LogRecord>& records);
+    bool wait_durable(std::uint64_t lsn);
+    bool failed() const;
+
+    void recover();
+    bool open_segment(std::uint64_t first_lsn);
+    void snapshot_loop();
+    // Writes the snapshot, setting lsn to the LSN it covers
+    bool write_snapshot(std::uint64_t& lsn);
+
+    BookLogOptions options_;
+    ShardedBookStore& books_;
+    RecoveryStats recovery_;
+
+    // Held while a change is applied and appended, so the log has changes in
+    // store order, and by snapshot() while it rotates the segment
+    std::mutex order_mutex_;
+
+    mutable std::mutex mutex_; // Guards everything below
+    std::condition_variable flushed_;
+    std::string buffer_;              // Encoded records not yet written
+    std::uint64_t last_lsn_ = 0;      // Last LSN handed out
+    std::uint64_t durable_lsn_ = 0;   // Last LSN written (and synced)
+    bool flushing_ = false;           // A writer is flushing buffer_
+    bool failed_ = false;
+    int fd_ = -1;                     // Current segment
+    std::uint64_t snapshot_lsn_ = 0;  // LSN covered by the newest snapshot on disk
+    bool snapshot_wanted_ = false;    // Due, or being written
+    bool stopping_ = false;
+    std::condition_variable snapshot_cv_;
+
+    std::thread snapshot_thread_;
+};
+
+#endif
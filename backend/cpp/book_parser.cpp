@@ -0,0 +1,591 @@
+#include "book_parser.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define BOOK_PARSER_X86 1
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+
+constexpr int max_depth = 64;
+
+// True for bytes that end a run of plain string content: '"', '\\' and
+// control characters
+struct SpecialTable {
+    bool special[256] = {};
+    constexpr SpecialTable() {
+        for (int c = 0; c < 0x20; ++c) {
+            special[c] = true;
+        }
+        special[static_cast<unsigned char>('"')] = true;
+        special[static_cast<unsigned char>('\\')] = true;
+    }
+};
+
+constexpr SpecialTable string_special;
+
+const char* scan_string_scalar(const char* p, const char* end) {
+    while (p < end && !string_special.special[static_cast<unsigned char>(*p)]) {
+        ++p;
+    }
+    return p;
+}
+
+#ifdef BOOK_PARSER_X86
+inline unsigned lowest_bit(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+const char* scan_string_sse2(const char* p, const char* end) {
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1f);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        // max(c, 0x1f) == 0x1f is an unsigned c <= 0x1f
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+        if (mask != 0) {
+            return p + lowest_bit(mask);
+        }
+        p += 16;
+    }
+    return scan_string_scalar(p, end);
+}
+
+#if defined(__GNUC__)
+#define BOOK_PARSER_AVX2 1
+
+__attribute__((target("avx2")))
+const char* scan_string_avx2(const char* p, const char* end) {
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1f);
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash)),
+            _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hits));
+        if (mask != 0) {
+            return p + lowest_bit(mask);
+        }
+        p += 32;
+    }
+    return scan_string_sse2(p, end);
+}
+#endif
+#endif
+
+using ScanFn = const char* (*)(const char*, const char*);
+
+ScanFn pick_scan_string() {
+#if defined(BOOK_PARSER_AVX2)
+    __builtin_cpu_init(); // Runs during static initialization
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_string_avx2;
+    }
+#endif
+#if defined(BOOK_PARSER_X86)
+    return scan_string_sse2;
+#else
+    return scan_string_scalar;
+#endif
+}
+
+// Returns the first '"', '\\' or control character in [p, end), or end
+const ScanFn scan_string = pick_scan_string();
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void append_code_point(std::string& out, std::uint32_t cp) {
+    if (cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        out += static_cast<char>(0xc0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += static_cast<char>(0xe0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+        out += static_cast<char>(0xf0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+}
+
+class Parser {
+public:
+    explicit Parser(std::string_view body) : p_(body.data()), end_(body.data() + body.size()) {}
+
+    std::optional<ParsedBook> parse() {
+        ParsedBook parsed;
+
+        skip_whitespace();
+        if (!consume('{')) {
+            return std::nullopt;
+        }
+        skip_whitespace();
+        if (!consume('}')) {
+            for (;;) {
+                std::string key;
+                if (!parse_string(&key)) {
+                    return std::nullopt;
+                }
+                skip_whitespace();
+                if (!consume(':')) {
+                    return std::nullopt;
+                }
+                skip_whitespace();
+
+                unsigned field = 0;
+                std::string* target = field_for_key(key, parsed.book, field);
+                if (!target) {
+                    if (!skip_value(1)) {
+                        return std::nullopt;
+                    }
+                } else if (p_ < end_ && *p_ == '"') {
+                    target->clear();
+                    if (!parse_string(target)) {
+                        return std::nullopt;
+                    }
+                    parsed.fields |= field;
+                    parsed.nulls &= ~field;
+                } else if (consume_literal("null")) {
+                    target->clear();
+                    parsed.fields &= ~field;
+                    parsed.nulls |= field;
+                } else {
+                    return std::nullopt;
+                }
+
+                skip_whitespace();
+                if (consume('}')) {
+                    break;
+                }
+                if (!consume(',')) {
+                    return std::nullopt;
+                }
+                skip_whitespace();
+            }
+        }
+
+        skip_whitespace();
+        if (p_ != end_) {
+            return std::nullopt;
+        }
+        if (parsed.fields & BookFieldPublishedDate) {
+            parsed.book.published_date = std::move(published_date_);
+        }
+        if (parsed.fields & BookFieldId) {
+            parsed.book.id = std::move(id_);
+        }
+        return parsed;
+    }
+
+    // Skips one value and returns how many bytes were consumed
+    std::size_t value_length(const char* start) {
+        if (!skip_value(0)) {
+            return std::string_view::npos;
+        }
+        return static_cast<std::size_t>(p_ - start);
+    }
+
+private:
+    std::string* field_for_key(const std::string& key, BookFields& book, unsigned& field) {
+        if (key == "title") {
+            field = BookFieldTitle;
+            return &book.title;
+        }
+        if (key == "author") {
+            field = BookFieldAuthor;
+            return &book.author;
+        }
+        if (key == "published_date") {
+            field = BookFieldPublishedDate;
+            return &published_date_;
+        }
+        if (key == "coverImageUrl") {
+            field = BookFieldCoverImageUrl;
+            return &book.coverImageUrl;
+        }
+        if (key == "id") {
+            field = BookFieldId;
+            return &id_;
+        }
+        return nullptr;
+    }
+
+    bool consume(char c) {
+        if (p_ < end_ && *p_ == c) {
+            ++p_;
+            return true;
+        }
+        return false;
+    }
+
+    bool consume_literal(std::string_view literal) {
+        if (static_cast<std::size_t>(end_ - p_) < literal.size() ||
+            std::memcmp(p_, literal.data(), literal.size()) != 0) {
+            return false;
+        }
+        p_ += literal.size();
+        return true;
+    }
+
+    void skip_whitespace() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\n' || *p_ == '\r' || *p_ == '\t')) {
+            ++p_;
+        }
+    }
+
+    bool parse_hex4(std::uint32_t& value) {
+        if (end_ - p_ < 4) {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; ++i) {
+            int digit = hex_value(p_[i]);
+            if (digit < 0) {
+                return false;
+            }
+            value = (value << 4) | static_cast<std::uint32_t>(digit);
+        }
+        p_ += 4;
+        return true;
+    }
+
+    // Decodes the string at p_ into out, or validates it when out is null
+    bool parse_string(std::string* out) {
+        if (!consume('"')) {
+            return false;
+        }
+        for (;;) {
+            const char* special = scan_string(p_, end_);
+            if (out) {
+                out->append(p_, special);
+            }
+            p_ = special;
+            if (p_ == end_) {
+                return false;
+            }
+
+            char c = *p_++;
+            if (c == '"') {
+                return true;
+            }
+            if (c != '\\' || p_ == end_) {
+                return false; // Raw control character or truncated escape
+            }
+
+            char escaped;
+            switch (*p_++) {
+            case '"':  escaped = '"'; break;
+            case '\\': escaped = '\\'; break;
+            case '/':  escaped = '/'; break;
+            case 'b':  escaped = '\b'; break;
+            case 'f':  escaped = '\f'; break;
+            case 'n':  escaped = '\n'; break;
+            case 'r':  escaped = '\r'; break;
+            case 't':  escaped = '\t'; break;
+            case 'u': {
+                std::uint32_t cp;
+                if (!parse_hex4(cp)) {
+                    return false;
+                }
+                if (cp >= 0xd800 && cp <= 0xdbff) {
+                    std::uint32_t low;
+                    if (!consume_literal("\\u") || !parse_hex4(low) || low < 0xdc00 || low > 0xdfff) {
+                        return false;
+                    }
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+                    return false; // Lone low surrogate
+                }
+                if (out) {
+                    append_code_point(*out, cp);
+                }
+                continue;
+            }
+            default:
+                return false;
+            }
+            if (out) {
+                *out += escaped;
+            }
+        }
+    }
+
+    bool skip_digits() {
+        const char* start = p_;
+        while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+            ++p_;
+        }
+        return p_ > start;
+    }
+
+    bool skip_number() {
+        consume('-');
+        if (!consume('0') && !skip_digits()) {
+            return false;
+        }
+        if (consume('.') && !skip_digits()) {
+            return false;
+        }
+        if (consume('e') || consume('E')) {
+            if (!consume('+')) {
+                consume('-');
+            }
+            if (!skip_digits()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Skips the members of the object or array whose opening bracket is at p_
+    bool skip_container(int depth, char close, bool is_object) {
+        if (depth >= max_depth) {
+            return false;
+        }
+        ++p_;
+        skip_whitespace();
+        if (consume(close)) {
+            return true;
+        }
+        for (;;) {
+            if (is_object) {
+                if (!parse_string(nullptr)) {
+                    return false;
+                }
+                skip_whitespace();
+                if (!consume(':')) {
+                    return false;
+                }
+            }
+            if (!skip_value(depth + 1)) {
+                return false;
+            }
+            skip_whitespace();
+            if (consume(close)) {
+                return true;
+            }
+            if (!consume(',')) {
+                return false;
+            }
+            skip_whitespace();
+        }
+    }
+
+    bool skip_value(int depth) {
+        skip_whitespace();
+        if (p_ == end_) {
+            return false;
+        }
+        switch (*p_) {
+        case '"':
+            return parse_string(nullptr);
+        case '{':
+            return skip_container(depth, '}', true);
+        case '[':
+            return skip_container(depth, ']', false);
+        case 't':
+            return consume_literal("true");
+        case 'f':
+            return consume_literal("false");
+        case 'n':
+            return consume_literal("null");
+        default:
+            return skip_number();
+        }
+    }
+
+    const char* p_;
+    const char* end_;
+    std::string published_date_;
+    std::string id_;
+};
+
+} // namespace
+
+std::optional<ParsedBook> parse_book_json(std::string_view body) {
+    return Parser(body).parse();
+}
+
+std::size_t json_value_length(std::string_view text) {
+    return Parser(text).value_length(text.data());
+}
+
+std::optional<ParsedBook> parse_book_msgpack(std::string_view body) {
+    MsgpackReader reader(body);
+    auto members = reader.read_map();
+    if (!members) {
+        return std::nullopt;
+    }
+
+    ParsedBook parsed;
+    std::optional<std::string_view> published_date;
+    std::optional<std::string_view> id;
+    for (std::size_t i = 0; i < *members; ++i) {
+        auto key = reader.read_str();
+        if (!key) {
+            return std::nullopt;
+        }
+        unsigned field = *key == "title"            ? BookFieldTitle
+                         : *key == "author"         ? BookFieldAuthor
+                         : *key == "published_date" ? BookFieldPublishedDate
+                         : *key == "coverImageUrl"  ? BookFieldCoverImageUrl
+                         : *key == "id"             ? BookFieldId
+                                                    : 0u;
+        if (field == 0) {
+            if (!reader.read_value()) {
+                return std::nullopt;
+            }
+            continue;
+        }
+
+        std::optional<std::string_view> value;
+        if (reader.read_nil()) {
+            parsed.fields &= ~field;
+            parsed.nulls |= field;
+        } else if ((value = reader.read_str())) {
+            parsed.fields |= field;
+            parsed.nulls &= ~field;
+        } else {
+            return std::nullopt;
+        }
+        std::string_view text = value.value_or(std::string_view());
+        switch (field) {
+        case BookFieldTitle:
+            parsed.book.title = text;
+            break;
+        case BookFieldAuthor:
+            parsed.book.author = text;
+            break;
+        case BookFieldCoverImageUrl:
+            parsed.book.coverImageUrl = text;
+            break;
+        case BookFieldPublishedDate:
+            published_date = value;
+            break;
+        default:
+            id = value;
+            break;
+        }
+    }
+
+    if (!reader.at_end()) {
+        return std::nullopt;
+    }
+    if (published_date) {
+        parsed.book.published_date = std::string(*published_date);
+    }
+    if (id) {
+        parsed.book.id = std::string(*id);
+    }
+    return parsed;
+}
+
+namespace {
+
+std::string_view trim_leading(std::string_view text) {
+    std::size_t start = text.find_first_not_of(" \t\r\n");
+    return start == std::string_view::npos ? std::string_view() : text.substr(start);
+}
+
+} // namespace
+
+BulkBodyReader::BulkBodyReader(std::string_view body, WireFormat format) : rest_(trim_leading(body)) {
+    if (format == WireFormat::Msgpack) {
+        msgpack_.emplace(body);
+        auto size = msgpack_->read_array();
+        msgpack_left_ = size.value_or(0);
+        failed_ = !size;
+        return;
+    }
+    if (!rest_.empty() && rest_.front() == '[') {
+        is_array_ = true;
+        rest_.remove_prefix(1);
+    }
+}
+
+std::optional<std::string_view> BulkBodyReader::next() {
+    if (failed_) {
+        return std::nullopt;
+    }
+
+    if (msgpack_) {
+        if (msgpack_left_ == 0) {
+            failed_ = !msgpack_->at_end();
+            return std::nullopt;
+        }
+        auto element = msgpack_->read_value();
+        failed_ = !element;
+        msgpack_left_ -= element.has_value();
+        return element;
+    }
+
+    if (!is_array_) {
+        // NDJSON: one document per line
+        while (!rest_.empty()) {
+            std::size_t end = rest_.find('\n');
+            std::string_view line = rest_.substr(0, end);
+            rest_.remove_prefix(end == std::string_view::npos ? rest_.size() : end + 1);
+            if (!trim_leading(line).empty()) {
+                return line;
+            }
+        }
+        return std::nullopt;
+    }
+
+    rest_ = trim_leading(rest_);
+    if (!first_) {
+        if (!rest_.empty() && rest_.front() == ']') {
+            rest_ = trim_leading(rest_.substr(1));
+            failed_ = !rest_.empty();
+            return std::nullopt;
+        }
+        if (rest_.empty() || rest_.front() != ',') {
+            failed_ = true;
+            return std::nullopt;
+        }
+        rest_ = trim_leading(rest_.substr(1));
+    } else if (!rest_.empty() && rest_.front() == ']') {
+        first_ = false;
+        rest_ = trim_leading(rest_.substr(1));
+        failed_ = !rest_.empty();
+        return std::nullopt;
+    }
+    first_ = false;
+
+    std::size_t length = json_value_length(rest_);
+    if (length == std::string_view::npos) {
+        failed_ = true;
+        return std::nullopt;
+    }
+    std::string_view element = rest_.substr(0, length);
+    rest_.remove_prefix(length);
+    return element;
+}
@@ -0,0 +1,66 @@
+#ifndef BOOK_PARSER_H
+#define BOOK_PARSER_H
+
+#include "book.h"
+#include "msgpack.h"
+#include <cstddef>
+#include <optional>
+#include <string_view>
+
+// Bits in ParsedBook::fields for the keys a body supplied
+enum BookField : unsigned {
+    BookFieldTitle = 1u << 0,
+    BookFieldAuthor = 1u << 1,
+    BookFieldPublishedDate = 1u << 2,
+    BookFieldCoverImageUrl = 1u << 3,
+    BookFieldId = 1u << 4,
+};
+
+struct ParsedBook {
+    BookFields book;     // id is only set if the body supplied one
+    unsigned fields = 0; // BookField bits for keys present with a string value
+    unsigned nulls = 0;  // BookField bits for keys present with null
+};
+
+// Parses a POST/PUT/PATCH body straight into BookFields without building a JSON DOM.
+// String content is scanned with AVX2 or SSE2 where available.
+//
+// The body must be a single JSON object. id, title, author, published_date
+// and coverImageUrl must hold a string or null (null leaves the field unset);
+// any other key may hold any JSON value and is validated and skipped. Later
+// duplicate keys win. Returns std::nullopt if the body is malformed.
+std::optional<ParsedBook> parse_book_json(std::string_view body);
+
+// Parses the same body in MessagePack (see msgpack.h): a map whose keys are
+// strings, with the fields above holding a string or nil and any other key
+// any value, which is skipped. Returns std::nullopt if the body is malformed
+// or has bytes after the map.
+std::optional<ParsedBook> parse_book_msgpack(std::string_view body);
+
+// Returns the length of the JSON value at the start of text, including any
+// leading whitespace, or std::string_view::npos if it is malformed.
+std::size_t json_value_length(std::string_view text);
+
+// Splits a bulk request body into one document per book. A JSON body is
+// either an array of objects or NDJSON (one object per line, blank lines
+// ignored); a MessagePack body is an array of maps. Elements are only
+// delimited here; parse each with parse_book_json or parse_book_msgpack.
+class BulkBodyReader {
+public:
+    explicit BulkBodyReader(std::string_view body, WireFormat format = WireFormat::Json);
+
+    // Returns the next element, or std::nullopt at the end of the body or
+    // when the framing is broken (see failed()).
+    std::optional<std::string_view> next();
+
+    bool failed() const { return failed_; }
+
+private:
+    std::string_view rest_;
+    std::optional<MsgpackReader> msgpack_;
+    std::size_t msgpack_left_ = 0; // Elements of the MessagePack array still to come
+    bool is_array_ = false;
+    bool first_ = true;
+    bool failed_ = false;
+};
+#endif
@@ -0,0 +1,418 @@
+#include "book_store.h"
+#include <utility>
+
+BookStore::BookPtr BookStore::find(std::string_view id) const {
+    if (std::optional<BookId> uuid = parse_book_id(id)) {
+        auto it = uuid_index_.find(*uuid);
+        return it == uuid_index_.end() ? nullptr : slots_[it->second].book;
+    }
+    auto it = text_index_.find(id);
+    return it == text_index_.end() ? nullptr : slots_[it->second].book;
+}
+
+bool BookStore::insert(BookPtr book) {
+    return insert(std::move(book), next_seq_);
+}
+
+bool BookStore::insert(BookPtr book, std::uint64_t seq) {
+    if (!book || book->id().empty() || seq < next_seq_) {
+        return false;
+    }
+
+    std::uint32_t* entry;
+    if (std::optional<BookId> uuid = parse_book_id(book->id())) {
+        auto [it, inserted] = uuid_index_.try_emplace(*uuid, npos);
+        if (!inserted) {
+            return false;
+        }
+        entry = &it->second;
+    } else {
+        auto [it, inserted] = text_index_.try_emplace(book->id(), npos);
+        if (!inserted) {
+            return false;
+        }
+        entry = &it->second;
+    }
+
+    std::uint32_t slot = acquire_slot();
+    *entry = slot;
+    slots_[slot].book = std::move(book);
+    slots_[slot].position = static_cast<std::uint32_t>(order_.size());
+    order_.push_back({seq, slot});
+    next_seq_ = seq + 1;
+    index_book(order_.back());
+    return true;
+}
+
+bool BookStore::update(BookPtr book) {
+    if (!book || book->id().empty()) {
+        return false;
+    }
+
+    std::uint32_t slot;
+    if (std::optional<BookId> uuid = parse_book_id(book->id())) {
+        auto it = uuid_index_.find(*uuid);
+        if (it == uuid_index_.end()) {
+            return false;
+        }
+        slot = it->second;
+    } else {
+        auto it = text_index_.find(book->id());
+        if (it == text_index_.end()) {
+            return false;
+        }
+        // Point the key at the new book's id before the old book can go away
+        slot = it->second;
+        auto node = text_index_.extract(it);
+        node.key() = book->id();
+        text_index_.insert(std::move(node));
+    }
+
+    // The secondary indexes only move the book if its keys changed; they are
+    // ordered through the stored book, so take it out before swapping
+    const Book& old = *slots_[slot].book;
+    Entry entry{order_[slots_[slot].position].seq, slot};
+    bool rekey = old.author() != book->author() || old.published_date() != book->published_date();
+    if (rekey) {
+        unindex_book(entry);
+    }
+    slots_[slot].book = std::move(book);
+    if (rekey) {
+        index_book(entry);
+    }
+    return true;
+}
+
+BookStore::WriteResult BookStore::replace(BookPtr book, std::uint32_t expected_version) {
+    BookPtr current = book ? find(book->id()) : nullptr;
+    if (!current) {
+        return WriteResult::NotFound;
+    }
+    if (current->version() != expected_version) {
+        return WriteResult::VersionConflict;
+    }
+    update(std::move(book));
+    return WriteResult::Written;
+}
+
+BookStore::WriteResult BookStore::erase(std::string_view id, std::uint32_t expected_version) {
+    BookPtr current = find(id);
+    if (!current) {
+        return WriteResult::NotFound;
+    }
+    if (current->version() != expected_version) {
+        return WriteResult::VersionConflict;
+    }
+    erase(id);
+    return WriteResult::Written;
+}
+
+bool BookStore::erase(std::string_view id) {
+    std::uint32_t slot;
+    if (std::optional<BookId> uuid = parse_book_id(id)) {
+        auto it = uuid_index_.find(*uuid);
+        if (it == uuid_index_.end()) {
+            return false;
+        }
+        slot = it->second;
+        uuid_index_.erase(it);
+    } else {
+        auto it = text_index_.find(id);
+        if (it == text_index_.end()) {
+            return false;
+        }
+        slot = it->second;
+        text_index_.erase(it);
+    }
+    unindex_book({order_[slots_[slot].position].seq, slot});
+
+    // Leave a tombstone in the order log, release the book and put the slot
+    // on the free list
+    order_[slots_[slot].position].slot = npos;
+    slots_[slot].book.reset();
+    slots_[slot].position = npos;
+    slots_[slot].next_free = free_head_;
+    free_head_ = slot;
+
+    if (++tombstones_ > 64 && tombstones_ * 2 > order_.size()) {
+        compact_order();
+    }
+    return true;
+}
+
+void BookStore::reserve(std::size_t n) {
+    slots_.reserve(n);
+    uuid_index_.reserve(n);
+    order_.reserve(n);
+}
+
+std::uint32_t BookStore::acquire_slot() {
+    if (free_head_ != npos) {
+        std::uint32_t slot = free_head_;
+        free_head_ = slots_[slot].next_free;
+        return slot;
+    }
+    slots_.emplace_back();
+    return static_cast<std::uint32_t>(slots_.size() - 1);
+}
+
+void BookStore::compact_order() {
+    std::size_t live = 0;
+    for (const Entry& entry : order_) {
+        if (entry.slot != npos) {
+            slots_[entry.slot].position = static_cast<std::uint32_t>(live);
+            order_[live++] = entry;
+        }
+    }
+    order_.resize(live);
+    tombstones_ = 0;
+}
+
+namespace {
+
+// How a key looks in an index entry: its first 16 bytes zero padded and
+// read big-endian, and its size
+struct KeyPrefix {
+    std::uint64_t high;
+    std::uint64_t low;
+    std::uint32_t size;
+};
+
+constexpr std::size_t prefix_bytes = 16;
+
+KeyPrefix key_prefix(std::string_view key) {
+    std::uint64_t words[2] = {0, 0};
+    for (std::size_t i = 0; i < prefix_bytes; ++i) {
+        words[i / 8] = words[i / 8] << 8 | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0u);
+    }
+    return {words[0], words[1], static_cast<std::uint32_t>(std::min<std::size_t>(key.size(), UINT32_MAX))};
+}
+
+// Orders two keys by their prefixes, like comparing the strings. Returns
+// std::nullopt when only the full keys can tell.
+template <typename A, typename B>
+std::optional<int> compare_prefixes(const A& a, const B& b) {
+    if (a.high != b.high) {
+        return a.high < b.high ? -1 : 1;
+    }
+    if (a.low != b.low) {
+        return a.low < b.low ? -1 : 1;
+    }
+    if (a.size <= prefix_bytes && b.size <= prefix_bytes) {
+        return a.size == b.size ? 0 : (a.size < b.size ? -1 : 1);
+    }
+    return std::nullopt;
+}
+
+// Compares an entry's key with a probe key and its prefix, loading the
+// entry's full key only if the prefixes cannot tell
+template <typename FullKey>
+int compare_keys(const KeyPrefix& a, FullKey&& full_a, std::string_view b, const KeyPrefix& b_prefix) {
+    if (auto order = compare_prefixes(a, b_prefix)) {
+        return *order;
+    }
+    return full_a().compare(b);
+}
+
+// Whether date is no later than `to`, counting dates `to` is a prefix of
+bool not_after(std::string_view date, std::string_view to) {
+    return date.compare(0, to.size(), to) <= 0;
+}
+
+// The prefix of the key's first `bytes` bytes
+KeyPrefix truncate(KeyPrefix key, std::size_t bytes) {
+    auto keep = [](std::uint64_t word, std::size_t n) {
+        return n >= 8 ? word : n == 0 ? 0 : word & ~std::uint64_t{0} << (8 - n) * 8;
+    };
+    key.high = keep(key.high, bytes);
+    key.low = keep(key.low, bytes > 8 ? bytes - 8 : 0);
+    key.size = static_cast<std::uint32_t>(std::min<std::size_t>(key.size, bytes));
+    return key;
+}
+
+} // namespace
+
+BookStore::IndexEntry BookStore::make_index_entry(std::string_view key, const Entry& entry) {
+    KeyPrefix prefix = key_prefix(key);
+    return {prefix.high, prefix.low, entry.seq, entry.slot, prefix.size};
+}
+
+void BookStore::index_book(const Entry& entry) {
+    const Book& book = *slots_[entry.slot].book;
+    by_author_.insert(make_index_entry(book.author(), entry),
+                      [this](const IndexEntry& a, const IndexEntry& b) { return author_less(a, b); });
+    if (auto date = book.published_date()) {
+        by_date_.insert(make_index_entry(*date, entry),
+                        [this](const IndexEntry& a, const IndexEntry& b) { return date_less(a, b); });
+    }
+}
+
+void BookStore::unindex_book(const Entry& entry) {
+    const Book& book = *slots_[entry.slot].book;
+    by_author_.erase(make_index_entry(book.author(), entry),
+                     [this](const IndexEntry& a, const IndexEntry& b) { return author_less(a, b); });
+    if (auto date = book.published_date()) {
+        by_date_.erase(make_index_entry(*date, entry),
+                       [this](const IndexEntry& a, const IndexEntry& b) { return date_less(a, b); });
+    }
+}
+
+bool BookStore::author_less(const IndexEntry& a, const IndexEntry& b) const {
+    if (a.slot == b.slot) {
+        return false;
+    }
+    auto by_author = compare_prefixes(a, b);
+    if (by_author && *by_author != 0) {
+        return *by_author < 0;
+    }
+    const Book& x = *slots_[a.slot].book;
+    const Book& y = *slots_[b.slot].book;
+    if (!by_author) {
+        if (int full = x.author().compare(y.author())) {
+            return full < 0;
+        }
+    }
+    // Undated books (nullopt) sort first
+    auto x_date = x.published_date();
+    auto y_date = y.published_date();
+    if (x_date != y_date) {
+        return x_date < y_date;
+    }
+    return a.seq < b.seq;
+}
+
+bool BookStore::date_less(const IndexEntry& a, const IndexEntry& b) const {
+    if (a.slot == b.slot) {
+        return false;
+    }
+    auto by_date = compare_prefixes(a, b);
+    if (!by_date) {
+        by_date = slots_[a.slot].book->published_date()->compare(*slots_[b.slot].book->published_date());
+    }
+    return *by_date != 0 ? *by_date < 0 : a.seq < b.seq;
+}
+
+BookStore::Range BookStore::find_range(const Query& query) const {
+    const std::optional<std::string>& from = query.published_from;
+    const std::optional<std::string>& to = query.published_to;
+    auto prefix = [](const IndexEntry& entry) { return KeyPrefix{entry.high, entry.low, entry.size}; };
+
+    if (query.author) {
+        // The author's books sit together in by_author_, by date with the
+        // undated ones first, so the range is two binary searches
+        std::string_view author = *query.author;
+        const KeyPrefix author_prefix = key_prefix(author);
+        const bool dated_only = from || to || query.order == Order::PublishedDate;
+        auto compare_author = [&](const IndexEntry& entry) {
+            return compare_keys(
+                prefix(entry), [&] { return slots_[entry.slot].book->author(); }, author, author_prefix);
+        };
+        auto first = by_author_.partition_point([&](const IndexEntry& entry) {
+            if (int by_author = compare_author(entry)) {
+                return by_author < 0;
+            }
+            auto date = slots_[entry.slot].book->published_date();
+            if (!date) {
+                return dated_only;
+            }
+            return from && *date < *from;
+        });
+        auto last = by_author_.partition_point([&](const IndexEntry& entry) {
+            if (int by_author = compare_author(entry)) {
+                return by_author < 0;
+            }
+            auto date = slots_[entry.slot].book->published_date();
+            return !date || !to || not_after(*date, *to);
+        });
+        return {first, last < first ? first : last};
+    }
+
+    if (query.order == Order::Author) {
+        return {by_author_.begin(), by_author_.end()};
+    }
+
+    auto date_of = [this](const IndexEntry& entry) { return *slots_[entry.slot].book->published_date(); };
+    const KeyPrefix from_prefix = from ? key_prefix(*from) : KeyPrefix{};
+    const KeyPrefix to_prefix = to ? key_prefix(*to) : KeyPrefix{};
+    auto first = by_date_.partition_point([&](const IndexEntry& entry) {
+        return from && compare_keys(prefix(entry), [&] { return date_of(entry); }, *from, from_prefix) < 0;
+    });
+    auto last = by_date_.partition_point([&](const IndexEntry& entry) {
+        if (!to) {
+            return true;
+        }
+        // Dates compare with `to` on its first to->size() bytes
+        auto order = compare_prefixes(truncate(prefix(entry), to->size()), to_prefix);
+        return order ? *order <= 0 : not_after(date_of(entry), *to);
+    });
+    return {first, last < first ? first : last};
+}
+
+// An author listing over a date range walks by_author_ checking every date
+// until the page fills, which visits about size() / matches books per book
+// wanted. When the range is small it is cheaper to take its books from
+// by_date_ and sort them by author, even though that loads each one's author
+// and costs about four times as much per book. Fills `sorted` with the books
+// up to the end of the page, in the listing's order, and returns true if it
+// did.
+bool BookStore::sort_date_range(const Query& query, std::size_t limit, std::vector<IndexEntry>& sorted) const {
+    Query by_date = query;
+    by_date.order = Order::PublishedDate;
+    Range range = find_range(by_date);
+    std::size_t matches = by_date_.distance(range.first, range.last);
+    if (matches == 0) {
+        return true;
+    }
+    std::size_t wanted = std::min(matches, query.offset + std::min(limit, matches) + 1);
+    if (matches * 4 / wanted > size() / matches) {
+        return false;
+    }
+
+    // Date entries carry date prefixes; key them by author instead
+    sorted.reserve(matches);
+    for (auto it = range.first; it != range.last; ++it) {
+        sorted.push_back(make_index_entry(slots_[it->slot].book->author(), {it->seq, it->slot}));
+    }
+    auto middle = sorted.begin() + static_cast<std::ptrdiff_t>(wanted);
+    if (query.descending) {
+        std::partial_sort(sorted.begin(), middle, sorted.end(),
+                          [this](const IndexEntry& a, const IndexEntry& b) { return author_less(b, a); });
+    } else {
+        std::partial_sort(sorted.begin(), middle, sorted.end(),
+                          [this](const IndexEntry& a, const IndexEntry& b) { return author_less(a, b); });
+    }
+    sorted.erase(middle, sorted.end());
+    return true;
+}
+
+bool BookStore::in_date_range(const Book& book, const Query& query) {
+    auto date = book.published_date();
+    if (!date) {
+        return false;
+    }
+    if (query.published_from && *date < *query.published_from) {
+        return false;
+    }
+    return !query.published_to || not_after(*date, *query.published_to);
+}
+
+bool BookStore::sorted_before(const Query& query, std::uint64_t a_seq, const Book& a, std::uint64_t b_seq,
+                              const Book& b) {
+    const Book* x = &a;
+    const Book* y = &b;
+    if (query.descending) {
+        std::swap(x, y);
+        std::swap(a_seq, b_seq);
+    }
+    if (query.order == Order::Author) {
+        if (int by_author = x->author().compare(y->author())) {
+            return by_author < 0;
+        }
+    }
+    auto x_date = x->published_date();
+    auto y_date = y->published_date();
+    if (x_date != y_date) {
+        return x_date < y_date;
+    }
+    return a_seq < b_seq;
+}
@@ -0,0 +1,248 @@
+#ifndef BOOK_STORE_H
+#define BOOK_STORE_H
+
+#include "book.h"
+#include "book_id.h"
+#include "ordered_index.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// In-memory book storage.
+//
+// Books live in a slot map: a vector of slots that are reused through a free
+// list, so a book keeps its slot for as long as it is stored. A hash index
+// maps ids to slots, so lookups, updates and deletes are O(1). UUID ids are
+// keyed by their BookId, so a probe compares two words; other ids, from
+// before ids were UUIDs, are keyed by their text.
+//
+// Every insert is stamped with an increasing sequence number and appended to
+// an order log. Deletes leave a tombstone that is compacted away once half
+// the log is dead, so iteration keeps insertion order and a cursor (the
+// sequence number of the last book seen) stays valid across deletes and can
+// be resumed with a binary search.
+//
+// Two secondary ordered indexes, by author and by publication date, are kept
+// up to date on every change so sorted listings and date ranges read only the
+// books they return instead of scanning and sorting the whole store.
+//
+// Stored books are immutable and shared: an update swaps in a new Book, so the
+// same Book can sit in several stores (see ConcurrentBookStore) and callers
+// can keep using one after the store has moved on.
+//
+// BookStore is not synchronized; see ConcurrentBookStore.
+class BookStore {
+public:
+    using BookPtr = std::shared_ptr<const Book>;
+
+    // Returns the book with the given id, or nullptr.
+    BookPtr find(std::string_view id) const;
+
+    // Stores a book that already has an id. Returns false if the id is
+    // missing or already taken.
+    bool insert(BookPtr book);
+
+    // Like insert(book), but stamps the book with `seq`, which must be at
+    // least next_seq(). Lets several stores share one sequence (see
+    // ShardedBookStore).
+    bool insert(BookPtr book, std::uint64_t seq);
+
+    // Sequence number the next insert(book) will use
+    std::uint64_t next_seq() const { return next_seq_; }
+
+    // Replaces the stored book with the same id, keeping its position.
+    // Returns false if it was not found.
+    bool update(BookPtr book);
+
+    // Removes the book with the given id. Returns false if it was not found.
+    bool erase(std::string_view id);
+
+    // Outcome of a write conditional on the stored book's version
+    enum class WriteResult { Written, NotFound, VersionConflict };
+
+    // Like update(book) and erase(id), but only if the stored book is at
+    // `expected_version`: a compare-and-swap for optimistic concurrency.
+    WriteResult replace(BookPtr book, std::uint32_t expected_version);
+    WriteResult erase(std::string_view id, std::uint32_t expected_version);
+
+    std::size_t size() const { return uuid_index_.size() + text_index_.size(); }
+    bool empty() const { return size() == 0; }
+    void reserve(std::size_t n);
+
+    // Calls fn(const BookPtr&) for every book in insertion order.
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+        for (const Entry& entry : order_) {
+            if (entry.slot != npos) {
+                fn(slots_[entry.slot].book);
+            }
+        }
+    }
+
+    // Calls fn(const BookPtr&) for up to `limit` books inserted after
+    // `cursor` (0 starts from the beginning), in insertion order. Returns the
+    // cursor to resume from, or 0 if no books follow.
+    template <typename Fn>
+    std::uint64_t for_each_after(std::uint64_t cursor, std::size_t limit, Fn&& fn) const {
+        return for_each_entry_after(cursor, limit, [&](std::uint64_t, const BookPtr& book) { fn(book); });
+    }
+
+    // Like for_each_after, but calls fn(seq, const BookPtr&) with each book's
+    // sequence number.
+    template <typename Fn>
+    std::uint64_t for_each_entry_after(std::uint64_t cursor, std::size_t limit, Fn&& fn) const {
+        auto it = std::upper_bound(order_.begin(), order_.end(), cursor,
+                                   [](std::uint64_t seq, const Entry& entry) { return seq < entry.seq; });
+        std::uint64_t last = cursor;
+        for (; it != order_.end(); ++it) {
+            if (it->slot == npos) {
+                continue;
+            }
+            if (limit == 0) {
+                return last;
+            }
+            fn(it->seq, slots_[it->slot].book);
+            last = it->seq;
+            --limit;
+        }
+        return 0;
+    }
+
+    enum class Order { Author, PublishedDate };
+
+    // A sorted listing. By author, books are ordered by author and then by
+    // publication date, undated books first; by publication date, only dated
+    // books are listed. Ties keep insertion order.
+    struct Query {
+        Order order = Order::PublishedDate;
+        std::optional<std::string> author; // Only this author's books
+        // Only books published in this range. Dates compare as strings, and
+        // published_to also takes in dates it is a prefix of, so "1999"
+        // includes "1999-12-31". Undated books never match a range.
+        std::optional<std::string> published_from;
+        std::optional<std::string> published_to;
+        bool descending = false;
+        std::size_t offset = 0; // Matching books to skip
+    };
+
+    // Calls fn(seq, const BookPtr&) for up to `limit` books matching query,
+    // in its order. Returns true if more matching books follow.
+    template <typename Fn>
+    bool for_each_sorted(const Query& query, std::size_t limit, Fn&& fn) const {
+        Range range = find_range(query);
+        // Only a whole-catalog author listing has to check dates book by book,
+        // unless the date range is small enough to sort
+        bool check_dates = query.order == Order::Author && !query.author &&
+                           (query.published_from || query.published_to);
+        std::vector<IndexEntry> sorted;
+        const bool use_sorted = check_dates && sort_date_range(query, limit, sorted);
+        if (use_sorted) {
+            check_dates = false;
+        }
+        std::size_t skip = query.offset;
+        auto visit = [&](const IndexEntry& entry) {
+            const BookPtr& book = slots_[entry.slot].book;
+            if (check_dates && !in_date_range(*book, query)) {
+                return true;
+            }
+            if (skip > 0) {
+                --skip;
+                return true;
+            }
+            if (limit == 0) {
+                return false;
+            }
+            fn(entry.seq, book);
+            --limit;
+            return true;
+        };
+        if (use_sorted) {
+            for (const IndexEntry& entry : sorted) {
+                if (!visit(entry)) {
+                    return true;
+                }
+            }
+        } else if (query.descending) {
+            for (auto it = range.last; it != range.first;) {
+                if (!visit(*--it)) {
+                    return true;
+                }
+            }
+        } else {
+            for (auto it = range.first; it != range.last; ++it) {
+                if (!visit(*it)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Whether book a (with sequence number a_seq) comes before b in the
+    // order of query, for merging listings from several stores
+    static bool sorted_before(const Query& query, std::uint64_t a_seq, const Book& a, std::uint64_t b_seq,
+                              const Book& b);
+
+private:
+    static constexpr std::uint32_t npos = UINT32_MAX;
+
+    struct Slot {
+        BookPtr book;
+        std::uint32_t position = npos;  // Index into order_
+        std::uint32_t next_free = npos; // Next free slot when unused
+    };
+
+    // One insert, in sequence order; slot is npos once the book is deleted
+    struct Entry {
+        std::uint64_t seq;
+        std::uint32_t slot;
+    };
+
+    // A book in a secondary index, with the first 16 bytes of its key (author
+    // or date) as two big-endian numbers and the key's size. Keys of up to 16
+    // bytes, like dates and most names, then compare without loading the book.
+    struct IndexEntry {
+        std::uint64_t high;
+        std::uint64_t low;
+        std::uint64_t seq;
+        std::uint32_t slot;
+        std::uint32_t size;
+    };
+
+    struct Range {
+        OrderedIndex<IndexEntry>::const_iterator first;
+        OrderedIndex<IndexEntry>::const_iterator last;
+    };
+
+    std::uint32_t acquire_slot();
+    void compact_order();
+
+    static IndexEntry make_index_entry(std::string_view key, const Entry& entry);
+    void index_book(const Entry& entry);
+    void unindex_book(const Entry& entry);
+    bool author_less(const IndexEntry& a, const IndexEntry& b) const;
+    bool date_less(const IndexEntry& a, const IndexEntry& b) const;
+    Range find_range(const Query& query) const;
+    bool sort_date_range(const Query& query, std::size_t limit, std::vector<IndexEntry>& sorted) const;
+    static bool in_date_range(const Book& book, const Query& query);
+
+    std::vector<Slot> slots_;
+    std::unordered_map<BookId, std::uint32_t, BookIdHash> uuid_index_;
+    std::unordered_map<std::string_view, std::uint32_t> text_index_; // Keys view the stored books' ids
+    std::uint32_t free_head_ = npos;
+
+    std::vector<Entry> order_;
+    std::size_t tombstones_ = 0;
+    std::uint64_t next_seq_ = 1;
+
+    OrderedIndex<IndexEntry> by_author_; // Every book
+    OrderedIndex<IndexEntry> by_date_;   // Books with a published date
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include "change_feed.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <utility>
+
+namespace {
+
+std::size_t round_up_to_power_of_two(std::size_t n) {
+    std::size_t size = 2;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+// Microseconds since 1970 at startup, different for every run of the server
+std::uint64_t startup_epoch() {
+    return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                          std::chrono::system_clock::now().time_since_epoch())
+                                          .count());
+}
+
+// Length byte for an id kept in the long id table
+constexpr unsigned char id_out_of_line = 0xff;
+
+} // namespace
+
+ChangeFeed::ChangeFeed(const ShardedBookStore& books, std::size_t capacity)
+    : books_(books),
+      epoch_(startup_epoch()),
+      mask_(round_up_to_power_of_two(capacity) - 1),
+      slots_(new Slot[mask_ + 1]),
+      dispatcher_([this] { run(); }) {}
+
+ChangeFeed::~ChangeFeed() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_one();
+    dispatcher_.join();
+}
+
+void ChangeFeed::publish(std::string_view id) {
+    std::uint64_t seq = claimed_.fetch_add(1, std::memory_order_release) + 1;
+    Slot& slot = slots_[seq & mask_];
+
+    // Another writer can only be filling this slot if one of us is a whole
+    // ring behind: wait for it, or give up if its entry is the newer one
+    std::uint64_t current = slot.seq.load(std::memory_order_relaxed);
+    for (;;) {
+        if (current == writing) {
+            std::this_thread::yield();
+            current = slot.seq.load(std::memory_order_relaxed);
+        } else if (current > seq) {
+            return;
+        } else if (slot.seq.compare_exchange_weak(current, writing, std::memory_order_acquire,
+                                                  std::memory_order_relaxed)) {
+            break;
+        }
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    unsigned char bytes[slot_words * 8] = {};
+    std::size_t length = id.size() <= max_inline_id ? id.size() : 0;
+    bytes[0] = id.size() <= max_inline_id ? static_cast<unsigned char>(length) : id_out_of_line;
+    if (id.size() > max_inline_id) {
+        store_long_id(seq, id);
+    }
+    std::memcpy(bytes + 1, id.data(), length);
+    for (std::size_t i = 0; i * 8 < length + 1; ++i) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes + i * 8, 8);
+        slot.words[i].store(word, std::memory_order_relaxed);
+    }
+    slot.seq.store(seq, std::memory_order_release);
+
+    if (subscriber_count_.load(std::memory_order_relaxed) != 0) {
+        wake_.notify_one();
+    }
+}
+
+ChangeFeed::Read ChangeFeed::read(std::uint64_t seq, std::string& id) const {
+    const Slot& slot = slots_[seq & mask_];
+    std::uint64_t before = slot.seq.load(std::memory_order_acquire);
+    if (before != seq) {
+        return before == writing || before < seq ? Read::NotYet : Read::Overwritten;
+    }
+
+    // A writer may be overwriting the words as they are copied; the second
+    // look at the sequence number says whether they can be used
+    unsigned char bytes[slot_words * 8];
+    std::uint64_t word = slot.words[0].load(std::memory_order_relaxed);
+    std::memcpy(bytes, &word, 8);
+    std::size_t length = bytes[0] == id_out_of_line ? 0 : std::min<std::size_t>(bytes[0], max_inline_id);
+    for (std::size_t i = 1; i * 8 < length + 1; ++i) {
+        word = slot.words[i].load(std::memory_order_relaxed);
+        std::memcpy(bytes + i * 8, &word, 8);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != seq) {
+        return Read::Overwritten;
+    }
+    if (bytes[0] == id_out_of_line) {
+        return find_long_id(seq, id) ? Read::Ok : Read::Overwritten;
+    }
+    id.assign(reinterpret_cast<const char*>(bytes) + 1, length);
+    return Read::Ok;
+}
+
+void ChangeFeed::store_long_id(std::uint64_t seq, std::string_view id) {
+    std::lock_guard<std::mutex> lock(long_ids_mutex_);
+    // Entries a whole ring behind have had their slots reused
+    while (!long_ids_.empty() && long_ids_.begin()->first + mask_ < seq) {
+        long_ids_.erase(long_ids_.begin());
+    }
+    long_ids_.emplace(seq, id);
+}
+
+bool ChangeFeed::find_long_id(std::uint64_t seq, std::string& id) const {
+    std::lock_guard<std::mutex> lock(long_ids_mutex_);
+    auto it = long_ids_.find(seq);
+    if (it == long_ids_.end()) {
+        return false;
+    }
+    id = it->second;
+    return true;
+}
+
+void ChangeFeed::subscribe(const void* key, Start start, Send send, Reload reload) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Subscriber& subscriber = subscribers_[key];
+    subscriber.send = std::move(send);
+    subscriber.reload = std::move(reload);
+
+    std::uint64_t last = last_seq();
+    std::uint64_t oldest = last > mask_ ? last - mask_ : 1; // Oldest seq still in the ring
+    if (start.resume && (start.epoch != epoch_ || start.since > last || start.since + 1 < oldest)) {
+        resync(subscriber);
+    } else {
+        subscriber.sent = subscriber.acked = start.resume ? start.since : last;
+        subscriber.send("{\"type\":\"hello\",\"epoch\":" + std::to_string(epoch_) +
+                        ",\"seq\":" + std::to_string(subscriber.sent) + "}");
+        if (!start.resume && subscriber.reload) {
+            subscriber.reload(subscriber.sent);
+        }
+    }
+
+    subscriber_count_.store(subscribers_.size(), std::memory_order_relaxed);
+    pending_ = true;
+    wake_.notify_one();
+}
+
+void ChangeFeed::ack(const void* key, std::uint64_t seq) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = subscribers_.find(key);
+    if (it == subscribers_.end()) {
+        return;
+    }
+    Subscriber& subscriber = it->second;
+    subscriber.acked = std::max(subscriber.acked, std::min(seq, subscriber.sent));
+    pending_ = true;
+    wake_.notify_one();
+}
+
+void ChangeFeed::unsubscribe(const void* key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    subscribers_.erase(key);
+    subscriber_count_.store(subscribers_.size(), std::memory_order_relaxed);
+}
+
+void ChangeFeed::resync(Subscriber& subscriber) {
+    // Every write numbered up to here has reached the store, so a reload
+    // started after this frame arrives sees them all
+    subscriber.sent = subscriber.acked = last_seq();
+    subscriber.send("{\"type\":\"resync\",\"epoch\":" + std::to_string(epoch_) +
+                    ",\"seq\":" + std::to_string(subscriber.sent) + "}");
+    if (subscriber.reload) {
+        subscriber.reload(subscriber.sent);
+    }
+}
+
+void ChangeFeed::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::uint64_t seen = 0;
+    bool complete = true;
+    while (!stop_) {
+        // Writers wake this thread without taking the lock, so a wakeup can
+        // slip in just before it waits; the timeout bounds the delay. An
+        // entry still being written is retried sooner.
+        bool woken = wake_.wait_for(lock, std::chrono::milliseconds(complete ? 100 : 1), [&] {
+            return stop_ || pending_ || claimed_.load(std::memory_order_acquire) != seen;
+        });
+        if (stop_) {
+            break;
+        }
+        if (!woken && complete) {
+            continue;
+        }
+        pending_ = false;
+        seen = claimed_.load(std::memory_order_acquire);
+        complete = dispatch();
+    }
+}
+
+bool ChangeFeed::dispatch() {
+    std::uint64_t last = last_seq();
+    std::uint64_t oldest = last > mask_ ? last - mask_ : 1;
+    bool complete = true;
+
+    // Each event is read and serialized once a round, and subscribers due
+    // the same range share its frame
+    std::map<std::uint64_t, std::string> events;
+    struct Frame {
+        std::string text;
+        std::uint64_t end = 0; // Last seq in it
+        bool resync = false;   // An entry in the range was overwritten
+    };
+    std::map<std::pair<std::uint64_t, std::uint64_t>, Frame> frames;
+    std::string id;
+
+    auto event = [&](std::uint64_t seq, const std::string*& json) {
+        auto it = events.find(seq);
+        if (it != events.end()) {
+            json = &it->second;
+            return Read::Ok;
+        }
+        Read result = read(seq, id);
+        if (result != Read::Ok) {
+            complete = complete && result != Read::NotYet;
+            return result;
+        }
+        crow::json::wvalue change;
+        change["seq"] = seq;
+        if (auto book = books_.find(id)) {
+            change["op"] = "put";
+            change["version"] = static_cast<std::uint64_t>(book->version());
+            change["book"] = book->to_json();
+        } else {
+            change["op"] = "delete";
+            change["id"] = id;
+        }
+        json = &events.emplace(seq, change.dump()).first->second;
+        return Read::Ok;
+    };
+
+    for (auto& [key, subscriber] : subscribers_) {
+        if (subscriber.sent < last && subscriber.sent + 1 < oldest) {
+            resync(subscriber);
+            continue;
+        }
+        std::uint64_t to = std::min({last, subscriber.acked + window, subscriber.sent + max_frame_events});
+        if (to <= subscriber.sent) {
+            continue;
+        }
+
+        auto [it, fresh] = frames.try_emplace({subscriber.sent, to});
+        Frame& frame = it->second;
+        if (fresh) {
+            frame.text = "{\"type\":\"changes\",\"events\":[";
+            for (std::uint64_t seq = subscriber.sent + 1; seq <= to; ++seq) {
+                const std::string* json = nullptr;
+                Read result = event(seq, json);
+                if (result != Read::Ok) {
+                    frame.resync = result == Read::Overwritten;
+                    break;
+                }
+                if (frame.end != 0) {
+                    frame.text += ',';
+                }
+                frame.text += *json;
+                frame.end = seq;
+            }
+            frame.text += "]}";
+        }
+
+        if (frame.resync) {
+            resync(subscriber);
+        } else if (frame.end != 0) {
+            subscriber.send(frame.text);
+            subscriber.sent = frame.end;
+        }
+    }
+    return complete;
+}
@@ -0,0 +1,151 @@
+#ifndef CHANGE_FEED_H
+#define CHANGE_FEED_H
+
+#include "sharded_book_store.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+// Stream of book changes behind GET /book/_changes.
+//
+// Writers publish the id of every book they changed into a bounded ring,
+// numbered by a sequence number. Publishing never locks: a writer claims the
+// next number with one fetch_add and fills its slot under the slot's own
+// sequence word (a seqlock), so a reader that raced with it sees a number
+// that does not match and knows the slot moved on. Ids longer than
+// max_inline_id do not fit a slot: they go in a table by sequence number
+// under a lock of their own, which only such writers and the dispatcher
+// take, and the slot just marks where to look.
+//
+// One dispatcher thread turns new entries into frames and hands them to
+// every subscriber. An entry only says which book changed: the dispatcher
+// reads the book from the store when it sends it, so writers may publish in
+// a different order from the one their writes landed in, as with
+// SearchIndex::refresh(), and the last event for a book always carries what
+// the store holds. Subscribers that are caught up share one frame per
+// round, and idle ones cost an entry in a map.
+//
+// Subscribers acknowledge what they have processed, and are sent at most
+// window events past their last acknowledgement. One that stops keeping up
+// falls behind in the ring instead of piling up frames in memory; once its
+// next event has been overwritten it is told to resync, reloads GET /book
+// and carries on from the current sequence number.
+//
+// Frames are JSON text:
+//   {"type":"hello","epoch":E,"seq":S}   events after S follow
+//   {"type":"resync","epoch":E,"seq":S}  reload the books; events after S follow
+//   {"type":"changes","events":[{"seq":N,"op":"put","version":V,"book":{...}},
+//                               {"seq":N,"op":"delete","id":"..."}]}
+// Sequence numbers start from 1 in every process; epoch tells processes
+// apart, so a client resuming against a restarted server is told to resync.
+class ChangeFeed {
+public:
+    static constexpr std::size_t default_capacity = 1 << 16;
+    static constexpr std::size_t max_inline_id = 119;
+    static constexpr std::uint64_t window = 4096;    // Unacknowledged events per subscriber
+    static constexpr std::size_t max_frame_events = 512;
+
+    // Sends one frame to a subscriber. Called on the dispatcher thread, so it
+    // should only queue the frame.
+    using Send = std::function<void(const std::string& frame)>;
+
+    // Called when a subscriber has to load every book, with the seq the
+    // events that follow start after: right after its resync frame, and
+    // after the hello of one that did not resume. It runs under the feed's
+    // lock, before anything else is sent, so it should only queue the load:
+    // every write numbered up to seq is in the store by then, so a copy
+    // taken afterwards holds them all, and any later writes it also holds
+    // come again in the events after seq.
+    using Reload = std::function<void(std::uint64_t seq)>;
+
+    // Where a new subscriber starts: from now, or after `since` if `epoch`
+    // is this feed's.
+    struct Start {
+        bool resume = false;
+        std::uint64_t epoch = 0;
+        std::uint64_t since = 0;
+    };
+
+    // capacity is rounded up to a power of two.
+    explicit ChangeFeed(const ShardedBookStore& books, std::size_t capacity = default_capacity);
+    ~ChangeFeed();
+
+    ChangeFeed(const ChangeFeed&) = delete;
+    ChangeFeed& operator=(const ChangeFeed&) = delete;
+
+    // Records that the book with this id changed. Call it after the store
+    // write; safe from any thread.
+    void publish(std::string_view id);
+
+    // Adds a subscriber under `key`, which identifies it to ack() and
+    // unsubscribe(), and sends it a hello or resync frame.
+    void subscribe(const void* key, Start start, Send send, Reload reload = nullptr);
+
+    // The subscriber has processed everything up to seq.
+    void ack(const void* key, std::uint64_t seq);
+
+    // Removes a subscriber; send is not called for it once this returns.
+    void unsubscribe(const void* key);
+
+    std::uint64_t epoch() const { return epoch_; }
+    std::uint64_t last_seq() const { return claimed_.load(std::memory_order_acquire); }
+    std::size_t subscribers() const { return subscriber_count_.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr std::size_t slot_words = 15; // Length byte plus the id
+    static constexpr std::uint64_t writing = UINT64_MAX;
+
+    // Two cache lines: the sequence number of the entry it holds (0 if
+    // none, writing while being filled) and the id, as words so readers
+    // racing with a writer copy them without a data race.
+    struct alignas(64) Slot {
+        std::atomic<std::uint64_t> seq{0};
+        std::atomic<std::uint64_t> words[slot_words];
+    };
+
+    enum class Read { Ok, NotYet, Overwritten };
+
+    struct Subscriber {
+        Send send;
+        Reload reload;
+        std::uint64_t sent = 0;  // Last seq sent
+        std::uint64_t acked = 0; // Last seq acknowledged
+    };
+
+    Read read(std::uint64_t seq, std::string& id) const;
+    void store_long_id(std::uint64_t seq, std::string_view id);
+    bool find_long_id(std::uint64_t seq, std::string& id) const;
+    void resync(Subscriber& subscriber);
+    void run();
+    bool dispatch(); // Returns false if it stopped at an entry still being written
+
+    const ShardedBookStore& books_;
+    const std::uint64_t epoch_;
+    const std::size_t mask_;
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<std::uint64_t> claimed_{0}; // Last seq handed to a writer
+    std::atomic<std::size_t> subscriber_count_{0};
+
+    // Ids too long for a slot, by sequence number, for as long as their
+    // slot could still hold them
+    mutable std::mutex long_ids_mutex_;
+    std::map<std::uint64_t, std::string> long_ids_;
+
+    std::mutex mutex_; // Guards everything below
+    std::condition_variable wake_;
+    std::unordered_map<const void*, Subscriber> subscribers_;
+    bool pending_ = false; // A subscriber joined or acknowledged
+    bool stop_ = false;
+    std::thread dispatcher_;
+};
+
+#endif
@@ -0,0 +1,264 @@
+#include "compression.h"
+#include "metrics.h"
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace {
+
+// Levels by CompressionLevel. Fast keeps up with serializing the body (zstd
+// 1 runs at over 300 MB/s on book JSON); Small takes several times the CPU
+// for a few percent less, which only pays on a body sent many times.
+constexpr int gzip_levels[] = {1, 6};
+constexpr int zstd_levels[] = {1, 9};
+
+// Output grows by at least this much per codec call
+constexpr std::size_t min_output_step = 16 * 1024;
+
+std::string_view trim(std::string_view text) {
+    std::size_t first = text.find_first_not_of(" \t");
+    if (first == std::string_view::npos) {
+        return {};
+    }
+    std::size_t last = text.find_last_not_of(" \t");
+    return text.substr(first, last - first + 1);
+}
+
+// A q value in thousandths: "1", "0.5", "0.125". Malformed values count as 1,
+// as if the parameter were not there.
+int parse_q(std::string_view value) {
+    if (value.empty() || (value[0] != '0' && value[0] != '1')) {
+        return 1000;
+    }
+    int q = (value[0] - '0') * 1000;
+    if (value.size() > 1) {
+        if (value[1] != '.' || value.size() > 5) {
+            return 1000;
+        }
+        int scale = 100;
+        for (std::size_t i = 2; i < value.size(); ++i, scale /= 10) {
+            if (value[i] < '0' || value[i] > '9') {
+                return 1000;
+            }
+            q += (value[i] - '0') * scale;
+        }
+    }
+    return std::min(q, 1000);
+}
+
+} // namespace
+
+bool equals_lower(std::string_view text, std::string_view lower) {
+    if (text.size() != lower.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        char c = text[i] >= 'A' && text[i] <= 'Z' ? static_cast<char>(text[i] - 'A' + 'a') : text[i];
+        if (c != lower[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void for_each_accepted(std::string_view header, const std::function<void(std::string_view item, int q)>& fn) {
+    std::size_t pos = 0;
+    while (pos < header.size()) {
+        std::size_t end = std::min(header.find(',', pos), header.size());
+        std::string_view item = header.substr(pos, end - pos);
+        pos = end + 1;
+
+        std::size_t semicolon = item.find(';');
+        std::string_view name = trim(item.substr(0, semicolon));
+        int q = 1000;
+        while (semicolon != std::string_view::npos) {
+            std::size_t next = item.find(';', semicolon + 1);
+            std::string_view param = trim(item.substr(semicolon + 1, next - semicolon - 1));
+            if (param.size() >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = parse_q(trim(param.substr(2)));
+            }
+            semicolon = next;
+        }
+        fn(name, q);
+    }
+}
+
+ContentEncoding negotiate_encoding(std::string_view accept_encoding) {
+    // q of zstd, gzip and *, or -1 where not listed
+    int zstd = -1;
+    int gzip = -1;
+    int any = -1;
+    for_each_accepted(accept_encoding, [&](std::string_view coding, int q) {
+        if (equals_lower(coding, "zstd")) {
+            zstd = q;
+        } else if (equals_lower(coding, "gzip") || equals_lower(coding, "x-gzip")) {
+            gzip = q;
+        } else if (coding == "*") {
+            any = q;
+        }
+    });
+
+    zstd = zstd >= 0 ? zstd : any;
+    gzip = gzip >= 0 ? gzip : any;
+    if (zstd > 0 && zstd >= gzip) {
+        return ContentEncoding::Zstd;
+    }
+    if (gzip > 0) {
+        return ContentEncoding::Gzip;
+    }
+    return ContentEncoding::Identity;
+}
+
+const char* encoding_name(ContentEncoding encoding) {
+    switch (encoding) {
+    case ContentEncoding::Gzip:
+        return "gzip";
+    case ContentEncoding::Zstd:
+        return "zstd";
+    default:
+        return "identity";
+    }
+}
+
+// One gzip or zstd stream, reset between bodies
+class Compressor::Codec {
+public:
+    Codec(ContentEncoding encoding, CompressionLevel level) : encoding_(encoding) {
+        int index = static_cast<int>(level);
+        if (encoding_ == ContentEncoding::Gzip) {
+            // 15 window bits, plus 16 for a gzip header and trailer
+            if (deflateInit2(&zlib_, gzip_levels[index], Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                throw std::runtime_error("cannot start gzip stream");
+            }
+        } else {
+            zstd_ = ZSTD_createCCtx();
+            if (zstd_ == nullptr) {
+                throw std::runtime_error("cannot start zstd stream");
+            }
+            ZSTD_CCtx_setParameter(zstd_, ZSTD_c_compressionLevel, zstd_levels[index]);
+        }
+    }
+
+    ~Codec() {
+        if (encoding_ == ContentEncoding::Gzip) {
+            deflateEnd(&zlib_);
+        } else {
+            ZSTD_freeCCtx(zstd_);
+        }
+    }
+
+    Codec(const Codec&) = delete;
+    Codec& operator=(const Codec&) = delete;
+
+    // Forgets any body in progress, keeping the level and the memory
+    void reset() {
+        if (encoding_ == ContentEncoding::Gzip) {
+            deflateReset(&zlib_);
+        } else {
+            ZSTD_CCtx_reset(zstd_, ZSTD_reset_session_only);
+        }
+    }
+
+    void run(std::string_view data, bool finish, std::string& out) {
+        if (encoding_ == ContentEncoding::Gzip) {
+            run_gzip(data, finish, out);
+        } else {
+            run_zstd(data, finish, out);
+        }
+    }
+
+private:
+    void run_gzip(std::string_view data, bool finish, std::string& out) {
+        zlib_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        std::size_t left = data.size();
+        for (;;) {
+            // zlib counts in 32 bits
+            std::size_t step = std::min<std::size_t>(left, UINT_MAX);
+            zlib_.avail_in = static_cast<uInt>(step);
+            left -= step;
+            bool last = finish && left == 0;
+
+            int result;
+            do {
+                std::size_t room = last ? deflateBound(&zlib_, zlib_.avail_in) : zlib_.avail_in / 4;
+                room = std::min<std::size_t>(std::max(room, min_output_step), UINT_MAX);
+                std::size_t used = out.size();
+                out.resize(used + room);
+                zlib_.next_out = reinterpret_cast<Bytef*>(&out[used]);
+                zlib_.avail_out = static_cast<uInt>(room);
+                result = deflate(&zlib_, last ? Z_FINISH : Z_NO_FLUSH);
+                out.resize(used + room - zlib_.avail_out);
+                if (result == Z_STREAM_ERROR) {
+                    throw std::runtime_error("gzip stream failed");
+                }
+            } while (last ? result != Z_STREAM_END : zlib_.avail_in > 0 || zlib_.avail_out == 0);
+
+            if (left == 0) {
+                return;
+            }
+        }
+    }
+
+    void run_zstd(std::string_view data, bool finish, std::string& out) {
+        ZSTD_inBuffer in{data.data(), data.size(), 0};
+        for (;;) {
+            std::size_t room = finish ? ZSTD_compressBound(in.size - in.pos) : (in.size - in.pos) / 4;
+            room = std::max(room, min_output_step);
+            std::size_t used = out.size();
+            out.resize(used + room);
+            ZSTD_outBuffer buffer{&out[used], room, 0};
+            std::size_t result = ZSTD_compressStream2(zstd_, &buffer, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+            out.resize(used + buffer.pos);
+            if (ZSTD_isError(result)) {
+                throw std::runtime_error(std::string("zstd stream failed: ") + ZSTD_getErrorName(result));
+            }
+            // Unfinished, zstd may hold output back until it has a block
+            if (finish ? result == 0 : in.pos == in.size) {
+                return;
+            }
+        }
+    }
+
+    ContentEncoding encoding_;
+    z_stream zlib_{};
+    ZSTD_CCtx* zstd_ = nullptr;
+};
+
+std::unique_ptr<Compressor::Codec>& Compressor::idle_codec(ContentEncoding encoding, CompressionLevel level) {
+    thread_local std::unique_ptr<Codec> idle[2][2];
+    return idle[encoding == ContentEncoding::Zstd][static_cast<int>(level)];
+}
+
+Compressor::Compressor(ContentEncoding encoding, CompressionLevel level)
+    : encoding_(encoding), level_(level), codec_(std::move(idle_codec(encoding, level))) {
+    if (codec_) {
+        codec_->reset();
+    } else {
+        codec_ = std::make_unique<Codec>(encoding, level);
+    }
+}
+
+Compressor::~Compressor() {
+    std::unique_ptr<Codec>& idle = idle_codec(encoding_, level_);
+    if (!idle) {
+        idle = std::move(codec_);
+    }
+}
+
+void Compressor::write(std::string_view data, std::string& out) {
+    ScopedTiming timing(MetricTiming::Compress);
+    codec_->run(data, false, out);
+}
+
+void Compressor::finish(std::string_view data, std::string& out) {
+    ScopedTiming timing(MetricTiming::Compress);
+    codec_->run(data, true, out);
+}
+
+std::string compress(std::string_view data, ContentEncoding encoding, CompressionLevel level) {
+    std::string out;
+    Compressor(encoding, level).finish(data, out);
+    return out;
+}
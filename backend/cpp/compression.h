@@ -0,0 +1,71 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Content codings a response body can be sent in.
+enum class ContentEncoding { Identity, Gzip, Zstd };
+
+// Bodies smaller than this go out as they are: they fit in a packet either
+// way, so compressing them would cost CPU and save no round trip.
+constexpr std::size_t min_compress_size = 1400;
+
+// How hard to compress: Fast for bodies compressed for one response, Small
+// for bodies compressed once and sent many times.
+enum class CompressionLevel { Fast, Small };
+
+// The coding to answer an Accept-Encoding header value with: the one it
+// gives the highest q, zstd before gzip on a tie, or Identity if it accepts
+// neither (or is empty).
+ContentEncoding negotiate_encoding(std::string_view accept_encoding);
+
+// Calls fn(item, q) for each item an Accept-style header value lists, such
+// as "gzip" or "application/json": trimmed and without its parameters, with
+// its q in thousandths (1000 where none is given).
+void for_each_accepted(std::string_view header, const std::function<void(std::string_view item, int q)>& fn);
+
+// True if text equals lower, which must be lower case, ignoring ASCII case.
+bool equals_lower(std::string_view text, std::string_view lower);
+
+// The Content-Encoding header value for an encoding, e.g. "gzip".
+const char* encoding_name(ContentEncoding encoding);
+
+// Compresses a body as it is produced. Each write() appends whatever
+// compressed output is ready to out, and finish() the rest, so a large body
+// never has to be held whole before it is compressed.
+//
+// Setting up gzip or zstd costs more than compressing a small body, so each
+// thread keeps one codec per encoding and level and the next Compressor it
+// makes resets and reuses it. Throws std::runtime_error if the codec fails.
+class Compressor {
+public:
+    // encoding must not be Identity
+    Compressor(ContentEncoding encoding, CompressionLevel level);
+    ~Compressor();
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    void write(std::string_view data, std::string& out);
+
+    // Compresses the last of the body, which may be empty, and ends the stream.
+    void finish(std::string_view data, std::string& out);
+
+private:
+    class Codec;
+
+    static std::unique_ptr<Codec>& idle_codec(ContentEncoding encoding, CompressionLevel level);
+
+    ContentEncoding encoding_;
+    CompressionLevel level_;
+    std::unique_ptr<Codec> codec_;
+};
+
+// Compresses a whole body in one go.
+std::string compress(std::string_view data, ContentEncoding encoding, CompressionLevel level);
+
+#endif
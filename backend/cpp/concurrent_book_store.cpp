@@ -0,0 +1,77 @@
+#include "concurrent_book_store.h"
+#include <thread>
+
+namespace {
+
+// Spreads reader threads over the counter slots; threads beyond the slot
+// count share counters, which stays correct but costs some scaling
+std::size_t reader_slot(std::size_t slots) {
+    static std::atomic<std::size_t> next_slot{0};
+    thread_local std::size_t slot = next_slot++;
+    return slot % slots;
+}
+
+} // namespace
+
+std::optional<StoreMode> parse_store_mode(const std::string& name) {
+    if (name == "mutex") {
+        return StoreMode::Mutex;
+    }
+    if (name == "rwlock") {
+        return StoreMode::SharedMutex;
+    }
+    if (name == "leftright") {
+        return StoreMode::LeftRight;
+    }
+    return std::nullopt;
+}
+
+const char* store_mode_name(StoreMode mode) {
+    switch (mode) {
+    case StoreMode::Mutex:
+        return "mutex";
+    case StoreMode::SharedMutex:
+        return "rwlock";
+    default:
+        return "leftright";
+    }
+}
+
+ConcurrentBookStore::ConcurrentBookStore(StoreMode mode) : mode_(mode) {}
+
+std::shared_ptr<const BookStore> ConcurrentBookStore::snapshot() const {
+    return read([](const BookStore& store) { return std::make_shared<const BookStore>(store); });
+}
+
+ConcurrentBookStore::ReadSection::ReadSection(const ConcurrentBookStore& store)
+    : counter_(store.readers_[store.epoch_.load(std::memory_order_seq_cst)][reader_slot(reader_slots)]) {
+    // The seq_cst increment orders this reader's arrival before its load of
+    // read_side_, which is what the writer's wait_for_readers relies on
+    counter_.active.fetch_add(1, std::memory_order_seq_cst);
+    side_ = store.read_side_.load(std::memory_order_seq_cst);
+}
+
+ConcurrentBookStore::ReadSection::~ReadSection() {
+    counter_.active.fetch_sub(1, std::memory_order_release);
+}
+
+void ConcurrentBookStore::publish(int side) {
+    read_side_.store(side, std::memory_order_seq_cst);
+    version_.fetch_add(1, std::memory_order_release);
+
+    // Readers that arrived before the switch may be on either copy. Move new
+    // arrivals to the other epoch's counters, then wait for both epochs to
+    // drain so a steady stream of readers cannot starve the writer.
+    int epoch = epoch_.load(std::memory_order_relaxed);
+    wait_for_readers(1 - epoch);
+    epoch_.store(1 - epoch, std::memory_order_seq_cst);
+    wait_for_readers(epoch);
+}
+
+void ConcurrentBookStore::wait_for_readers(int epoch) {
+    for (const ReaderCounter& counter : readers_[epoch]) {
+        while (counter.active.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+    }
+}
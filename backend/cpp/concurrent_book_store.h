@@ -0,0 +1,150 @@
+#ifndef CONCURRENT_BOOK_STORE_H
+#define CONCURRENT_BOOK_STORE_H
+
+#include "book_store.h"
+#include "metrics.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <type_traits>
+
+// How a ConcurrentBookStore synchronizes readers with writers.
+enum class StoreMode {
+    Mutex,       // One exclusive lock for readers and writers
+    SharedMutex, // Readers share a std::shared_mutex, writers take it exclusively
+    LeftRight,   // RCU-style: readers never lock, writers publish a second copy
+};
+
+// Parses "mutex", "rwlock" or "leftright". Returns std::nullopt otherwise.
+std::optional<StoreMode> parse_store_mode(const std::string& name);
+const char* store_mode_name(StoreMode mode);
+
+// A BookStore shared between Crow worker threads.
+//
+// read(fn) calls fn(const BookStore&) and write(fn) calls fn(BookStore&);
+// both return whatever fn returns. Callbacks should only touch the store and
+// leave parsing and serialization to the caller, and must not re-enter it.
+//
+// LeftRight mode keeps two copies of the store (sharing the Book objects).
+// Readers announce themselves on a per-thread, cache-line sized epoch counter
+// and read whichever copy is currently published, without taking a lock or
+// touching a shared cache line. A writer applies its change to the hidden
+// copy, publishes it, waits for readers that may still be on the old copy to
+// drain, then replays the change there. Readers are never blocked; writers
+// are serialized and pay for applying each change twice.
+//
+// In LeftRight mode write(fn) calls fn once per copy, so fn must make the
+// same change both times (insert the same BookPtr, not a moved-from Book).
+//
+// With metrics on, every read and write records how long it waited for the
+// lock and how long it held it; LeftRight readers never wait, and a
+// LeftRight write holds the writer lock through both copies.
+class ConcurrentBookStore {
+public:
+    explicit ConcurrentBookStore(StoreMode mode = StoreMode::SharedMutex);
+
+    ConcurrentBookStore(const ConcurrentBookStore&) = delete;
+    ConcurrentBookStore& operator=(const ConcurrentBookStore&) = delete;
+
+    StoreMode mode() const { return mode_; }
+
+    template <typename Fn>
+    decltype(auto) read(Fn&& fn) const {
+        // Declared before the lock so it sees the lock released
+        LockTiming timing(false);
+        switch (mode_) {
+        case StoreMode::Mutex: {
+            std::lock_guard<std::shared_mutex> lock(mutex_);
+            timing.acquired();
+            return fn(static_cast<const BookStore&>(sides_[0]));
+        }
+        case StoreMode::SharedMutex: {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            timing.acquired();
+            return fn(static_cast<const BookStore&>(sides_[0]));
+        }
+        default: {
+            ReadSection section(*this);
+            timing.acquired();
+            return fn(static_cast<const BookStore&>(sides_[section.side()]));
+        }
+        }
+    }
+
+    template <typename Fn>
+    decltype(auto) write(Fn&& fn) {
+        LockTiming timing(true);
+        if (mode_ != StoreMode::LeftRight) {
+            std::lock_guard<std::shared_mutex> lock(mutex_);
+            timing.acquired();
+            version_.fetch_add(1, std::memory_order_release);
+            return fn(sides_[0]);
+        }
+
+        std::lock_guard<std::mutex> lock(writer_mutex_);
+        timing.acquired();
+        int hidden = 1 - read_side_.load(std::memory_order_relaxed);
+        if constexpr (std::is_void_v<std::invoke_result_t<Fn&, BookStore&>>) {
+            fn(sides_[hidden]);
+            publish(hidden);
+            fn(sides_[1 - hidden]);
+        } else {
+            auto result = fn(sides_[hidden]);
+            publish(hidden);
+            fn(sides_[1 - hidden]);
+            return result;
+        }
+    }
+
+    // Returns a consistent copy of the store that stays valid after the call.
+    // This is an O(n) pointer copy; use it for long-running scans.
+    std::shared_ptr<const BookStore> snapshot() const;
+
+    // Incremented by every write.
+    std::uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+private:
+    static constexpr std::size_t reader_slots = 128;
+
+    struct alignas(64) ReaderCounter {
+        std::atomic<std::uint64_t> active{0};
+    };
+
+    // Marks the calling thread as reading for its lifetime
+    class ReadSection {
+    public:
+        explicit ReadSection(const ConcurrentBookStore& store);
+        ~ReadSection();
+        int side() const { return side_; }
+
+    private:
+        ReaderCounter& counter_;
+        int side_;
+    };
+
+    // Makes `side` the published copy and waits until no reader can still
+    // be looking at the other one
+    void publish(int side);
+    void wait_for_readers(int epoch);
+
+    const StoreMode mode_;
+    std::array<BookStore, 2> sides_;
+    std::atomic<std::uint64_t> version_{0};
+
+    // Mutex and SharedMutex modes use sides_[0] only
+    mutable std::shared_mutex mutex_;
+
+    // LeftRight mode
+    std::mutex writer_mutex_;
+    std::atomic<int> read_side_{0};
+    std::atomic<int> epoch_{0};
+    mutable std::array<std::array<ReaderCounter, reader_slots>, 2> readers_{};
+};
+
+#endif
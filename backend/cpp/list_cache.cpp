@@ -0,0 +1,129 @@
+#include "list_cache.h"
+#include "metrics.h"
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// 64-bit FNV-1a, used to derive ETags from the body
+std::uint64_t fnv1a(std::string_view data) {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : data) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// This thread's last body, so the hot path touches no shared state
+struct LocalList {
+    const ListCache* owner = nullptr;
+    std::shared_ptr<const CachedList> list;
+};
+
+thread_local LocalList local_list;
+
+} // namespace
+
+const CachedList::Encoded& CachedList::encoded(ContentEncoding encoding) const {
+    std::size_t i = encoding == ContentEncoding::Zstd;
+    std::call_once(once_[i], [&] {
+        encoded_[i].body = compress(body, encoding, CompressionLevel::Small);
+        // The body's ETag with the coding added inside the quotes
+        encoded_[i].etag = etag.substr(0, etag.size() - 1) + "-" + encoding_name(encoding) + "\"";
+    });
+    return encoded_[i];
+}
+
+const CachedList& ListCache::get() {
+    // Read the version before the store so a concurrent write can only make
+    // the body look older than it is, never newer
+    std::uint64_t version = books_.version();
+    if (local_list.owner == this && local_list.list->version == version) {
+        return *local_list.list;
+    }
+
+    std::shared_ptr<const CachedList> list;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!current_ || current_->version != version) {
+            current_ = rebuild(version);
+        }
+        list = current_;
+    }
+
+    local_list.owner = this;
+    local_list.list = std::move(list);
+    return *local_list.list;
+}
+
+std::shared_ptr<const CachedList> ListCache::rebuild(std::uint64_t version) {
+    std::vector<BookStore::BookPtr> order = books_.books();
+    ScopedTiming timing(MetricTiming::JsonSerialize);
+
+    std::unordered_map<const Book*, Fragment> fragments;
+    fragments.reserve(order.size());
+    std::size_t size = 2;
+
+    for (const auto& book : order) {
+        auto it = fragments_.find(book.get());
+        if (it != fragments_.end()) {
+            it = fragments.emplace(book.get(), std::move(it->second)).first;
+        } else {
+            it = fragments.emplace(book.get(), Fragment{book, book->to_json().dump()}).first;
+        }
+        size += it->second.json.size() + 1;
+    }
+
+    auto list = std::make_shared<CachedList>();
+    list->version = version;
+    list->body.reserve(size);
+    list->body += '[';
+    for (std::size_t i = 0; i < order.size(); ++i) {
+        if (i > 0) {
+            list->body += ',';
+        }
+        list->body += fragments[order[i].get()].json;
+    }
+    list->body += ']';
+
+    list->etag = body_etag(list->body);
+
+    fragments_ = std::move(fragments);
+    return list;
+}
+
+std::string body_etag(std::string_view body) {
+    char etag[24];
+    std::snprintf(etag, sizeof(etag), "\"%016llx\"", static_cast<unsigned long long>(fnv1a(body)));
+    return etag;
+}
+
+bool etag_matches(const std::string& if_none_match, const std::string& etag) {
+    std::size_t pos = 0;
+    while (pos < if_none_match.size()) {
+        std::size_t end = if_none_match.find(',', pos);
+        if (end == std::string::npos) {
+            end = if_none_match.size();
+        }
+
+        std::size_t first = if_none_match.find_first_not_of(" \t", pos);
+        std::size_t last = if_none_match.find_last_not_of(" \t", end - 1);
+        if (first != std::string::npos && first < end) {
+            std::string candidate = if_none_match.substr(first, last - first + 1);
+            if (candidate == "*") {
+                return true;
+            }
+            // If-None-Match uses weak comparison, so ignore a W/ prefix
+            if (candidate.compare(0, 2, "W/") == 0) {
+                candidate.erase(0, 2);
+            }
+            if (candidate == etag) {
+                return true;
+            }
+        }
+        pos = end + 1;
+    }
+    return false;
+}
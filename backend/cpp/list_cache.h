@@ -0,0 +1,72 @@
+#ifndef LIST_CACHE_H
+#define LIST_CACHE_H
+
+#include "book_store.h"
+#include "compression.h"
+#include "sharded_book_store.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// A serialized GET /book body and its strong ETag.
+struct CachedList {
+    // The body in one content coding. Each coding has an ETag of its own, as
+    // the bytes differ.
+    struct Encoded {
+        std::string body;
+        std::string etag;
+    };
+
+    std::uint64_t version = 0; // Store version the body was built from
+    std::string body;
+    std::string etag;
+
+    // The body compressed with encoding (not Identity). The first caller
+    // compresses it, once per version however many ask at the same time,
+    // and it lives as long as the body.
+    const Encoded& encoded(ContentEncoding encoding) const;
+
+private:
+    mutable std::once_flag once_[2];
+    mutable Encoded encoded_[2];
+};
+
+// Keeps the GET /book body serialized between writes.
+//
+// The body is rebuilt lazily, at most once per store version, by the first
+// reader that notices the version moved. Each book's JSON is cached next to
+// the Book it came from, so a rebuild only serializes books that were added
+// or replaced and concatenates the rest.
+class ListCache {
+public:
+    explicit ListCache(const ShardedBookStore& books) : books_(books) {}
+
+    // Returns the body for the current store version. The reference stays
+    // valid until the calling thread calls get() again.
+    const CachedList& get();
+
+private:
+    struct Fragment {
+        BookStore::BookPtr book; // Keeps the key's address from being reused
+        std::string json;
+    };
+
+    std::shared_ptr<const CachedList> rebuild(std::uint64_t version);
+
+    const ShardedBookStore& books_;
+
+    std::mutex mutex_; // Guards everything below
+    std::shared_ptr<const CachedList> current_;
+    std::unordered_map<const Book*, Fragment> fragments_;
+};
+
+// A strong ETag derived from a body's bytes, as GET /book's.
+std::string body_etag(std::string_view body);
+
+// True if an If-None-Match header value matches the ETag.
+bool etag_matches(const std::string& if_none_match, const std::string& etag);
+
+#endif
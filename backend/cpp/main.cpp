@@ -1,161 +1,1221 @@
 #include <crow.h>
 #include "crow/middlewares/cors.h"
 #include <nlohmann/json.hpp>
-#include <vector>
 #include <string>
-#include <mutex>
+#include <string_view>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+#include <memory>
 #include <optional> // For std::optional
-#include <atomic>   // For std::atomic in generate_uuid
-
-// Simple Book structure
-struct Book {
-    std::optional<std::string> id;
-    std::string title;
-    std::string author;
-    std::optional<std::string> published_date;
-    std::string coverImageUrl;
-
-    // Helper to convert Book to Crow JSON
-    crow::json::wvalue to_json() const {
-        crow::json::wvalue x({});
-        if (id) {
-            x["id"] = *id;
-        }
-        x["title"] = title;
-        x["author"] = author;
-        if (published_date) {
-            x["published_date"] = *published_date;
-        }
-        x["coverImageUrl"] = coverImageUrl;
-        return x;
+#include "book.h"
+#include "book_id.h"
+#include "book_log.h"
+#include "book_parser.h"
+#include "book_store.h"
+#include "change_feed.h"
+#include "compression.h"
+#include "concurrent_book_store.h"
+#include "list_cache.h"
+#include "metrics.h"
+#include "msgpack.h"
+#include "replication.h"
+#include "search_index.h"
+#include "sharded_book_store.h"
+
+// A fresh UUIDv7 in its text form (see book_id.h)
+std::string generate_uuid() {
+    return format_book_id(generate_book_id());
+}
+
+// Largest page GET /book?limit= will return
+constexpr std::uint64_t max_page_size = 1000;
+
+// Parses a non-negative decimal query parameter
+std::optional<std::uint64_t> parse_uint(const char* text) {
+    if (text == nullptr || *text == '\0') {
+        return std::nullopt;
     }
-};
+    char* end = nullptr;
+    errno = 0;
+    unsigned long long value = std::strtoull(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || *text == '-') {
+        return std::nullopt;
+    }
+    return value;
+}
 
-// In-memory storage for books
-std::vector<Book> books;
-std::mutex books_mutex; // To protect access to the books vector
+// Default and largest number of results GET /book/search returns
+constexpr std::uint64_t default_search_limit = 20;
+constexpr std::uint64_t max_search_limit = 100;
 
-// Function to generate a UUID (simplified for this example)
-std::string generate_uuid() {
-    static std::atomic<long long> counter(0);
-    return "cpp-" + std::to_string(counter++);
+// Serializes one book
+std::string book_to_json(const Book& book) {
+    ScopedTiming timing(MetricTiming::JsonSerialize);
+    return book.to_json().dump();
+}
+
+// Serializes books as a JSON array
+std::string books_to_json(const std::vector<BookStore::BookPtr>& books) {
+    ScopedTiming timing(MetricTiming::JsonSerialize);
+    std::vector<crow::json::wvalue> items;
+    items.reserve(books.size());
+    for (const auto& book : books) {
+        items.push_back(book->to_json());
+    }
+    return crow::json::wvalue(std::move(items)).dump();
+}
+
+// Serializes one book in format
+std::string encode_book(const Book& book, WireFormat format) {
+    if (format == WireFormat::Json) {
+        return book_to_json(book);
+    }
+    ScopedTiming timing(MetricTiming::JsonSerialize);
+    std::string body;
+    book.append_msgpack(body);
+    return body;
+}
+
+// Serializes books as an array in format
+std::string encode_books(const std::vector<BookStore::BookPtr>& books, WireFormat format) {
+    if (format == WireFormat::Json) {
+        return books_to_json(books);
+    }
+    ScopedTiming timing(MetricTiming::JsonSerialize);
+    std::string body;
+    append_msgpack_array(body, books.size());
+    for (const auto& book : books) {
+        book->append_msgpack(body);
+    }
+    return body;
+}
+
+// Parses a POST, PUT or PATCH body, or one item of a bulk body, in the
+// format its Content-Type names
+std::optional<ParsedBook> parse_body(std::string_view body, WireFormat format) {
+    ScopedTiming timing(MetricTiming::JsonParse);
+    return format == WireFormat::Msgpack ? parse_book_msgpack(body) : parse_book_json(body);
+}
+
+// The 400 message for a body parse_body rejected
+const char* invalid_body_message(WireFormat format) {
+    return format == WireFormat::Msgpack ? "Invalid MessagePack" : "Invalid JSON";
+}
+
+// Most ids POST /book/_mget looks up at once
+constexpr std::size_t max_mget_ids = 1000;
+
+// Parses a POST /book/_mget body, {"ids":["...",...]}, in either format.
+// Other keys are ignored. Returns std::nullopt if it is malformed or an id
+// is not a string.
+std::optional<std::vector<std::string>> parse_id_list(std::string_view body, WireFormat format) {
+    ScopedTiming timing(MetricTiming::JsonParse);
+    std::vector<std::string> ids;
+    if (format == WireFormat::Json) {
+        auto json = crow::json::load(body.data(), body.size());
+        if (!json || json.t() != crow::json::type::Object || !json.has("ids") ||
+            json["ids"].t() != crow::json::type::List) {
+            return std::nullopt;
+        }
+        ids.reserve(json["ids"].size());
+        for (const auto& id : json["ids"]) {
+            if (id.t() != crow::json::type::String) {
+                return std::nullopt;
+            }
+            ids.push_back(id.s());
+        }
+        return ids;
+    }
+
+    MsgpackReader reader(body);
+    auto members = reader.read_map();
+    if (!members) {
+        return std::nullopt;
+    }
+    bool has_ids = false;
+    for (std::size_t i = 0; i < *members; ++i) {
+        auto key = reader.read_str();
+        if (!key) {
+            return std::nullopt;
+        }
+        if (*key != "ids") {
+            if (!reader.read_value()) {
+                return std::nullopt;
+            }
+            continue;
+        }
+        auto count = reader.read_array();
+        if (!count) {
+            return std::nullopt;
+        }
+        has_ids = true;
+        ids.clear();
+        ids.reserve(*count);
+        for (std::size_t k = 0; k < *count; ++k) {
+            auto id = reader.read_str();
+            if (!id) {
+                return std::nullopt;
+            }
+            ids.emplace_back(*id);
+        }
+    }
+    if (!has_ids || !reader.at_end()) {
+        return std::nullopt;
+    }
+    return ids;
+}
+
+// Serializes a POST /book/_mget result: the books found, in request order,
+// and the ids that were not
+std::string encode_mget(const std::vector<BookStore::BookPtr>& found, const std::vector<std::string>& ids,
+                        WireFormat format) {
+    ScopedTiming timing(MetricTiming::JsonSerialize);
+    std::size_t missing = static_cast<std::size_t>(std::count(found.begin(), found.end(), nullptr));
+    if (format == WireFormat::Json) {
+        std::vector<crow::json::wvalue> book_items;
+        std::vector<crow::json::wvalue> missing_items;
+        book_items.reserve(found.size() - missing);
+        missing_items.reserve(missing);
+        for (std::size_t i = 0; i < found.size(); ++i) {
+            if (found[i]) {
+                book_items.push_back(found[i]->to_json());
+            } else {
+                missing_items.emplace_back(ids[i]);
+            }
+        }
+        crow::json::wvalue result;
+        result["books"] = std::move(book_items);
+        result["missing"] = std::move(missing_items);
+        return result.dump();
+    }
+
+    std::string body;
+    append_msgpack_map(body, 2);
+    append_msgpack_str(body, "books");
+    append_msgpack_array(body, found.size() - missing);
+    for (const auto& book : found) {
+        if (book) {
+            book->append_msgpack(body);
+        }
+    }
+    append_msgpack_str(body, "missing");
+    append_msgpack_array(body, missing);
+    for (std::size_t i = 0; i < found.size(); ++i) {
+        if (!found[i]) {
+            append_msgpack_str(body, ids[i]);
+        }
+    }
+    return body;
 }
 
+// Fields a POST or PUT body must supply, and a PATCH body cannot clear
+constexpr unsigned required_book_fields = BookFieldTitle | BookFieldAuthor | BookFieldCoverImageUrl;
+
+// Strong ETag of one book as sent in format and encoding: its version,
+// which every change bumps, with "-msgpack" and the coding added when they
+// apply, since each is a different body (as with the GET /book codings)
+std::string book_etag(const Book& book, WireFormat format, ContentEncoding encoding) {
+    std::string etag = "\"" + std::to_string(book.version());
+    if (format == WireFormat::Msgpack) {
+        etag += "-msgpack";
+    }
+    if (encoding != ContentEncoding::Identity) {
+        etag += '-';
+        etag += encoding_name(encoding);
+    }
+    etag += '"';
+    return etag;
+}
+
+// Whether an If-Match header lets a write to a book at this version go
+// ahead: it is absent, "*" or lists an ETag of the version in any format or
+// coding. If-Match compares strongly, so weak (W/) tags never match.
+bool if_match_allows(const std::string& if_match, std::uint64_t version) {
+    if (if_match.empty()) {
+        return true;
+    }
+    std::string tag = std::to_string(version);
+    std::size_t pos = 0;
+    while (pos < if_match.size()) {
+        std::size_t end = if_match.find(',', pos);
+        if (end == std::string::npos) {
+            end = if_match.size();
+        }
+        std::size_t first = if_match.find_first_not_of(" \t", pos);
+        std::size_t last = if_match.find_last_not_of(" \t", end - 1);
+        if (first != std::string::npos && first < end) {
+            std::string_view candidate(if_match.data() + first, last - first + 1);
+            if (candidate == "*") {
+                return true;
+            }
+            if (candidate.size() >= 2 && candidate.front() == '"' && candidate.back() == '"') {
+                std::string_view opaque = candidate.substr(1, candidate.size() - 2);
+                if (opaque.substr(0, opaque.find('-')) == tag) {
+                    return true;
+                }
+            }
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+// A response body in the format the request's Accept chose. Every body
+// that can go out in either format says so with Vary: Accept.
+crow::response body_response(int code, std::string body, WireFormat format) {
+    crow::response res(code, std::move(body));
+    res.set_header("Content-Type", format_content_type(format));
+    res.set_header("Vary", "Accept");
+    return res;
+}
+
+// A book in a response body in the format the request's Accept chose, with
+// the ETag of the body CompressionMiddleware will send. A body large enough
+// to be compressed varies by Accept-Encoding too, which is set here so a 304
+// made from the response says so as well.
+crow::response book_response(int code, const Book& book, const crow::request& req) {
+    WireFormat format = negotiate_format(req.get_header_value("Accept"));
+    crow::response res = body_response(code, encode_book(book, format), format);
+    ContentEncoding encoding = ContentEncoding::Identity;
+    if (res.body.size() >= min_compress_size) {
+        encoding = negotiate_encoding(req.get_header_value("Accept-Encoding"));
+        res.set_header("Vary", "Accept, Accept-Encoding");
+    }
+    res.set_header("ETag", book_etag(book, format, encoding));
+    return res;
+}
+
+// Books POST /book/_bulk inserts per batch (one store write per shard)
+constexpr std::size_t bulk_batch_size = 1024;
+
+// The route a request is counted under in GET /metrics
+MetricRoute metric_route(const crow::request& req) {
+    std::string_view url = req.url;
+    bool get = req.method == "GET"_method;
+    bool post = req.method == "POST"_method;
+    if (url == "/book") {
+        return get ? MetricRoute::ListBooks : post ? MetricRoute::CreateBook : MetricRoute::Other;
+    }
+    if (url == "/metrics") {
+        return get ? MetricRoute::Metrics : MetricRoute::Other;
+    }
+    if (url.compare(0, 6, "/book/") != 0 || url.size() == 6 || url.find('/', 6) != std::string_view::npos) {
+        return MetricRoute::Other;
+    }
+    std::string_view name = url.substr(6);
+    if (name == "search") {
+        return get ? MetricRoute::SearchBooks : MetricRoute::Other;
+    }
+    if (name == "_export") {
+        return get ? MetricRoute::ExportBooks : MetricRoute::Other;
+    }
+    if (name == "_bulk") {
+        return post ? MetricRoute::BulkCreateBooks : MetricRoute::Other;
+    }
+    if (name == "_mget") {
+        return post ? MetricRoute::MultiGetBooks : MetricRoute::Other;
+    }
+    if (name == "_changes") {
+        return MetricRoute::Other;
+    }
+    if (get) {
+        return MetricRoute::GetBook;
+    }
+    if (req.method == "PUT"_method) {
+        return MetricRoute::UpdateBook;
+    }
+    if (req.method == "PATCH"_method) {
+        return MetricRoute::PatchBook;
+    }
+    if (req.method == "DELETE"_method) {
+        return MetricRoute::DeleteBook;
+    }
+    return MetricRoute::Other;
+}
+
+// Times every request, from before the other middleware runs until after it
+// has finished with the response
+struct MetricsMiddleware {
+    struct context {
+        std::chrono::steady_clock::time_point start;
+    };
+
+    void before_handle(crow::request&, crow::response&, context& ctx) {
+        if (metrics_enabled()) {
+            ctx.start = std::chrono::steady_clock::now();
+        }
+    }
+
+    void after_handle(crow::request& req, crow::response& res, context& ctx) {
+        if (metrics_enabled()) {
+            record_request(metric_route(req), res.code, std::chrono::steady_clock::now() - ctx.start);
+        }
+    }
+};
+
+// Compresses response bodies of min_compress_size or more in the coding the
+// request's Accept-Encoding prefers. Responses that already carry a
+// Content-Encoding (the cached GET /book variants, the export) are left
+// alone, and smaller ones cost nothing but the size check. Accept-Encoding
+// is added to any Vary the handler set.
+struct CompressionMiddleware {
+    struct context {};
+
+    void before_handle(crow::request&, crow::response&, context&) {}
+
+    void after_handle(crow::request& req, crow::response& res, context&) {
+        if (res.body.size() < min_compress_size || !res.get_header_value("Content-Encoding").empty()) {
+            return;
+        }
+        std::string vary = res.get_header_value("Vary");
+        if (vary.empty()) {
+            res.set_header("Vary", "Accept-Encoding");
+        } else if (vary.find("Accept-Encoding") == std::string::npos) {
+            res.set_header("Vary", vary + ", Accept-Encoding");
+        }
+        ContentEncoding encoding = negotiate_encoding(req.get_header_value("Accept-Encoding"));
+        if (encoding != ContentEncoding::Identity) {
+            res.body = compress(res.body, encoding, CompressionLevel::Fast);
+            res.set_header("Content-Encoding", encoding_name(encoding));
+        }
+    }
+};
+
+// On a follower (BOOK_FOLLOW), sends writes to the leader with 307, which
+// keeps their method and body, and refuses reads of /book with 503 while
+// the store is further behind the leader than the staleness bound.
+// POST /book/_mget is a read and is answered locally. Does nothing on a
+// leader or a standalone server.
+struct ReplicaMiddleware {
+    struct context {};
+
+    const Follower* follower = nullptr;
+    std::string leader_url; // Scheme, host and port the writes go to
+    std::chrono::milliseconds max_staleness{1000};
+
+    void before_handle(crow::request& req, crow::response& res, context&) {
+        if (follower == nullptr) {
+            return;
+        }
+        bool read = req.method == "POST"_method && req.url == "/book/_mget";
+        if (!read && (req.method == "POST"_method || req.method == "PUT"_method || req.method == "PATCH"_method ||
+                      req.method == "DELETE"_method)) {
+            res.code = 307;
+            res.set_header("Location", leader_url + req.raw_url);
+            res.end();
+            return;
+        }
+        std::string_view url = req.url;
+        if (url.compare(0, 5, "/book") == 0 && follower->staleness() > max_staleness) {
+            res.code = 503;
+            res.set_header("Retry-After", "1");
+            res.body = "Replica is behind the leader";
+            res.end();
+        }
+    }
+
+    void after_handle(crow::request&, crow::response&, context&) {}
+};
+
 int main() {
-    crow::App<crow::CORSHandler> app;
+    // Store concurrency mode: BOOK_STORE_MODE=mutex|rwlock|leftright (default rwlock)
+    StoreMode store_mode = StoreMode::SharedMutex;
+    if (const char* mode_name = std::getenv("BOOK_STORE_MODE")) {
+        auto mode = parse_store_mode(mode_name);
+        if (!mode) {
+            CROW_LOG_ERROR << "Unknown BOOK_STORE_MODE '" << mode_name << "', expected mutex, rwlock or leftright";
+            return 1;
+        }
+        store_mode = *mode;
+    }
+
+    // Store shards: BOOK_STORE_SHARDS=N (default 1). Writers to different
+    // shards never contend, which pays off for write-heavy traffic on many
+    // cores.
+    std::size_t store_shards = 1;
+    if (const char* shards_text = std::getenv("BOOK_STORE_SHARDS")) {
+        auto shards = parse_uint(shards_text);
+        if (!shards || *shards == 0 || *shards > ShardedBookStore::max_shards) {
+            CROW_LOG_ERROR << "Invalid BOOK_STORE_SHARDS '" << shards_text << "', expected 1 to "
+                           << ShardedBookStore::max_shards;
+            return 1;
+        }
+        store_shards = static_cast<std::size_t>(*shards);
+    }
+
+    // HTTP port: BOOK_PORT (default 8080), so a leader and its followers can
+    // run on one machine
+    std::uint16_t port = 8080;
+    if (const char* port_text = std::getenv("BOOK_PORT")) {
+        auto parsed = parse_uint(port_text);
+        if (!parsed || *parsed == 0 || *parsed > 65535) {
+            CROW_LOG_ERROR << "Invalid BOOK_PORT '" << port_text << "'";
+            return 1;
+        }
+        port = static_cast<std::uint16_t>(*parsed);
+    }
+
+    // Replication: BOOK_REPLICATION_PORT=P makes this server a leader that
+    // streams every change to followers connecting on port P.
+    // BOOK_FOLLOW=host:P makes it a read-only follower of the leader there:
+    // writes are redirected to BOOK_LEADER_URL (default http://host:8080)
+    // and /book reads fail with 503 while the copy is more than
+    // BOOK_MAX_STALENESS_MS (default 1000) behind.
+    std::optional<std::uint16_t> replication_port;
+    if (const char* port_text = std::getenv("BOOK_REPLICATION_PORT")) {
+        auto parsed = parse_uint(port_text);
+        if (!parsed || *parsed == 0 || *parsed > 65535) {
+            CROW_LOG_ERROR << "Invalid BOOK_REPLICATION_PORT '" << port_text << "'";
+            return 1;
+        }
+        replication_port = static_cast<std::uint16_t>(*parsed);
+    }
+    const char* follow = std::getenv("BOOK_FOLLOW");
+    std::string leader_host;
+    std::uint16_t leader_port = 0;
+    if (follow) {
+        std::string_view target = follow;
+        std::size_t colon = target.rfind(':');
+        auto parsed = colon == std::string_view::npos ? std::nullopt : parse_uint(follow + colon + 1);
+        if (colon == 0 || !parsed || *parsed == 0 || *parsed > 65535) {
+            CROW_LOG_ERROR << "Invalid BOOK_FOLLOW '" << follow << "', expected host:port";
+            return 1;
+        }
+        leader_host = std::string(target.substr(0, colon));
+        leader_port = static_cast<std::uint16_t>(*parsed);
+        if (std::getenv("BOOK_DATA_DIR")) {
+            CROW_LOG_ERROR << "BOOK_FOLLOW keeps books in memory only; unset BOOK_DATA_DIR";
+            return 1;
+        }
+    }
+    std::chrono::milliseconds max_staleness(1000);
+    if (const char* staleness_text = std::getenv("BOOK_MAX_STALENESS_MS")) {
+        auto parsed = parse_uint(staleness_text);
+        if (!parsed) {
+            CROW_LOG_ERROR << "Invalid BOOK_MAX_STALENESS_MS '" << staleness_text << "'";
+            return 1;
+        }
+        max_staleness = std::chrono::milliseconds(*parsed);
+    }
+
+    // In-memory storage for books
+    ShardedBookStore books(store_shards, store_mode);
+
+    // Optional persistence: BOOK_DATA_DIR=<dir> logs every change there and
+    // reloads it on startup. BOOK_WAL_SYNC=0 skips fdatasync;
+    // BOOK_SNAPSHOT_EVERY=N sets the records between snapshots.
+    std::unique_ptr<BookLog> book_log;
+    if (const char* data_dir = std::getenv("BOOK_DATA_DIR")) {
+        BookLogOptions log_options;
+        log_options.dir = data_dir;
+        if (const char* sync = std::getenv("BOOK_WAL_SYNC")) {
+            log_options.sync = std::string(sync) != "0";
+        }
+        if (const char* every = std::getenv("BOOK_SNAPSHOT_EVERY")) {
+            auto records = parse_uint(every);
+            if (!records) {
+                CROW_LOG_ERROR << "Invalid BOOK_SNAPSHOT_EVERY '" << every << "'";
+                return 1;
+            }
+            log_options.snapshot_every = *records;
+        }
+        try {
+            book_log = std::make_unique<BookLog>(std::move(log_options), books);
+        } catch (const std::exception& e) {
+            CROW_LOG_ERROR << "Cannot open BOOK_DATA_DIR '" << data_dir << "': " << e.what();
+            return 1;
+        }
+
+        const RecoveryStats& recovered = book_log->recovery();
+        CROW_LOG_INFO << "Loaded " << recovered.snapshot_books << " books from snapshot and replayed "
+                      << recovered.replayed_records << " log records in " << recovered.seconds << "s";
+    }
+
+    // Applies a store write, fn(), which returns true if it changed the
+    // store. With persistence on, that change is logged as `record` and the
+    // call returns once it is durable. A change can reach the store, where
+    // readers see it, and still fail to reach the log.
+    struct LoggedWrite {
+        bool changed = false;   // fn() changed the store
+        bool persisted = true;  // The log has every change fn() made
+    };
+    auto write_logged = [&](LogRecord record, auto&& fn) {
+        LoggedWrite write;
+        if (!book_log) {
+            write.changed = fn();
+            return write;
+        }
+        write.persisted = book_log->commit([&](std::vector<LogRecord>& records) {
+            write.changed = fn();
+            if (write.changed) {
+                records.push_back(std::move(record));
+            }
+            return write.changed;
+        }).has_value();
+        return write;
+    };
+
+    // Request, JSON and lock timings for GET /metrics: BOOK_METRICS=0 turns
+    // them off
+    const char* metrics_setting = std::getenv("BOOK_METRICS");
+    set_metrics_enabled(metrics_setting == nullptr || std::string(metrics_setting) != "0");
+
+    // Book changes streamed by GET /book/_changes; every write publishes the
+    // books it changed. Declared before the app so that it outlives the
+    // connections subscribed to it.
+    ChangeFeed change_feed(books);
+
+    // Middleware runs in this order before a handler and in reverse after it,
+    // so the metrics time compression too
+    crow::App<MetricsMiddleware, crow::CORSHandler, ReplicaMiddleware, CompressionMiddleware> app;
 
     // Configure CORS
     auto& cors = app.get_middleware<crow::CORSHandler>();
     cors.global()
         .origin("*")
-        .methods("POST"_method, "GET"_method, "PUT"_method, "DELETE"_method, "OPTIONS"_method)
-        .headers("Content-Type", "Authorization", "X-Requested-With");
+        .methods("POST"_method, "GET"_method, "PUT"_method, "PATCH"_method, "DELETE"_method, "OPTIONS"_method)
+        .headers("Content-Type", "Authorization", "X-Requested-With", "If-Match", "If-None-Match")
+        .expose("ETag", "X-Next-Cursor", "X-Next-Offset");
+
+    // Serialized GET /book body, rebuilt only after writes
+    ListCache list_cache(books);
+
+    // Full-text index over titles and authors; every write refreshes the
+    // books it touched
+    SearchIndex search_index(books);
+
+    // A leader's followers get a snapshot of the store, then every change
+    std::unique_ptr<ReplicationServer> replication_server;
+    if (replication_port) {
+        try {
+            replication_server = std::make_unique<ReplicationServer>(books, change_feed, *replication_port);
+        } catch (const std::exception& e) {
+            CROW_LOG_ERROR << "Cannot listen on BOOK_REPLICATION_PORT " << *replication_port << ": " << e.what();
+            return 1;
+        }
+    }
+
+    // A follower's store only changes through the leader's stream, which
+    // refreshes the search index and feeds its own GET /book/_changes
+    std::unique_ptr<Follower> follower;
+    if (follow) {
+        follower = std::make_unique<Follower>(books, leader_host, leader_port,
+                                              [&](const std::vector<std::string_view>& ids) {
+                                                  search_index.refresh(ids);
+                                                  for (std::string_view id : ids) {
+                                                      change_feed.publish(id);
+                                                  }
+                                              });
+        auto& replica = app.get_middleware<ReplicaMiddleware>();
+        replica.follower = follower.get();
+        const char* leader_url = std::getenv("BOOK_LEADER_URL");
+        replica.leader_url = leader_url ? leader_url : "http://" + leader_host + ":8080";
+        replica.max_staleness = max_staleness;
+    }
+
+    // Replaces book id with make(current book) as its next version. The new
+    // book is built outside any lock; the store only checks, under the
+    // shard's lock, that the version it was built from is still current, and
+    // if another writer got in first it is rebuilt from theirs. If-Match is
+    // checked against every version tried, so a client's stale ETag fails
+    // with 412 instead of overwriting a change it has not seen.
+    auto replace_book = [&](const crow::request& req, const std::string& id, auto&& make) {
+        const std::string& if_match = req.get_header_value("If-Match");
+        for (;;) {
+            auto current = books.find(id);
+            if (!current) {
+                return if_match.empty() ? crow::response(404, "Book not found")
+                                        : crow::response(412, "Book not found");
+            }
+            if (!if_match_allows(if_match, current->version())) {
+                return crow::response(412, "Book has changed");
+            }
 
-    // GET all books
+            BookFields book = make(*current);
+            book.id = id;
+            book.version = current->version() + 1;
+            auto updated = std::make_shared<const Book>(std::move(book));
+
+            auto result = BookStore::WriteResult::NotFound;
+            auto written = write_logged(LogRecord::put(updated), [&] {
+                result = books.replace(updated, current->version());
+                return result == BookStore::WriteResult::Written;
+            });
+            if (written.changed) {
+                search_index.refresh(id);
+                change_feed.publish(id);
+            }
+            if (!written.persisted) {
+                return crow::response(500, "Could not persist book");
+            }
+            if (written.changed) {
+                return book_response(200, *updated, req);
+            }
+            // Deleted or changed since the find; look again
+        }
+    };
+
+    // GET all books, or one page of them with ?limit=N[&cursor=X], or a
+    // sorted page with ?sort=author|published_date[&order=asc|desc]
+    // [&author=A][&published_from=D][&published_to=D][&limit=N][&offset=K]
     CROW_ROUTE(app, "/book")
-        .methods("GET"_method)([&]() {
-            std::lock_guard<std::mutex> lock(books_mutex);
-            crow::json::wvalue x;
-            for (size_t i = 0; i < books.size(); ++i) {
-                x[i] = books[i].to_json();
+        .methods("GET"_method)([&](const crow::request& req) {
+            WireFormat format = negotiate_format(req.get_header_value("Accept"));
+            const char* limit_param = req.url_params.get("limit");
+            const char* cursor_param = req.url_params.get("cursor");
+            const char* sort_param = req.url_params.get("sort");
+            const char* order_param = req.url_params.get("order");
+            const char* author_param = req.url_params.get("author");
+            const char* from_param = req.url_params.get("published_from");
+            const char* to_param = req.url_params.get("published_to");
+            const char* offset_param = req.url_params.get("offset");
+            if (sort_param || order_param || author_param || from_param || to_param || offset_param) {
+                if (cursor_param) {
+                    return crow::response(400, "cursor cannot be combined with sorting or filtering; use offset");
+                }
+                BookStore::Query query;
+                // Without sort=, one author's books come by date and date
+                // ranges by date
+                query.order = author_param ? BookStore::Order::Author : BookStore::Order::PublishedDate;
+                if (sort_param) {
+                    std::string_view sort = sort_param;
+                    if (sort == "author") {
+                        query.order = BookStore::Order::Author;
+                    } else if (sort == "published_date") {
+                        query.order = BookStore::Order::PublishedDate;
+                    } else {
+                        return crow::response(400, "Invalid sort, expected author or published_date");
+                    }
+                }
+                if (order_param) {
+                    std::string_view order = order_param;
+                    if (order != "asc" && order != "desc") {
+                        return crow::response(400, "Invalid order, expected asc or desc");
+                    }
+                    query.descending = order == "desc";
+                }
+                if (author_param) {
+                    query.author = author_param;
+                }
+                if (from_param) {
+                    query.published_from = from_param;
+                }
+                if (to_param) {
+                    query.published_to = to_param;
+                }
+                auto limit = limit_param ? parse_uint(limit_param) : max_page_size;
+                auto offset = offset_param ? parse_uint(offset_param) : 0;
+                if (!limit || !offset || *limit == 0) {
+                    return crow::response(400, "Invalid limit or offset");
+                }
+                query.offset = *offset;
+
+                std::vector<BookStore::BookPtr> page;
+                bool more = books.sorted_page(query, std::min(*limit, max_page_size), page);
+
+                crow::response res = body_response(200, encode_books(page, format), format);
+                if (more) {
+                    res.set_header("X-Next-Offset", std::to_string(*offset + page.size()));
+                }
+                return res;
             }
-            return crow::response(200, x.dump());
+
+            if (limit_param || cursor_param) {
+                auto limit = limit_param ? parse_uint(limit_param) : max_page_size;
+                auto cursor = cursor_param ? parse_uint(cursor_param) : 0;
+                if (!limit || !cursor || *limit == 0) {
+                    return crow::response(400, "Invalid limit or cursor");
+                }
+
+                std::vector<BookStore::BookPtr> page;
+                std::uint64_t next = books.page_after(*cursor, std::min(*limit, max_page_size), page);
+
+                crow::response res = body_response(200, encode_books(page, format), format);
+                if (next != 0) {
+                    res.set_header("X-Next-Cursor", std::to_string(next));
+                }
+                return res;
+            }
+
+            // Only the JSON list is cached: MessagePack clients are expected
+            // to page, so the whole list is encoded per request, with an
+            // ETag from its bytes
+            if (format == WireFormat::Msgpack) {
+                crow::response res = body_response(200, encode_books(books.books(), format), format);
+                std::string etag = body_etag(res.body);
+                res.set_header("ETag", etag);
+                if (etag_matches(req.get_header_value("If-None-Match"), etag)) {
+                    res.code = 304;
+                    res.body.clear();
+                }
+                return res;
+            }
+
+            // A large list goes out in the coding the client prefers,
+            // compressed once per store version
+            const CachedList& list = list_cache.get();
+            const std::string* body = &list.body;
+            const std::string* etag = &list.etag;
+            ContentEncoding encoding = ContentEncoding::Identity;
+            if (list.body.size() >= min_compress_size) {
+                encoding = negotiate_encoding(req.get_header_value("Accept-Encoding"));
+                if (encoding != ContentEncoding::Identity) {
+                    const CachedList::Encoded& encoded = list.encoded(encoding);
+                    body = &encoded.body;
+                    etag = &encoded.etag;
+                }
+            }
+
+            crow::response res(200);
+            res.set_header("Vary", list.body.size() >= min_compress_size ? "Accept, Accept-Encoding" : "Accept");
+            res.set_header("ETag", *etag);
+            if (etag_matches(req.get_header_value("If-None-Match"), *etag)) {
+                res.code = 304;
+                return res;
+            }
+            res.body = *body;
+            res.set_header("Content-Type", "application/json");
+            if (encoding != ContentEncoding::Identity) {
+                res.set_header("Content-Encoding", encoding_name(encoding));
+            }
+            return res;
+        });
+
+    // GET books matching ?q=, best first; the last word matches as a prefix
+    CROW_ROUTE(app, "/book/search")
+        .methods("GET"_method)([&](const crow::request& req) {
+            const char* query = req.url_params.get("q");
+            const char* limit_param = req.url_params.get("limit");
+            auto limit = limit_param ? parse_uint(limit_param) : default_search_limit;
+            if (query == nullptr || !limit || *limit == 0) {
+                return crow::response(400, "Missing q or invalid limit");
+            }
+
+            auto found = search_index.search(query, std::min(*limit, max_search_limit));
+            WireFormat format = negotiate_format(req.get_header_value("Accept"));
+            return body_response(200, encode_books(found, format), format);
+        });
+
+    // GET every book as NDJSON, one object per line. A compressed export is
+    // compressed a book at a time as it is serialized, so the whole NDJSON
+    // never has to be held at once.
+    CROW_ROUTE(app, "/book/_export")
+        .methods("GET"_method)([&](const crow::request& req) {
+            // Take a snapshot of the order, then serialize unlocked
+            std::vector<BookStore::BookPtr> order = books.books();
+
+            ContentEncoding encoding = negotiate_encoding(req.get_header_value("Accept-Encoding"));
+            std::string body;
+            if (encoding == ContentEncoding::Identity) {
+                for (const auto& book : order) {
+                    body += book_to_json(*book);
+                    body += '\n';
+                }
+            } else {
+                Compressor compressor(encoding, CompressionLevel::Fast);
+                for (const auto& book : order) {
+                    std::string line = book_to_json(*book);
+                    line += '\n';
+                    compressor.write(line, body);
+                }
+                compressor.finish({}, body);
+            }
+            crow::response res(200, std::move(body));
+            res.set_header("Content-Type", "application/x-ndjson");
+            res.set_header("Vary", "Accept-Encoding");
+            if (encoding != ContentEncoding::Identity) {
+                res.set_header("Content-Encoding", encoding_name(encoding));
+            }
+            return res;
         });
 
     // GET a single book by ID
     CROW_ROUTE(app, "/book/<string>")
-        .methods("GET"_method)([&](const std::string& id) {
-            std::lock_guard<std::mutex> lock(books_mutex);
-            for (const auto& book : books) {
-                if (book.id && *book.id == id) {
-                    return crow::response(200, book.to_json().dump());
-                }
+        .methods("GET"_method)([&](const crow::request& req, const std::string& id) {
+            auto book = books.find(id);
+            if (!book) {
+                return crow::response(404, "Book not found");
+            }
+            crow::response res = book_response(200, *book, req);
+            if (etag_matches(req.get_header_value("If-None-Match"), res.get_header_value("ETag"))) {
+                res.code = 304;
+                res.body.clear();
             }
-            return crow::response(404, "Book not found");
+            return res;
         });
 
     // POST create a new book
     CROW_ROUTE(app, "/book")
         .methods("POST"_method)([&](const crow::request& req) {
-            std::lock_guard<std::mutex> lock(books_mutex);
-            auto json_body = crow::json::load(req.body);
-            if (!json_body) {
-                return crow::response(400, "Invalid JSON");
+            WireFormat body_type = body_format(req.get_header_value("Content-Type"));
+            auto parsed = parse_body(req.body, body_type);
+            if (!parsed) {
+                return crow::response(400, invalid_body_message(body_type));
+            }
+            if ((parsed->fields & required_book_fields) != required_book_fields) {
+                return crow::response(400, "title, author and coverImageUrl are required");
             }
 
-            Book new_book;
+            BookFields new_book = std::move(parsed->book);
             new_book.id = generate_uuid();
-            new_book.title = json_body["title"].s();
-            new_book.author = json_body["author"].s();
-            
-            // Handle optional published_date
-            if (json_body.has("published_date") && json_body["published_date"].t() != crow::json::type::Null) {
-                new_book.published_date = json_body["published_date"].s();
-            } else {
-                new_book.published_date = std::nullopt; // Explicitly set to nullopt if not provided
+
+            auto stored = std::make_shared<const Book>(std::move(new_book));
+            auto inserted = write_logged(LogRecord::put(stored), [&] { return books.insert(stored); });
+            if (inserted.changed) {
+                search_index.refresh(stored->id());
+                change_feed.publish(stored->id());
+            }
+            if (!inserted.persisted) {
+                return crow::response(500, "Could not persist book");
+            }
+            if (!inserted.changed) {
+                return crow::response(500, "Could not store book");
             }
+            return book_response(201, *stored, req);
+        });
 
-            new_book.coverImageUrl = json_body["coverImageUrl"].s();
+    // POST many books at once, as a JSON array, NDJSON or a MessagePack
+    // array. Books that carry an id keep it, so an export can be loaded back
+    // as is. Bad items are reported by index and do not stop the rest.
+    CROW_ROUTE(app, "/book/_bulk")
+        .methods("POST"_method)([&](const crow::request& req) {
+            std::size_t created = 0;
+            std::vector<std::pair<std::size_t, const char*>> errors;
+            auto add_error = [&](std::size_t index, const char* message) { errors.emplace_back(index, message); };
 
-            books.push_back(new_book);
-            return crow::response(201, new_book.to_json().dump());
-        });
+            std::vector<BookStore::BookPtr> batch;
+            std::vector<std::size_t> batch_index;
+            batch.reserve(bulk_batch_size);
+            batch_index.reserve(bulk_batch_size);
+            auto flush = [&]() {
+                if (batch.empty()) {
+                    return;
+                }
+                // Empty if the log had already failed and nothing was stored
+                std::vector<bool> inserted;
+                bool persisted = true;
+                if (book_log) {
+                    persisted = book_log->commit([&](std::vector<LogRecord>& records) {
+                        inserted = books.insert_batch(batch);
+                        for (std::size_t i = 0; i < inserted.size(); ++i) {
+                            if (inserted[i]) {
+                                records.push_back(LogRecord::put(batch[i]));
+                            }
+                        }
+                        return true;
+                    }).has_value();
+                } else {
+                    inserted = books.insert_batch(batch);
+                }
 
-    // PUT update a book
-    CROW_ROUTE(app, "/book/<string>")
-        .methods("PUT"_method)([&](const crow::request& req, const std::string& id) {
-            std::lock_guard<std::mutex> lock(books_mutex);
-            auto json_body = crow::json::load(req.body);
-            if (!json_body) {
-                return crow::response(400, "Invalid JSON");
-            }
-
-            for (auto& book : books) {
-                if (book.id && *book.id == id) {
-                    book.title = json_body["title"].s();
-                    book.author = json_body["author"].s();
-                    
-                    // Handle optional published_date
-                    if (json_body.has("published_date") && json_body["published_date"].t() != crow::json::type::Null) {
-                        book.published_date = json_body["published_date"].s();
+                std::vector<std::string_view> ids;
+                ids.reserve(batch.size());
+                for (const auto& book : batch) {
+                    ids.push_back(book->id());
+                }
+                search_index.refresh(ids);
+
+                // Books the store took are published even if the log failed,
+                // as readers already see them
+                for (std::size_t i = 0; i < batch.size(); ++i) {
+                    bool stored = i < inserted.size() && inserted[i];
+                    if (stored) {
+                        change_feed.publish(batch[i]->id());
+                    }
+                    if (!persisted) {
+                        add_error(batch_index[i], "Could not persist book");
+                    } else if (stored) {
+                        ++created;
                     } else {
-                        book.published_date = std::nullopt;
+                        add_error(batch_index[i], "Duplicate id");
                     }
+                }
+                batch.clear();
+                batch_index.clear();
+            };
+
+            WireFormat body_type = body_format(req.get_header_value("Content-Type"));
+            BulkBodyReader reader(req.body, body_type);
+            std::size_t index = 0;
+            for (; auto item = reader.next(); ++index) {
+                auto parsed = parse_body(*item, body_type);
+                if (!parsed) {
+                    add_error(index, invalid_body_message(body_type));
+                    continue;
+                }
+                if ((parsed->fields & required_book_fields) != required_book_fields) {
+                    add_error(index, "title, author and coverImageUrl are required");
+                    continue;
+                }
 
-                    book.coverImageUrl = json_body["coverImageUrl"].s();
-                    return crow::response(200, book.to_json().dump());
+                BookFields new_book = std::move(parsed->book);
+                if (!new_book.id || new_book.id->empty()) {
+                    new_book.id = generate_uuid();
+                }
+                batch.push_back(std::make_shared<const Book>(std::move(new_book)));
+                batch_index.push_back(index);
+                if (batch.size() == bulk_batch_size) {
+                    flush();
                 }
             }
-            return crow::response(404, "Book not found");
+            flush();
+            if (reader.failed()) {
+                add_error(index, "Malformed bulk body");
+            }
+
+            // Duplicates are only found when a batch is applied, after later
+            // parse errors were recorded
+            std::stable_sort(errors.begin(), errors.end(),
+                             [](const auto& a, const auto& b) { return a.first < b.first; });
+            WireFormat format = negotiate_format(req.get_header_value("Accept"));
+            if (format == WireFormat::Msgpack) {
+                std::string body;
+                append_msgpack_map(body, 3);
+                append_msgpack_str(body, "created");
+                append_msgpack_uint(body, created);
+                append_msgpack_str(body, "failed");
+                append_msgpack_uint(body, errors.size());
+                append_msgpack_str(body, "errors");
+                append_msgpack_array(body, errors.size());
+                for (const auto& [error_index, message] : errors) {
+                    append_msgpack_map(body, 2);
+                    append_msgpack_str(body, "index");
+                    append_msgpack_uint(body, error_index);
+                    append_msgpack_str(body, "error");
+                    append_msgpack_str(body, message);
+                }
+                return body_response(200, std::move(body), format);
+            }
+            std::vector<crow::json::wvalue> error_items;
+            error_items.reserve(errors.size());
+            for (const auto& [error_index, message] : errors) {
+                crow::json::wvalue error;
+                error["index"] = error_index;
+                error["error"] = message;
+                error_items.push_back(std::move(error));
+            }
+
+            crow::json::wvalue result;
+            result["created"] = created;
+            result["failed"] = errors.size();
+            result["errors"] = std::move(error_items);
+            return body_response(200, result.dump(), format);
         });
 
-    // DELETE a book
+    // POST ids to get many books in one request: {"ids":["...",...]}, at
+    // most max_mget_ids, in JSON or MessagePack. Every lookup is made under
+    // one view of the store (see ShardedBookStore::find_many). Returns
+    // {"books":[...],"missing":[...]}: the books found, in request order,
+    // and the ids that were not.
+    CROW_ROUTE(app, "/book/_mget")
+        .methods("POST"_method)([&](const crow::request& req) {
+            WireFormat body_type = body_format(req.get_header_value("Content-Type"));
+            auto ids = parse_id_list(req.body, body_type);
+            if (!ids) {
+                return crow::response(400, "Expected an object with an ids array of strings");
+            }
+            if (ids->size() > max_mget_ids) {
+                return crow::response(400, "At most " + std::to_string(max_mget_ids) + " ids");
+            }
+
+            std::vector<std::string_view> keys(ids->begin(), ids->end());
+            std::vector<BookStore::BookPtr> found = books.find_many(keys);
+            WireFormat format = negotiate_format(req.get_header_value("Accept"));
+            return body_response(200, encode_mget(found, *ids, format), format);
+        });
+
+    // PUT replace a book; with If-Match, only if it is still that version
     CROW_ROUTE(app, "/book/<string>")
-        .methods("DELETE"_method)([&](const std::string& id) {
-            std::lock_guard<std::mutex> lock(books_mutex);
-            auto it = std::remove_if(books.begin(), books.end(), [&](const Book& book) {
-                return book.id && *book.id == id;
+        .methods("PUT"_method)([&](const crow::request& req, const std::string& id) {
+            WireFormat body_type = body_format(req.get_header_value("Content-Type"));
+            auto parsed = parse_body(req.body, body_type);
+            if (!parsed) {
+                return crow::response(400, invalid_body_message(body_type));
+            }
+            if ((parsed->fields & required_book_fields) != required_book_fields) {
+                return crow::response(400, "title, author and coverImageUrl are required");
+            }
+            return replace_book(req, id, [&](const Book&) { return parsed->book; });
+        });
+
+    // PATCH change only the fields the body supplies; null removes
+    // published_date. With If-Match, only if the book is still that version.
+    CROW_ROUTE(app, "/book/<string>")
+        .methods("PATCH"_method)([&](const crow::request& req, const std::string& id) {
+            WireFormat body_type = body_format(req.get_header_value("Content-Type"));
+            auto parsed = parse_body(req.body, body_type);
+            if (!parsed) {
+                return crow::response(400, invalid_body_message(body_type));
+            }
+            if (parsed->nulls & required_book_fields) {
+                return crow::response(400, "title, author and coverImageUrl cannot be null");
+            }
+            if ((parsed->fields & BookFieldId) && *parsed->book.id != id) {
+                return crow::response(400, "id cannot be changed");
+            }
+
+            const BookFields& patch = parsed->book;
+            return replace_book(req, id, [&](const Book& current) {
+                BookFields book = current.fields();
+                if (parsed->fields & BookFieldTitle) {
+                    book.title = patch.title;
+                }
+                if (parsed->fields & BookFieldAuthor) {
+                    book.author = patch.author;
+                }
+                if (parsed->fields & BookFieldCoverImageUrl) {
+                    book.coverImageUrl = patch.coverImageUrl;
+                }
+                if (parsed->fields & BookFieldPublishedDate) {
+                    book.published_date = patch.published_date;
+                } else if (parsed->nulls & BookFieldPublishedDate) {
+                    book.published_date.reset();
+                }
+                return book;
             });
+        });
 
-            if (it != books.end()) {
-                books.erase(it, books.end());
-                return crow::response(204);
+    // DELETE a book; with If-Match, only if it is still that version
+    CROW_ROUTE(app, "/book/<string>")
+        .methods("DELETE"_method)([&](const crow::request& req, const std::string& id) {
+            const std::string& if_match = req.get_header_value("If-Match");
+            if (if_match.empty()) {
+                auto found = write_logged(LogRecord::erase(id), [&] { return books.erase(id); });
+                if (found.changed) {
+                    search_index.refresh(id);
+                    change_feed.publish(id);
+                }
+                if (!found.persisted) {
+                    return crow::response(500, "Could not persist book");
+                }
+                if (found.changed) {
+                    return crow::response(204);
+                }
+                return crow::response(404, "Book not found");
+            }
+
+            for (;;) {
+                auto current = books.find(id);
+                if (!current) {
+                    return crow::response(412, "Book not found");
+                }
+                if (!if_match_allows(if_match, current->version())) {
+                    return crow::response(412, "Book has changed");
+                }
+
+                auto result = BookStore::WriteResult::NotFound;
+                auto erased = write_logged(LogRecord::erase(id), [&] {
+                    result = books.erase(id, current->version());
+                    return result == BookStore::WriteResult::Written;
+                });
+                if (erased.changed) {
+                    search_index.refresh(id);
+                    change_feed.publish(id);
+                }
+                if (!erased.persisted) {
+                    return crow::response(500, "Could not persist book");
+                }
+                if (erased.changed) {
+                    return crow::response(204);
+                }
             }
-            return crow::response(404, "Book not found");
         });
 
-    // Add an initial book
-    { // Use a block to ensure lock_guard is released
-        std::lock_guard<std::mutex> lock(books_mutex);
-        books.push_back({
-            generate_uuid(),
-            "The C++ Programming Language",
-            "Bjarne Stroustrup",
-            "1985-10-14",
-            "https://covers.openlibrary.org/b/id/6660100-L.jpg"
+    // GET /book/_changes upgrades to a WebSocket streaming book changes (see
+    // change_feed.h). ?epoch=E&since=N resumes after event N of run E. The
+    // client acknowledges events by sending the last seq it has processed.
+    CROW_WEBSOCKET_ROUTE(app, "/book/_changes")
+        .onaccept([&](const crow::request& req, void** userdata) {
+            ChangeFeed::Start start;
+            const char* since = req.url_params.get("since");
+            const char* epoch = req.url_params.get("epoch");
+            if (since || epoch) {
+                auto since_seq = parse_uint(since);
+                auto epoch_id = parse_uint(epoch);
+                if (!since_seq || !epoch_id) {
+                    return false;
+                }
+                start = {true, *epoch_id, *since_seq};
+            }
+            // Handed to onopen, which Crow calls for every accepted connection
+            *userdata = new ChangeFeed::Start(start);
+            return true;
+        })
+        .onopen([&](crow::websocket::connection& conn) {
+            std::unique_ptr<ChangeFeed::Start> start(static_cast<ChangeFeed::Start*>(conn.userdata()));
+            conn.userdata(nullptr);
+            change_feed.subscribe(&conn, start ? *start : ChangeFeed::Start{},
+                                  [&conn](const std::string& frame) { conn.send_text(frame); });
+        })
+        .onmessage([&](crow::websocket::connection& conn, const std::string& data, bool is_binary) {
+            auto seq = is_binary ? std::nullopt : parse_uint(data.c_str());
+            if (seq) {
+                change_feed.ack(&conn, *seq);
+            }
+        })
+        .onclose([&](crow::websocket::connection& conn, const std::string&) { change_feed.unsubscribe(&conn); });
+
+    // GET request, JSON and lock timings and store size in the Prometheus
+    // text format
+    CROW_ROUTE(app, "/metrics")
+        .methods("GET"_method)([&]() {
+            std::vector<MetricGauge> gauges = {
+                {"book_store_books", "Books in the store.", static_cast<double>(books.size())},
+                {"book_store_shards", "Store shards (BOOK_STORE_SHARDS).", static_cast<double>(books.shard_count())},
+                {"book_store_version", "Writes applied to the store since startup.",
+                 static_cast<double>(books.version())},
+                {"book_changes_seq", "Changes published to GET /book/_changes since startup.",
+                 static_cast<double>(change_feed.last_seq())},
+                {"book_changes_subscribers", "Clients subscribed to GET /book/_changes.",
+                 static_cast<double>(change_feed.subscribers())},
+                {"book_metrics_enabled", "1 unless BOOK_METRICS=0 turned timing off.", metrics_enabled() ? 1.0 : 0.0},
+            };
+            if (replication_server) {
+                gauges.push_back({"book_replication_followers", "Followers connected to BOOK_REPLICATION_PORT.",
+                                  static_cast<double>(replication_server->followers())});
+            }
+            if (follower) {
+                Follower::Stats stats = follower->stats();
+                auto staleness = follower->staleness();
+                gauges.push_back({"book_replica_connected", "1 while connected to the leader.",
+                                  stats.connected ? 1.0 : 0.0});
+                gauges.push_back({"book_replica_staleness_seconds",
+                                  "How far behind the leader the store may be; +Inf before it first catches up.",
+                                  staleness == std::chrono::steady_clock::duration::max()
+                                      ? HUGE_VAL
+                                      : std::chrono::duration<double>(staleness).count()});
+                gauges.push_back({"book_replica_applied_seq", "Last leader change applied.",
+                                  static_cast<double>(stats.applied_seq)});
+                gauges.push_back({"book_replica_events", "Leader changes applied since startup.",
+                                  static_cast<double>(stats.events)});
+                gauges.push_back({"book_replica_snapshots", "Snapshots loaded from the leader since startup.",
+                                  static_cast<double>(stats.snapshots)});
+                gauges.push_back({"book_replica_reconnects", "Reconnections to the leader since startup.",
+                                  static_cast<double>(stats.reconnects)});
+            }
+            crow::response res(200, render_metrics(gauges));
+            res.set_header("Content-Type", "text/plain; version=0.0.4");
+            return res;
         });
+
+    // Add an initial book to an empty store
+    auto initial_book = std::make_shared<const Book>(BookFields{
+        generate_uuid(),
+        "The C++ Programming Language",
+        "Bjarne Stroustrup",
+        "1985-10-14",
+        "https://covers.openlibrary.org/b/id/6660100-L.jpg"
+    });
+    if (books.empty() && !follower) {
+        write_logged(LogRecord::put(initial_book), [&] { return books.insert(initial_book); });
+        search_index.refresh(initial_book->id());
     }
 
-    app.port(8080).multithreaded().run();
+    app.port(port).multithreaded().run();
 }
- 
\ No newline at end of file
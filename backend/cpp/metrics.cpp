@@ -0,0 +1,240 @@
+#include "metrics.h"
+#include <algorithm>
+#include <array>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+namespace metrics_detail {
+std::atomic<bool> enabled{false};
+}
+
+namespace {
+
+// Upper bounds of the histogram buckets, in seconds for the output and in
+// nanoseconds for recording; a last bucket takes everything above
+constexpr std::array<const char*, 22> bucket_labels = {
+    "1e-06", "2.5e-06", "5e-06", "1e-05", "2.5e-05", "5e-05", "0.0001", "0.00025", "0.0005", "0.001", "0.0025",
+    "0.005", "0.01", "0.025", "0.05", "0.1", "0.25", "0.5", "1", "2.5", "5", "10"};
+constexpr std::array<std::uint64_t, 22> bucket_nanos = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+    5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000,
+    5000000000, 10000000000};
+constexpr std::size_t bucket_count = bucket_nanos.size() + 1;
+
+constexpr std::size_t route_count = static_cast<std::size_t>(MetricRoute::Count);
+constexpr std::size_t timing_count = static_cast<std::size_t>(MetricTiming::Count);
+constexpr std::size_t status_classes = 5; // 1xx to 5xx
+
+constexpr std::array<const char*, route_count> route_labels = {
+    "GET /book", "GET /book/search", "GET /book/_export", "GET /book/<id>", "POST /book",
+    "POST /book/_bulk", "POST /book/_mget", "PUT /book/<id>", "PATCH /book/<id>", "DELETE /book/<id>",
+    "GET /metrics", "other"};
+
+// Written only by the thread that owns it, so a relaxed load and store
+// count correctly without a locked instruction; scrapes only read
+using Counter = std::atomic<std::uint64_t>;
+
+void bump(Counter& counter, std::uint64_t by) {
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+struct Histogram {
+    std::array<Counter, bucket_count> buckets{};
+    Counter count{0};
+    Counter sum_nanos{0};
+
+    void record(std::uint64_t nanos) {
+        std::size_t i = 0;
+        while (i < bucket_nanos.size() && nanos > bucket_nanos[i]) {
+            ++i;
+        }
+        bump(buckets[i], 1);
+        bump(count, 1);
+        bump(sum_nanos, nanos);
+    }
+
+    void add(const Histogram& other) {
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            bump(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+        }
+        bump(count, other.count.load(std::memory_order_relaxed));
+        bump(sum_nanos, other.sum_nanos.load(std::memory_order_relaxed));
+    }
+};
+
+// One thread's metrics, on cache lines of its own
+struct alignas(64) ThreadBlock {
+    std::array<Histogram, route_count> requests;
+    std::array<std::array<Counter, status_classes>, route_count> statuses{};
+    std::array<Histogram, timing_count> timings;
+
+    void add(const ThreadBlock& other) {
+        for (std::size_t r = 0; r < route_count; ++r) {
+            requests[r].add(other.requests[r]);
+            for (std::size_t s = 0; s < status_classes; ++s) {
+                bump(statuses[r][s], other.statuses[r][s].load(std::memory_order_relaxed));
+            }
+        }
+        for (std::size_t t = 0; t < timing_count; ++t) {
+            timings[t].add(other.timings[t]);
+        }
+    }
+};
+
+struct Registry {
+    std::mutex mutex; // Guards everything below
+    std::vector<ThreadBlock*> live;
+    ThreadBlock retired; // Sum of the blocks of threads that have exited
+};
+
+// Never destroyed, so threads that outlive static destruction can still
+// retire their blocks
+Registry& registry() {
+    static Registry* instance = new Registry;
+    return *instance;
+}
+
+// Registers the calling thread's block for its lifetime
+class ThreadSlot {
+public:
+    ThreadSlot() : block_(new ThreadBlock) {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.live.push_back(block_);
+    }
+
+    ~ThreadSlot() {
+        Registry& r = registry();
+        {
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.retired.add(*block_);
+            r.live.erase(std::find(r.live.begin(), r.live.end(), block_));
+        }
+        delete block_;
+    }
+
+    ThreadSlot(const ThreadSlot&) = delete;
+    ThreadSlot& operator=(const ThreadSlot&) = delete;
+
+    ThreadBlock& block() { return *block_; }
+
+private:
+    ThreadBlock* block_;
+};
+
+ThreadBlock& this_thread_block() {
+    thread_local ThreadSlot slot;
+    return slot.block();
+}
+
+std::uint64_t to_nanos(std::chrono::steady_clock::duration elapsed) {
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return nanos > 0 ? static_cast<std::uint64_t>(nanos) : 0;
+}
+
+void append(std::string& out, const char* format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = std::vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0) {
+        out.append(line, std::min(static_cast<std::size_t>(len), sizeof(line) - 1));
+    }
+}
+
+void append_header(std::string& out, const char* name, const char* type, const char* help) {
+    append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// Appends one histogram's series; labels is empty or ends with a comma
+void append_histogram(std::string& out, const char* name, const std::string& labels, const Histogram& h) {
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < bucket_count; ++i) {
+        cumulative += h.buckets[i].load(std::memory_order_relaxed);
+        append(out, "%s_bucket{%sle=\"%s\"} %" PRIu64 "\n", name, labels.c_str(),
+               i < bucket_labels.size() ? bucket_labels[i] : "+Inf", cumulative);
+    }
+    std::string bare = labels.empty() ? labels : "{" + labels.substr(0, labels.size() - 1) + "}";
+    append(out, "%s_sum%s %.9g\n", name, bare.c_str(), h.sum_nanos.load(std::memory_order_relaxed) / 1e9);
+    append(out, "%s_count%s %" PRIu64 "\n", name, bare.c_str(), cumulative);
+}
+
+} // namespace
+
+void set_metrics_enabled(bool enabled) {
+    metrics_detail::enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void record_request(MetricRoute route, int status, std::chrono::steady_clock::duration elapsed) {
+    ThreadBlock& block = this_thread_block();
+    auto r = static_cast<std::size_t>(route);
+    block.requests[r].record(to_nanos(elapsed));
+    int status_class = std::clamp(status / 100, 1, static_cast<int>(status_classes));
+    bump(block.statuses[r][status_class - 1], 1);
+}
+
+void record_timing(MetricTiming timing, std::chrono::steady_clock::duration elapsed) {
+    this_thread_block().timings[static_cast<std::size_t>(timing)].record(to_nanos(elapsed));
+}
+
+std::string render_metrics(const std::vector<MetricGauge>& gauges) {
+    // Threads only take the registry lock to register or retire, so
+    // summing under it never holds up a request
+    auto total = std::make_unique<ThreadBlock>();
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        total->add(r.retired);
+        for (const ThreadBlock* block : r.live) {
+            total->add(*block);
+        }
+    }
+
+    std::string out;
+    out.reserve(64 * 1024);
+
+    append_header(out, "book_http_requests_total", "counter", "Requests answered, by route and status class.");
+    for (std::size_t r = 0; r < route_count; ++r) {
+        for (std::size_t s = 0; s < status_classes; ++s) {
+            std::uint64_t count = total->statuses[r][s].load(std::memory_order_relaxed);
+            if (count != 0) {
+                append(out, "book_http_requests_total{route=\"%s\",code=\"%zuxx\"} %" PRIu64 "\n",
+                       route_labels[r], s + 1, count);
+            }
+        }
+    }
+
+    append_header(out, "book_http_request_duration_seconds", "histogram",
+                  "Time from receiving a request to having its response, by route.");
+    for (std::size_t r = 0; r < route_count; ++r) {
+        append_histogram(out, "book_http_request_duration_seconds",
+                         std::string("route=\"") + route_labels[r] + "\",", total->requests[r]);
+    }
+
+    const auto timing = [&](MetricTiming t) -> const Histogram& {
+        return total->timings[static_cast<std::size_t>(t)];
+    };
+    append_header(out, "book_json_parse_seconds", "histogram", "Time parsing a request body, JSON or MessagePack.");
+    append_histogram(out, "book_json_parse_seconds", "", timing(MetricTiming::JsonParse));
+    append_header(out, "book_json_serialize_seconds", "histogram", "Time serializing a response body.");
+    append_histogram(out, "book_json_serialize_seconds", "", timing(MetricTiming::JsonSerialize));
+    append_header(out, "book_compress_seconds", "histogram", "Time compressing a response body.");
+    append_histogram(out, "book_compress_seconds", "", timing(MetricTiming::Compress));
+
+    append_header(out, "book_store_lock_wait_seconds", "histogram", "Time waiting for a store shard's lock.");
+    append_histogram(out, "book_store_lock_wait_seconds", "access=\"read\",", timing(MetricTiming::ReadLockWait));
+    append_histogram(out, "book_store_lock_wait_seconds", "access=\"write\",", timing(MetricTiming::WriteLockWait));
+    append_header(out, "book_store_lock_hold_seconds", "histogram", "Time holding a store shard's lock.");
+    append_histogram(out, "book_store_lock_hold_seconds", "access=\"read\",", timing(MetricTiming::ReadLockHold));
+    append_histogram(out, "book_store_lock_hold_seconds", "access=\"write\",", timing(MetricTiming::WriteLockHold));
+
+    for (const MetricGauge& gauge : gauges) {
+        append_header(out, gauge.name, "gauge", gauge.help);
+        append(out, "%s %.17g\n", gauge.name, gauge.value);
+    }
+    return out;
+}
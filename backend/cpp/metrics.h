@@ -0,0 +1,141 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Request, serialization and lock timings, exposed by GET /metrics in the
+// Prometheus text format.
+//
+// Every thread records into a block of its own, registered on first use:
+// a counter is bumped with a relaxed load and store by the one thread that
+// owns it, so the hot path never takes a lock, issues a locked instruction
+// or shares a cache line with another thread. A scrape walks the registered
+// blocks and adds them up; a thread that exits folds its block into a
+// running total first. Latencies go into fixed histogram buckets from 1 us
+// to 10 s.
+//
+// Recording is off until set_metrics_enabled(true) (the server turns it on
+// unless BOOK_METRICS=0), leaving one predictable branch per call site, so
+// the benchmarks and tools that share the store code pay nothing for it.
+
+// Routes timed separately; each is one method and path pattern.
+enum class MetricRoute : std::uint8_t {
+    ListBooks,
+    SearchBooks,
+    ExportBooks,
+    GetBook,
+    CreateBook,
+    BulkCreateBooks,
+    MultiGetBooks,
+    UpdateBook,
+    PatchBook,
+    DeleteBook,
+    Metrics,
+    Other,
+    Count
+};
+
+// Timings recorded outside the request histogram. JsonParse and
+// JsonSerialize cover MessagePack bodies too.
+enum class MetricTiming : std::uint8_t {
+    JsonParse,
+    JsonSerialize,
+    Compress,
+    ReadLockWait,
+    ReadLockHold,
+    WriteLockWait,
+    WriteLockHold,
+    Count
+};
+
+// A value sampled at scrape time, such as the number of books.
+struct MetricGauge {
+    const char* name;
+    const char* help;
+    double value;
+};
+
+namespace metrics_detail {
+extern std::atomic<bool> enabled;
+}
+
+inline bool metrics_enabled() {
+    return metrics_detail::enabled.load(std::memory_order_relaxed);
+}
+
+void set_metrics_enabled(bool enabled);
+
+// Records a request that `route` answered with `status` after `elapsed`.
+void record_request(MetricRoute route, int status, std::chrono::steady_clock::duration elapsed);
+
+// Records one timing.
+void record_timing(MetricTiming timing, std::chrono::steady_clock::duration elapsed);
+
+// Everything recorded so far, then the gauges, in the Prometheus text format.
+std::string render_metrics(const std::vector<MetricGauge>& gauges);
+
+// Records the time from construction to destruction as `timing`.
+class ScopedTiming {
+public:
+    explicit ScopedTiming(MetricTiming timing) : timing_(timing), on_(metrics_enabled()) {
+        if (on_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~ScopedTiming() {
+        if (on_) {
+            record_timing(timing_, std::chrono::steady_clock::now() - start_);
+        }
+    }
+
+    ScopedTiming(const ScopedTiming&) = delete;
+    ScopedTiming& operator=(const ScopedTiming&) = delete;
+
+private:
+    MetricTiming timing_;
+    bool on_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Times a lock: construct it just before locking, call acquired() once the
+// lock is held, and let it go out of scope after the lock is released.
+// Records the wait and the hold as read or write lock timings.
+class LockTiming {
+public:
+    explicit LockTiming(bool write) : write_(write), on_(metrics_enabled()) {
+        if (on_) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    void acquired() {
+        if (on_) {
+            auto now = std::chrono::steady_clock::now();
+            record_timing(write_ ? MetricTiming::WriteLockWait : MetricTiming::ReadLockWait, now - start_);
+            start_ = now;
+        }
+    }
+
+    ~LockTiming() {
+        if (on_) {
+            record_timing(write_ ? MetricTiming::WriteLockHold : MetricTiming::ReadLockHold,
+                          std::chrono::steady_clock::now() - start_);
+        }
+    }
+
+    LockTiming(const LockTiming&) = delete;
+    LockTiming& operator=(const LockTiming&) = delete;
+
+private:
+    bool write_;
+    bool on_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#endif
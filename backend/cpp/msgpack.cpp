@@ -0,0 +1,294 @@
+#include "msgpack.h"
+#include "compression.h"
+#include <algorithm>
+
+namespace {
+
+constexpr int max_depth = 64;
+
+bool is_msgpack_type(std::string_view media_type) {
+    return equals_lower(media_type, "application/msgpack") || equals_lower(media_type, "application/x-msgpack") ||
+           equals_lower(media_type, "application/vnd.msgpack");
+}
+
+void append_big_endian(std::string& out, std::uint64_t value, int bytes) {
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8) {
+        out += static_cast<char>((value >> shift) & 0xff);
+    }
+}
+
+// Appends a header for a string, array or map of size: the fix form if
+// size fits in fix_bits, else the first of the wide forms (8, 16 and 32-bit
+// lengths; 0 where the type has none) that holds it
+void append_header(std::string& out, std::size_t size, std::uint8_t fix, unsigned fix_bits,
+                   const std::uint8_t (&wide)[3]) {
+    if (size < (std::size_t{1} << fix_bits)) {
+        out += static_cast<char>(fix | size);
+    } else if (wide[0] != 0 && size <= 0xff) {
+        out += static_cast<char>(wide[0]);
+        append_big_endian(out, size, 1);
+    } else if (size <= 0xffff) {
+        out += static_cast<char>(wide[1]);
+        append_big_endian(out, size, 2);
+    } else {
+        out += static_cast<char>(wide[2]);
+        append_big_endian(out, size, 4);
+    }
+}
+
+// Reads a big-endian integer of `bytes` bytes from the front of data
+std::optional<std::uint64_t> take_big_endian(std::string_view& data, std::size_t bytes) {
+    if (data.size() < bytes) {
+        return std::nullopt;
+    }
+    std::uint64_t value = 0;
+    for (std::size_t i = 0; i < bytes; ++i) {
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    }
+    data.remove_prefix(bytes);
+    return value;
+}
+
+// Reads the header of a string, array or map whose fix form is fix (under
+// fix_mask) and whose 8, 16 and 32-bit length forms are wide (0 where the
+// type has none). Returns the length, leaving data past the header.
+std::optional<std::size_t> take_header(std::string_view& data, std::uint8_t fix, std::uint8_t fix_mask,
+                                       const std::uint8_t (&wide)[3]) {
+    if (data.empty()) {
+        return std::nullopt;
+    }
+    auto type = static_cast<std::uint8_t>(data[0]);
+    std::string_view rest = data.substr(1);
+    std::optional<std::uint64_t> size;
+    if ((type & fix_mask) == fix) {
+        size = type & static_cast<std::uint8_t>(~fix_mask);
+    } else if (wide[0] != 0 && type == wide[0]) {
+        size = take_big_endian(rest, 1);
+    } else if (type == wide[1]) {
+        size = take_big_endian(rest, 2);
+    } else if (type == wide[2]) {
+        size = take_big_endian(rest, 4);
+    }
+    if (size) {
+        data = rest;
+    }
+    return size;
+}
+
+constexpr std::uint8_t str_wide[3] = {0xd9, 0xda, 0xdb};
+constexpr std::uint8_t array_wide[3] = {0, 0xdc, 0xdd};
+constexpr std::uint8_t map_wide[3] = {0, 0xde, 0xdf};
+
+} // namespace
+
+WireFormat negotiate_format(std::string_view accept) {
+    // q of a MessagePack type and of the most specific range covering JSON,
+    // or -1 where not listed
+    int msgpack = -1;
+    int json = -1;
+    int application_any = -1;
+    int any = -1;
+    for_each_accepted(accept, [&](std::string_view type, int q) {
+        if (is_msgpack_type(type)) {
+            msgpack = std::max(msgpack, q);
+        } else if (equals_lower(type, "application/json")) {
+            json = q;
+        } else if (equals_lower(type, "application/*")) {
+            application_any = q;
+        } else if (type == "*/*") {
+            any = q;
+        }
+    });
+
+    json = json >= 0 ? json : application_any >= 0 ? application_any : any;
+    return msgpack > 0 && msgpack >= json ? WireFormat::Msgpack : WireFormat::Json;
+}
+
+WireFormat body_format(std::string_view content_type) {
+    std::size_t semicolon = content_type.find(';');
+    std::string_view type = content_type.substr(0, semicolon);
+    std::size_t first = type.find_first_not_of(" \t");
+    std::size_t last = type.find_last_not_of(" \t");
+    if (first == std::string_view::npos) {
+        return WireFormat::Json;
+    }
+    return is_msgpack_type(type.substr(first, last - first + 1)) ? WireFormat::Msgpack : WireFormat::Json;
+}
+
+const char* format_content_type(WireFormat format) {
+    return format == WireFormat::Msgpack ? "application/msgpack" : "application/json";
+}
+
+void append_msgpack_map(std::string& out, std::size_t size) {
+    append_header(out, size, 0x80, 4, map_wide);
+}
+
+void append_msgpack_array(std::string& out, std::size_t size) {
+    append_header(out, size, 0x90, 4, array_wide);
+}
+
+void append_msgpack_str(std::string& out, std::string_view value) {
+    append_msgpack_str_header(out, value.size());
+    out.append(value);
+}
+
+void append_msgpack_str_header(std::string& out, std::size_t size) {
+    append_header(out, size, 0xa0, 5, str_wide);
+}
+
+void append_msgpack_uint(std::string& out, std::uint64_t value) {
+    if (value < 0x80) {
+        out += static_cast<char>(value);
+    } else if (value <= 0xff) {
+        out += static_cast<char>(0xcc);
+        append_big_endian(out, value, 1);
+    } else if (value <= 0xffff) {
+        out += static_cast<char>(0xcd);
+        append_big_endian(out, value, 2);
+    } else if (value <= 0xffffffff) {
+        out += static_cast<char>(0xce);
+        append_big_endian(out, value, 4);
+    } else {
+        out += static_cast<char>(0xcf);
+        append_big_endian(out, value, 8);
+    }
+}
+
+void append_msgpack_nil(std::string& out) {
+    out += static_cast<char>(0xc0);
+}
+
+std::optional<std::size_t> MsgpackReader::read_map() {
+    std::string_view rest = rest_;
+    auto size = take_header(rest, 0x80, 0xf0, map_wide);
+    // Every key and value takes at least a byte, so a larger count is a lie
+    if (!size || *size > rest.size() / 2) {
+        return std::nullopt;
+    }
+    rest_ = rest;
+    return size;
+}
+
+std::optional<std::size_t> MsgpackReader::read_array() {
+    std::string_view rest = rest_;
+    auto size = take_header(rest, 0x90, 0xf0, array_wide);
+    if (!size || *size > rest.size()) {
+        return std::nullopt;
+    }
+    rest_ = rest;
+    return size;
+}
+
+std::optional<std::string_view> MsgpackReader::read_str() {
+    std::string_view rest = rest_;
+    auto size = take_header(rest, 0xa0, 0xe0, str_wide);
+    if (!size || *size > rest.size()) {
+        return std::nullopt;
+    }
+    rest_ = rest.substr(*size);
+    return rest.substr(0, *size);
+}
+
+std::optional<std::uint64_t> MsgpackReader::read_uint() {
+    if (rest_.empty()) {
+        return std::nullopt;
+    }
+    auto type = static_cast<std::uint8_t>(rest_[0]);
+    if (type < 0x80) {
+        rest_.remove_prefix(1);
+        return type;
+    }
+    if (type < 0xcc || type > 0xcf) {
+        return std::nullopt;
+    }
+    std::string_view rest = rest_.substr(1);
+    auto value = take_big_endian(rest, std::size_t{1} << (type - 0xcc));
+    if (value) {
+        rest_ = rest;
+    }
+    return value;
+}
+
+bool MsgpackReader::read_nil() {
+    if (rest_.empty() || static_cast<std::uint8_t>(rest_[0]) != 0xc0) {
+        return false;
+    }
+    rest_.remove_prefix(1);
+    return true;
+}
+
+std::optional<std::string_view> MsgpackReader::read_value() {
+    std::string_view start = rest_;
+    if (!skip(0)) {
+        rest_ = start;
+        return std::nullopt;
+    }
+    return start.substr(0, start.size() - rest_.size());
+}
+
+bool MsgpackReader::skip(int depth) {
+    if (depth >= max_depth || rest_.empty()) {
+        return false;
+    }
+    auto type = static_cast<std::uint8_t>(rest_[0]);
+
+    // Containers: skip their members
+    std::optional<std::size_t> members;
+    if ((type & 0xf0) == 0x80 || type == 0xde || type == 0xdf) {
+        auto size = read_map();
+        members = size ? std::optional<std::size_t>(*size * 2) : std::nullopt;
+    } else if ((type & 0xf0) == 0x90 || type == 0xdc || type == 0xdd) {
+        members = read_array();
+    } else {
+        // Everything else is a fixed size, or a length and that many bytes
+        std::size_t fixed = 0;
+        std::size_t length_bytes = 0;
+        if (type < 0x80 || type >= 0xe0 || type == 0xc0 || type == 0xc2 || type == 0xc3) {
+            fixed = 1;
+        } else if ((type & 0xe0) == 0xa0) {
+            fixed = 1 + (type & 0x1f);
+        } else if (type >= 0xcc && type <= 0xcf) {
+            fixed = 1 + (std::size_t{1} << (type - 0xcc)); // uint 8-64
+        } else if (type >= 0xd0 && type <= 0xd3) {
+            fixed = 1 + (std::size_t{1} << (type - 0xd0)); // int 8-64
+        } else if (type == 0xca || type == 0xcb) {
+            fixed = type == 0xca ? 5 : 9; // float 32, 64
+        } else if (type >= 0xd4 && type <= 0xd8) {
+            fixed = 2 + (std::size_t{1} << (type - 0xd4)); // fixext 1-16
+        } else if (type >= 0xc4 && type <= 0xc6) {
+            length_bytes = std::size_t{1} << (type - 0xc4); // bin 8-32
+        } else if (type >= 0xd9 && type <= 0xdb) {
+            length_bytes = std::size_t{1} << (type - 0xd9); // str 8-32
+        } else if (type >= 0xc7 && type <= 0xc9) {
+            length_bytes = std::size_t{1} << (type - 0xc7); // ext 8-32, plus a type byte
+        } else {
+            return false; // 0xc1 is never used
+        }
+
+        std::string_view rest = rest_.substr(1);
+        if (length_bytes > 0) {
+            auto length = take_big_endian(rest, length_bytes);
+            if (!length) {
+                return false;
+            }
+            fixed = *length + (type >= 0xc7 && type <= 0xc9);
+        } else {
+            fixed -= 1;
+        }
+        if (rest.size() < fixed) {
+            return false;
+        }
+        rest_ = rest.substr(fixed);
+        return true;
+    }
+
+    if (!members) {
+        return false;
+    }
+    for (std::size_t i = 0; i < *members; ++i) {
+        if (!skip(depth + 1)) {
+            return false;
+        }
+    }
+    return true;
+}
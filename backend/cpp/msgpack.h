@@ -0,0 +1,72 @@
+#ifndef MSGPACK_H
+#define MSGPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// MessagePack (https://msgpack.org), the binary alternative to JSON that the
+// /book routes speak to clients that ask for it. A book is the same map as
+// its JSON object, with the same keys, so the two decode to the same thing;
+// strings go out as length-prefixed bytes, which costs no escaping to write
+// and no scanning to read.
+//
+// Only what a book and the responses around it need is written: maps,
+// arrays, strings, unsigned integers and nil. The reader accepts any
+// well-formed value, so unknown keys can be skipped.
+
+// Body formats a /book route can read and write.
+enum class WireFormat { Json, Msgpack };
+
+// The format to answer an Accept header value with: MessagePack if it gives
+// application/msgpack (or application/x-msgpack, application/vnd.msgpack) a
+// q above zero and at least that of application/json, JSON otherwise.
+WireFormat negotiate_format(std::string_view accept);
+
+// The format of a request body, from its Content-Type header value:
+// MessagePack for the media types above, JSON for anything else.
+WireFormat body_format(std::string_view content_type);
+
+// The Content-Type header value for a format.
+const char* format_content_type(WireFormat format);
+
+// Appends one value, in the smallest encoding that holds it.
+void append_msgpack_map(std::string& out, std::size_t size);
+void append_msgpack_array(std::string& out, std::size_t size);
+void append_msgpack_str(std::string& out, std::string_view value);
+void append_msgpack_uint(std::string& out, std::uint64_t value);
+void append_msgpack_nil(std::string& out);
+
+// Appends the header of a string of size bytes; the caller appends the bytes.
+void append_msgpack_str_header(std::string& out, std::size_t size);
+
+// Reads MessagePack values one at a time from the front of a buffer. Each
+// read_* returns std::nullopt (or false) and consumes nothing if the next
+// value is not of its type or is cut short. Strings are returned as views
+// into the buffer.
+class MsgpackReader {
+public:
+    explicit MsgpackReader(std::string_view data) : rest_(data) {}
+
+    // Number of key/value pairs or elements that follow
+    std::optional<std::size_t> read_map();
+    std::optional<std::size_t> read_array();
+    std::optional<std::string_view> read_str();
+    std::optional<std::uint64_t> read_uint();
+    bool read_nil();
+
+    // Skips the next value, however deeply nested (up to a limit), and
+    // returns its bytes
+    std::optional<std::string_view> read_value();
+
+    bool at_end() const { return rest_.empty(); }
+
+private:
+    bool skip(int depth);
+
+    std::string_view rest_;
+};
+
+#endif
@@ -0,0 +1,182 @@
+#ifndef ORDERED_INDEX_H
+#define ORDERED_INDEX_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+// A sorted sequence kept in leaves of at most leaf_size elements, like the
+// bottom two levels of a B+-tree. Finding a position binary searches a flat
+// copy of every leaf's first element and then one leaf; inserts and erases
+// shift at most one leaf; scans walk contiguous arrays.
+//
+// The ordering is not stored: calls that need it take the comparison, so
+// elements can be small handles whose keys live elsewhere. Every call must
+// pass the same strict weak ordering.
+template <typename T>
+class OrderedIndex {
+public:
+    static constexpr std::size_t leaf_size = 256;
+
+    class const_iterator {
+    public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        const T& operator*() const { return (*leaves_)[leaf_][pos_]; }
+        const T* operator->() const { return &**this; }
+
+        const_iterator& operator++() {
+            if (++pos_ == (*leaves_)[leaf_].size()) {
+                ++leaf_;
+                pos_ = 0;
+            }
+            return *this;
+        }
+
+        const_iterator& operator--() {
+            if (pos_ == 0) {
+                pos_ = (*leaves_)[--leaf_].size();
+            }
+            --pos_;
+            return *this;
+        }
+
+        bool operator==(const const_iterator& other) const { return leaf_ == other.leaf_ && pos_ == other.pos_; }
+        bool operator!=(const const_iterator& other) const { return !(*this == other); }
+        bool operator<(const const_iterator& other) const {
+            return leaf_ < other.leaf_ || (leaf_ == other.leaf_ && pos_ < other.pos_);
+        }
+
+    private:
+        friend class OrderedIndex;
+
+        const_iterator(const std::vector<std::vector<T>>* leaves, std::size_t leaf, std::size_t pos)
+            : leaves_(leaves), leaf_(leaf), pos_(pos) {}
+
+        const std::vector<std::vector<T>>* leaves_;
+        std::size_t leaf_;
+        std::size_t pos_;
+    };
+
+    const_iterator begin() const { return {&leaves_, 0, 0}; }
+    const_iterator end() const { return {&leaves_, leaves_.size(), 0}; }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // Returns the first element for which before(element) is false. The
+    // elements must be partitioned by it: all those it holds for come first.
+    template <typename Before>
+    const_iterator partition_point(Before before) const {
+        auto next = std::partition_point(firsts_.begin(), firsts_.end(), before);
+        if (next == firsts_.begin()) {
+            return begin();
+        }
+        auto leaf = static_cast<std::size_t>(next - firsts_.begin()) - 1;
+        const std::vector<T>& elements = leaves_[leaf];
+        auto it = std::partition_point(elements.begin(), elements.end(), before);
+        if (it == elements.end()) {
+            return {&leaves_, leaf + 1, 0};
+        }
+        return {&leaves_, leaf, static_cast<std::size_t>(it - elements.begin())};
+    }
+
+    // Number of elements in [first, last); walks the leaves in between
+    std::size_t distance(const_iterator first, const_iterator last) const {
+        if (!(first < last)) {
+            return 0;
+        }
+        if (first.leaf_ == last.leaf_) {
+            return last.pos_ - first.pos_;
+        }
+        std::size_t count = leaves_[first.leaf_].size() - first.pos_ + last.pos_;
+        for (std::size_t leaf = first.leaf_ + 1; leaf < last.leaf_; ++leaf) {
+            count += leaves_[leaf].size();
+        }
+        return count;
+    }
+
+    // Inserts value after any elements equivalent to it
+    template <typename Less>
+    void insert(const T& value, Less less) {
+        if (leaves_.empty()) {
+            leaves_.emplace_back().reserve(leaf_size);
+            firsts_.push_back(value);
+        }
+        // The last leaf that starts at or before value. A full one is split
+        // first, so leaves never outgrow the capacity they were created with.
+        auto next = std::upper_bound(firsts_.begin(), firsts_.end(), value, less);
+        auto leaf = next == firsts_.begin() ? 0 : static_cast<std::size_t>(next - firsts_.begin()) - 1;
+        if (leaves_[leaf].size() == leaf_size) {
+            split(leaf);
+            if (!less(value, firsts_[leaf + 1])) {
+                ++leaf;
+            }
+        }
+        std::vector<T>& elements = leaves_[leaf];
+        elements.insert(std::upper_bound(elements.begin(), elements.end(), value, less), value);
+        firsts_[leaf] = elements.front();
+        ++size_;
+    }
+
+    // Removes the first element equivalent to value. Returns false if there
+    // is none.
+    template <typename Less>
+    bool erase(const T& value, Less less) {
+        const_iterator it = partition_point([&](const T& element) { return less(element, value); });
+        if (it == end() || less(value, *it)) {
+            return false;
+        }
+        std::size_t leaf = it.leaf_;
+        std::vector<T>& elements = leaves_[leaf];
+        elements.erase(elements.begin() + static_cast<std::ptrdiff_t>(it.pos_));
+        --size_;
+        if (elements.empty()) {
+            leaves_.erase(leaves_.begin() + static_cast<std::ptrdiff_t>(leaf));
+            firsts_.erase(firsts_.begin() + static_cast<std::ptrdiff_t>(leaf));
+            return true;
+        }
+        firsts_[leaf] = elements.front();
+
+        // Fold a small leaf into its successor when they fit in one, so
+        // leaves stay mostly full after many erases
+        if (elements.size() < leaf_size / 4 && leaf + 1 < leaves_.size() &&
+            elements.size() + leaves_[leaf + 1].size() <= leaf_size) {
+            std::vector<T>& following = leaves_[leaf + 1];
+            elements.insert(elements.end(), following.begin(), following.end());
+            leaves_.erase(leaves_.begin() + static_cast<std::ptrdiff_t>(leaf) + 1);
+            firsts_.erase(firsts_.begin() + static_cast<std::ptrdiff_t>(leaf) + 1);
+        }
+        return true;
+    }
+
+    void clear() {
+        leaves_.clear();
+        firsts_.clear();
+        size_ = 0;
+    }
+
+private:
+    // Moves the upper half of a full leaf into a new one after it
+    void split(std::size_t leaf) {
+        std::vector<T> upper;
+        upper.reserve(leaf_size);
+        std::vector<T>& elements = leaves_[leaf];
+        auto middle = elements.begin() + static_cast<std::ptrdiff_t>(elements.size() / 2);
+        upper.assign(middle, elements.end());
+        elements.erase(middle, elements.end());
+        firsts_.insert(firsts_.begin() + static_cast<std::ptrdiff_t>(leaf) + 1, upper.front());
+        leaves_.insert(leaves_.begin() + static_cast<std::ptrdiff_t>(leaf) + 1, std::move(upper));
+    }
+
+    std::vector<std::vector<T>> leaves_; // Each sorted and non-empty
+    std::vector<T> firsts_;              // First element of each leaf
+    std::size_t size_ = 0;
+};
+
+#endif
@@ -0,0 +1,628 @@
+#include "replication.h"
+#include <algorithm>
+#include <cerrno>
+#include <exception>
+#include <optional>
+#include <system_error>
+#include <unordered_set>
+#include <utility>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+// Longest line accepted; a changes frame of max_frame_events large books
+// stays well under it
+constexpr std::size_t max_line_size = 64 * 1024 * 1024;
+
+// Heartbeats a follower remembers while behind; older ones are dropped,
+// which can only make it report itself staler than it is
+constexpr std::size_t max_heartbeats = 1024;
+
+// Books a follower inserts per store write while loading a snapshot
+constexpr std::size_t snapshot_batch_size = 1024;
+
+bool send_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(n));
+    }
+    return true;
+}
+
+void set_no_delay(int fd) {
+    int on = 1;
+    ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// Splits what arrives on a socket into lines
+class LineReader {
+public:
+    explicit LineReader(int fd) : fd_(fd) {}
+
+    // Sets line to the next line, without its '\n', valid until the next
+    // call. Returns false once the connection has closed, failed or timed
+    // out, or sent a line over max_line_size.
+    bool next(std::string_view& line) {
+        for (;;) {
+            std::size_t end = buffer_.find('\n', scanned_);
+            if (end != std::string::npos) {
+                line = std::string_view(buffer_).substr(start_, end - start_);
+                start_ = scanned_ = end + 1;
+                return true;
+            }
+            scanned_ = buffer_.size();
+            if (scanned_ - start_ > max_line_size) {
+                return false;
+            }
+            // Keep only the unfinished line, then read more after it
+            buffer_.erase(0, start_);
+            scanned_ -= start_;
+            start_ = 0;
+            std::size_t size = buffer_.size();
+            buffer_.resize(size + read_size);
+            ssize_t n;
+            do {
+                n = ::recv(fd_, buffer_.data() + size, read_size, 0);
+            } while (n < 0 && errno == EINTR);
+            buffer_.resize(size + static_cast<std::size_t>(std::max<ssize_t>(n, 0)));
+            if (n <= 0) {
+                return false;
+            }
+        }
+    }
+
+private:
+    static constexpr std::size_t read_size = 64 * 1024;
+
+    int fd_;
+    std::string buffer_;
+    std::size_t start_ = 0;   // Start of the next line
+    std::size_t scanned_ = 0; // Where to look for its end
+};
+
+std::optional<std::uint64_t> parse_seq(std::string_view text) {
+    if (text.empty() || text.size() > 20) {
+        return std::nullopt;
+    }
+    std::uint64_t value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return std::nullopt;
+        }
+        value = value * 10 + static_cast<std::uint64_t>(c - '0');
+    }
+    return value;
+}
+
+// The line a snapshot or a changes frame carries a stored book in
+std::string put_line(const Book& book) {
+    crow::json::wvalue line;
+    line["op"] = "put";
+    line["version"] = static_cast<std::uint64_t>(book.version());
+    line["book"] = book.to_json();
+    std::string text = line.dump();
+    text += '\n';
+    return text;
+}
+
+// The book in a put event or snapshot line. Throws std::exception if it is
+// malformed.
+BookStore::BookPtr book_from_put(const crow::json::rvalue& event) {
+    const crow::json::rvalue& book = event["book"];
+    BookFields fields;
+    fields.id = std::string(book["id"].s());
+    fields.title = std::string(book["title"].s());
+    fields.author = std::string(book["author"].s());
+    if (book.has("published_date")) {
+        fields.published_date = std::string(book["published_date"].s());
+    }
+    fields.coverImageUrl = std::string(book["coverImageUrl"].s());
+    fields.version = static_cast<std::uint32_t>(event["version"].u());
+    return std::make_shared<const Book>(fields);
+}
+
+bool same_book(const Book& a, const Book& b) {
+    return a.version() == b.version() && a.title() == b.title() && a.author() == b.author() &&
+           a.published_date() == b.published_date() && a.coverImageUrl() == b.coverImageUrl();
+}
+
+// A socket connected to host:port, or -1. Sends and the connect itself give
+// up after Follower::receive_timeout.
+int connect_to(const std::string& host, std::uint16_t port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = nullptr;
+    if (::getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0) {
+        return -1;
+    }
+    auto timeout = std::chrono::duration_cast<std::chrono::microseconds>(Follower::receive_timeout).count();
+    timeval tv{};
+    tv.tv_sec = static_cast<time_t>(timeout / 1000000);
+    tv.tv_usec = static_cast<suseconds_t>(timeout % 1000000);
+
+    int fd = -1;
+    for (addrinfo* address = found; address != nullptr && fd < 0; address = address->ai_next) {
+        fd = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    ::freeaddrinfo(found);
+    if (fd >= 0) {
+        set_no_delay(fd);
+    }
+    return fd;
+}
+
+} // namespace
+
+// One follower connection on the leader
+struct ReplicationServer::Session {
+    // A frame to send, or with an empty frame, a snapshot as of seq
+    struct Outgoing {
+        std::string frame;
+        std::uint64_t seq = 0;
+    };
+
+    explicit Session(int fd) : fd(fd) {}
+    ~Session() { ::close(fd); }
+
+    void push(Outgoing item) {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(item));
+        wake.notify_one();
+    }
+
+    // Shuts the socket down, which wakes both threads
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!closed) {
+            closed = true;
+            ::shutdown(fd, SHUT_RDWR);
+        }
+        wake.notify_one();
+    }
+
+    const int fd;
+    std::atomic<int> running{2}; // Threads still using the session
+    std::thread reader;
+    std::thread writer;
+
+    std::mutex mutex; // Guards everything below
+    std::condition_variable wake;
+    std::deque<Outgoing> queue;
+    bool closed = false;
+};
+
+ReplicationServer::ReplicationServer(const ShardedBookStore& books, ChangeFeed& feed, std::uint16_t port)
+    : books_(books), feed_(feed) {
+    listen_fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd_ < 0) {
+        throw std::system_error(errno, std::generic_category(), "create replication socket");
+    }
+    int on = 1;
+    ::setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    socklen_t size = sizeof(address);
+    if (::bind(listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listen_fd_, SOMAXCONN) != 0 ||
+        ::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&address), &size) != 0) {
+        int error = errno;
+        ::close(listen_fd_);
+        throw std::system_error(error, std::generic_category(), "listen on replication port " + std::to_string(port));
+    }
+    port_ = ntohs(address.sin_port);
+    acceptor_ = std::thread([this] { accept_loop(); });
+}
+
+ReplicationServer::~ReplicationServer() {
+    stop_ = true;
+    ::shutdown(listen_fd_, SHUT_RDWR); // Wakes accept()
+    acceptor_.join();
+    ::close(listen_fd_);
+    reap(true);
+}
+
+void ReplicationServer::accept_loop() {
+    while (!stop_) {
+        int fd = ::accept(listen_fd_, nullptr, nullptr);
+        if (fd < 0) {
+            if (!stop_ && errno != EINTR && errno != ECONNABORTED) {
+                // Out of descriptors, most likely: give connections time to close
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            continue;
+        }
+        reap(false);
+        set_no_delay(fd);
+
+        auto owned = std::make_unique<Session>(fd);
+        Session& session = *owned;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sessions_.push_back(std::move(owned));
+        }
+        session.reader = std::thread([this, &session] { read_loop(session); });
+        session.writer = std::thread([this, &session] { write_loop(session); });
+    }
+}
+
+void ReplicationServer::reap(bool all) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = sessions_.begin(); it != sessions_.end();) {
+        Session& session = **it;
+        if (all) {
+            session.close();
+        } else if (session.running.load() != 0) {
+            ++it;
+            continue;
+        }
+        session.reader.join();
+        session.writer.join();
+        it = sessions_.erase(it);
+    }
+}
+
+void ReplicationServer::read_loop(Session& session) {
+    LineReader reader(session.fd);
+    std::string_view line;
+    std::optional<ChangeFeed::Start> start;
+    if (reader.next(line)) {
+        try {
+            auto request = crow::json::load(line.data(), line.size());
+            if (request && request.t() == crow::json::type::Object) {
+                start.emplace();
+                if (request.has("since")) {
+                    *start = {true, request["epoch"].u(), request["since"].u()};
+                }
+            }
+        } catch (const std::exception&) {
+            start.reset();
+        }
+    }
+
+    if (start) {
+        feed_.subscribe(
+            &session, *start, [&session](const std::string& frame) { session.push({frame, 0}); },
+            // Only queued here, under the feed's lock: the writer thread
+            // copies the store when it gets to it
+            [&session](std::uint64_t seq) { session.push({{}, seq}); });
+        ++followers_;
+        while (reader.next(line)) {
+            auto seq = parse_seq(line);
+            if (!seq) {
+                break;
+            }
+            feed_.ack(&session, *seq);
+        }
+        feed_.unsubscribe(&session);
+        --followers_;
+    }
+    session.close();
+    --session.running;
+}
+
+void ReplicationServer::write_loop(Session& session) {
+    std::chrono::steady_clock::time_point last_heartbeat;
+    std::deque<Session::Outgoing> batch;
+    std::string out;
+    bool ok = true;
+    while (ok) {
+        {
+            std::unique_lock<std::mutex> lock(session.mutex);
+            session.wake.wait_for(lock, heartbeat_interval,
+                                  [&] { return session.closed || !session.queue.empty(); });
+            if (session.closed) {
+                break;
+            }
+            batch.swap(session.queue);
+        }
+
+        // Also sent between frames, so a follower that is busy keeping up
+        // still learns how far it has to go
+        out.clear();
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_heartbeat >= heartbeat_interval) {
+            out = "{\"type\":\"heartbeat\",\"seq\":" + std::to_string(feed_.last_seq()) + "}\n";
+            last_heartbeat = now;
+        }
+        for (Session::Outgoing& item : batch) {
+            if (!item.frame.empty()) {
+                out += item.frame;
+                out += '\n';
+                continue;
+            }
+            // Taken after the feed handed out seq, so it holds every write up
+            // to seq and maybe some after, which the events that follow
+            // carry again as the store holds them
+            std::vector<BookStore::BookPtr> snapshot = books_.books();
+            out += "{\"type\":\"snapshot\",\"seq\":" + std::to_string(item.seq) +
+                   ",\"books\":" + std::to_string(snapshot.size()) + "}\n";
+            for (const auto& book : snapshot) {
+                out += put_line(*book);
+                if (out.size() >= send_chunk) {
+                    ok = ok && send_all(session.fd, out);
+                    out.clear();
+                }
+            }
+        }
+        batch.clear();
+        ok = ok && send_all(session.fd, out);
+    }
+    session.close();
+    --session.running;
+}
+
+Follower::Follower(ShardedBookStore& books, std::string host, std::uint16_t port, Changed changed,
+                   ChangeFeed::Start start)
+    : books_(books), host_(std::move(host)), port_(port), changed_(std::move(changed)) {
+    if (start.resume) {
+        stats_.loaded = true;
+        stats_.epoch = start.epoch;
+        stats_.applied_seq = start.since;
+    }
+    thread_ = std::thread([this] { run(); });
+}
+
+Follower::~Follower() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        if (fd_ >= 0) {
+            ::shutdown(fd_, SHUT_RDWR);
+        }
+    }
+    wake_.notify_one();
+    thread_.join();
+}
+
+std::chrono::steady_clock::duration Follower::staleness() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (current_at_ == std::chrono::steady_clock::time_point()) {
+        return std::chrono::steady_clock::duration::max();
+    }
+    return std::chrono::steady_clock::now() - current_at_;
+}
+
+ChangeFeed::Start Follower::position() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return {stats_.loaded, stats_.epoch, stats_.applied_seq};
+}
+
+Follower::Stats Follower::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void Follower::run() {
+    auto backoff = std::chrono::milliseconds(50);
+    bool connected_before = false;
+    for (;;) {
+        int fd = connect_to(host_, port_);
+        if (fd >= 0) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stop_) {
+                    ::close(fd);
+                    return;
+                }
+                fd_ = fd;
+                stats_.connected = true;
+                stats_.reconnects += connected_before ? 1 : 0;
+                in_sync_ = false;
+                heartbeats_.clear();
+            }
+            connected_before = true;
+            backoff = std::chrono::milliseconds(50);
+            try {
+                session(fd);
+            } catch (const std::exception&) {
+                // A malformed frame: start over on a new connection
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                fd_ = -1;
+                stats_.connected = false;
+            }
+            ::close(fd);
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (wake_.wait_for(lock, backoff, [this] { return stop_; })) {
+            return;
+        }
+        backoff = std::min<std::chrono::milliseconds>(backoff * 2, max_backoff);
+    }
+}
+
+void Follower::session(int fd) {
+    ChangeFeed::Start start = position();
+    std::string request = start.resume ? "{\"epoch\":" + std::to_string(start.epoch) +
+                                             ",\"since\":" + std::to_string(start.since) + "}\n"
+                                       : "{}\n";
+    if (!send_all(fd, request)) {
+        return;
+    }
+
+    LineReader reader(fd);
+    std::string_view line;
+    std::uint64_t epoch = 0; // Of the leader run this connection serves
+    std::vector<std::string> ids;
+    std::vector<std::string_view> id_views;
+    auto report = [&] {
+        if (changed_ && !ids.empty()) {
+            id_views.assign(ids.begin(), ids.end());
+            changed_(id_views);
+        }
+        ids.clear();
+    };
+
+    while (reader.next(line)) {
+        auto frame = crow::json::load(line.data(), line.size());
+        if (!frame) {
+            return;
+        }
+        std::string type = frame["type"].s();
+        if (type == "heartbeat") {
+            heartbeat(frame["seq"].u());
+        } else if (type == "hello") {
+            epoch = frame["epoch"].u();
+            if (start.resume) {
+                // Resumed where it left off: nothing missed so far
+                applied(epoch, frame["seq"].u(), 0);
+            }
+        } else if (type == "resync") {
+            epoch = frame["epoch"].u();
+            std::lock_guard<std::mutex> lock(mutex_);
+            in_sync_ = false;
+        } else if (type == "snapshot") {
+            std::uint64_t seq = frame["seq"].u();
+            std::uint64_t count = frame["books"].u();
+            std::vector<BookPtr> snapshot;
+            snapshot.reserve(static_cast<std::size_t>(std::min<std::uint64_t>(count, 1 << 20)));
+            for (std::uint64_t i = 0; i < count; ++i) {
+                if (!reader.next(line)) {
+                    return;
+                }
+                auto put = crow::json::load(line.data(), line.size());
+                if (!put) {
+                    return;
+                }
+                snapshot.push_back(book_from_put(put));
+            }
+            load_snapshot(snapshot, ids);
+            report();
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++stats_.snapshots;
+            }
+            applied(epoch, seq, 0);
+            if (!send_all(fd, std::to_string(seq) + "\n")) {
+                return;
+            }
+        } else if (type == "changes") {
+            std::uint64_t last = 0;
+            std::size_t events = 0;
+            for (const crow::json::rvalue& event : frame["events"]) {
+                last = event["seq"].u();
+                ++events;
+                if (std::string(event["op"].s()) == "put") {
+                    BookPtr book = book_from_put(event);
+                    if (apply_put(book)) {
+                        ids.emplace_back(book->id());
+                    }
+                } else {
+                    std::string id = event["id"].s();
+                    if (books_.erase(id)) {
+                        ids.push_back(std::move(id));
+                    }
+                }
+            }
+            report();
+            if (events == 0) {
+                continue;
+            }
+            applied(epoch, last, events);
+            if (!send_all(fd, std::to_string(last) + "\n")) {
+                return;
+            }
+        }
+    }
+}
+
+bool Follower::apply_put(const BookPtr& book) {
+    // The leader reads each book as it sends the event, so a book changed
+    // several times in a row can arrive several times as it is now
+    auto current = books_.find(book->id());
+    if (!current) {
+        return books_.insert(book);
+    }
+    if (same_book(*current, *book)) {
+        return false;
+    }
+    return books_.update(book);
+}
+
+void Follower::load_snapshot(const std::vector<BookPtr>& snapshot, std::vector<std::string>& ids) {
+    // Books the store already holds as they are are left alone, so a
+    // resync after a short gap only writes what changed
+    std::unordered_set<std::string_view> keep;
+    keep.reserve(snapshot.size());
+    std::vector<BookPtr> batch;
+    auto flush = [&] {
+        std::vector<bool> inserted = books_.insert_batch(batch);
+        for (std::size_t i = 0; i < batch.size(); ++i) {
+            if (inserted[i]) {
+                ids.emplace_back(batch[i]->id());
+            }
+        }
+        batch.clear();
+    };
+    for (const auto& book : snapshot) {
+        keep.insert(book->id());
+        auto current = books_.find(book->id());
+        if (!current) {
+            batch.push_back(book);
+            if (batch.size() == snapshot_batch_size) {
+                flush();
+            }
+        } else if (!same_book(*current, *book) && books_.update(book)) {
+            ids.emplace_back(book->id());
+        }
+    }
+    flush();
+
+    for (const auto& book : books_.books()) {
+        if (keep.count(book->id()) == 0 && books_.erase(book->id())) {
+            ids.emplace_back(book->id());
+        }
+    }
+}
+
+void Follower::applied(std::uint64_t epoch, std::uint64_t seq, std::size_t events) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.loaded = true;
+    stats_.epoch = epoch;
+    stats_.applied_seq = seq;
+    stats_.events += events;
+    in_sync_ = true;
+    while (!heartbeats_.empty() && heartbeats_.front().first <= seq) {
+        current_at_ = heartbeats_.front().second;
+        heartbeats_.pop_front();
+    }
+}
+
+void Follower::heartbeat(std::uint64_t seq) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (in_sync_ && seq <= stats_.applied_seq) {
+        current_at_ = now;
+        return;
+    }
+    if (heartbeats_.size() == max_heartbeats) {
+        heartbeats_.pop_front();
+    }
+    heartbeats_.push_back({seq, now});
+}
@@ -0,0 +1,159 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "book_store.h"
+#include "change_feed.h"
+#include "sharded_book_store.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Leader/follower replication of the book store, so reads can be spread
+// over several server processes.
+//
+// The leader's ChangeFeed already numbers every write in order; a
+// ReplicationServer streams it to followers over plain TCP, and a Follower
+// applies it to a store of its own. A follower starts from a copy of every
+// book (a snapshot), taken on its writer thread once the feed has handed it
+// its first seq, so the feed never waits for the copy, and from then on
+// applies events; acknowledgements keep it at
+// most ChangeFeed::window events behind, as for a WebSocket client. After a
+// disconnect it resumes from the last seq it applied; if those events have
+// left the ring, or the leader restarted, it is resynced with a new snapshot.
+//
+// The leader also sends its latest seq every heartbeat_interval. A follower
+// that has applied everything up to a heartbeat was current when it arrived,
+// which bounds how stale its store can be (see Follower::staleness()).
+//
+// Every message is one line of JSON. The follower opens with
+//   {}  or  {"epoch":E,"since":N}      to resume after event N of run E
+// and then sends the seq of every frame it has applied, as a plain number.
+// The leader sends the ChangeFeed frames, plus
+//   {"type":"snapshot","seq":S,"books":N}  followed by N lines of
+//   {"op":"put","version":V,"book":{...}}  every book, as of seq S or later
+//   {"type":"heartbeat","seq":S}           the leader's latest seq
+
+// The leader's side: accepts followers on a TCP port and streams them the
+// change feed. Each follower gets a thread reading its acknowledgements and
+// one writing its frames, so a slow follower holds up no other.
+class ReplicationServer {
+public:
+    static constexpr std::chrono::milliseconds heartbeat_interval{100};
+    static constexpr std::size_t send_chunk = 1 << 20; // Snapshot bytes buffered per send
+
+    // Listens on port on every interface (0 picks a free port; see port()).
+    // Throws std::system_error if the port cannot be bound.
+    ReplicationServer(const ShardedBookStore& books, ChangeFeed& feed, std::uint16_t port);
+    ~ReplicationServer();
+
+    ReplicationServer(const ReplicationServer&) = delete;
+    ReplicationServer& operator=(const ReplicationServer&) = delete;
+
+    std::uint16_t port() const { return port_; }
+    std::size_t followers() const { return followers_.load(std::memory_order_relaxed); }
+
+private:
+    struct Session;
+
+    void accept_loop();
+    void read_loop(Session& session);
+    void write_loop(Session& session);
+    void reap(bool all);
+
+    const ShardedBookStore& books_;
+    ChangeFeed& feed_;
+    int listen_fd_ = -1;
+    std::uint16_t port_ = 0;
+    std::atomic<bool> stop_{false};
+    std::atomic<std::size_t> followers_{0};
+
+    std::mutex mutex_; // Guards sessions_
+    std::list<std::unique_ptr<Session>> sessions_;
+    std::thread acceptor_;
+};
+
+// The follower's side: keeps a store in step with a leader's, reconnecting
+// with backoff whenever the connection drops. Writes only come from the
+// leader; the store must not be written to by anything else.
+class Follower {
+public:
+    using BookPtr = BookStore::BookPtr;
+
+    // A leader silent for this long (twenty heartbeats) is given up on and
+    // reconnected to
+    static constexpr std::chrono::milliseconds receive_timeout{2000};
+    static constexpr std::chrono::milliseconds max_backoff{2000};
+
+    // Called on the follower's thread with the ids of the books each frame
+    // or snapshot changed, once they are in the store.
+    using Changed = std::function<void(const std::vector<std::string_view>& ids)>;
+
+    struct Stats {
+        bool connected = false;
+        bool loaded = false;           // Holds the leader's books up to applied_seq
+        std::uint64_t epoch = 0;       // The leader run the seq below belongs to
+        std::uint64_t applied_seq = 0; // Last leader seq applied
+        std::uint64_t events = 0;      // Events applied since startup
+        std::uint64_t snapshots = 0;   // Snapshots loaded since startup
+        std::uint64_t reconnects = 0;
+    };
+
+    // Connects to the leader's ReplicationServer at host:port. With
+    // start.resume, the store already holds the leader's books up to
+    // start.since of run start.epoch (see position()) and only later
+    // events are fetched; otherwise it is loaded from a snapshot.
+    Follower(ShardedBookStore& books, std::string host, std::uint16_t port, Changed changed,
+             ChangeFeed::Start start = {});
+    ~Follower();
+
+    Follower(const Follower&) = delete;
+    Follower& operator=(const Follower&) = delete;
+
+    // How long ago the store last held every write the leader had made, as
+    // of the latest heartbeat it has caught up with: under two heartbeat
+    // intervals while it keeps up, growing while it falls behind or is cut
+    // off, and duration::max() until it first catches up.
+    std::chrono::steady_clock::duration staleness() const;
+
+    // Where a Follower taking over this store would resume from
+    ChangeFeed::Start position() const;
+
+    Stats stats() const;
+
+private:
+    void run();
+    void session(int fd);
+    void load_snapshot(const std::vector<BookPtr>& snapshot, std::vector<std::string>& ids);
+    bool apply_put(const BookPtr& book); // Returns false if the store already held it
+    void applied(std::uint64_t epoch, std::uint64_t seq, std::size_t events);
+    void heartbeat(std::uint64_t seq);
+
+    ShardedBookStore& books_;
+    const std::string host_;
+    const std::uint16_t port_;
+    const Changed changed_;
+
+    mutable std::mutex mutex_; // Guards everything below
+    std::condition_variable wake_;
+    bool stop_ = false;
+    int fd_ = -1; // Connected socket, shut down to stop
+    Stats stats_;
+    bool in_sync_ = false; // applied_seq is from the connected leader's run
+    // Heartbeats not yet caught up with: the leader's seq and when it came
+    std::deque<std::pair<std::uint64_t, std::chrono::steady_clock::time_point>> heartbeats_;
+    std::chrono::steady_clock::time_point current_at_; // When the store was last current; zero if never
+    std::thread thread_;
+};
+
+#endif
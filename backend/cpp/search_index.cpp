@@ -0,0 +1,561 @@
+#include "search_index.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <utility>
+
+namespace {
+
+// Longer words are cut to this many bytes
+constexpr std::size_t max_word_size = 32;
+
+// Terms of a prefix looked at when picking its most common completions
+constexpr std::size_t max_prefix_scan = 4096;
+
+// Prefixes up to this long have their completions cached, and a cached list
+// is used until this many books have changed
+constexpr std::size_t cached_prefix_size = 3;
+constexpr std::uint64_t completions_max_age = 4096;
+
+// Terms get a bitset once they have this many postings and are in at least
+// 1/dense_ratio of the docs
+constexpr std::size_t dense_min_postings = 1024;
+constexpr std::size_t dense_ratio = 32;
+
+// BM25 parameters
+constexpr double k1 = 1.2;
+constexpr double b = 0.75;
+
+bool is_word_byte(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+// Calls fn(std::string_view) for every word of text, lowercased
+template <typename Fn>
+void for_each_word(std::string_view text, Fn&& fn) {
+    char word[max_word_size];
+    std::size_t size = 0;
+    for (std::size_t i = 0; i <= text.size(); ++i) {
+        unsigned char c = i < text.size() ? static_cast<unsigned char>(text[i]) : ' ';
+        if (is_word_byte(c)) {
+            if (size < max_word_size) {
+                word[size++] = static_cast<char>(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+            }
+        } else if (size > 0) {
+            fn(std::string_view(word, size));
+            size = 0;
+        }
+    }
+}
+
+// The distinct words of a book's title and author, sorted, viewing text
+std::vector<std::string_view> book_words(const Book& book, std::string& text) {
+    std::vector<std::pair<std::size_t, std::size_t>> spans;
+    auto collect = [&](std::string_view word) {
+        spans.emplace_back(text.size(), word.size());
+        text += word;
+    };
+    for_each_word(book.title(), collect);
+    for_each_word(book.author(), collect);
+
+    std::vector<std::string_view> words;
+    words.reserve(spans.size());
+    for (const auto& [offset, size] : spans) {
+        words.emplace_back(text.data() + offset, size);
+    }
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+    return words;
+}
+
+} // namespace
+
+// Looks up docs of one length in a term
+class SearchIndex::Cursor {
+public:
+    Cursor(const Term& term, std::uint32_t length)
+        : bits_(term.bits.empty() ? nullptr : &term.bits), bucket_(term.bucket(length)) {}
+
+    // True if the term is in doc. Docs must be asked for in increasing
+    // order.
+    bool contains(std::uint32_t doc) {
+        if (bits_) {
+            return doc / 64 < bits_->size() && ((*bits_)[doc / 64] >> (doc % 64) & 1) != 0;
+        }
+        if (!bucket_) {
+            return false;
+        }
+
+        // Gallop from the last position, then binary search the last step
+        const std::vector<Posting>& postings = bucket_->postings;
+        std::size_t low = next_;
+        std::size_t high = low;
+        for (std::size_t step = 1; high < postings.size() && postings[high].doc < doc; step *= 2) {
+            low = high + 1;
+            high = low + step;
+        }
+        high = std::min(high, postings.size());
+        auto it = std::lower_bound(postings.begin() + low, postings.begin() + high, doc,
+                                   [](const Posting& p, std::uint32_t d) { return p.doc < d; });
+        next_ = static_cast<std::size_t>(it - postings.begin());
+        return next_ < postings.size() && it->doc == doc;
+    }
+
+private:
+    const std::vector<std::uint64_t>* bits_;
+    const Bucket* bucket_;
+    std::size_t next_ = 0;
+};
+
+void SearchIndex::Term::append(const Posting& posting) {
+    std::uint32_t length = std::min(posting.length, long_doc);
+    auto it = std::lower_bound(buckets.begin(), buckets.end(), length,
+                               [](const Bucket& bucket, std::uint32_t l) { return bucket.length < l; });
+    if (it == buckets.end() || it->length != length) {
+        it = buckets.insert(it, Bucket{length, {}});
+    }
+    it->postings.push_back(posting);
+    ++postings;
+    if (!bits.empty()) {
+        if (posting.doc / 64 >= bits.size()) {
+            bits.resize(posting.doc / 64 + 1);
+        }
+        bits[posting.doc / 64] |= std::uint64_t(1) << (posting.doc % 64);
+    }
+}
+
+const SearchIndex::Bucket* SearchIndex::Term::bucket(std::uint32_t length) const {
+    length = std::min(length, long_doc);
+    auto it = std::lower_bound(buckets.begin(), buckets.end(), length,
+                               [](const Bucket& bucket, std::uint32_t l) { return bucket.length < l; });
+    return it != buckets.end() && it->length == length ? &*it : nullptr;
+}
+
+void SearchIndex::update_bits(Term& term) {
+    if (!term.bits.empty() || term.postings < dense_min_postings || term.postings * dense_ratio < docs_.size()) {
+        return;
+    }
+    term.bits.assign(docs_.size() / 64 + 1, 0);
+    for (const Bucket& bucket : term.buckets) {
+        for (const Posting& posting : bucket.postings) {
+            term.bits[posting.doc / 64] |= std::uint64_t(1) << (posting.doc % 64);
+        }
+    }
+}
+
+SearchIndex::SearchIndex(const ShardedBookStore& books) : books_(books) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    std::vector<BookStore::BookPtr> all = books_.books();
+    docs_.reserve(all.size());
+    doc_ids_.reserve(all.size());
+    for (auto& book : all) {
+        add(std::move(book));
+    }
+}
+
+void SearchIndex::refresh(std::string_view id) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    sync(id);
+}
+
+void SearchIndex::refresh(const std::vector<std::string_view>& ids) {
+    if (ids.empty()) {
+        return;
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    for (std::string_view id : ids) {
+        sync(id);
+    }
+}
+
+std::size_t SearchIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return doc_ids_.size();
+}
+
+void SearchIndex::sync(std::string_view id) {
+    BookStore::BookPtr book = books_.find(id);
+    auto it = doc_ids_.find(id);
+    if (it != doc_ids_.end()) {
+        std::uint32_t doc = it->second;
+        if (docs_[doc] == book) {
+            return;
+        }
+        // An update that kept the words (a new cover, say) keeps the postings;
+        // point the key at the new book's id before the old one can go away
+        if (book && book->title() == docs_[doc]->title() && book->author() == docs_[doc]->author()) {
+            auto node = doc_ids_.extract(it);
+            node.key() = book->id();
+            docs_[doc] = std::move(book);
+            doc_ids_.insert(std::move(node));
+            return;
+        }
+        doc_ids_.erase(it);
+        retire(doc);
+    }
+    if (book) {
+        add(std::move(book));
+    }
+    if (dead_docs_ > 1024 && dead_docs_ * 2 > docs_.size()) {
+        compact();
+    }
+}
+
+void SearchIndex::add(BookStore::BookPtr book) {
+    auto doc = static_cast<std::uint32_t>(docs_.size());
+    std::string text;
+    std::vector<std::string_view> words = book_words(*book, text);
+    auto length = static_cast<std::uint32_t>(words.size());
+    for (std::string_view word : words) {
+        Term& term = terms_[acquire_term(word)];
+        term.append({doc, length});
+        ++term.live;
+        update_bits(term);
+    }
+    total_length_ += length;
+    ++changes_;
+
+    doc_ids_.emplace(book->id(), doc);
+    docs_.push_back(std::move(book));
+    alive_.push_back(true);
+}
+
+void SearchIndex::retire(std::uint32_t doc) {
+    std::string text;
+    std::vector<std::string_view> words = book_words(*docs_[doc], text);
+    for (std::string_view word : words) {
+        --terms_[dictionary_.find(word)->second].live;
+    }
+    total_length_ -= words.size();
+    ++changes_;
+
+    docs_[doc].reset();
+    alive_[doc] = false;
+    ++dead_docs_;
+}
+
+void SearchIndex::compact() {
+    // Term ids are about to be reused
+    {
+        std::lock_guard<std::mutex> lock(completions_mutex_);
+        completions_.clear();
+    }
+
+    // Renumber live docs in order, so postings stay sorted
+    std::vector<std::uint32_t> renumbered(docs_.size(), UINT32_MAX);
+    std::uint32_t live = 0;
+    for (std::uint32_t doc = 0; doc < docs_.size(); ++doc) {
+        if (alive_[doc]) {
+            renumbered[doc] = live;
+            docs_[live++] = std::move(docs_[doc]);
+        }
+    }
+    docs_.resize(live);
+    alive_.assign(live, true);
+    dead_docs_ = 0;
+    for (auto& entry : doc_ids_) {
+        entry.second = renumbered[entry.second];
+    }
+
+    for (std::uint32_t id = 0; id < terms_.size(); ++id) {
+        Term& term = terms_[id];
+        if (term.text == nullptr) {
+            continue;
+        }
+        std::vector<Bucket> buckets;
+        buckets.swap(term.buckets);
+        std::vector<std::uint64_t>().swap(term.bits);
+        term.postings = 0;
+        for (const Bucket& bucket : buckets) {
+            for (const Posting& posting : bucket.postings) {
+                if (renumbered[posting.doc] != UINT32_MAX) {
+                    term.append({renumbered[posting.doc], posting.length});
+                }
+            }
+        }
+        if (term.postings == 0) {
+            dictionary_.erase(dictionary_.find(*term.text));
+            term = Term();
+            term.next_free = free_term_;
+            free_term_ = id;
+        } else {
+            update_bits(term);
+        }
+    }
+}
+
+std::uint32_t SearchIndex::acquire_term(std::string_view text) {
+    auto it = dictionary_.find(text);
+    if (it != dictionary_.end()) {
+        return it->second;
+    }
+
+    std::uint32_t term;
+    if (free_term_ != UINT32_MAX) {
+        term = free_term_;
+        free_term_ = terms_[term].next_free;
+        terms_[term].next_free = UINT32_MAX;
+    } else {
+        terms_.emplace_back();
+        term = static_cast<std::uint32_t>(terms_.size() - 1);
+    }
+    it = dictionary_.emplace(std::string(text), term).first;
+    terms_[term].text = &it->first;
+    return term;
+}
+
+std::vector<std::uint32_t> SearchIndex::expand_prefix(std::string_view prefix) const {
+    bool cached = prefix.size() <= cached_prefix_size;
+    if (cached) {
+        std::lock_guard<std::mutex> lock(completions_mutex_);
+        auto it = completions_.find(std::string(prefix));
+        if (it != completions_.end() && changes_ - it->second.changes < completions_max_age) {
+            std::vector<std::uint32_t> terms;
+            for (std::uint32_t term : it->second.terms) {
+                if (terms_[term].live > 0) {
+                    terms.push_back(term);
+                }
+            }
+            return terms;
+        }
+    }
+
+    std::vector<std::uint32_t> terms;
+    std::size_t scanned = 0;
+    for (auto it = dictionary_.lower_bound(prefix);
+         it != dictionary_.end() && it->first.compare(0, prefix.size(), prefix) == 0 && scanned < max_prefix_scan;
+         ++it, ++scanned) {
+        if (terms_[it->second].live > 0) {
+            terms.push_back(it->second);
+        }
+    }
+    std::size_t wanted = prefix.size() < 3 ? max_prefix_terms >> (3 - prefix.size()) : max_prefix_terms;
+    if (terms.size() > wanted) {
+        auto more_common = [&](std::uint32_t a, std::uint32_t c) { return terms_[a].live > terms_[c].live; };
+        std::nth_element(terms.begin(), terms.begin() + wanted, terms.end(), more_common);
+        terms.resize(wanted);
+    }
+
+    if (cached) {
+        std::lock_guard<std::mutex> lock(completions_mutex_);
+        completions_[std::string(prefix)] = {changes_, terms};
+    }
+    return terms;
+}
+
+std::vector<BookStore::BookPtr> SearchIndex::search(std::string_view query, std::size_t limit) const {
+    // The last word is a prefix unless the query ends between words or has
+    // more words than are used
+    std::vector<std::string> words;
+    std::size_t word_count = 0;
+    for_each_word(query, [&](std::string_view word) {
+        if (word_count++ < max_query_words) {
+            words.emplace_back(word);
+        }
+    });
+    if (words.empty() || limit == 0) {
+        return {};
+    }
+    std::string prefix;
+    if (word_count <= max_query_words && is_word_byte(static_cast<unsigned char>(query.back()))) {
+        prefix = std::move(words.back());
+        words.pop_back();
+    }
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (doc_ids_.empty()) {
+        return {};
+    }
+
+    double n = static_cast<double>(doc_ids_.size());
+    double average_length = std::max(1.0, static_cast<double>(total_length_) / n);
+    // BM25 weight of a word in a doc of `length` words, with tf = 1
+    auto weight = [&](std::uint32_t length) { return (k1 + 1) / (1 + k1 * (1 - b + b * length / average_length)); };
+
+    struct QueryTerm {
+        const Term* term;
+        double idf;
+        double bound; // Best score the word can add to any doc
+    };
+    auto query_term = [&](std::uint32_t id) {
+        const Term& term = terms_[id];
+        double df = term.live;
+        double idf = std::log(1 + (n - df + 0.5) / (df + 0.5));
+        return QueryTerm{&term, idf, idf * weight(term.buckets.front().length)};
+    };
+
+    std::vector<QueryTerm> exact;
+    double exact_bound = 0;
+    for (const std::string& word : words) {
+        auto it = dictionary_.find(word);
+        if (it == dictionary_.end() || terms_[it->second].live == 0) {
+            return {};
+        }
+        exact.push_back(query_term(it->second));
+        exact_bound += exact.back().bound;
+    }
+    std::vector<QueryTerm> completions;
+    std::size_t completion_postings = 0;
+    if (!prefix.empty()) {
+        std::vector<std::uint32_t> expanded = expand_prefix(prefix);
+        if (expanded.empty()) {
+            return {};
+        }
+        for (std::uint32_t id : expanded) {
+            completions.push_back(query_term(id));
+            completion_postings += terms_[id].live;
+        }
+        // Rarest first: a doc's best completion is the first one it has
+        std::sort(completions.begin(), completions.end(),
+                  [](const QueryTerm& a, const QueryTerm& c) { return a.idf > c.idf; });
+    }
+
+    // The best `limit` hits so far, with the worst on top
+    using Hit = std::pair<double, std::uint32_t>;
+    auto better = [](const Hit& a, const Hit& c) { return a.first > c.first || (a.first == c.first && a.second < c.second); };
+    std::vector<Hit> hits;
+    auto threshold = [&] { return hits.size() < limit ? -1.0 : hits.front().first; };
+    auto push = [&](const Hit& hit, bool may_repeat) {
+        if (may_repeat) {
+            // A doc with several completions of the prefix keeps its best score
+            for (Hit& existing : hits) {
+                if (existing.second == hit.second) {
+                    if (hit.first > existing.first) {
+                        existing.first = hit.first;
+                        std::make_heap(hits.begin(), hits.end(), better);
+                    }
+                    return;
+                }
+            }
+        }
+        if (hits.size() < limit) {
+            hits.push_back(hit);
+            std::push_heap(hits.begin(), hits.end(), better);
+        } else if (better(hit, hits.front())) {
+            std::pop_heap(hits.begin(), hits.end(), better);
+            hits.back() = hit;
+            std::push_heap(hits.begin(), hits.end(), better);
+        }
+    };
+
+    // Scores the docs in driver's postings that also contain every word in
+    // others and, if with_completions, one of the completions. All of a
+    // doc's words have the same weight, so its score is known before finding
+    // them, and a bucket's docs all score the same or, for long docs, no
+    // better than its length allows.
+    auto run = [&](const QueryTerm& driver, const std::vector<const QueryTerm*>& others, bool with_completions,
+                   bool may_repeat) {
+        double idf = driver.idf;
+        for (const QueryTerm* other : others) {
+            idf += other->idf;
+        }
+        double best_completion = with_completions ? completions.front().idf : 0;
+
+        for (const Bucket& bucket : driver.term->buckets) {
+            // Later buckets hold longer docs, which score less
+            if ((idf + best_completion) * weight(bucket.length) <= threshold()) {
+                break;
+            }
+            std::vector<Cursor> cursors;
+            for (const QueryTerm* other : others) {
+                cursors.emplace_back(*other->term, bucket.length);
+            }
+            std::vector<Cursor> completion_cursors;
+            if (with_completions) {
+                for (const QueryTerm& completion : completions) {
+                    completion_cursors.emplace_back(*completion.term, bucket.length);
+                }
+            }
+
+            for (const Posting& posting : bucket.postings) {
+                if (!alive_[posting.doc]) {
+                    continue;
+                }
+                double w = weight(posting.length);
+                if ((idf + best_completion) * w <= threshold()) {
+                    // Docs further on in the bucket tie at best
+                    if (bucket.length < long_doc) {
+                        break;
+                    }
+                    continue;
+                }
+
+                bool matched = true;
+                for (std::size_t k = 0; k < cursors.size() && matched; ++k) {
+                    matched = cursors[k].contains(posting.doc);
+                }
+                double score = idf;
+                if (matched && with_completions) {
+                    // Only completions that could still make the cut matter
+                    matched = false;
+                    for (std::size_t k = 0; k < completion_cursors.size(); ++k) {
+                        if ((idf + completions[k].idf) * w <= threshold()) {
+                            break;
+                        }
+                        if (completion_cursors[k].contains(posting.doc)) {
+                            score += completions[k].idf;
+                            matched = true;
+                            break;
+                        }
+                    }
+                }
+                if (matched) {
+                    push({score * w, posting.doc}, may_repeat);
+                }
+            }
+        }
+    };
+
+    // Candidates come from whichever side needs the fewest lookups: the
+    // rarest exact word, checking each candidate against the others and
+    // those that have them all against the completions (estimating the
+    // words as independent), or each completion in turn
+    const QueryTerm* driver = nullptr;
+    for (const QueryTerm& q : exact) {
+        if (!driver || q.term->live < driver->term->live) {
+            driver = &q;
+        }
+    }
+    bool exact_driven = driver != nullptr;
+    if (driver && !completions.empty()) {
+        double matches = driver->term->live;
+        for (const QueryTerm& q : exact) {
+            if (&q != driver) {
+                matches *= q.term->live / n;
+            }
+        }
+        double exact_cost = driver->term->live * static_cast<double>(exact.size()) + matches * completions.size();
+        double prefix_cost = static_cast<double>(completion_postings) * (exact.size() + 1);
+        exact_driven = exact_cost <= prefix_cost;
+    }
+    if (exact_driven) {
+        std::vector<const QueryTerm*> others;
+        for (const QueryTerm& q : exact) {
+            if (&q != driver) {
+                others.push_back(&q);
+            }
+        }
+        run(*driver, others, !completions.empty(), false);
+    } else {
+        std::vector<const QueryTerm*> others;
+        for (const QueryTerm& q : exact) {
+            others.push_back(&q);
+        }
+        for (const QueryTerm& completion : completions) {
+            if (completion.bound + exact_bound <= threshold()) {
+                continue;
+            }
+            run(completion, others, false, true);
+        }
+    }
+
+    std::sort(hits.begin(), hits.end(), better);
+    std::vector<BookStore::BookPtr> result;
+    result.reserve(hits.size());
+    for (const Hit& hit : hits) {
+        result.push_back(docs_[hit.second]);
+    }
+    return result;
+}
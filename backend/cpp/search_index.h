@@ -0,0 +1,131 @@
+#ifndef SEARCH_INDEX_H
+#define SEARCH_INDEX_H
+
+#include "book_store.h"
+#include "sharded_book_store.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Full-text index over book titles and authors, for GET /book/search.
+//
+// Text is split into lowercase words of ASCII letters and digits (bytes
+// above 0x7f count as letters, so UTF-8 words stay whole). Every indexed
+// book gets a new doc number, and each word keeps a posting list of the docs
+// that contain it along with their lengths, so postings are sorted by doc
+// and scoring never has to look at the book. A replaced or deleted book's
+// doc is only marked dead; once dead docs outnumber live ones the index is
+// renumbered without them.
+//
+// A query matches books that contain all of its words. The last word is a
+// prefix unless the query ends in a space, so "harry pot" finds "Harry
+// Potter"; a prefix stands for its most common completions, up to
+// max_prefix_terms of them for three letters or more and fewer for shorter
+// prefixes, which say less about the word. Completions of prefixes up to
+// three letters are cached for a while since finding them is slow.
+// Matches are ranked with BM25, counting a word once per book: titles and
+// authors are short, and it makes a doc's score depend only on the query's
+// words and the doc's length. So each word's postings are split into one
+// bucket per doc length (docs of long_doc words or more share the last),
+// and buckets are scanned shortest first: once `limit` hits are found, the
+// scan stops at the first bucket whose docs cannot beat them. Candidates
+// come from the word with the fewest postings and the other words are
+// looked up in their bucket for the same length by galloping through it.
+// Words in more than 1/32 of the books also keep a bitset of their docs, so
+// checking whether a candidate has one is a single load.
+//
+// The index follows a ShardedBookStore: after changing books, pass their
+// ids to refresh(), which re-reads them from the store. Refreshing under the
+// index's own lock makes concurrent writers converge on what the store holds
+// whatever order their refreshes run in.
+class SearchIndex {
+public:
+    static constexpr std::size_t max_query_words = 8;
+    static constexpr std::size_t max_prefix_terms = 32;
+
+    // Indexes every book in the store.
+    explicit SearchIndex(const ShardedBookStore& books);
+
+    SearchIndex(const SearchIndex&) = delete;
+    SearchIndex& operator=(const SearchIndex&) = delete;
+
+    // Brings the given books up to date with the store: indexes new ones,
+    // reindexes replaced ones and drops deleted ones.
+    void refresh(std::string_view id);
+    void refresh(const std::vector<std::string_view>& ids);
+
+    // Returns up to `limit` matching books, best first.
+    std::vector<BookStore::BookPtr> search(std::string_view query, std::size_t limit) const;
+
+    std::size_t size() const;
+
+private:
+    static constexpr std::uint32_t long_doc = 16;
+
+    struct Posting {
+        std::uint32_t doc;
+        std::uint32_t length; // Words in the doc
+    };
+
+    struct Bucket {
+        std::uint32_t length;          // Doc length, or long_doc for longer ones
+        std::vector<Posting> postings; // Sorted by doc, dead docs included
+    };
+
+    struct Term {
+        const std::string* text = nullptr; // Key in dictionary_
+        std::vector<Bucket> buckets;       // Sorted by length
+        std::vector<std::uint64_t> bits;   // Docs with the word, if it is common
+        std::uint32_t postings = 0;        // Dead docs included
+        std::uint32_t live = 0;            // Postings of live docs
+        std::uint32_t next_free = UINT32_MAX;
+
+        void append(const Posting& posting);
+        // The bucket holding docs of this length, or null
+        const Bucket* bucket(std::uint32_t length) const;
+    };
+
+    class Cursor;
+
+    // Gives a term a bitset once it is common enough
+    void update_bits(Term& term);
+
+    // Makes the index match the store for one id
+    void sync(std::string_view id);
+    void add(BookStore::BookPtr book);
+    void retire(std::uint32_t doc);
+    void compact();
+    std::uint32_t acquire_term(std::string_view text);
+
+    // Returns the ids of the most common live terms starting with prefix
+    std::vector<std::uint32_t> expand_prefix(std::string_view prefix) const;
+
+    const ShardedBookStore& books_;
+
+    mutable std::shared_mutex mutex_; // Guards everything below
+    std::vector<BookStore::BookPtr> docs_; // By doc; null once dead
+    std::vector<bool> alive_;
+    std::size_t dead_docs_ = 0;
+    std::unordered_map<std::string_view, std::uint32_t> doc_ids_; // Keys view the indexed books' ids
+    std::vector<Term> terms_;
+    std::uint32_t free_term_ = UINT32_MAX;
+    std::map<std::string, std::uint32_t, std::less<>> dictionary_;
+    std::uint64_t total_length_ = 0; // Words in live docs
+    std::uint64_t changes_ = 0;      // Books indexed or retired so far
+
+    struct CachedCompletions {
+        std::uint64_t changes; // changes_ when they were found
+        std::vector<std::uint32_t> terms;
+    };
+    mutable std::mutex completions_mutex_; // Guards completions_, which readers update
+    mutable std::unordered_map<std::string, CachedCompletions> completions_;
+};
+
+#endif
@@ -0,0 +1,323 @@
+#include "sharded_book_store.h"
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <utility>
+
+namespace {
+
+using Sequenced = std::pair<std::uint64_t, BookStore::BookPtr>;
+
+// Merges back-to-back runs of items, each sorted by sequence number; run i
+// ends at ends[i]
+void merge_runs(std::vector<Sequenced>& items, std::vector<std::size_t> ends) {
+    auto by_seq = [](const Sequenced& a, const Sequenced& b) { return a.first < b.first; };
+    while (ends.size() > 1) {
+        std::vector<std::size_t> merged;
+        for (std::size_t i = 0; i < ends.size(); i += 2) {
+            if (i + 1 == ends.size()) {
+                merged.push_back(ends[i]);
+                break;
+            }
+            std::size_t begin = i == 0 ? 0 : ends[i - 1];
+            std::inplace_merge(items.begin() + static_cast<std::ptrdiff_t>(begin),
+                               items.begin() + static_cast<std::ptrdiff_t>(ends[i]),
+                               items.begin() + static_cast<std::ptrdiff_t>(ends[i + 1]), by_seq);
+            merged.push_back(ends[i + 1]);
+        }
+        ends = std::move(merged);
+    }
+}
+
+} // namespace
+
+std::uint64_t ShardedBookStore::Sequencer::begin(std::size_t count) {
+    if (!track_) {
+        return next_.fetch_add(count, std::memory_order_relaxed);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::uint64_t first = next_.fetch_add(count, std::memory_order_relaxed);
+    in_flight_.insert(first);
+    return first;
+}
+
+void ShardedBookStore::Sequencer::end(std::uint64_t first) {
+    if (track_) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        in_flight_.erase(first);
+    }
+}
+
+std::uint64_t ShardedBookStore::Sequencer::settled() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return in_flight_.empty() ? next_.load(std::memory_order_relaxed) : *in_flight_.begin();
+}
+
+ShardedBookStore::ShardedBookStore(std::size_t shards, StoreMode mode) : seq_(shards > 1) {
+    shards = std::clamp<std::size_t>(shards, 1, max_shards);
+    shards_.reserve(shards);
+    for (std::size_t i = 0; i < shards; ++i) {
+        shards_.push_back(std::make_unique<Shard>(mode));
+    }
+}
+
+std::size_t ShardedBookStore::shard_index(std::string_view id) const {
+    if (std::optional<BookId> uuid = parse_book_id(id)) {
+        return BookIdHash{}(*uuid) % shards_.size();
+    }
+    return std::hash<std::string_view>{}(id) % shards_.size();
+}
+
+ShardedBookStore::BookPtr ShardedBookStore::find(std::string_view id) const {
+    return shards_[shard_index(id)]->books.read([&](const BookStore& store) { return store.find(id); });
+}
+
+std::vector<ShardedBookStore::BookPtr> ShardedBookStore::find_many(const std::vector<std::string_view>& ids) const {
+    std::vector<BookPtr> found(ids.size());
+    if (shards_.size() == 1) {
+        shards_.front()->books.read([&](const BookStore& store) {
+            for (std::size_t i = 0; i < ids.size(); ++i) {
+                found[i] = store.find(ids[i]);
+            }
+        });
+        return found;
+    }
+
+    std::vector<std::size_t> shard_of(ids.size());
+    std::vector<std::size_t> involved;
+    involved.reserve(ids.size());
+    for (std::size_t i = 0; i < ids.size(); ++i) {
+        shard_of[i] = shard_index(ids[i]);
+        involved.push_back(shard_of[i]);
+    }
+    std::sort(involved.begin(), involved.end());
+    involved.erase(std::unique(involved.begin(), involved.end()), involved.end());
+
+    std::vector<const BookStore*> stores(shards_.size(), nullptr);
+    read_together(involved, 0, stores, [&] {
+        for (std::size_t i = 0; i < ids.size(); ++i) {
+            found[i] = stores[shard_of[i]]->find(ids[i]);
+        }
+    });
+    return found;
+}
+
+// Writers lock one shard at a time, so holding several reads cannot close a
+// cycle with them, and every reader of several goes in the same order
+void ShardedBookStore::read_together(const std::vector<std::size_t>& shards, std::size_t next,
+                                     std::vector<const BookStore*>& stores, const std::function<void()>& fn) const {
+    if (next == shards.size()) {
+        fn();
+        return;
+    }
+    std::size_t s = shards[next];
+    shards_[s]->books.read([&](const BookStore& store) {
+        stores[s] = &store;
+        read_together(shards, next + 1, stores, fn);
+    });
+}
+
+bool ShardedBookStore::insert(BookPtr book) {
+    if (!book) {
+        return false;
+    }
+    // Drawn under the shard's lock so each shard sees increasing numbers,
+    // and only once, as LeftRight mode calls back twice
+    std::uint64_t seq = 0;
+    bool inserted = shards_[shard_index(book->id())]->books.write([&](BookStore& store) {
+        if (seq == 0) {
+            seq = seq_.begin(1);
+        }
+        return store.insert(book, seq);
+    });
+    seq_.end(seq);
+    return inserted;
+}
+
+bool ShardedBookStore::update(BookPtr book) {
+    if (!book) {
+        return false;
+    }
+    return shards_[shard_index(book->id())]->books.write([&](BookStore& store) { return store.update(book); });
+}
+
+bool ShardedBookStore::erase(std::string_view id) {
+    return shards_[shard_index(id)]->books.write([&](BookStore& store) { return store.erase(id); });
+}
+
+BookStore::WriteResult ShardedBookStore::replace(BookPtr book, std::uint32_t expected_version) {
+    if (!book) {
+        return BookStore::WriteResult::NotFound;
+    }
+    return shards_[shard_index(book->id())]->books.write(
+        [&](BookStore& store) { return store.replace(book, expected_version); });
+}
+
+BookStore::WriteResult ShardedBookStore::erase(std::string_view id, std::uint32_t expected_version) {
+    return shards_[shard_index(id)]->books.write(
+        [&](BookStore& store) { return store.erase(id, expected_version); });
+}
+
+std::vector<bool> ShardedBookStore::insert_batch(const std::vector<BookPtr>& books) {
+    std::vector<bool> inserted(books.size(), false);
+    std::vector<std::vector<std::size_t>> by_shard(shards_.size());
+    for (std::size_t i = 0; i < books.size(); ++i) {
+        if (books[i]) {
+            by_shard[shard_index(books[i]->id())].push_back(i);
+        }
+    }
+
+    // Numbering the whole batch up front keeps its order across shards. A
+    // shard that an insert with a later number reached first gets fresh
+    // numbers for its part instead, so its numbers still only grow.
+    std::uint64_t base = seq_.begin(books.size());
+    for (std::size_t s = 0; s < shards_.size(); ++s) {
+        const std::vector<std::size_t>& group = by_shard[s];
+        if (group.empty()) {
+            continue;
+        }
+        std::optional<std::uint64_t> fresh_base;
+        bool checked = false;
+        shards_[s]->books.write([&](BookStore& store) {
+            if (!checked) {
+                checked = true;
+                if (store.next_seq() > base + group.front()) {
+                    fresh_base = seq_.begin(group.size());
+                }
+            }
+            store.reserve(store.size() + group.size());
+            for (std::size_t k = 0; k < group.size(); ++k) {
+                std::size_t i = group[k];
+                inserted[i] = store.insert(books[i], fresh_base ? *fresh_base + k : base + i);
+            }
+        });
+        if (fresh_base) {
+            seq_.end(*fresh_base);
+        }
+    }
+    seq_.end(base);
+    return inserted;
+}
+
+std::size_t ShardedBookStore::size() const {
+    std::size_t size = 0;
+    for (const auto& shard : shards_) {
+        size += shard->books.read([](const BookStore& store) { return store.size(); });
+    }
+    return size;
+}
+
+std::uint64_t ShardedBookStore::version() const {
+    std::uint64_t version = 0;
+    for (const auto& shard : shards_) {
+        version += shard->books.version();
+    }
+    return version;
+}
+
+std::vector<ShardedBookStore::BookPtr> ShardedBookStore::books() const {
+    if (shards_.size() == 1) {
+        return shards_.front()->books.read([](const BookStore& store) {
+            std::vector<BookPtr> all;
+            all.reserve(store.size());
+            store.for_each([&](const BookPtr& book) { all.push_back(book); });
+            return all;
+        });
+    }
+
+    // Each shard's books come out in sequence order; merge the runs
+    std::vector<Sequenced> entries;
+    std::vector<std::size_t> ends;
+    ends.reserve(shards_.size());
+    for (const auto& shard : shards_) {
+        shard->books.read([&](const BookStore& store) {
+            entries.reserve(entries.size() + store.size());
+            store.for_each_entry_after(0, SIZE_MAX,
+                                       [&](std::uint64_t seq, const BookPtr& book) { entries.emplace_back(seq, book); });
+        });
+        ends.push_back(entries.size());
+    }
+    merge_runs(entries, std::move(ends));
+
+    std::vector<BookPtr> all;
+    all.reserve(entries.size());
+    for (auto& entry : entries) {
+        all.push_back(std::move(entry.second));
+    }
+    return all;
+}
+
+std::uint64_t ShardedBookStore::page_after(std::uint64_t cursor, std::size_t limit, std::vector<BookPtr>& page) const {
+    if (shards_.size() == 1) {
+        return shards_.front()->books.read([&](const BookStore& store) {
+            return store.for_each_after(cursor, limit, [&](const BookPtr& book) { page.push_back(book); });
+        });
+    }
+
+    // The page is among the first `limit` books of every shard. Only books
+    // numbered below every insert in flight when the reads start are kept:
+    // all of those are in their shards by then, and whatever lands later
+    // is numbered above the cursor returned.
+    std::uint64_t settled = seq_.settled();
+    std::vector<Sequenced> candidates;
+    bool more = false;
+    for (const auto& shard : shards_) {
+        more |= shard->books.read([&](const BookStore& store) {
+            return store.for_each_entry_after(cursor, limit, [&](std::uint64_t seq, const BookPtr& book) {
+                candidates.emplace_back(seq, book);
+            }) != 0;
+        });
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Sequenced& a, const Sequenced& b) { return a.first < b.first; });
+    auto unsettled = std::lower_bound(candidates.begin(), candidates.end(), settled,
+                                      [](const Sequenced& a, std::uint64_t seq) { return a.first < seq; });
+    if (unsettled != candidates.end()) {
+        more = true;
+        candidates.erase(unsettled, candidates.end());
+    }
+    if (candidates.size() > limit) {
+        more = true;
+        candidates.resize(limit);
+    }
+    for (auto& candidate : candidates) {
+        page.push_back(std::move(candidate.second));
+    }
+    if (!more) {
+        return 0;
+    }
+    return candidates.empty() ? cursor : candidates.back().first;
+}
+
+bool ShardedBookStore::sorted_page(const BookStore::Query& query, std::size_t limit,
+                                   std::vector<BookPtr>& page) const {
+    auto collect = [&](std::uint64_t, const BookPtr& book) { page.push_back(book); };
+    if (shards_.size() == 1) {
+        return shards_.front()->books.read(
+            [&](const BookStore& store) { return store.for_each_sorted(query, limit, collect); });
+    }
+
+    // The page is among the first offset + limit books of every shard
+    BookStore::Query shard_query = query;
+    shard_query.offset = 0;
+    std::size_t wanted = query.offset > SIZE_MAX - limit ? SIZE_MAX : query.offset + limit;
+    std::vector<Sequenced> candidates;
+    bool more = false;
+    for (const auto& shard : shards_) {
+        more |= shard->books.read([&](const BookStore& store) {
+            return store.for_each_sorted(shard_query, wanted, [&](std::uint64_t seq, const BookPtr& book) {
+                candidates.emplace_back(seq, book);
+            });
+        });
+    }
+    std::sort(candidates.begin(), candidates.end(), [&](const Sequenced& a, const Sequenced& b) {
+        return BookStore::sorted_before(query, a.first, *a.second, b.first, *b.second);
+    });
+    if (candidates.size() > wanted) {
+        more = true;
+    }
+    for (std::size_t i = query.offset; i < std::min(candidates.size(), wanted); ++i) {
+        page.push_back(std::move(candidates[i].second));
+    }
+    return more;
+}
@@ -0,0 +1,127 @@
+#ifndef SHARDED_BOOK_STORE_H
+#define SHARDED_BOOK_STORE_H
+
+#include "book_store.h"
+#include "concurrent_book_store.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string_view>
+#include <vector>
+
+// Books spread over independently locked shards.
+//
+// An id hashes to one of N shards, each a ConcurrentBookStore in the chosen
+// StoreMode with its own lock and version counter on cache lines of its own,
+// so writers to different shards neither wait for each other nor bounce a
+// shared line. Only inserts touch shared state: one counter hands out the
+// sequence numbers that order books across shards, so merging the shards by
+// sequence number gives back insertion order and GET /book cursors work as
+// with a single store. A number is drawn before its book reaches its shard,
+// so a later number in one shard can show up while an earlier one in
+// another is still on its way; cursor pages therefore stop short of the
+// earliest number still in flight, which would otherwise land behind a
+// cursor already handed out.
+//
+// Operations on one id lock only its shard. Operations over every book read
+// the shards one at a time and merge what they read: each shard's part is
+// consistent, but a write that lands while another shard is being read may
+// or may not show up. With one shard nothing is merged and every operation
+// behaves as on a single ConcurrentBookStore.
+class ShardedBookStore {
+public:
+    using BookPtr = BookStore::BookPtr;
+
+    static constexpr std::size_t max_shards = 1024;
+
+    // shards is clamped to [1, max_shards].
+    explicit ShardedBookStore(std::size_t shards = 1, StoreMode mode = StoreMode::SharedMutex);
+
+    ShardedBookStore(const ShardedBookStore&) = delete;
+    ShardedBookStore& operator=(const ShardedBookStore&) = delete;
+
+    std::size_t shard_count() const { return shards_.size(); }
+    StoreMode mode() const { return shards_.front()->books.mode(); }
+
+    // As the BookStore operations of the same names, locking one shard.
+    BookPtr find(std::string_view id) const;
+    bool insert(BookPtr book);
+    bool update(BookPtr book);
+    bool erase(std::string_view id);
+    BookStore::WriteResult replace(BookPtr book, std::uint32_t expected_version);
+    BookStore::WriteResult erase(std::string_view id, std::uint32_t expected_version);
+
+    // Looks up every id under one consistent view of the store: the read
+    // locks of all the shards the ids fall in are held at once, taken in
+    // shard order so that two callers cannot deadlock, and no write lands
+    // between two of the lookups. Returns a book or null per id, in order.
+    std::vector<BookPtr> find_many(const std::vector<std::string_view>& ids) const;
+
+    // Inserts books in order with one write per shard they fall in. Returns
+    // whether each one was inserted (false for a missing or taken id).
+    std::vector<bool> insert_batch(const std::vector<BookPtr>& books);
+
+    std::size_t size() const;
+    bool empty() const { return size() == 0; }
+
+    // Sum of the shards' versions, so it grows with every write.
+    std::uint64_t version() const;
+
+    // Every book in insertion order.
+    std::vector<BookPtr> books() const;
+
+    // Appends up to `limit` books inserted after `cursor` to page, as
+    // BookStore::for_each_after. Returns the cursor to resume from, or 0.
+    // Books numbered at or after an insert still in flight are left for a
+    // later page.
+    std::uint64_t page_after(std::uint64_t cursor, std::size_t limit, std::vector<BookPtr>& page) const;
+
+    // Appends up to `limit` books matching query to page, as
+    // BookStore::for_each_sorted. Each shard lists offset + limit books, so
+    // deep offsets cost that much per shard. Returns true if more follow.
+    bool sorted_page(const BookStore::Query& query, std::size_t limit, std::vector<BookPtr>& page) const;
+
+private:
+    struct alignas(64) Shard {
+        explicit Shard(StoreMode mode) : books(mode) {}
+        ConcurrentBookStore books;
+    };
+
+    std::size_t shard_index(std::string_view id) const;
+
+    // Calls fn() while holding a read of each shard in shards (ascending,
+    // from next on), with stores[s] set to shard s's store
+    void read_together(const std::vector<std::size_t>& shards, std::size_t next,
+                       std::vector<const BookStore*>& stores, const std::function<void()>& fn) const;
+
+    // Hands out sequence numbers and, with more than one shard, keeps the
+    // first number of every insert that has drawn numbers but not finished
+    class Sequencer {
+    public:
+        explicit Sequencer(bool track) : track_(track) {}
+
+        // Draws count numbers and returns the first
+        std::uint64_t begin(std::size_t count);
+        // Marks the numbers drawn from first as landed (or never used)
+        void end(std::uint64_t first);
+        // Every number below this has landed or never will
+        std::uint64_t settled() const;
+
+    private:
+        const bool track_;
+        mutable std::mutex mutex_;
+        std::atomic<std::uint64_t> next_{1};
+        std::set<std::uint64_t> in_flight_;
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+    // On lines of their own
+    alignas(64) Sequencer seq_;
+};
+
+#endif